@@ -6,12 +6,14 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include "config.h"
 
 /*
  * On Linux, or at least in some glibc versions, fcntl.h defines the
@@ -22,12 +24,19 @@
 #include <sys/file.h>
 #endif
 
-#define SECTORSIZE 512
-#define MINSIZE (128 * SECTORSIZE)
+#include "diskmodel.h"
+
+#define SECTORSIZE 512		/* default */
+#define MAXSECTORSIZE 4096
+#define MINSECTORS 128
 #define MAXSIZE 0x100000000LL
 
-#define HEADERSIZE   SECTORSIZE
+/*
+ * The header is one sector. Images with other than 512-byte sectors
+ * have the sector size appended to the header string.
+ */
 #define HEADERSTRING "System/161 Disk Image"
+#define HEADERSECTSIZE ", %u-byte sectors"
 
 ////////////////////////////////////////////////////////////
 // Compat
@@ -151,6 +160,20 @@ dofstat(const char *file, int fd, struct stat *st)
 	}
 }
 
+#ifdef HAVE_PUNCH_HOLE
+static
+void
+dopunch(const char *file, int fd, off_t pos, off_t len)
+{
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+		      pos, len) == -1) {
+		fprintf(stderr, "disk161: %s: fallocate: %s\n", file,
+			strerror(errno));
+		exit(1);
+	}
+}
+#endif
+
 static
 void
 doflock(const char *file, int fd, int mode)
@@ -173,7 +196,7 @@ doflock(const char *file, int fd, int mode)
 
 static
 off_t
-getsize(const char *str)
+getsize(const char *str, unsigned sectsize)
 {
 	char *suffix;
 	off_t value;
@@ -190,7 +213,7 @@ getsize(const char *str)
 	}
 	if (!strcmp(suffix, "s")) {
 		/* sectors */
-		return value * SECTORSIZE;
+		return value * sectsize;
 	}
 	if (!strcmp(suffix, "k") || !strcmp(suffix, "K")) {
 		/* Kb */
@@ -220,16 +243,28 @@ filesize(const char *file, int fd)
 
 static
 void
-checksize(off_t size)
+checksectsize(unsigned sectsize)
 {
-	if (size % SECTORSIZE) {
+	if (sectsize < SECTORSIZE || sectsize > MAXSECTORSIZE ||
+	    (sectsize & (sectsize - 1)) != 0) {
+		fprintf(stderr, "Invalid sector size %u (512, 1024, 2048, "
+			"or 4096 allowed)\n", sectsize);
+		exit(1);
+	}
+}
+
+static
+void
+checksize(off_t size, unsigned sectsize)
+{
+	if (size % sectsize) {
 		fprintf(stderr, "Size %lld not an even number of sectors\n",
 			(long long)size);
-		size = SECTORSIZE * ((size + SECTORSIZE - 1) / SECTORSIZE);
+		size = sectsize * ((size + sectsize - 1) / sectsize);
 		fprintf(stderr, "Try %lld instead.\n", (long long)size);
 		exit(1);
 	}
-	if (size < MINSIZE) {
+	if (size < MINSECTORS * (off_t)sectsize) {
 		fprintf(stderr, "Size %lld too small\n", (long long)size);
 		exit(1);
 	}
@@ -239,18 +274,35 @@ checksize(off_t size)
 	}
 }
 
+/*
+ * Check the header and return the sector size, which is also the
+ * size of the header.
+ */
 static
-void
+unsigned
 checkheader(const char *file, int fd)
 {
 	char buf[SECTORSIZE];
+	size_t len;
+	unsigned sectsize;
+	int n;
 
 	doread(file, fd, buf, sizeof(buf));
 	buf[sizeof(buf) - 1] = 0;
 
-	if (!strcmp(buf, HEADERSTRING)) {
-		/* ok */
-		return;
+	len = strlen(HEADERSTRING);
+	if (!strncmp(buf, HEADERSTRING, len)) {
+		if (buf[len] == 0) {
+			/* ok */
+			return SECTORSIZE;
+		}
+		n = -1;
+		if (sscanf(buf + len, HEADERSECTSIZE "%n",
+			   &sectsize, &n) == 1 &&
+		    n >= 0 && buf[len + n] == 0) {
+			checksectsize(sectsize);
+			return sectsize;
+		}
 	}
 	fprintf(stderr, "disk161: %s: Not a System/161 disk image\n", file);
 	exit(1);
@@ -258,15 +310,20 @@ checkheader(const char *file, int fd)
 
 static
 void
-writeheader(const char *file, int fd)
+writeheader(const char *file, int fd, unsigned sectsize)
 {
-	char buf[SECTORSIZE];
+	char buf[MAXSECTORSIZE];
+	size_t len;
 
-	memset(buf, 0, sizeof(buf));
+	memset(buf, 0, sectsize);
 	strcpy(buf, HEADERSTRING);
+	if (sectsize != SECTORSIZE) {
+		len = strlen(buf);
+		snprintf(buf + len, sectsize - len, HEADERSECTSIZE, sectsize);
+	}
 
 	dolseek(file, fd, 0, SEEK_SET);
-	dowrite(file, fd, buf, sizeof(buf));
+	dowrite(file, fd, buf, sectsize);
 }
 
 ////////////////////////////////////////////////////////////
@@ -274,7 +331,8 @@ writeheader(const char *file, int fd)
 
 static
 void
-docreate(const char *file, const char *sizespec, int doforce)
+docreate(const char *file, const char *sizespec, unsigned sectsize,
+	 int doforce)
 {
 	int fd;
 	off_t size;
@@ -290,10 +348,10 @@ docreate(const char *file, const char *sizespec, int doforce)
 
 	fd = doopen(file, O_RDWR|O_CREAT|O_TRUNC, 0664);
 	doflock(file, fd, LOCK_EX);
-	size = getsize(sizespec);
-	checksize(size);
-	dotruncate(file, fd, HEADERSIZE + size);
-	writeheader(file, fd);
+	size = getsize(sizespec, sectsize);
+	checksize(size, sectsize);
+	dotruncate(file, fd, sectsize + size);
+	writeheader(file, fd, sectsize);
 	doflock(file, fd, LOCK_UN);
 	close(fd);
 }
@@ -308,19 +366,22 @@ doinfo(const char *file)
 	int fd;
 	struct stat st;
 	long long amt;
+	unsigned sectsize;
 
 	fd = doopen(file, O_RDWR, 0);
-	checkheader(file, fd);
+	sectsize = checkheader(file, fd);
 	dofstat(file, fd, &st);
 
-	amt = st.st_size - HEADERSIZE;
+	printf("%s sectorsize %u bytes\n", file, sectsize);
+
+	amt = st.st_size - sectsize;
 	printf("%s size %lld bytes (%lld sectors; %lldK; %lldM)\n", file,
-	       amt, amt / SECTORSIZE, amt / 1024, amt / (1024*1024));
+	       amt, amt / sectsize, amt / 1024, amt / (1024*1024));
 	
 
 	amt = st.st_blocks * 512LL;
 	printf("%s spaceused %lld bytes (%lld sectors; %lldK; %lldM)\n", file,
-	       amt, amt / SECTORSIZE, amt / 1024, amt / (1024*1024));
+	       amt, amt / sectsize, amt / 1024, amt / (1024*1024));
 
 	close(fd);
 }
@@ -334,6 +395,7 @@ doresize(const char *file, const char *sizespec)
 {
 	enum { M_SET, M_PLUS, M_MINUS } mode;
 	off_t oldsize, newsize;
+	unsigned sectsize;
 	int fd;
 
 	if (*sizespec == '+') {
@@ -348,12 +410,12 @@ doresize(const char *file, const char *sizespec)
 		mode = M_SET;
 	}
 
-	newsize = getsize(sizespec);
 	fd = doopen(file, O_RDWR, 0);
 	doflock(file, fd, LOCK_EX);
-	checkheader(file, fd);
+	sectsize = checkheader(file, fd);
+	newsize = getsize(sizespec, sectsize);
 	oldsize = filesize(file, fd);
-	oldsize -= HEADERSIZE;
+	oldsize -= sectsize;
 	switch (mode) {
 	    case M_SET:
 		break;
@@ -375,10 +437,471 @@ doresize(const char *file, const char *sizespec)
 		break;
 	}
 
-	checksize(newsize);
-	dotruncate(file, fd, HEADERSIZE + newsize);
+	checksize(newsize, sectsize);
+	dotruncate(file, fd, sectsize + newsize);
+	doflock(file, fd, LOCK_UN);
+	close(fd);
+}
+
+////////////////////////////////////////////////////////////
+// sparsify
+
+/*
+ * Give back the host space used by sectors that are entirely zero,
+ * by punching holes over them. This recovers space in images whose
+ * guest has zeroed or discarded blocks since before sys161 could
+ * punch holes itself, or that were copied without preserving holes.
+ * The image contents are unchanged.
+ */
+static
+void
+dosparsify(const char *file)
+{
+#ifdef HAVE_PUNCH_HOLE
+	int fd;
+	struct stat st;
+	unsigned sectsize;
+	char *buf;
+	size_t bufsize, pos, len;
+	off_t offset, fsize, runstart, punched;
+	long long before, after;
+	ssize_t r;
+
+	fd = doopen(file, O_RDWR, 0);
+	doflock(file, fd, LOCK_EX);
+	sectsize = checkheader(file, fd);
+	dofstat(file, fd, &st);
+	fsize = st.st_size;
+	before = st.st_blocks * 512LL;
+
+	bufsize = 256 * MAXSECTORSIZE;
+	buf = malloc(bufsize);
+	if (buf == NULL) {
+		fprintf(stderr, "disk161: Out of memory\n");
+		exit(1);
+	}
+
+	/* runstart is -1 when not in a run of zero sectors */
+	runstart = -1;
+	punched = 0;
+	offset = sectsize;
+	dolseek(file, fd, offset, SEEK_SET);
+	while (offset < fsize) {
+		r = read(fd, buf, bufsize);
+		if (r < 0) {
+			fprintf(stderr, "disk161: %s: read: %s\n", file,
+				strerror(errno));
+			exit(1);
+		}
+		if (r == 0) {
+			break;
+		}
+		/* a partial trailing sector is never punched */
+		len = r - r % sectsize;
+		for (pos = 0; pos < len; pos += sectsize) {
+			if (buf[pos] == 0 &&
+			    !memcmp(buf + pos, buf + pos + 1, sectsize - 1)) {
+				if (runstart < 0) {
+					runstart = offset + pos;
+				}
+			}
+			else if (runstart >= 0) {
+				dopunch(file, fd, runstart,
+					offset + pos - runstart);
+				punched += offset + pos - runstart;
+				runstart = -1;
+			}
+		}
+		offset += len;
+		if ((size_t)r != len) {
+			break;
+		}
+	}
+	if (runstart >= 0) {
+		dopunch(file, fd, runstart, offset - runstart);
+		punched += offset - runstart;
+	}
+	free(buf);
+
+	if (fsync(fd)) {
+		fprintf(stderr, "disk161: %s: fsync: %s\n", file,
+			strerror(errno));
+		exit(1);
+	}
+	dofstat(file, fd, &st);
+	after = st.st_blocks * 512LL;
 	doflock(file, fd, LOCK_UN);
 	close(fd);
+
+	printf("%s zero sectors %lld (%lldK)\n", file,
+	       (long long)punched / sectsize, (long long)punched / 1024);
+	printf("%s spaceused %lldK before, %lldK after\n", file,
+	       before / 1024, after / 1024);
+#else
+	fprintf(stderr, "disk161: %s: Hole punching is not supported "
+		"on this platform\n", file);
+	exit(1);
+#endif
+}
+
+////////////////////////////////////////////////////////////
+// replay
+
+/*
+ * Replay an I/O log written by the sys161 disk device (iolog=)
+ * against the disk timing model, possibly with different settings.
+ *
+ * The "closed" schedule issues requests one at a time in log order,
+ * keeping the gap between each completion and the next issue, which
+ * is what the guest saw. The other schedules issue requests at their
+ * logged times, queue them, and pick the next one when the disk goes
+ * idle.
+ */
+
+#define NSECS_PER_SEC 1000000000ULL
+
+enum sched { S_CLOSED, S_FCFS, S_SSTF, S_SCAN };
+
+struct replayreq {
+	struct disklog_record rr_log;
+	uint64_t rr_issue;		/* logged issue time */
+	uint64_t rr_done;		/* logged completion time */
+	int rr_track;
+	int rr_rotoffset;
+	int rr_served;
+};
+
+struct replaystats {
+	unsigned rs_count;
+	uint64_t rs_totlatency;
+	uint64_t rs_maxlatency;
+	uint64_t rs_totseek;
+	uint64_t rs_totrotwait;
+};
+
+static
+uint64_t
+mktime64(uint32_t secs, uint32_t nsecs)
+{
+	return secs * NSECS_PER_SEC + nsecs;
+}
+
+static
+void
+addstat(struct replaystats *rs, uint64_t latency, int32_t seek,
+	uint32_t rotwait)
+{
+	rs->rs_count++;
+	rs->rs_totlatency += latency;
+	if (latency > rs->rs_maxlatency) {
+		rs->rs_maxlatency = latency;
+	}
+	rs->rs_totseek += seek < 0 ? -(int64_t)seek : seek;
+	rs->rs_totrotwait += rotwait;
+}
+
+static
+double
+statavg(uint64_t tot, unsigned count)
+{
+	return count ? (double)tot / count : 0.0;
+}
+
+static
+struct replayreq *
+loadlog(const char *file, struct disklog_header *dlh, unsigned *num_ret)
+{
+	unsigned char buf[DISKLOG_RECSIZE];
+	struct replayreq *reqs = NULL;
+	unsigned num = 0, max = 0;
+	ssize_t r;
+	int fd;
+
+	fd = doopen(file, O_RDONLY, 0);
+	doread(file, fd, buf, DISKLOG_HEADERSIZE);
+	if (disklog_decodeheader(buf, dlh) ||
+	    dlh->dlh_version != DISKLOG_VERSION) {
+		fprintf(stderr, "disk161: %s: Not a System/161 disk I/O log\n",
+			file);
+		exit(1);
+	}
+
+	while (1) {
+		r = read(fd, buf, DISKLOG_RECSIZE);
+		if (r < 0) {
+			fprintf(stderr, "disk161: %s: read: %s\n", file,
+				strerror(errno));
+			exit(1);
+		}
+		if (r == 0) {
+			break;
+		}
+		if (r != DISKLOG_RECSIZE) {
+			fprintf(stderr, "disk161: %s: Truncated record "
+				"ignored\n", file);
+			break;
+		}
+		if (num == max) {
+			max = max ? max * 2 : 1024;
+			reqs = realloc(reqs, max * sizeof(reqs[0]));
+			if (reqs == NULL) {
+				fprintf(stderr, "disk161: Out of memory\n");
+				exit(1);
+			}
+		}
+		disklog_decoderecord(buf, &reqs[num].rr_log);
+		reqs[num].rr_issue = mktime64(reqs[num].rr_log.dlr_issuesecs,
+					      reqs[num].rr_log.dlr_issuensecs);
+		reqs[num].rr_done = mktime64(reqs[num].rr_log.dlr_donesecs,
+					     reqs[num].rr_log.dlr_donensecs);
+		reqs[num].rr_served = 0;
+		num++;
+	}
+	close(fd);
+
+	*num_ret = num;
+	return reqs;
+}
+
+/*
+ * Run one request through the model starting at time now, in the
+ * same steps as dev_disk.c. Returns the completion time.
+ */
+static
+uint64_t
+service(const struct diskmodel *dm, struct replayreq *rr, uint64_t now,
+	int *curtrack, uint64_t *trackarrival,
+	int32_t *seek_ret, uint32_t *rotwait_ret)
+{
+	int iswrite = (rr->rr_log.dlr_flags & DISKLOG_WRITE) != 0;
+	int distance;
+	uint32_t rotwait;
+
+	*seek_ret = 0;
+	*rotwait_ret = 0;
+
+	if (rr->rr_log.dlr_flags & DISKLOG_DISCARD) {
+		/* no mechanical work */
+		return now + DISCARD_TIME;
+	}
+
+	if (rr->rr_track != *curtrack) {
+		distance = rr->rr_track - *curtrack;
+		*seek_ret = distance;
+		if (distance < 0) {
+			distance = -distance;
+		}
+		now += diskmodel_seektime(dm, distance);
+		*curtrack = rr->rr_track;
+		*trackarrival = now;
+	}
+
+	if (iswrite) {
+		now += CACHE_WRITE_TIME;
+		rotwait = diskmodel_writerotdelay(dm,
+				rr->rr_track, rr->rr_rotoffset,
+				now / NSECS_PER_SEC, now % NSECS_PER_SEC);
+	}
+	else {
+		rotwait = diskmodel_readrotdelay(dm,
+				rr->rr_track, rr->rr_rotoffset,
+				*trackarrival / NSECS_PER_SEC,
+				*trackarrival % NSECS_PER_SEC,
+				now / NSECS_PER_SEC, now % NSECS_PER_SEC);
+	}
+	now += rotwait;
+	*rotwait_ret = rotwait;
+
+	if (!iswrite) {
+		now += CACHE_READ_TIME;
+	}
+	return now;
+}
+
+/*
+ * Choose the next request to serve among those issued by time now.
+ * Returns -1 if none.
+ */
+static
+int
+pickreq(struct replayreq *reqs, unsigned num, unsigned first,
+	uint64_t now, enum sched sched, int curtrack, int *direction)
+{
+	unsigned i;
+	int best = -1, dist, bestdist = 0, pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i=first; i<num && reqs[i].rr_issue <= now; i++) {
+			if (reqs[i].rr_served) {
+				continue;
+			}
+			if (sched == S_FCFS) {
+				return i;
+			}
+			dist = reqs[i].rr_track - curtrack;
+			if (sched == S_SCAN) {
+				/* only look ahead of the heads */
+				if (dist * *direction < 0) {
+					continue;
+				}
+			}
+			if (dist < 0) {
+				dist = -dist;
+			}
+			if (best < 0 || dist < bestdist) {
+				best = i;
+				bestdist = dist;
+			}
+		}
+		if (best >= 0 || sched != S_SCAN) {
+			break;
+		}
+		/* nothing ahead; turn around */
+		*direction = -*direction;
+	}
+	return best;
+}
+
+static
+void
+doreplay(const char *file, uint32_t rpm, uint32_t tracks, enum sched sched,
+	 int verbose)
+{
+	static const char *const schednames[] = {
+		"closed", "fcfs", "sstf", "scan"
+	};
+	struct disklog_header dlh;
+	struct replayreq *reqs, *rr;
+	struct diskmodel dm;
+	struct replaystats orig, replay;
+	char errbuf[128];
+	unsigned num, i, first, done, errors;
+	uint64_t now, start, end, prevdone, issue;
+	uint64_t trackarrival;
+	int curtrack, direction, next;
+	int32_t seek;
+	uint32_t rotwait;
+
+	reqs = loadlog(file, &dlh, &num);
+
+	if (rpm == 0) {
+		rpm = dlh.dlh_rpm;
+	}
+	if (tracks == 0) {
+		tracks = dlh.dlh_tracks;
+	}
+	if (rpm < 60 || rpm % 60) {
+		fprintf(stderr, "disk161: RPM %u not a multiple of 60\n", rpm);
+		exit(1);
+	}
+	if (diskmodel_init(&dm, dlh.dlh_totsectors, dlh.dlh_sectsize,
+			   rpm, tracks, errbuf, sizeof(errbuf))) {
+		fprintf(stderr, "disk161: %s: %s\n", file, errbuf);
+		exit(1);
+	}
+
+	memset(&orig, 0, sizeof(orig));
+	memset(&replay, 0, sizeof(replay));
+	errors = 0;
+	for (i=0; i<num; i++) {
+		rr = &reqs[i];
+		if (rr->rr_log.dlr_flags & DISKLOG_INVSECT ||
+		    diskmodel_locate(&dm, rr->rr_log.dlr_sector,
+				     &rr->rr_track, &rr->rr_rotoffset)) {
+			/* not a real disk operation; skip it */
+			rr->rr_served = 1;
+			errors++;
+			continue;
+		}
+		addstat(&orig, rr->rr_done - rr->rr_issue,
+			rr->rr_log.dlr_seek,
+			rr->rr_log.dlr_flags & DISKLOG_DISCARD ?
+			0 : rr->rr_log.dlr_rotwait);
+	}
+
+	start = num > 0 ? reqs[0].rr_issue : 0;
+	now = start;
+	end = start;
+	prevdone = start;
+	trackarrival = start;
+	curtrack = 0;
+	direction = 1;
+	first = 0;
+	done = errors;
+
+	while (done < num) {
+		while (first < num && reqs[first].rr_served) {
+			first++;
+		}
+		if (sched == S_CLOSED) {
+			next = first;
+			rr = &reqs[next];
+			/* keep the guest's think time */
+			issue = prevdone;
+			if (first > 0 && rr->rr_issue > reqs[first-1].rr_done) {
+				issue += rr->rr_issue - reqs[first-1].rr_done;
+			}
+			if (issue > now) {
+				now = issue;
+			}
+		}
+		else {
+			if (reqs[first].rr_issue > now) {
+				/* idle until the next request arrives */
+				now = reqs[first].rr_issue;
+			}
+			next = pickreq(reqs, num, first, now, sched,
+				       curtrack, &direction);
+			rr = &reqs[next];
+			issue = rr->rr_issue;
+		}
+
+		now = service(&dm, rr, now, &curtrack, &trackarrival,
+			      &seek, &rotwait);
+		rr->rr_served = 1;
+		done++;
+		prevdone = now;
+		if (now > end) {
+			end = now;
+		}
+		addstat(&replay, now - issue, seek, rotwait);
+
+		if (verbose) {
+			printf("%8u %c %10u  %10.3f %10.3f  %6d %8.3f\n",
+			       next,
+			       rr->rr_log.dlr_flags & DISKLOG_DISCARD ? 'D' :
+			       rr->rr_log.dlr_flags & DISKLOG_WRITE ? 'W':'R',
+			       rr->rr_log.dlr_sector,
+			       (rr->rr_done - rr->rr_issue) / 1e6,
+			       (now - issue) / 1e6, seek, rotwait / 1e6);
+		}
+	}
+
+	printf("%s: %u requests (%u invalid); %u-byte sectors, "
+	       "%u sectors\n", file, num, errors, dlh.dlh_sectsize,
+	       dlh.dlh_totsectors);
+	printf("%-20s %14s %14s\n", "", "logged", "replayed");
+	printf("%-20s %14u %14u\n", "RPM", dlh.dlh_rpm, rpm);
+	printf("%-20s %14u %14u\n", "Tracks", dlh.dlh_tracks, tracks);
+	printf("%-20s %14s %14s\n", "Scheduling", "closed",
+	       schednames[sched]);
+	printf("%-20s %14.3f %14.3f\n", "Elapsed (ms)",
+	       num > 0 ? (reqs[num-1].rr_done - start) / 1e6 : 0.0,
+	       (end - start) / 1e6);
+	printf("%-20s %14.3f %14.3f\n", "Mean latency (ms)",
+	       statavg(orig.rs_totlatency, orig.rs_count) / 1e6,
+	       statavg(replay.rs_totlatency, replay.rs_count) / 1e6);
+	printf("%-20s %14.3f %14.3f\n", "Max latency (ms)",
+	       orig.rs_maxlatency / 1e6, replay.rs_maxlatency / 1e6);
+	printf("%-20s %14.1f %14.1f\n", "Mean seek (tracks)",
+	       statavg(orig.rs_totseek, orig.rs_count),
+	       statavg(replay.rs_totseek, replay.rs_count));
+	printf("%-20s %14.3f %14.3f\n", "Mean rotation (ms)",
+	       statavg(orig.rs_totrotwait, orig.rs_count) / 1e6,
+	       statavg(replay.rs_totrotwait, replay.rs_count) / 1e6);
+
+	diskmodel_cleanup(&dm);
+	free(reqs);
 }
 
 ////////////////////////////////////////////////////////////
@@ -389,9 +912,12 @@ void
 usage(void)
 {
 	fprintf(stderr, "Usage: disk161 action [options] [arguments]\n");
-	fprintf(stderr, "   disk161 create [-f] filename size\n"); 
+	fprintf(stderr, "   disk161 create [-f] [-s sectorsize] filename size\n"); 
 	fprintf(stderr, "   disk161 info filename...\n");
 	fprintf(stderr, "   disk161 resize filename [+-]size\n");
+	fprintf(stderr, "   disk161 replay [-v] [-r rpm] [-t tracks] "
+		"[-S closed|fcfs|sstf|scan] logfile\n");
+	fprintf(stderr, "   disk161 sparsify filename...\n");
 	exit(3);
 }
 
@@ -400,6 +926,11 @@ main(int argc, char *argv[])
 {
 	const char *command;
 	int doforce = 0;
+	unsigned sectsize = SECTORSIZE;
+	int gotsectsize = 0;
+	uint32_t rpm = 0, tracks = 0;
+	enum sched sched = S_CLOSED;
+	int verbose = 0, gotreplay = 0;
 	int ch;
 	int i;
 
@@ -411,18 +942,47 @@ main(int argc, char *argv[])
 	argv++;
 	argc--;
 
-	while ((ch = getopt(argc, argv, "f"))!=-1) {
+	while ((ch = getopt(argc, argv, "fs:r:t:S:v"))!=-1) {
 		switch (ch) {
 		    case 'f': doforce = 1; break;
+		    case 's':
+			sectsize = getsize(optarg, SECTORSIZE);
+			checksectsize(sectsize);
+			gotsectsize = 1;
+			break;
+		    case 'r': rpm = atoi(optarg); gotreplay = 1; break;
+		    case 't':
+			tracks = atoi(optarg);
+			if (tracks == 0) {
+				usage();
+			}
+			gotreplay = 1;
+			break;
+		    case 'S':
+			if (!strcmp(optarg, "closed")) sched = S_CLOSED;
+			else if (!strcmp(optarg, "fcfs")) sched = S_FCFS;
+			else if (!strcmp(optarg, "sstf")) sched = S_SSTF;
+			else if (!strcmp(optarg, "scan")) sched = S_SCAN;
+			else usage();
+			gotreplay = 1;
+			break;
+		    case 'v': verbose = 1; gotreplay = 1; break;
 		    default: usage();
 		}
 	}
 
+	if (gotsectsize && strcmp(command, "create")) {
+		usage();
+	}
+	if (gotreplay && strcmp(command, "replay")) {
+		usage();
+	}
+
 	if (!strcmp(command, "create")) {
 		if (optind + 2 != argc) {
 			usage();
 		}
-		docreate(argv[optind], argv[optind+1], doforce);
+		docreate(argv[optind], argv[optind+1], sectsize, doforce);
 	}
 	else if (!strcmp(command, "info") || !strcmp(command, "stat") ||
 		 !strcmp(command, "stats") || !strcmp(command, "status")) {
@@ -442,6 +1002,23 @@ main(int argc, char *argv[])
 		}
 		doresize(argv[optind], argv[optind+1]);
 	}
+	else if (!strcmp(command, "replay")) {
+		if (optind + 1 != argc) {
+			usage();
+		}
+		if (doforce) {
+			usage();
+		}
+		doreplay(argv[optind], rpm, tracks, sched, verbose);
+	}
+	else if (!strcmp(command, "sparsify")) {
+		if (doforce) {
+			usage();
+		}
+		for (i=optind; i<argc; i++) {
+			dosparsify(argv[i]);
+		}
+	}
 	else if (!strcmp(command, "help")) {
 		usage();
 	}
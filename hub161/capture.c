@@ -0,0 +1,117 @@
+/*
+ * Packet capture. See capture.h.
+ */
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "config.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "capture.h"
+
+/*
+ * pcap file format: a file header, then a record header before each
+ * frame, all in our own byte order (the reader checks the magic).
+ */
+#define PCAP_MAGIC_NS	0xa1b23c4d	/* nanosecond timestamps */
+#define PCAP_SNAPLEN	65535
+
+struct pcap_filehdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_rechdr {
+	uint32_t ts_sec;
+	uint32_t ts_nsec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+static FILE *capfile;
+static int capfailed;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t caplock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK()		pthread_mutex_lock(&caplock)
+#define UNLOCK()	pthread_mutex_unlock(&caplock)
+#else
+#define LOCK()		((void)0)
+#define UNLOCK()	((void)0)
+#endif
+
+int
+capture_open(const char *path)
+{
+	struct pcap_filehdr fh;
+
+	capfile = fopen(path, "wb");
+	if (capfile == NULL) {
+		fprintf(stderr, "hub161: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	fh.magic = PCAP_MAGIC_NS;
+	fh.version_major = 2;
+	fh.version_minor = 4;
+	fh.thiszone = 0;
+	fh.sigfigs = 0;
+	fh.snaplen = PCAP_SNAPLEN;
+	fh.linktype = CAPTURE_LINKTYPE;
+	if (fwrite(&fh, sizeof(fh), 1, capfile) != 1 || fflush(capfile)) {
+		fprintf(stderr, "hub161: %s: %s\n", path, strerror(errno));
+		fclose(capfile);
+		capfile = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void
+capture_frame(const char *pkt, size_t len)
+{
+	struct pcap_rechdr rh;
+	struct timespec ts;
+
+	if (capfile == NULL) {
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rh.ts_sec = ts.tv_sec;
+	rh.ts_nsec = ts.tv_nsec;
+	rh.incl_len = len;
+	rh.orig_len = len;
+
+	LOCK();
+	if (!capfailed &&
+	    (fwrite(&rh, sizeof(rh), 1, capfile) != 1 ||
+	     fwrite(pkt, len, 1, capfile) != 1)) {
+		fprintf(stderr, "hub161: capture: %s (stopping)\n",
+			strerror(errno));
+		capfailed = 1;
+	}
+	UNLOCK();
+}
+
+void
+capture_flush(void)
+{
+	if (capfile == NULL) {
+		return;
+	}
+	LOCK();
+	fflush(capfile);
+	UNLOCK();
+}
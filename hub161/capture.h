@@ -0,0 +1,26 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+/*
+ * Packet capture to a pcap file.
+ *
+ * Frames are written whole, link header and all, with the link type
+ * set to LINKTYPE_USER0 (147), one of the values reserved for private
+ * use; tell the reader (e.g. Wireshark's DLT_USER table) to treat the
+ * first 8 bytes as the hub161 header. Timestamps have nanosecond
+ * resolution.
+ *
+ * Functions:
+ *     capture_open  - start writing to path. Returns -1 (having printed
+ *                     a message) on error.
+ *     capture_frame - record a frame. May be called from any thread.
+ *     capture_flush - push buffered frames out to the file.
+ */
+
+#define CAPTURE_LINKTYPE 147	/* LINKTYPE_USER0 */
+
+int  capture_open(const char *path);
+void capture_frame(const char *pkt, size_t len);
+void capture_flush(void);
+
+#endif /* _CAPTURE_H_ */
@@ -0,0 +1,189 @@
+/*
+ * Waiting for file descriptors. See events.h.
+ */
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include "config.h"
+
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#include "events.h"
+
+#ifdef HAVE_EPOLL
+
+struct evset {
+	int epfd;
+};
+
+struct evset *
+evset_create(void)
+{
+	struct evset *es = malloc(sizeof(struct evset));
+	if (es==NULL) {
+		return NULL;
+	}
+	es->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (es->epfd < 0) {
+		free(es);
+		return NULL;
+	}
+	return es;
+}
+
+int
+evset_add(struct evset *es, int fd, int events, uint64_t tag)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = ((events & EV_IN) ? EPOLLIN : 0) |
+		((events & EV_OUT) ? EPOLLOUT : 0);
+	ev.data.u64 = tag;
+	return epoll_ctl(es->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void
+evset_remove(struct evset *es, int fd)
+{
+	struct epoll_event ev;
+
+	/* old kernels want a non-null pointer */
+	epoll_ctl(es->epfd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+int
+evset_wait(struct evset *es, uint64_t *tags, int max, int timeoutms)
+{
+	struct epoll_event evs[64];
+	int i, n;
+
+	if (max > 64) {
+		max = 64;
+	}
+	n = epoll_wait(es->epfd, evs, max, timeoutms);
+	for (i=0; i<n; i++) {
+		tags[i] = evs[i].data.u64;
+	}
+	return n < 0 ? 0 : n;
+}
+
+void
+evset_destroy(struct evset *es)
+{
+	close(es->epfd);
+	free(es);
+}
+
+int
+evset_threadsafe(void)
+{
+	return 1;
+}
+
+#else /* !HAVE_EPOLL */
+
+struct evset {
+	struct pollfd *pfds;
+	uint64_t *tags;
+	int num;
+	int max;
+};
+
+struct evset *
+evset_create(void)
+{
+	struct evset *es = malloc(sizeof(struct evset));
+	if (es==NULL) {
+		return NULL;
+	}
+	es->pfds = NULL;
+	es->tags = NULL;
+	es->num = 0;
+	es->max = 0;
+	return es;
+}
+
+int
+evset_add(struct evset *es, int fd, int events, uint64_t tag)
+{
+	if (es->num == es->max) {
+		int newmax = es->max ? es->max*2 : 16;
+		struct pollfd *np;
+		uint64_t *nt;
+
+		np = realloc(es->pfds, newmax*sizeof(*np));
+		if (np == NULL) {
+			return -1;
+		}
+		es->pfds = np;
+		nt = realloc(es->tags, newmax*sizeof(*nt));
+		if (nt == NULL) {
+			return -1;
+		}
+		es->tags = nt;
+		es->max = newmax;
+	}
+	es->pfds[es->num].fd = fd;
+	es->pfds[es->num].events = ((events & EV_IN) ? POLLIN : 0) |
+		((events & EV_OUT) ? POLLOUT : 0);
+	es->tags[es->num] = tag;
+	es->num++;
+	return 0;
+}
+
+void
+evset_remove(struct evset *es, int fd)
+{
+	int i;
+
+	for (i=0; i<es->num; i++) {
+		if (es->pfds[i].fd == fd) {
+			es->num--;
+			es->pfds[i] = es->pfds[es->num];
+			es->tags[i] = es->tags[es->num];
+			return;
+		}
+	}
+}
+
+int
+evset_wait(struct evset *es, uint64_t *tags, int max, int timeoutms)
+{
+	int i, n, r;
+
+	r = poll(es->pfds, es->num, timeoutms);
+	if (r <= 0) {
+		return 0;
+	}
+	n = 0;
+	for (i=0; i<es->num && n<max; i++) {
+		if (es->pfds[i].revents) {
+			tags[n++] = es->tags[i];
+		}
+	}
+	return n;
+}
+
+void
+evset_destroy(struct evset *es)
+{
+	free(es->pfds);
+	free(es->tags);
+	free(es);
+}
+
+int
+evset_threadsafe(void)
+{
+	return 0;
+}
+
+#endif /* HAVE_EPOLL */
@@ -0,0 +1,37 @@
+#ifndef _EVENTS_H_
+#define _EVENTS_H_
+
+/*
+ * Wait for file descriptors to become ready.
+ *
+ * Each descriptor is registered with a tag that is handed back when
+ * it's ready; descriptors are watched for reading (EV_IN), writing
+ * (EV_OUT), or both. Uses epoll where available, in which case a set
+ * may be changed by other threads while one thread waits on it, and
+ * poll otherwise, in which case it may not.
+ *
+ * Functions:
+ *     evset_create     - allocate a new set.
+ *     evset_add        - watch fd. Returns -1 on error.
+ *     evset_remove     - stop watching fd.
+ *     evset_wait       - wait up to timeoutms (-1 forever) for something
+ *                        to be ready; store up to max tags and return
+ *                        how many.
+ *     evset_destroy    - dispose of a set.
+ *     evset_threadsafe - nonzero if sets can be shared between threads.
+ */
+
+#define EV_IN   1
+#define EV_OUT  2
+
+struct evset;  /* Opaque. */
+
+struct evset *evset_create(void);
+int           evset_add(struct evset *, int fd, int events, uint64_t tag);
+void          evset_remove(struct evset *, int fd);
+int           evset_wait(struct evset *, uint64_t *tags, int max,
+			 int timeoutms);
+void          evset_destroy(struct evset *);
+int           evset_threadsafe(void);
+
+#endif /* _EVENTS_H_ */
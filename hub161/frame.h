@@ -0,0 +1,22 @@
+#ifndef _FRAME_H_
+#define _FRAME_H_
+
+/*
+ * What goes over the hub socket: every packet starts with a link
+ * header, all fields in network byte order. This must match
+ * dev_net.c.
+ */
+
+#define HUB_ADDR        0x0000
+#define BROADCAST_ADDR  0xffff
+#define FRAME_MAGIC     0xa4b3
+#define MAXPACKET       4096
+
+struct linkheader {
+	uint16_t lh_frame;
+	uint16_t lh_from;
+	uint16_t lh_packetlen;
+	uint16_t lh_to;
+};
+
+#endif /* _FRAME_H_ */
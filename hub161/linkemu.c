@@ -0,0 +1,753 @@
+/*
+ * Link emulation. See linkemu.h.
+ */
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <assert.h>
+#include "config.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "linkemu.h"
+
+#define ANYADDR		0x10000		/* "*" in a rule */
+#define RULE_BUCKETS	256		/* power of two */
+#define LINK_BUCKETS	1024		/* power of two */
+
+#define TICK_NS		1000000ULL	/* 1 ms */
+#define WHEEL_SLOTS	1024		/* power of two */
+#define DUETICK(t)	(((t) + TICK_NS - 1) / TICK_NS)	/* never early */
+#define MAXPENDING	65536		/* packets held at once */
+
+#define MINBURST	4096		/* bytes */
+#define DEFAULT_LIMIT	1000000000ULL	/* 1 s */
+
+#define PARETO_SHAPE	3.0
+
+#ifndef M_PI
+#define M_PI		3.14159265358979323846
+#endif
+
+enum {
+	DIST_UNIFORM,
+	DIST_NORMAL,
+	DIST_EXPONENTIAL,
+	DIST_PARETO,
+};
+
+struct lerule {
+	uint32_t r_from, r_to;		/* address or ANYADDR */
+	uint64_t r_delay;		/* ns */
+	uint64_t r_jitter;		/* ns */
+	int r_dist;
+	double r_rate;			/* bits per second, or 0 */
+	double r_burst;			/* bytes, or 0 for the default */
+	uint64_t r_limit;		/* ns */
+	double r_loss;			/* probabilities, 0-1 */
+	double r_enterbad, r_leavebad;
+	double r_dup;
+	double r_reorder;
+	struct lerule *r_next;
+};
+
+struct lelink {
+	uint64_t l_key;
+	struct lerule *l_rule;
+	uint64_t l_rng;
+	double l_tokens;		/* bytes; negative is debt */
+	uint64_t l_last;		/* when l_tokens was figured */
+	uint64_t l_lastdue;		/* latest in-order packet */
+	int l_bad;			/* in the burst-loss state */
+	struct lelink *l_next;
+};
+
+struct lepkt {
+	struct lepkt *p_next;
+	uint64_t p_due;
+	uint64_t p_tag;
+	size_t p_len;
+	/* data follows */
+};
+
+struct leslot {
+	struct lepkt *s_head;
+	struct lepkt **s_tailp;
+};
+
+static struct lerule *rulehash[RULE_BUCKETS];
+static unsigned nrules;
+static struct lelink *linkhash[LINK_BUCKETS];
+static uint64_t seed;
+
+static struct leslot wheel[WHEEL_SLOTS];
+static uint64_t wheeltick;		/* last tick handed back */
+static unsigned npending;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t lelock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK()		pthread_mutex_lock(&lelock)
+#define UNLOCK()	pthread_mutex_unlock(&lelock)
+#else
+#define LOCK()		((void)0)
+#define UNLOCK()	((void)0)
+#endif
+
+////////////////////////////////////////////////////////////
+//
+// Random numbers
+
+static
+uint64_t
+splitmix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+/*
+ * xorshift64*; returns a double in [0, 1).
+ */
+static
+double
+rnd(struct lelink *l)
+{
+	uint64_t x = l->l_rng;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	l->l_rng = x;
+	x *= 0x2545f4914f6cdd1dULL;
+	return (x >> 11) * (1.0 / 9007199254740992.0);	/* 2^-53 */
+}
+
+/*
+ * Latency for one packet, in ns.
+ */
+static
+uint64_t
+latency(struct lelink *l)
+{
+	const struct lerule *r = l->l_rule;
+	double d, u, v;
+
+	d = r->r_delay;
+	if (r->r_jitter > 0) {
+		switch (r->r_dist) {
+		    case DIST_UNIFORM:
+			d += r->r_jitter * (2.0 * rnd(l) - 1.0);
+			break;
+		    case DIST_NORMAL:
+			/* Box-Muller; 1-u keeps log away from 0 */
+			u = 1.0 - rnd(l);
+			v = rnd(l);
+			d += r->r_jitter * sqrt(-2.0 * log(u)) *
+				cos(2.0 * M_PI * v);
+			break;
+		    case DIST_EXPONENTIAL:
+			d += -(double)r->r_jitter * log(1.0 - rnd(l));
+			break;
+		    case DIST_PARETO:
+			/* scaled so the part added has mean r_jitter */
+			u = 1.0 - rnd(l);
+			d += r->r_jitter * (PARETO_SHAPE - 1.0) *
+				(pow(u, -1.0 / PARETO_SHAPE) - 1.0);
+			break;
+		}
+	}
+	return d < 0 ? 0 : (uint64_t)d;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Rules and links
+
+static
+uint64_t
+addrkey(uint32_t from, uint32_t to)
+{
+	return ((uint64_t)from << 32) | to;
+}
+
+static
+unsigned
+keybucket(uint64_t key, unsigned nbuckets)
+{
+	return splitmix(key) & (nbuckets - 1);
+}
+
+static
+struct lerule *
+rulelookup(uint32_t from, uint32_t to)
+{
+	struct lerule *r;
+	uint64_t key = addrkey(from, to);
+
+	for (r = rulehash[keybucket(key, RULE_BUCKETS)]; r != NULL;
+	     r = r->r_next) {
+		if (addrkey(r->r_from, r->r_to) == key) {
+			return r;
+		}
+	}
+	return NULL;
+}
+
+static
+struct lerule *
+findrule(uint16_t from, uint16_t to)
+{
+	struct lerule *r;
+
+	if ((r = rulelookup(from, to)) != NULL ||
+	    (r = rulelookup(ANYADDR, to)) != NULL ||
+	    (r = rulelookup(from, ANYADDR)) != NULL ||
+	    (r = rulelookup(ANYADDR, ANYADDR)) != NULL) {
+		return r;
+	}
+	return NULL;
+}
+
+/*
+ * Get the state for packets from one port to another under rule r.
+ * Call locked.
+ */
+static
+struct lelink *
+getlink(struct lerule *r, uint16_t from, uint16_t to, uint64_t now)
+{
+	struct lelink *l;
+	uint64_t key;
+	unsigned b;
+
+	key = addrkey(r->r_from == ANYADDR ? ANYADDR : from, to);
+	b = keybucket(key, LINK_BUCKETS);
+	for (l = linkhash[b]; l != NULL; l = l->l_next) {
+		if (l->l_key == key) {
+			return l;
+		}
+	}
+
+	l = malloc(sizeof(struct lelink));
+	if (l == NULL) {
+		fprintf(stderr, "hub161: out of memory\n");
+		exit(1);
+	}
+	l->l_key = key;
+	l->l_rule = r;
+	l->l_rng = splitmix(seed ^ splitmix(key));
+	if (l->l_rng == 0) {
+		/* xorshift gets stuck at 0 */
+		l->l_rng = 1;
+	}
+	l->l_tokens = r->r_burst;
+	l->l_last = now;
+	l->l_lastdue = 0;
+	l->l_bad = 0;
+	l->l_next = linkhash[b];
+	linkhash[b] = l;
+	return l;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Parsing
+
+static
+int
+parseaddr(const char *s, uint32_t *ret)
+{
+	unsigned long val;
+	char *t;
+
+	if (!strcmp(s, "*")) {
+		*ret = ANYADDR;
+		return 0;
+	}
+	errno = 0;
+	val = strtoul(s, &t, 0);
+	if (*s == 0 || *t != 0 || errno != 0 || val > 0xffff) {
+		return -1;
+	}
+	*ret = val;
+	return 0;
+}
+
+static
+int
+parsetime(const char *s, uint64_t *ret)
+{
+	double val, mult;
+	char *t;
+
+	val = strtod(s, &t);
+	if (t == s || val < 0) {
+		return -1;
+	}
+	if (!strcmp(t, "ns")) {
+		mult = 1;
+	}
+	else if (!strcmp(t, "us")) {
+		mult = 1e3;
+	}
+	else if (!strcmp(t, "ms") || !strcmp(t, "")) {
+		mult = 1e6;
+	}
+	else if (!strcmp(t, "s")) {
+		mult = 1e9;
+	}
+	else {
+		return -1;
+	}
+	*ret = val * mult;
+	return 0;
+}
+
+/*
+ * A number with an optional k, M, or G. If bits is set, "bit" or
+ * "bps" may follow.
+ */
+static
+int
+parsesize(const char *s, int bits, double *ret)
+{
+	double val;
+	char *t;
+
+	val = strtod(s, &t);
+	if (t == s || val < 0) {
+		return -1;
+	}
+	switch (*t) {
+	    case 'k': case 'K': val *= bits ? 1e3 : 1024; t++; break;
+	    case 'M': val *= bits ? 1e6 : 1024*1024; t++; break;
+	    case 'G': val *= bits ? 1e9 : 1024*1024*1024; t++; break;
+	}
+	if (bits && (!strcmp(t, "bit") || !strcmp(t, "bps"))) {
+		t += 3;
+	}
+	if (*t != 0) {
+		return -1;
+	}
+	*ret = val;
+	return 0;
+}
+
+static
+int
+parsepct(const char *s, double *ret)
+{
+	double val;
+	char *t;
+
+	val = strtod(s, &t);
+	if (t == s || val < 0 || val > 100) {
+		return -1;
+	}
+	if (*t == '%') {
+		t++;
+	}
+	if (*t != 0) {
+		return -1;
+	}
+	*ret = val / 100.0;
+	return 0;
+}
+
+static
+int
+parseoption(struct lerule *r, char *opt)
+{
+	char *val, *slash;
+
+	val = strchr(opt, '=');
+	if (val == NULL) {
+		return -1;
+	}
+	*val++ = 0;
+
+	if (!strcmp(opt, "delay")) {
+		return parsetime(val, &r->r_delay);
+	}
+	if (!strcmp(opt, "jitter")) {
+		return parsetime(val, &r->r_jitter);
+	}
+	if (!strcmp(opt, "dist")) {
+		if (!strcmp(val, "uniform")) {
+			r->r_dist = DIST_UNIFORM;
+		}
+		else if (!strcmp(val, "normal")) {
+			r->r_dist = DIST_NORMAL;
+		}
+		else if (!strcmp(val, "exponential")) {
+			r->r_dist = DIST_EXPONENTIAL;
+		}
+		else if (!strcmp(val, "pareto")) {
+			r->r_dist = DIST_PARETO;
+		}
+		else {
+			return -1;
+		}
+		return 0;
+	}
+	if (!strcmp(opt, "rate")) {
+		return parsesize(val, 1, &r->r_rate);
+	}
+	if (!strcmp(opt, "burst")) {
+		return parsesize(val, 0, &r->r_burst);
+	}
+	if (!strcmp(opt, "limit")) {
+		return parsetime(val, &r->r_limit);
+	}
+	if (!strcmp(opt, "loss")) {
+		return parsepct(val, &r->r_loss);
+	}
+	if (!strcmp(opt, "burstloss")) {
+		slash = strchr(val, '/');
+		if (slash == NULL) {
+			return -1;
+		}
+		*slash++ = 0;
+		if (parsepct(val, &r->r_enterbad) ||
+		    parsepct(slash, &r->r_leavebad)) {
+			return -1;
+		}
+		return 0;
+	}
+	if (!strcmp(opt, "dup")) {
+		return parsepct(val, &r->r_dup);
+	}
+	if (!strcmp(opt, "reorder")) {
+		return parsepct(val, &r->r_reorder);
+	}
+	return -1;
+}
+
+int
+linkemu_addrule(const char *spec, const char *where)
+{
+	struct lerule rule, *r;
+	char buf[1024], *words[64], *s, *opt;
+	unsigned b;
+	int nwords, i;
+
+	if (strlen(spec) >= sizeof(buf)) {
+		fprintf(stderr, "hub161: %s: rule too long\n", where);
+		return -1;
+	}
+	strcpy(buf, spec);
+
+	nwords = 0;
+	for (s = strtok(buf, " \t\r\n"); s != NULL;
+	     s = strtok(NULL, " \t\r\n")) {
+		if (nwords == 64) {
+			fprintf(stderr, "hub161: %s: rule too long\n", where);
+			return -1;
+		}
+		words[nwords++] = s;
+	}
+	if (nwords < 2) {
+		fprintf(stderr, "hub161: %s: rule needs from and to "
+			"addresses\n", where);
+		return -1;
+	}
+
+	memset(&rule, 0, sizeof(rule));
+	rule.r_dist = DIST_UNIFORM;
+	rule.r_limit = DEFAULT_LIMIT;
+	if (parseaddr(words[0], &rule.r_from) ||
+	    parseaddr(words[1], &rule.r_to)) {
+		fprintf(stderr, "hub161: %s: bad address\n", where);
+		return -1;
+	}
+	for (i=2; i<nwords; i++) {
+		/* parseoption takes it apart; keep the words[] copy whole */
+		opt = strdup(words[i]);
+		if (opt == NULL) {
+			fprintf(stderr, "hub161: out of memory\n");
+			exit(1);
+		}
+		if (parseoption(&rule, opt)) {
+			fprintf(stderr, "hub161: %s: bad option %s\n",
+				where, words[i]);
+			free(opt);
+			return -1;
+		}
+		free(opt);
+	}
+	if (rule.r_rate > 0 && rule.r_burst == 0) {
+		/* 10 ms worth, but at least a full packet */
+		rule.r_burst = rule.r_rate / 8 / 100;
+		if (rule.r_burst < MINBURST) {
+			rule.r_burst = MINBURST;
+		}
+	}
+
+	/* a later rule for the same addresses replaces an earlier one */
+	r = rulelookup(rule.r_from, rule.r_to);
+	if (r != NULL) {
+		rule.r_next = r->r_next;
+		*r = rule;
+		return 0;
+	}
+
+	r = malloc(sizeof(struct lerule));
+	if (r == NULL) {
+		fprintf(stderr, "hub161: out of memory\n");
+		exit(1);
+	}
+	*r = rule;
+	b = keybucket(addrkey(r->r_from, r->r_to), RULE_BUCKETS);
+	r->r_next = rulehash[b];
+	rulehash[b] = r;
+	nrules++;
+	return 0;
+}
+
+int
+linkemu_loadfile(const char *path)
+{
+	char buf[1024], where[256], *s;
+	FILE *f;
+	int lineno = 0, result = 0;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "hub161: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	while (fgets(buf, sizeof(buf), f) != NULL) {
+		lineno++;
+		s = strchr(buf, '#');
+		if (s != NULL) {
+			*s = 0;
+		}
+		for (s = buf; isspace((unsigned char)*s); s++) {
+			/* nothing */
+		}
+		if (*s == 0) {
+			continue;
+		}
+		snprintf(where, sizeof(where), "%s:%d", path, lineno);
+		if (linkemu_addrule(s, where)) {
+			result = -1;
+		}
+	}
+	fclose(f);
+	return result;
+}
+
+void
+linkemu_seed(uint64_t s)
+{
+	seed = s;
+}
+
+int
+linkemu_active(void)
+{
+	return nrules > 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Shaping
+
+uint64_t
+linkemu_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int
+linkemu_shape(uint16_t from, uint16_t to, size_t len, uint64_t now,
+	      uint64_t *delays)
+{
+	struct lerule *r;
+	struct lelink *l;
+	uint64_t wait, due;
+	int i, n;
+
+	r = findrule(from, to);
+	if (r == NULL) {
+		delays[0] = 0;
+		return 1;
+	}
+
+	LOCK();
+	l = getlink(r, from, to, now);
+
+	/* Loss */
+	if (r->r_enterbad > 0) {
+		if (l->l_bad) {
+			if (rnd(l) < r->r_leavebad) {
+				l->l_bad = 0;
+			}
+		}
+		else if (rnd(l) < r->r_enterbad) {
+			l->l_bad = 1;
+		}
+		if (l->l_bad) {
+			UNLOCK();
+			return 0;
+		}
+	}
+	if (r->r_loss > 0 && rnd(l) < r->r_loss) {
+		UNLOCK();
+		return 0;
+	}
+
+	/*
+	 * Bandwidth. Packets may run the bucket into debt; the debt is
+	 * how long this one has to wait, and later ones wait behind it.
+	 */
+	wait = 0;
+	if (r->r_rate > 0) {
+		if (now > l->l_last) {
+			l->l_tokens += (now - l->l_last) * r->r_rate / 8e9;
+			if (l->l_tokens > r->r_burst) {
+				l->l_tokens = r->r_burst;
+			}
+			l->l_last = now;
+		}
+		if (l->l_tokens < (double)len) {
+			wait = ((double)len - l->l_tokens) * 8e9 / r->r_rate;
+			if (wait > r->r_limit) {
+				/* the queue is full */
+				UNLOCK();
+				return 0;
+			}
+		}
+		l->l_tokens -= len;
+	}
+
+	n = (r->r_dup > 0 && rnd(l) < r->r_dup) ? 2 : 1;
+	for (i=0; i<n; i++) {
+		if (r->r_reorder > 0 && rnd(l) < r->r_reorder) {
+			delays[i] = wait;
+			continue;
+		}
+		due = now + wait + latency(l);
+		if (r->r_jitter == 0) {
+			/* Without jitter, don't let this pass earlier ones. */
+			if (due < l->l_lastdue) {
+				due = l->l_lastdue;
+			}
+		}
+		if (due > l->l_lastdue) {
+			l->l_lastdue = due;
+		}
+		delays[i] = due - now;
+	}
+	UNLOCK();
+	return n;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Timer wheel
+
+int
+linkemu_defer(uint64_t due, uint64_t tag, const char *pkt, size_t len)
+{
+	struct lepkt *p;
+	struct leslot *s;
+	uint64_t tick;
+
+	p = malloc(sizeof(struct lepkt) + len);
+	if (p == NULL) {
+		return -1;
+	}
+	p->p_next = NULL;
+	p->p_due = due;
+	p->p_tag = tag;
+	p->p_len = len;
+	memcpy(p + 1, pkt, len);
+
+	LOCK();
+	if (npending >= MAXPENDING) {
+		UNLOCK();
+		free(p);
+		return -1;
+	}
+	if (npending == 0) {
+		wheeltick = linkemu_now() / TICK_NS;
+	}
+	tick = DUETICK(due);
+	if (tick <= wheeltick) {
+		tick = wheeltick + 1;
+	}
+	s = &wheel[tick % WHEEL_SLOTS];
+	if (s->s_head == NULL) {
+		s->s_tailp = &s->s_head;
+	}
+	*s->s_tailp = p;
+	s->s_tailp = &p->p_next;
+	npending++;
+	UNLOCK();
+	return 0;
+}
+
+void
+linkemu_run(uint64_t now,
+	    void (*deliver)(uint64_t tag, const char *pkt, size_t len))
+{
+	struct lepkt *ready, **readytailp, *p, **pp;
+	struct leslot *s;
+	uint64_t tick, nowtick, last;
+
+	ready = NULL;
+	readytailp = &ready;
+	nowtick = now / TICK_NS;
+
+	LOCK();
+	if (npending == 0 || nowtick <= wheeltick) {
+		UNLOCK();
+		return;
+	}
+	/* after a long stall, once around is everything */
+	last = nowtick;
+	if (last - wheeltick > WHEEL_SLOTS) {
+		last = wheeltick + WHEEL_SLOTS;
+	}
+	for (tick = wheeltick + 1; tick <= last && npending > 0; tick++) {
+		s = &wheel[tick % WHEEL_SLOTS];
+		pp = &s->s_head;
+		while (*pp != NULL) {
+			p = *pp;
+			if (DUETICK(p->p_due) > nowtick) {
+				/* a later time around */
+				pp = &p->p_next;
+				continue;
+			}
+			*pp = p->p_next;
+			p->p_next = NULL;
+			*readytailp = p;
+			readytailp = &p->p_next;
+			npending--;
+		}
+		s->s_tailp = pp;
+	}
+	wheeltick = nowtick;
+	UNLOCK();
+
+	while (ready != NULL) {
+		p = ready;
+		ready = p->p_next;
+		deliver(p->p_tag, (const char *)(p + 1), p->p_len);
+		free(p);
+	}
+}
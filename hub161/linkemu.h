@@ -0,0 +1,81 @@
+#ifndef _LINKEMU_H_
+#define _LINKEMU_H_
+
+/*
+ * Link emulation: delay, bandwidth limits, loss, duplication, and
+ * reordering for packets going through the hub.
+ *
+ * Rules say what happens to packets from one address to another;
+ * either address may be "*". A packet uses the most specific rule
+ * that matches: both addresses, then the destination only, then the
+ * source only, then neither. The state for a rule (its token bucket
+ * and burst-loss
+ * state) is kept per destination port, or per pair of ports if the
+ * rule names the source; so "* *" rate=10M limits each port to 10
+ * Mbit/s, not the whole hub.
+ *
+ * Rule syntax, one per line in a file or per -L argument:
+ *
+ *     from to option=value...
+ *
+ * Options:
+ *     delay=TIME       fixed latency
+ *     jitter=TIME      spread of the random part of the latency
+ *     dist=NAME        distribution of that part: uniform (+/-jitter,
+ *                      the default), normal (jitter is the standard
+ *                      deviation), exponential or pareto (added, with
+ *                      jitter as the mean)
+ *     rate=BITS        bandwidth in bits per second (k, M, G allowed)
+ *     burst=BYTES      token bucket depth [10 ms of rate, at least
+ *                      4k]
+ *     limit=TIME       packets that would wait longer than this for
+ *                      bandwidth are dropped [1s]
+ *     loss=PCT         independent random loss
+ *     burstloss=P/R    two-state burst loss: each packet enters the
+ *                      losing state with probability P% and leaves it
+ *                      with probability R%; packets in it are lost
+ *     dup=PCT          send a second copy
+ *     reorder=PCT      send without the latency, so it overtakes
+ *
+ * TIME is a number with ns, us, ms (the default), or s. Addresses
+ * are decimal, or hex with 0x. Without jitter a link keeps packets
+ * in order (apart from reorder=); with it they may pass each other.
+ *
+ * Everything random comes from a per-link generator seeded from the
+ * global seed and the link, so a run can be repeated.
+ *
+ * Delayed packets are kept on a timer wheel with 1 ms ticks.
+ */
+
+/* Configuration. These print a message and return -1 on error. */
+int linkemu_addrule(const char *spec, const char *where);
+int linkemu_loadfile(const char *path);
+void linkemu_seed(uint64_t seed);
+
+/* True if there are any rules. */
+int linkemu_active(void);
+
+/* Current time for the functions below, in nanoseconds. */
+uint64_t linkemu_now(void);
+
+/*
+ * Decide what happens to a packet of len bytes from one port to
+ * another. Returns the number of copies to send (0, 1, or 2) and
+ * stores how long to hold each one, in nanoseconds, in delays[].
+ */
+int linkemu_shape(uint16_t from, uint16_t to, size_t len, uint64_t now,
+		  uint64_t *delays);
+
+/*
+ * Hold a copy of a packet until due. The tag is handed back when it
+ * comes out. Returns -1 if too much is already being held.
+ */
+int linkemu_defer(uint64_t due, uint64_t tag, const char *pkt, size_t len);
+
+/*
+ * Hand back everything due by now.
+ */
+void linkemu_run(uint64_t now,
+		 void (*deliver)(uint64_t tag, const char *pkt, size_t len));
+
+#endif /* _LINKEMU_H_ */
@@ -3,77 +3,275 @@
  *
  * Hub for sys161 network devices.
  *
- * The hub listens on an AF_UNIX datagram socket and redistributes all
- * the packets it receives to all the senders it knows about.
+ * The hub listens on an AF_UNIX datagram socket and forwards the
+ * packets it receives. It's really a learning switch: it remembers
+ * which hardware address each sender uses, sends packets for a known
+ * address only there, and floods broadcasts and packets for unknown
+ * addresses to everyone else. Senders it hasn't heard from in a while
+ * (they send keepalives once a second) are forgotten.
+ *
+ * Senders may instead hand us a pair of shared-memory rings (see
+ * netring.h) and exchange frames through those; the socket is then
+ * only used for keepalives and control messages.
+ *
+ * Each sender gets its own nonblocking socket connected to it. If a
+ * sender isn't reading fast enough, packets for it wait in a bounded
+ * queue until its socket is writable again; only when that fills are
+ * packets dropped. Senders are only dropped for real errors (their
+ * socket went away) or for going silent.
+ *
+ * Senders can be spread over several worker threads ("shards"), each
+ * with its own event set, which watch the senders' rings and drain
+ * their queues. The main thread reads the hub socket and does all
+ * adding, changing, and removing of senders. The sender table is
+ * covered by a reader/writer lock held (for reading) while
+ * forwarding; each sender's queue and ring toward it are covered by
+ * a per-sender lock.
+ *
+ * If link emulation rules are given (see linkemu.h), packets may be
+ * dropped, duplicated, or held for a while before going out. Held
+ * packets are sent by the main thread.
+ *
+ * The hub can also write everything it forwards to a pcap file (see
+ * capture.h), and keeps counters for each sender that it hands out
+ * to anyone who connects to its stats socket.
  */
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 #include <arpa/inet.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <time.h>
 #include <assert.h>
 #include "config.h"
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #include "array.h"
+#include "capture.h"
+#include "events.h"
+#include "frame.h"
+#include "linkemu.h"
+#include "netring.h"
+#include "trafgen.h"
 
 #define DEFAULT_SOCKET  ".sockets/hub"
 
-#define HUB_ADDR        0x0000
-#define BROADCAST_ADDR  0xffff
-#define FRAME_MAGIC     0xa4b3
-#define MAXPACKET       4096
+#define SENDER_BUCKETS  256	/* power of two */
+#define DEFAULT_AGE     30	/* seconds */
+#define DEFAULT_QUEUE   256	/* packets */
+#define MAXSHARDS       64
 
-struct linkheader {
-	uint16_t lh_frame;
-	uint16_t lh_from;
-	uint16_t lh_packetlen;
-	uint16_t lh_to;
+/*
+ * Event tags: what kind of event, and which sender. The generation
+ * number catches events for a sender that has since been replaced.
+ */
+#define EVK_SOCK        1	/* the hub socket */
+#define EVK_OUT         2	/* a sender's socket is writable */
+#define EVK_RING        3	/* a sender's ring doorbell */
+#define EVK_STATS       4	/* the stats socket */
+#define EVTAG(k, addr, gen) \
+	(((uint64_t)(k) << 48) | ((uint64_t)(addr) << 32) | (gen))
+#define EVTAG_KIND(t)   ((unsigned)((t) >> 48))
+#define EVTAG_ADDR(t)   ((uint16_t)((t) >> 32))
+#define EVTAG_GEN(t)    ((uint32_t)(t))
+
+struct shard {
+	struct evset *sh_evs;
+#ifdef HAVE_PTHREAD
+	pthread_t sh_thread;
+#endif
 };
 
 struct sender {
 	uint16_t sdr_addr;
+	uint32_t sdr_gen;
+	struct shard *sdr_shard;
 	struct sockaddr_un sdr_sun;
 	socklen_t sdr_len;
+	int sdr_sock;			/* connected to sdr_sun, or -1 */
 	int sdr_errors;
+	time_t sdr_lastheard;
+	struct sender *sdr_hashnext;
+
+	/* Packets waiting for sdr_sock to be writable */
+	char **sdr_q;
+	size_t *sdr_qlen;
+	unsigned sdr_qhead, sdr_qcount;
+	int sdr_qwaiting;		/* watching for EV_OUT */
+
+	/* Statistics, from the sender's point of view */
+	uint64_t sdr_txframes, sdr_txbytes;	/* it sent to us */
+	uint64_t sdr_rxframes, sdr_rxbytes;	/* we sent or queued for it */
+	uint64_t sdr_drops;			/* we couldn't */
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t sdr_lock;
+#endif
+#ifdef HAVE_NETSHM
+	struct netring_shm *sdr_shm;	/* rings, or NULL for the socket */
+	int sdr_waitfd;			/* doorbell for frames to us */
+	int sdr_wakefd;			/* doorbell for frames from us */
+#endif
 };
 
 ////////////////////////////////////////////////////////////
 
 static struct array *senders;
+static struct sender *senderhash[SENDER_BUCKETS];
+static uint32_t sendergen;
 static int sock;
+static int statsock = -1;
+static time_t starttime;
+static int agesecs = DEFAULT_AGE;
+static unsigned queuelen = DEFAULT_QUEUE;
+
+static struct shard shards[MAXSHARDS];
+static int nshards = 1;
+
+#ifdef HAVE_PTHREAD
+static pthread_rwlock_t senderlock = PTHREAD_RWLOCK_INITIALIZER;
+#define RDLOCK()	pthread_rwlock_rdlock(&senderlock)
+#define WRLOCK()	pthread_rwlock_wrlock(&senderlock)
+#define UNLOCK()	pthread_rwlock_unlock(&senderlock)
+#define SDR_LOCK(s)	pthread_mutex_lock(&(s)->sdr_lock)
+#define SDR_UNLOCK(s)	pthread_mutex_unlock(&(s)->sdr_lock)
+#else
+#define RDLOCK()	((void)0)
+#define WRLOCK()	((void)0)
+#define UNLOCK()	((void)0)
+#define SDR_LOCK(s)	((void)(s))
+#define SDR_UNLOCK(s)	((void)(s))
+#endif
 
 ////////////////////////////////////////////////////////////
+//
+// Sender table
+
+static
+unsigned
+senderbucket(uint16_t addr)
+{
+	return (addr ^ (addr >> 8)) & (SENDER_BUCKETS - 1);
+}
+
+static
+struct sender *
+findsender(uint16_t addr)
+{
+	struct sender *sdr;
+
+	for (sdr = senderhash[senderbucket(addr)]; sdr != NULL;
+	     sdr = sdr->sdr_hashnext) {
+		if (sdr->sdr_addr == addr) {
+			return sdr;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+unhashsender(struct sender *sdr)
+{
+	struct sender **pp;
+
+	pp = &senderhash[senderbucket(sdr->sdr_addr)];
+	while (*pp != sdr) {
+		assert(*pp != NULL);
+		pp = &(*pp)->sdr_hashnext;
+	}
+	*pp = sdr->sdr_hashnext;
+}
 
 static
 void
+clearqueue(struct sender *sdr)
+{
+	while (sdr->sdr_qcount > 0) {
+		free(sdr->sdr_q[sdr->sdr_qhead]);
+		sdr->sdr_qhead = (sdr->sdr_qhead + 1) % queuelen;
+		sdr->sdr_qcount--;
+	}
+}
+
+/*
+ * (Re)connect the sender's socket. Called with the sender locked or
+ * not yet visible to other threads.
+ */
+static
+void
+connectsender(struct sender *sdr)
+{
+	if (sdr->sdr_sock >= 0) {
+		if (sdr->sdr_qwaiting) {
+			evset_remove(sdr->sdr_shard->sh_evs, sdr->sdr_sock);
+			sdr->sdr_qwaiting = 0;
+		}
+		close(sdr->sdr_sock);
+		/* whatever was waiting was for the old socket */
+		clearqueue(sdr);
+	}
+
+	sdr->sdr_sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (sdr->sdr_sock < 0) {
+		fprintf(stderr, "hub161: socket: %s\n", strerror(errno));
+		exit(1);
+	}
+	fcntl(sdr->sdr_sock, F_SETFL, O_NONBLOCK);
+	fcntl(sdr->sdr_sock, F_SETFD, FD_CLOEXEC);
+	if (connect(sdr->sdr_sock, (struct sockaddr *)&sdr->sdr_sun,
+		    sdr->sdr_len) < 0) {
+		fprintf(stderr, "hub161: connect %04x: %s\n",
+			sdr->sdr_addr, strerror(errno));
+		sdr->sdr_errors++;
+		close(sdr->sdr_sock);
+		sdr->sdr_sock = -1;
+	}
+}
+
+/*
+ * Find or add the sender for a packet from the socket. Call with
+ * the table locked for writing.
+ */
+static
+struct sender *
 checksender(uint16_t addr, struct sockaddr_un *rsun, socklen_t rlen)
 {
-	int n, i;
 	struct sender *sdr;
+	unsigned b;
 	int pathlen;
 
 	assert(senders != NULL);
 	assert(rsun != NULL);
 	assert(addr != BROADCAST_ADDR);
 
-	n = array_getnum(senders);
-	for (i=0; i<n; i++) {
-		sdr = array_getguy(senders, i);
-		assert(sdr != NULL);
-		if (sdr->sdr_addr == addr) {
+	sdr = findsender(addr);
+	if (sdr != NULL) {
+		SDR_LOCK(sdr);
+		if (rlen != sdr->sdr_len ||
+		    memcmp(rsun, &sdr->sdr_sun, rlen) != 0) {
 			memcpy(&sdr->sdr_sun, rsun, sizeof(*rsun));
 			sdr->sdr_len = rlen;
-			return;
+			connectsender(sdr);
 		}
+		sdr->sdr_lastheard = time(NULL);
+		SDR_UNLOCK(sdr);
+		return sdr;
 	}
-	
+
 	sdr = malloc(sizeof(struct sender));
 	if (!sdr) {
 		fprintf(stderr, "hub161: out of memory\n");
@@ -83,70 +281,503 @@ checksender(uint16_t addr, struct sockaddr_un *rsun, socklen_t rlen)
 	pathlen = rlen;
 	pathlen = pathlen - (sizeof(*rsun) - sizeof(rsun->sun_path));
 
-	printf("hub161: adding %04x from %.*s\n", addr, pathlen, 
+	printf("hub161: adding %04x from %.*s\n", addr, pathlen,
 	       rsun->sun_path);
 	if (rsun->sun_path[0]!='/') {
 		printf("hub161: (not absolute pathname, may not work)\n");
 	}
 
 	sdr->sdr_addr = addr;
+	sdr->sdr_gen = ++sendergen;
+	sdr->sdr_shard = &shards[addr % nshards];
 	memcpy(&sdr->sdr_sun, rsun, sizeof(*rsun));
 	sdr->sdr_len = rlen;
+	sdr->sdr_sock = -1;
 	sdr->sdr_errors = 0;
+	sdr->sdr_lastheard = time(NULL);
+
+	sdr->sdr_q = malloc(queuelen * sizeof(char *));
+	sdr->sdr_qlen = malloc(queuelen * sizeof(size_t));
+	if (sdr->sdr_q == NULL || sdr->sdr_qlen == NULL) {
+		fprintf(stderr, "hub161: out of memory\n");
+		exit(1);
+	}
+	sdr->sdr_qhead = 0;
+	sdr->sdr_qcount = 0;
+	sdr->sdr_qwaiting = 0;
+	sdr->sdr_txframes = sdr->sdr_txbytes = 0;
+	sdr->sdr_rxframes = sdr->sdr_rxbytes = 0;
+	sdr->sdr_drops = 0;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&sdr->sdr_lock, NULL);
+#endif
+#ifdef HAVE_NETSHM
+	sdr->sdr_shm = NULL;
+	sdr->sdr_waitfd = -1;
+	sdr->sdr_wakefd = -1;
+#endif
+
+	connectsender(sdr);
 
 	if (array_add(senders, sdr)) {
 		fprintf(stderr, "hub161: Out of memory\n");
 		exit(1);
 	}
+	b = senderbucket(addr);
+	sdr->sdr_hashnext = senderhash[b];
+	senderhash[b] = sdr;
+	return sdr;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Sending
+
+/*
+ * Send on a sender's socket. Returns 0 on success, 1 if the socket
+ * is full, and -1 (having counted an error) on failure.
+ */
+static
+int
+trysend(struct sender *sdr, const char *pkt, size_t len)
+{
+	if (sdr->sdr_sock < 0) {
+		connectsender(sdr);
+		if (sdr->sdr_sock < 0) {
+			return -1;
+		}
+	}
+	if (send(sdr->sdr_sock, pkt, len, 0) < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK ||
+		    errno == ENOBUFS) {
+			return 1;
+		}
+		fprintf(stderr, "hub161: send %04x: %s\n",
+			sdr->sdr_addr, strerror(errno));
+		sdr->sdr_errors++;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Queue a packet for a sender whose socket is full. Call with the
+ * sender locked. Returns -1 (having counted a drop) if there's no
+ * room.
+ */
+static
+int
+enqueue(struct sender *sdr, const char *pkt, size_t len)
+{
+	unsigned ix;
+	char *copy;
+
+	if (sdr->sdr_qcount == queuelen) {
+		sdr->sdr_drops++;
+		return -1;
+	}
+	copy = malloc(len);
+	if (copy == NULL) {
+		sdr->sdr_drops++;
+		return -1;
+	}
+	memcpy(copy, pkt, len);
+	ix = (sdr->sdr_qhead + sdr->sdr_qcount) % queuelen;
+	sdr->sdr_q[ix] = copy;
+	sdr->sdr_qlen[ix] = len;
+	sdr->sdr_qcount++;
+
+	if (!sdr->sdr_qwaiting) {
+		if (evset_add(sdr->sdr_shard->sh_evs, sdr->sdr_sock, EV_OUT,
+			      EVTAG(EVK_OUT, sdr->sdr_addr,
+				    sdr->sdr_gen)) == 0) {
+			sdr->sdr_qwaiting = 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Send what we can from a sender's queue. Call with the sender
+ * locked.
+ */
+static
+void
+flushqueue(struct sender *sdr)
+{
+	unsigned ix;
+
+	while (sdr->sdr_qcount > 0) {
+		ix = sdr->sdr_qhead;
+		if (trysend(sdr, sdr->sdr_q[ix], sdr->sdr_qlen[ix]) == 1) {
+			return;
+		}
+		/* sent, or failed and counted; either way it's done */
+		free(sdr->sdr_q[ix]);
+		sdr->sdr_qhead = (ix + 1) % queuelen;
+		sdr->sdr_qcount--;
+	}
+	if (sdr->sdr_qwaiting) {
+		evset_remove(sdr->sdr_shard->sh_evs, sdr->sdr_sock);
+		sdr->sdr_qwaiting = 0;
+	}
+}
+
+static
+void
+sendnow(struct sender *sdr, const char *pkt, size_t len)
+{
+	SDR_LOCK(sdr);
+#ifdef HAVE_NETSHM
+	if (sdr->sdr_shm != NULL) {
+		int wake;
+
+		/* if it's not keeping up, it loses the packet */
+		if (netring_put(&sdr->sdr_shm->nsh_fromhub, pkt, len,
+				&wake) < 0) {
+			sdr->sdr_drops++;
+		}
+		else {
+			if (wake) {
+				netbell_ring(sdr->sdr_wakefd);
+			}
+			sdr->sdr_rxframes++;
+			sdr->sdr_rxbytes += len;
+		}
+		SDR_UNLOCK(sdr);
+		return;
+	}
+#endif
+	/* keep packets in order */
+	if (sdr->sdr_qcount > 0 || trysend(sdr, pkt, len) == 1) {
+		if (enqueue(sdr, pkt, len) < 0) {
+			SDR_UNLOCK(sdr);
+			return;
+		}
+	}
+	sdr->sdr_rxframes++;
+	sdr->sdr_rxbytes += len;
+	SDR_UNLOCK(sdr);
+}
+
+/*
+ * Send a packet, or hold it for a while, as the link rules say.
+ */
+static
+void
+sendone(struct sender *from, struct sender *sdr, const char *pkt, size_t len)
+{
+	uint64_t delays[2], now;
+	int i, n;
+
+	if (!linkemu_active()) {
+		sendnow(sdr, pkt, len);
+		return;
+	}
+
+	now = linkemu_now();
+	n = linkemu_shape(from->sdr_addr, sdr->sdr_addr, len, now, delays);
+	for (i=0; i<n; i++) {
+		if (delays[i] == 0) {
+			sendnow(sdr, pkt, len);
+		}
+		else if (linkemu_defer(now + delays[i],
+				       EVTAG(0, sdr->sdr_addr, sdr->sdr_gen),
+				       pkt, len) < 0) {
+			SDR_LOCK(sdr);
+			sdr->sdr_drops++;
+			SDR_UNLOCK(sdr);
+		}
+	}
 }
 
+/*
+ * Send a packet that was held; the sender may be gone by now.
+ */
 static
 void
-dosend(const char *pkt, size_t len)
+senddelayed(uint64_t tag, const char *pkt, size_t len)
 {
 	struct sender *sdr;
-	int r, n, i;
+
+	RDLOCK();
+	sdr = findsender(EVTAG_ADDR(tag));
+	if (sdr != NULL && sdr->sdr_gen == EVTAG_GEN(tag)) {
+		sendnow(sdr, pkt, len);
+	}
+	UNLOCK();
+}
+
+/*
+ * Forward a packet that came from sdr. Call with the table locked.
+ */
+static
+void
+dosend(struct sender *from, const char *pkt, size_t len)
+{
+	const struct linkheader *lh = (const struct linkheader *)pkt;
+	struct sender *sdr;
+	uint16_t to;
+	int n, i;
 
 	assert(senders != NULL);
 	assert(pkt != NULL);
 
+	SDR_LOCK(from);
+	from->sdr_txframes++;
+	from->sdr_txbytes += len;
+	SDR_UNLOCK(from);
+	capture_frame(pkt, len);
+
+	to = ntohs(lh->lh_to);
+	if (to != BROADCAST_ADDR) {
+		sdr = findsender(to);
+		if (sdr != NULL) {
+			sendone(from, sdr, pkt, len);
+			return;
+		}
+	}
+
+	/* Broadcast, or we don't know where it goes; flood it. */
 	n = array_getnum(senders);
 	for (i=0; i<n; i++) {
 		sdr = array_getguy(senders, i);
 		assert(sdr != NULL);
-		r = sendto(sock, pkt, len, 0, 
-			   (struct sockaddr *)&sdr->sdr_sun,
-			   sdr->sdr_len);
-		if (r < 0) {
-			fprintf(stderr, "hub161: sendto %04x: %s\n",
-				sdr->sdr_addr, strerror(errno));
-			sdr->sdr_errors++;
+		if (sdr != from) {
+			sendone(from, sdr, pkt, len);
 		}
 	}
 }
 
+static
+void
+freesender(struct sender *sdr);
+
+/*
+ * Drop senders that have failed or gone quiet. Only the main thread
+ * calls this.
+ */
 static
 void
 killsenders(void)
 {
 	struct sender *sdr;
-	int n, i;
+	time_t now;
+	int n, i, any = 0;
 
 	assert(senders != NULL);
 
+	now = time(NULL);
+
+	/* Don't hold up the forwarding threads unless we need to. */
+	RDLOCK();
+	n = array_getnum(senders);
+	for (i=0; i<n && !any; i++) {
+		sdr = array_getguy(senders, i);
+		SDR_LOCK(sdr);
+		if (sdr->sdr_errors > 5 ||
+		    (agesecs > 0 && now - sdr->sdr_lastheard > agesecs)) {
+			any = 1;
+		}
+		SDR_UNLOCK(sdr);
+	}
+	UNLOCK();
+	if (!any) {
+		return;
+	}
+
+	WRLOCK();
 	n = array_getnum(senders);
 	for (i=0; i<n; i++) {
 		sdr = array_getguy(senders, i);
 		assert(sdr != NULL);
 
+		if (agesecs > 0 && now - sdr->sdr_lastheard > agesecs) {
+			printf("hub161: %04x timed out\n", sdr->sdr_addr);
+			sdr->sdr_errors = 6;
+		}
+
 		if (sdr->sdr_errors > 5) {
 			printf("hub161: dropping %04x\n", sdr->sdr_addr);
+			unhashsender(sdr);
 			array_remove(senders, i);
 			i--;
 			n--;
-			free(sdr);
+			freesender(sdr);
 		}
 	}
+	UNLOCK();
+}
+
+////////////////////////////////////////////////////////////
+//
+// Shared-memory rings
+
+static
+void
+closefds(int *fds, int nfds)
+{
+	int i;
+
+	for (i=0; i<nfds; i++) {
+		close(fds[i]);
+	}
+}
+
+static
+void
+sendcontrol(struct sender *sdr, uint32_t op)
+{
+	char pkt[NETCTL_LEN];
+	struct linkheader *lh = (struct linkheader *)pkt;
+
+	lh->lh_frame = htons(FRAME_MAGIC);
+	lh->lh_from = htons(HUB_ADDR);
+	lh->lh_packetlen = htons(NETCTL_LEN);
+	lh->lh_to = htons(sdr->sdr_addr);
+	op = htonl(op);
+	memcpy(pkt + sizeof(*lh), &op, sizeof(op));
+
+	/* not through the rings, even if it has them */
+	SDR_LOCK(sdr);
+	if (sdr->sdr_qcount > 0 || trysend(sdr, pkt, sizeof(pkt)) == 1) {
+		(void)enqueue(sdr, pkt, sizeof(pkt));
+	}
+	SDR_UNLOCK(sdr);
+}
+
+#ifdef HAVE_NETSHM
+/*
+ * Call with the table locked for writing.
+ */
+static
+void
+detachshm(struct sender *sdr)
+{
+	if (sdr->sdr_shm == NULL) {
+		return;
+	}
+	printf("hub161: %04x stopped using shared memory\n", sdr->sdr_addr);
+	evset_remove(sdr->sdr_shard->sh_evs, sdr->sdr_waitfd);
+	munmap(sdr->sdr_shm, sizeof(struct netring_shm));
+	close(sdr->sdr_waitfd);
+	close(sdr->sdr_wakefd);
+	sdr->sdr_shm = NULL;
+	sdr->sdr_waitfd = -1;
+	sdr->sdr_wakefd = -1;
+}
+
+/*
+ * Take the rings a sender offered. The descriptors are ours
+ * whatever happens. Call with the table locked for writing.
+ */
+static
+void
+attachshm(struct sender *sdr, int *fds)
+{
+	struct stat st;
+	void *ptr;
+
+	detachshm(sdr);
+
+	if (fstat(fds[0], &st) < 0 ||
+	    st.st_size < (off_t)sizeof(struct netring_shm)) {
+		fprintf(stderr, "hub161: %04x: bad shared memory\n",
+			sdr->sdr_addr);
+		goto fail;
+	}
+	ptr = mmap(NULL, sizeof(struct netring_shm), PROT_READ|PROT_WRITE,
+		   MAP_SHARED, fds[0], 0);
+	if (ptr == MAP_FAILED) {
+		fprintf(stderr, "hub161: %04x: mmap: %s\n",
+			sdr->sdr_addr, strerror(errno));
+		goto fail;
+	}
+	if (netring_check(ptr)) {
+		fprintf(stderr, "hub161: %04x: bad shared memory\n",
+			sdr->sdr_addr);
+		munmap(ptr, sizeof(struct netring_shm));
+		goto fail;
+	}
+	if (evset_add(sdr->sdr_shard->sh_evs, fds[1], EV_IN,
+		      EVTAG(EVK_RING, sdr->sdr_addr, sdr->sdr_gen)) < 0) {
+		fprintf(stderr, "hub161: %04x: can't watch doorbell\n",
+			sdr->sdr_addr);
+		munmap(ptr, sizeof(struct netring_shm));
+		goto fail;
+	}
+	close(fds[0]);
+
+	sdr->sdr_shm = ptr;
+	sdr->sdr_waitfd = fds[1];
+	sdr->sdr_wakefd = fds[2];
+	netring_wantwake(&sdr->sdr_shm->nsh_tohub);
+	printf("hub161: %04x using shared memory\n", sdr->sdr_addr);
+
+	sendcontrol(sdr, NETCTL_ATTACHED);
+	return;
+
+ fail:
+	close(fds[0]);
+	close(fds[1]);
+	close(fds[2]);
+}
+#endif /* HAVE_NETSHM */
+
+/*
+ * Call with the table locked for writing.
+ */
+static
+void
+hubcontrol(struct sender *sdr, const char *pkt, int *fds, int nfds)
+{
+	uint32_t op;
+
+	memcpy(&op, pkt + sizeof(struct linkheader), sizeof(op));
+	op = ntohl(op);
+
+#ifdef HAVE_NETSHM
+	if (op == NETCTL_ATTACH && nfds == NETCTL_NFDS) {
+		attachshm(sdr, fds);
+		return;
+	}
+	if (op == NETCTL_ATTACHED && sdr->sdr_shm == NULL) {
+		/* we must have restarted */
+		sendcontrol(sdr, NETCTL_DETACHED);
+	}
+#else
+	if (op == NETCTL_ATTACHED) {
+		sendcontrol(sdr, NETCTL_DETACHED);
+	}
+#endif
+	closefds(fds, nfds);
+}
+
+/*
+ * Call with the table locked for writing, after removing sdr from
+ * it.
+ */
+static
+void
+freesender(struct sender *sdr)
+{
+#ifdef HAVE_NETSHM
+	detachshm(sdr);
+#endif
+	if (sdr->sdr_sock >= 0) {
+		if (sdr->sdr_qwaiting) {
+			evset_remove(sdr->sdr_shard->sh_evs, sdr->sdr_sock);
+		}
+		close(sdr->sdr_sock);
+	}
+	clearqueue(sdr);
+	free(sdr->sdr_q);
+	free(sdr->sdr_qlen);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&sdr->sdr_lock);
+#endif
+	free(sdr);
 }
 
 ////////////////////////////////////////////////////////////
@@ -182,7 +813,7 @@ opensock(const char *sockname)
 		exit(1);
 	}
 
-	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, 
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
 		   (void *)&one, sizeof(one));
 
 	su.sun_family = AF_UNIX;
@@ -196,6 +827,7 @@ opensock(const char *sockname)
 		fprintf(stderr, "hub161: bind: %s\n", strerror(errno));
 		exit(1);
 	}
+	fcntl(sock, F_SETFL, O_NONBLOCK);
 }
 
 static
@@ -203,90 +835,499 @@ void
 closesock(void)
 {
 	close(sock);
+	if (statsock >= 0) {
+		close(statsock);
+	}
 }
 
 ////////////////////////////////////////////////////////////
+//
+// Statistics
 
 static
 void
-loop(void)
+openstats(const char *path)
+{
+	struct sockaddr_un su;
+	socklen_t len;
+	struct stat st;
+
+	/* same caution as opensock */
+	if (lstat(path, &st)==0) {
+		if (S_ISSOCK(st.st_mode)) {
+			unlink(path);
+		}
+		else {
+			fprintf(stderr, "hub161: %s: File exists\n", path);
+			exit(1);
+		}
+	}
+	if (strlen(path) >= sizeof(su.sun_path)) {
+		fprintf(stderr, "hub161: %s: Name too long\n", path);
+		exit(1);
+	}
+
+	statsock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (statsock < 0) {
+		fprintf(stderr, "hub161: socket: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	su.sun_family = AF_UNIX;
+	strcpy(su.sun_path, path);
+	len = SUN_LEN(&su);
+#ifdef HAS_SUN_LEN
+	su.sun_len = len;
+#endif
+
+	if (bind(statsock, (struct sockaddr *)&su, len) < 0 ||
+	    listen(statsock, 8) < 0) {
+		fprintf(stderr, "hub161: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	fcntl(statsock, F_SETFL, O_NONBLOCK);
+	fcntl(statsock, F_SETFD, FD_CLOEXEC);
+}
+
+/*
+ * Hand the counters to whoever connected to the stats socket, as
+ * text, and hang up. Only the main thread calls this.
+ */
+static
+void
+sendstats(void)
+{
+	struct sender *sdr;
+	struct timeval tv;
+	char *buf, *nbuf;
+	size_t len, max;
+	unsigned queued;
+	int fd, n, i, r;
+
+	fd = accept(statsock, NULL, NULL);
+	if (fd < 0) {
+		return;
+	}
+	/* don't let a stuck reader hold up the hub for long */
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (void *)&tv, sizeof(tv));
+
+	RDLOCK();
+	n = array_getnum(senders);
+	max = 128 + (size_t)n * 128;
+	buf = malloc(max);
+	if (buf == NULL) {
+		UNLOCK();
+		close(fd);
+		return;
+	}
+	len = snprintf(buf, max, "# hub161: %d ports, up %lu seconds\n"
+		       "# addr txframes txbytes rxframes rxbytes drops "
+		       "queued\n", n, (unsigned long)(time(NULL) - starttime));
+	for (i=0; i<n; i++) {
+		sdr = array_getguy(senders, i);
+		SDR_LOCK(sdr);
+		queued = sdr->sdr_qcount;
+#ifdef HAVE_NETSHM
+		if (sdr->sdr_shm != NULL) {
+			struct netring *nr = &sdr->sdr_shm->nsh_fromhub;
+			uint32_t depth;
+
+			/* the tail moves under us; near enough */
+			depth = nr->nr_head - nr->nr_tail;
+			if (depth <= NETRING_SLOTS) {
+				queued += depth;
+			}
+		}
+#endif
+		r = snprintf(buf + len, max - len,
+			     "%04x %llu %llu %llu %llu %llu %u\n",
+			     sdr->sdr_addr,
+			     (unsigned long long)sdr->sdr_txframes,
+			     (unsigned long long)sdr->sdr_txbytes,
+			     (unsigned long long)sdr->sdr_rxframes,
+			     (unsigned long long)sdr->sdr_rxbytes,
+			     (unsigned long long)sdr->sdr_drops,
+			     queued);
+		SDR_UNLOCK(sdr);
+		if (r > 0 && (size_t)r < max - len) {
+			len += r;
+		}
+		else {
+			/* shouldn't happen; grow and redo this one */
+			nbuf = realloc(buf, max * 2);
+			if (nbuf == NULL) {
+				break;
+			}
+			buf = nbuf;
+			max *= 2;
+			i--;
+		}
+	}
+	UNLOCK();
+
+	(void)!write(fd, buf, len);
+	free(buf);
+	close(fd);
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Checks common to packets from the socket and from rings.
+ */
+static
+int
+badpacket(const char *packetbuf, size_t packetlen)
+{
+	const struct linkheader *lh;
+
+	if (packetlen < sizeof(struct linkheader)) {
+		fprintf(stderr, "hub161: runt packet (size %lu)\n",
+			(unsigned long) packetlen);
+		return 1;
+	}
+
+	lh = (const struct linkheader *)packetbuf;
+
+	if (ntohs(lh->lh_frame) != FRAME_MAGIC) {
+		fprintf(stderr, "hub161: frame error [%04x]\n",
+			ntohs(lh->lh_frame));
+		return 1;
+	}
+
+	if ((size_t)ntohs(lh->lh_packetlen) != packetlen) {
+		fprintf(stderr, "hub161: bad size [%04x %04lx]\n",
+			ntohs(lh->lh_packetlen),
+			(unsigned long) packetlen);
+		return 1;
+	}
+
+	if (ntohs(lh->lh_from) == BROADCAST_ADDR) {
+		fprintf(stderr, "hub161: packet came from broadcast "
+			"addr (dropped)\n");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Take one packet from the socket, along with any file descriptors
+ * passed with it. Returns -1 if there wasn't one.
+ */
+static
+int
+sockpacket(void)
 {
 	char packetbuf[MAXPACKET];
 	size_t packetlen;
 	struct sockaddr_un rsun;
 	socklen_t rlen;
 	struct linkheader *lh;
+	struct sender *sdr;
+	union {
+		struct cmsghdr cm;
+		char buf[CMSG_SPACE(NETCTL_NFDS * sizeof(int))];
+	} ctl;
+	struct cmsghdr *cm;
+	struct msghdr mh;
+	struct iovec iov;
+	int fds[NETCTL_NFDS];
+	int nfds = 0;
 	int r;
-	
-	while (1) {
-		rlen = sizeof(rsun);
-		r = recvfrom(sock, packetbuf, sizeof(packetbuf), 0,
-			     (struct sockaddr *)&rsun, &rlen);
-		if (r<0) {
-			fprintf(stderr, "hub161: recvfrom: %s\n", 
+
+	iov.iov_base = packetbuf;
+	iov.iov_len = sizeof(packetbuf);
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_name = &rsun;
+	mh.msg_namelen = sizeof(rsun);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = ctl.buf;
+	mh.msg_controllen = sizeof(ctl.buf);
+
+	r = recvmsg(sock, &mh, 0);
+	if (r<0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			fprintf(stderr, "hub161: recvmsg: %s\n",
 				strerror(errno));
-			continue;
 		}
-		packetlen = r;
+		return -1;
+	}
+	packetlen = r;
+	rlen = mh.msg_namelen;
+
+	for (cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET &&
+		    cm->cmsg_type == SCM_RIGHTS &&
+		    nfds == 0 &&
+		    cm->cmsg_len == CMSG_LEN(sizeof(fds))) {
+			memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+			nfds = NETCTL_NFDS;
+		}
+		else if (cm->cmsg_level == SOL_SOCKET &&
+			 cm->cmsg_type == SCM_RIGHTS) {
+			/* not what we wanted; don't leak them */
+			closefds((int *)CMSG_DATA(cm),
+				 (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+		}
+	}
 
-		assert(rlen <= sizeof(rsun));
-		assert(rsun.sun_family==AF_UNIX);
-		assert(packetlen <= sizeof(packetbuf));
+	assert(rlen <= sizeof(rsun));
+	assert(rsun.sun_family==AF_UNIX);
+	assert(packetlen <= sizeof(packetbuf));
 #ifdef HAS_SUN_LEN
-		assert(rlen <= rsun.sun_len);
-		if (rlen < rsun.sun_len) {
-			/*
-			 * This means the address (pathname) didn't fit
-			 * in the sockaddr.
-			 *
-			 * Beware: rsun.sun_path isn't necessarily null
-			 * terminated, so don't print it without a length
-			 * limit.
-			 */
-			fprintf(stderr, "hub161: packet from too-long "
-				"pathname\n");
-			continue;
+	assert(rlen <= rsun.sun_len);
+	if (rlen < rsun.sun_len) {
+		/*
+		 * This means the address (pathname) didn't fit
+		 * in the sockaddr.
+		 *
+		 * Beware: rsun.sun_path isn't necessarily null
+		 * terminated, so don't print it without a length
+		 * limit.
+		 */
+		fprintf(stderr, "hub161: packet from too-long "
+			"pathname\n");
+		closefds(fds, nfds);
+		return 0;
+	}
+	assert(rlen == rsun.sun_len);
+#endif
+
+	if (badpacket(packetbuf, packetlen)) {
+		closefds(fds, nfds);
+		return 0;
+	}
+
+	lh = (struct linkheader *)packetbuf;
+
+	/*
+	 * The common case: an ordinary packet from a sender we already
+	 * know. Only this thread changes senders, so we can check
+	 * without excluding the forwarding threads.
+	 */
+	if (ntohs(lh->lh_to) != HUB_ADDR && nfds == 0) {
+		RDLOCK();
+		sdr = findsender(ntohs(lh->lh_from));
+		if (sdr != NULL && sdr->sdr_len == rlen &&
+		    !memcmp(&sdr->sdr_sun, &rsun, rlen)) {
+			SDR_LOCK(sdr);
+			sdr->sdr_lastheard = time(NULL);
+			SDR_UNLOCK(sdr);
+			dosend(sdr, packetbuf, packetlen);
+			UNLOCK();
+			return 0;
 		}
-		assert(rlen == rsun.sun_len);
+		UNLOCK();
+	}
+
+	WRLOCK();
+	sdr = checksender(ntohs(lh->lh_from), &rsun, rlen);
+
+	if (ntohs(lh->lh_to) == HUB_ADDR) {
+		/* to us - don't forward it */
+		if (packetlen == NETCTL_LEN) {
+			hubcontrol(sdr, packetbuf, fds, nfds);
+			UNLOCK();
+			return 0;
+		}
+#ifdef HAVE_NETSHM
+		/* plain keepalive: it isn't using its rings (any more) */
+		detachshm(sdr);
 #endif
+		UNLOCK();
+		closefds(fds, nfds);
+		return 0;
+	}
+	UNLOCK();
+	closefds(fds, nfds);
+
+	/* Only this thread removes senders, so sdr is still good. */
+	RDLOCK();
+	dosend(sdr, packetbuf, packetlen);
+	UNLOCK();
+	return 0;
+}
 
-		if (packetlen < sizeof(struct linkheader)) {
-			fprintf(stderr, "hub161: runt packet (size %lu)\n",
-				(unsigned long) packetlen);
+#ifdef HAVE_NETSHM
+/*
+ * Take the packets waiting in a sender's ring. Call with the table
+ * locked.
+ */
+static
+void
+ringpackets(struct sender *sdr)
+{
+	char packetbuf[MAXPACKET];
+	struct netring *nr;
+	struct linkheader *lh;
+	int i, r;
+
+	if (sdr->sdr_shm == NULL) {
+		/* detached meanwhile */
+		return;
+	}
+	nr = &sdr->sdr_shm->nsh_tohub;
+
+	/* Don't let one sender hog the hub; we'll come back. */
+	for (i=0; i<NETRING_SLOTS; i++) {
+		r = netring_get(nr, packetbuf, sizeof(packetbuf));
+		if (r < 0) {
+			netbell_drain(sdr->sdr_waitfd);
+			if (!netring_wantwake(nr)) {
+				return;
+			}
+			continue;
+		}
+		if (badpacket(packetbuf, r)) {
 			continue;
 		}
-
 		lh = (struct linkheader *)packetbuf;
-
-		if (ntohs(lh->lh_frame) != FRAME_MAGIC) {
-			fprintf(stderr, "hub161: frame error [%04x]\n",
-				ntohs(lh->lh_frame));
+		if (ntohs(lh->lh_from) != sdr->sdr_addr) {
+			fprintf(stderr, "hub161: %04x: packet from %04x in "
+				"its ring (dropped)\n", sdr->sdr_addr,
+				ntohs(lh->lh_from));
 			continue;
 		}
-
-		if ((size_t)ntohs(lh->lh_packetlen) != packetlen) {
-			fprintf(stderr, "hub161: bad size [%04x %04lx]\n",
-				ntohs(lh->lh_packetlen),
-				(unsigned long) packetlen);
+		SDR_LOCK(sdr);
+		sdr->sdr_lastheard = time(NULL);
+		SDR_UNLOCK(sdr);
+		if (ntohs(lh->lh_to) == HUB_ADDR) {
 			continue;
 		}
+		dosend(sdr, packetbuf, r);
+	}
+}
+#endif /* HAVE_NETSHM */
 
-		if (ntohs(lh->lh_from) == BROADCAST_ADDR) {
-			fprintf(stderr, "hub161: packet came from broadcast "
-				"addr (dropped)\n");
-			continue;
+////////////////////////////////////////////////////////////
+
+/*
+ * Handle an event for a sender.
+ */
+static
+void
+senderevent(uint64_t tag)
+{
+	struct sender *sdr;
+
+	RDLOCK();
+	sdr = findsender(EVTAG_ADDR(tag));
+	if (sdr == NULL || sdr->sdr_gen != EVTAG_GEN(tag)) {
+		/* stale */
+		UNLOCK();
+		return;
+	}
+	switch (EVTAG_KIND(tag)) {
+	    case EVK_OUT:
+		SDR_LOCK(sdr);
+		flushqueue(sdr);
+		SDR_UNLOCK(sdr);
+		break;
+#ifdef HAVE_NETSHM
+	    case EVK_RING:
+		ringpackets(sdr);
+		break;
+#endif
+	}
+	UNLOCK();
+}
+
+static
+void
+shardloop(struct shard *sh)
+{
+	uint64_t tags[64];
+	time_t lastkill = 0;
+	int ismain = (sh == &shards[0]);
+	int timeout, i, n, k;
+
+	/*
+	 * The main thread wakes up now and then to age senders, and
+	 * every tick to send held packets.
+	 */
+	timeout = -1;
+	if (ismain) {
+		timeout = linkemu_active() ? 1 : 1000;
+	}
+
+	while (1) {
+		n = evset_wait(sh->sh_evs, tags, 64, timeout);
+
+		for (i=0; i<n; i++) {
+			if (EVTAG_KIND(tags[i]) == EVK_STATS) {
+				sendstats();
+			}
+			else if (EVTAG_KIND(tags[i]) == EVK_SOCK) {
+				/* take a batch, but let the others in */
+				for (k=0; k<64; k++) {
+					if (sockpacket() < 0) {
+						break;
+					}
+				}
+			}
+			else {
+				senderevent(tags[i]);
+			}
 		}
 
-		checksender(ntohs(lh->lh_from), &rsun, rlen);
+		if (ismain && linkemu_active()) {
+			linkemu_run(linkemu_now(), senddelayed);
+		}
+		if (ismain && time(NULL) != lastkill) {
+			killsenders();
+			capture_flush();
+			lastkill = time(NULL);
+		}
+	}
+}
 
-		if (ntohs(lh->lh_to) == HUB_ADDR) {
-			/* to us - don't forward it */
-			continue;
+#ifdef HAVE_PTHREAD
+static
+void *
+shardthread(void *arg)
+{
+	shardloop(arg);
+	return NULL;
+}
+#endif
+
+static
+void
+startshards(void)
+{
+	int i;
+
+	for (i=0; i<nshards; i++) {
+		shards[i].sh_evs = evset_create();
+		if (shards[i].sh_evs == NULL) {
+			fprintf(stderr, "hub161: can't create event set\n");
+			exit(1);
 		}
+	}
+	if (evset_add(shards[0].sh_evs, sock, EV_IN,
+		      EVTAG(EVK_SOCK, 0, 0)) < 0) {
+		fprintf(stderr, "hub161: can't watch socket\n");
+		exit(1);
+	}
+	if (statsock >= 0 &&
+	    evset_add(shards[0].sh_evs, statsock, EV_IN,
+		      EVTAG(EVK_STATS, 0, 0)) < 0) {
+		fprintf(stderr, "hub161: can't watch stats socket\n");
+		exit(1);
+	}
 
-		dosend(packetbuf, packetlen);
-		killsenders();
+#ifdef HAVE_PTHREAD
+	for (i=1; i<nshards; i++) {
+		if (pthread_create(&shards[i].sh_thread, NULL, shardthread,
+				   &shards[i])) {
+			fprintf(stderr, "hub161: can't start thread\n");
+			exit(1);
+		}
 	}
+#endif
 }
 
 ////////////////////////////////////////////////////////////
@@ -295,8 +1336,26 @@ static
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: hub161 [socketname]\n");
+	fprintf(stderr, "Usage: hub161 [-a seconds] [-l rulefile] "
+		"[-L rule] [-q packets]\n");
+	fprintf(stderr, "              [-s seed] [-S statsocket] [-t threads] "
+		"[-w capfile]\n");
+	fprintf(stderr, "              [socketname]\n");
+	fprintf(stderr, "       hub161 -g options [socketname]\n");
 	fprintf(stderr, "    Default socket is %s\n", DEFAULT_SOCKET);
+	fprintf(stderr, "    -a: forget silent senders after this long "
+		"[%d]; 0 never\n", DEFAULT_AGE);
+	fprintf(stderr, "    -g: generate traffic into the hub at "
+		"socketname (see man page)\n");
+	fprintf(stderr, "    -l: read link emulation rules from a file\n");
+	fprintf(stderr, "    -L: add a link emulation rule\n");
+	fprintf(stderr, "    -q: packets to hold for each slow receiver "
+		"[%d]\n", DEFAULT_QUEUE);
+	fprintf(stderr, "    -s: seed for link emulation [0]\n");
+	fprintf(stderr, "    -S: give out per-port counters on this "
+		"socket\n");
+	fprintf(stderr, "    -t: number of forwarding threads [1]\n");
+	fprintf(stderr, "    -w: write forwarded packets to this pcap file\n");
 	exit(3);
 }
 
@@ -304,10 +1363,29 @@ int
 main(int argc, char *argv[])
 {
 	const char *sockname = DEFAULT_SOCKET;
+	const char *statsname = NULL, *capname = NULL, *genspec = NULL;
+	uint64_t seed = 0;
 	int ch;
 
-	while ((ch = getopt(argc, argv, ""))!=-1) {
+	while ((ch = getopt(argc, argv, "a:g:l:L:q:s:S:t:w:"))!=-1) {
 		switch (ch) {
+		    case 'a': agesecs = atoi(optarg); break;
+		    case 'g': genspec = optarg; break;
+		    case 'l':
+			if (linkemu_loadfile(optarg)) {
+				exit(3);
+			}
+			break;
+		    case 'L':
+			if (linkemu_addrule(optarg, "-L")) {
+				exit(3);
+			}
+			break;
+		    case 'q': queuelen = atoi(optarg); break;
+		    case 's': seed = strtoull(optarg, NULL, 0); break;
+		    case 'S': statsname = optarg; break;
+		    case 't': nshards = atoi(optarg); break;
+		    case 'w': capname = optarg; break;
 		    default: usage();
 		}
 	}
@@ -317,6 +1395,29 @@ main(int argc, char *argv[])
 	if (optind < argc) {
 		usage();
 	}
+	if (genspec != NULL) {
+		return trafgen(genspec, sockname);
+	}
+	if (queuelen < 1 || queuelen > 65536) {
+		fprintf(stderr, "hub161: -q must be between 1 and 65536\n");
+		exit(3);
+	}
+	if (nshards < 1 || nshards > MAXSHARDS) {
+		fprintf(stderr, "hub161: -t must be between 1 and %d\n",
+			MAXSHARDS);
+		exit(3);
+	}
+#ifdef HAVE_PTHREAD
+	if (nshards > 1 && !evset_threadsafe()) {
+		fprintf(stderr, "hub161: -t not supported without epoll\n");
+		exit(3);
+	}
+#else
+	if (nshards > 1) {
+		fprintf(stderr, "hub161: -t not supported without threads\n");
+		exit(3);
+	}
+#endif
 
 	senders = array_create();
 	if (!senders) {
@@ -324,9 +1425,27 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
+	linkemu_seed(seed);
+	if (capname != NULL && capture_open(capname) < 0) {
+		exit(1);
+	}
+	starttime = time(NULL);
+
 	opensock(sockname);
 	printf("hub161: Listening on %s\n", sockname);
-	loop();
+	if (statsname != NULL) {
+		openstats(statsname);
+		printf("hub161: Statistics on %s\n", statsname);
+	}
+	if (capname != NULL) {
+		printf("hub161: Capturing to %s\n", capname);
+	}
+	if (linkemu_active()) {
+		printf("hub161: Emulating links, seed %llu\n",
+		       (unsigned long long)seed);
+	}
+	startshards();
+	shardloop(&shards[0]);
 	closesock();
 
 	return 0;
@@ -0,0 +1,742 @@
+/*
+ * Traffic generator. See trafgen.h.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include "config.h"
+
+#include "frame.h"
+#include "trafgen.h"
+
+#define DEFAULT_ADDR	0xfe00
+#define DEFAULT_SIZE	64
+#define DEFAULT_RATE	1000
+#define NSEC		1000000000ULL
+#define SLICE_NS	(NSEC / 10)	/* for the throughput histogram */
+#define NBUCKETS	40
+
+/*
+ * Our header, after the link header. All big-endian. tg_origin is
+ * the address of whoever made the packet, so we only time our own.
+ */
+#define TG_MAGIC	0x54473631	/* "TG61" */
+#define TGF_REQUEST	1		/* please echo */
+#define TGF_REPLY	2		/* an echo */
+
+struct tgheader {
+	uint32_t tg_magic;
+	uint32_t tg_flags;
+	uint32_t tg_seq;
+	uint32_t tg_origin;
+	uint32_t tg_stamphi;
+	uint32_t tg_stamplo;
+};
+
+#define MINSIZE		(sizeof(struct linkheader) + sizeof(struct tgheader))
+
+enum { TG_SEND, TG_PING, TG_ECHO };
+
+struct tgconf {
+	unsigned addr;
+	unsigned to;
+	int mode;
+	unsigned minsize, maxsize;
+	double rate;
+	unsigned burst;
+	uint64_t count;
+	double time;
+	double report;
+	uint64_t seed;
+	const char *sockpath;
+};
+
+struct tgcounts {
+	uint64_t txpkts, txbytes;
+	uint64_t rxpkts, rxbytes;
+	uint64_t echoed;
+	uint64_t timed;
+	uint64_t blocked;	/* the hub wasn't taking packets */
+};
+
+static struct tgconf conf;
+static struct tgcounts counts, lastcounts;
+static uint64_t lathist[NBUCKETS];	/* round trips, in log2 us */
+static uint64_t latmin, latmax, latsum;
+static uint64_t ratehist[NBUCKETS];	/* per-slice rates, in log2 pps */
+static uint64_t slicerx;
+static uint64_t rng;
+
+static int tgsock;
+static struct sockaddr_un hubsun;
+static socklen_t hublen;
+static volatile sig_atomic_t stopping;
+
+////////////////////////////////////////////////////////////
+//
+// Setup
+
+static
+int
+parsenum(const char *s, uint64_t *ret)
+{
+	unsigned long long val;
+	char *t;
+
+	errno = 0;
+	val = strtoull(s, &t, 0);
+	if (*s == 0 || *t != 0 || errno != 0) {
+		return -1;
+	}
+	*ret = val;
+	return 0;
+}
+
+static
+int
+parsedbl(const char *s, double *ret)
+{
+	char *t;
+
+	*ret = strtod(s, &t);
+	if (t == s || *t != 0 || *ret < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static
+int
+parseopt(char *opt)
+{
+	char *val, *dash;
+	uint64_t n, m;
+
+	val = strchr(opt, '=');
+	if (val == NULL) {
+		return -1;
+	}
+	*val++ = 0;
+
+	if (!strcmp(opt, "addr") || !strcmp(opt, "to")) {
+		if (parsenum(val, &n) || n == HUB_ADDR ||
+		    n > BROADCAST_ADDR) {
+			return -1;
+		}
+		if (!strcmp(opt, "addr")) {
+			if (n == BROADCAST_ADDR) {
+				return -1;
+			}
+			conf.addr = n;
+		}
+		else {
+			conf.to = n;
+		}
+		return 0;
+	}
+	if (!strcmp(opt, "mode")) {
+		if (!strcmp(val, "send")) {
+			conf.mode = TG_SEND;
+		}
+		else if (!strcmp(val, "ping")) {
+			conf.mode = TG_PING;
+		}
+		else if (!strcmp(val, "echo")) {
+			conf.mode = TG_ECHO;
+		}
+		else {
+			return -1;
+		}
+		return 0;
+	}
+	if (!strcmp(opt, "size")) {
+		dash = strchr(val, '-');
+		if (dash != NULL) {
+			*dash++ = 0;
+		}
+		if (parsenum(val, &n)) {
+			return -1;
+		}
+		m = n;
+		if (dash != NULL && parsenum(dash, &m)) {
+			return -1;
+		}
+		if (n < MINSIZE || m < n || m > MAXPACKET) {
+			return -1;
+		}
+		conf.minsize = n;
+		conf.maxsize = m;
+		return 0;
+	}
+	if (!strcmp(opt, "rate")) {
+		return parsedbl(val, &conf.rate);
+	}
+	if (!strcmp(opt, "burst")) {
+		if (parsenum(val, &n) || n < 1 || n > 65536) {
+			return -1;
+		}
+		conf.burst = n;
+		return 0;
+	}
+	if (!strcmp(opt, "count")) {
+		return parsenum(val, &conf.count);
+	}
+	if (!strcmp(opt, "time")) {
+		return parsedbl(val, &conf.time);
+	}
+	if (!strcmp(opt, "report")) {
+		return parsedbl(val, &conf.report);
+	}
+	if (!strcmp(opt, "seed")) {
+		return parsenum(val, &conf.seed);
+	}
+	if (!strcmp(opt, "sock")) {
+		conf.sockpath = val;
+		return 0;
+	}
+	return -1;
+}
+
+static
+int
+parsespec(char *spec)
+{
+	char *s, *t;
+
+	for (s = strtok(spec, ", \t"); s != NULL; s = strtok(NULL, ", \t")) {
+		t = strdup(s);
+		if (t == NULL) {
+			fprintf(stderr, "hub161: out of memory\n");
+			exit(1);
+		}
+		if (parseopt(s)) {
+			fprintf(stderr, "hub161: -g: bad option %s\n", t);
+			free(t);
+			return -1;
+		}
+		free(t);
+	}
+	return 0;
+}
+
+static
+void
+setaddr(struct sockaddr_un *su, socklen_t *len, const char *path)
+{
+	if (strlen(path) >= sizeof(su->sun_path)) {
+		fprintf(stderr, "hub161: %s: Name too long\n", path);
+		exit(1);
+	}
+	memset(su, 0, sizeof(*su));
+	su->sun_family = AF_UNIX;
+	strcpy(su->sun_path, path);
+	*len = SUN_LEN(su);
+#ifdef HAS_SUN_LEN
+	su->sun_len = *len;
+#endif
+}
+
+static
+void
+opentgsock(void)
+{
+	struct sockaddr_un su;
+	socklen_t len;
+	struct stat st;
+
+	/* as in opensock: don't clobber anything that isn't a socket */
+	if (lstat(conf.sockpath, &st)==0) {
+		if (S_ISSOCK(st.st_mode)) {
+			unlink(conf.sockpath);
+		}
+		else {
+			fprintf(stderr, "hub161: %s: File exists\n",
+				conf.sockpath);
+			exit(1);
+		}
+	}
+
+	tgsock = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (tgsock < 0) {
+		fprintf(stderr, "hub161: socket: %s\n", strerror(errno));
+		exit(1);
+	}
+	setaddr(&su, &len, conf.sockpath);
+	if (bind(tgsock, (struct sockaddr *)&su, len) < 0) {
+		fprintf(stderr, "hub161: bind: %s\n", strerror(errno));
+		exit(1);
+	}
+	fcntl(tgsock, F_SETFL, O_NONBLOCK);
+}
+
+static
+void
+onsignal(int sig)
+{
+	(void)sig;
+	stopping = 1;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Sending and receiving
+
+static
+uint64_t
+nowns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+static
+uint64_t
+rnd(void)
+{
+	/* xorshift64 */
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+static
+unsigned
+log2bucket(uint64_t val)
+{
+	unsigned b = 0;
+
+	while (val > 0 && b < NBUCKETS-1) {
+		val >>= 1;
+		b++;
+	}
+	return b;
+}
+
+/*
+ * Returns 0 if sent, 1 if the hub isn't taking packets right now.
+ */
+static
+int
+sendpkt(const char *pkt, size_t len)
+{
+	if (sendto(tgsock, pkt, len, 0, (struct sockaddr *)&hubsun,
+		   hublen) < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK ||
+		    errno == ENOBUFS) {
+			counts.blocked++;
+			return 1;
+		}
+		if (errno == ECONNREFUSED || errno == ENOENT) {
+			/* no hub (yet); act as if the wire ate it */
+			return 0;
+		}
+		fprintf(stderr, "hub161: send: %s\n", strerror(errno));
+		exit(1);
+	}
+	return 0;
+}
+
+static
+void
+sendkeepalive(void)
+{
+	struct linkheader lh;
+
+	lh.lh_frame = htons(FRAME_MAGIC);
+	lh.lh_from = htons(conf.addr);
+	lh.lh_packetlen = htons(sizeof(lh));
+	lh.lh_to = htons(HUB_ADDR);
+	(void)sendpkt((char *)&lh, sizeof(lh));
+}
+
+/*
+ * Send what's left of a burst, counting down *left. Returns 1 if the
+ * hub stopped taking them.
+ */
+static
+int
+sendburst(unsigned *left)
+{
+	char pkt[MAXPACKET];
+	struct linkheader *lh = (struct linkheader *)pkt;
+	struct tgheader *tg = (struct tgheader *)(lh + 1);
+	uint64_t stamp;
+	size_t len;
+
+	for (; *left > 0; (*left)--) {
+		if (conf.count > 0 && counts.txpkts >= conf.count) {
+			*left = 0;
+			return 0;
+		}
+		len = conf.minsize;
+		if (conf.maxsize > conf.minsize) {
+			len += rnd() % (conf.maxsize - conf.minsize + 1);
+		}
+		stamp = nowns();
+
+		lh->lh_frame = htons(FRAME_MAGIC);
+		lh->lh_from = htons(conf.addr);
+		lh->lh_packetlen = htons(len);
+		lh->lh_to = htons(conf.to);
+		tg->tg_magic = htonl(TG_MAGIC);
+		tg->tg_flags = htonl(conf.mode == TG_PING ? TGF_REQUEST : 0);
+		tg->tg_seq = htonl((uint32_t)counts.txpkts);
+		tg->tg_origin = htonl(conf.addr);
+		tg->tg_stamphi = htonl((uint32_t)(stamp >> 32));
+		tg->tg_stamplo = htonl((uint32_t)stamp);
+		memset(tg + 1, 0, len - MINSIZE);
+
+		if (sendpkt(pkt, len)) {
+			return 1;
+		}
+		counts.txpkts++;
+		counts.txbytes += len;
+	}
+	return 0;
+}
+
+static
+void
+recvpkt(char *pkt, size_t len)
+{
+	struct linkheader *lh = (struct linkheader *)pkt;
+	struct tgheader *tg = (struct tgheader *)(lh + 1);
+	uint64_t stamp, rtt;
+	unsigned from, to;
+	int ours;
+
+	if (len < sizeof(*lh) || ntohs(lh->lh_frame) != FRAME_MAGIC ||
+	    ntohs(lh->lh_packetlen) != len) {
+		return;
+	}
+	from = ntohs(lh->lh_from);
+	to = ntohs(lh->lh_to);
+	if (from == HUB_ADDR) {
+		/* hub control message; nothing for us */
+		return;
+	}
+	counts.rxpkts++;
+	counts.rxbytes += len;
+	slicerx++;
+
+	ours = len >= MINSIZE && ntohl(tg->tg_magic) == TG_MAGIC;
+
+	if (ours && ntohl(tg->tg_origin) == conf.addr) {
+		stamp = ((uint64_t)ntohl(tg->tg_stamphi) << 32) |
+			ntohl(tg->tg_stamplo);
+		rtt = nowns() - stamp;
+		if (counts.timed == 0 || rtt < latmin) {
+			latmin = rtt;
+		}
+		if (rtt > latmax) {
+			latmax = rtt;
+		}
+		latsum += rtt;
+		lathist[log2bucket(rtt / 1000)]++;
+		counts.timed++;
+		return;
+	}
+
+	if (conf.mode == TG_ECHO && from != conf.addr &&
+	    from != BROADCAST_ADDR &&
+	    (to == conf.addr || to == BROADCAST_ADDR)) {
+		/* never echo an echo, or two echoers go on forever */
+		if (ours && (ntohl(tg->tg_flags) & TGF_REPLY)) {
+			return;
+		}
+		lh->lh_from = htons(conf.addr);
+		lh->lh_to = htons(from);
+		if (ours) {
+			tg->tg_flags = htonl(TGF_REPLY);
+		}
+		if (sendpkt(pkt, len) == 0) {
+			counts.echoed++;
+			counts.txpkts++;
+			counts.txbytes += len;
+		}
+	}
+}
+
+static
+void
+recvall(void)
+{
+	char pkt[MAXPACKET];
+	ssize_t r;
+	int i;
+
+	/* take a batch, then go back and see about sending */
+	for (i=0; i<256; i++) {
+		r = recv(tgsock, pkt, sizeof(pkt), 0);
+		if (r < 0) {
+			return;
+		}
+		recvpkt(pkt, r);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reporting
+
+static
+void
+report(double elapsed, double secs)
+{
+	double txp, rxp;
+
+	txp = counts.txpkts - lastcounts.txpkts;
+	rxp = counts.rxpkts - lastcounts.rxpkts;
+	printf("hub161: %7.1fs  tx %8.0f pps %9.3f Mbit/s  "
+	       "rx %8.0f pps %9.3f Mbit/s\n", elapsed,
+	       txp / secs,
+	       (counts.txbytes - lastcounts.txbytes) * 8 / secs / 1e6,
+	       rxp / secs,
+	       (counts.rxbytes - lastcounts.rxbytes) * 8 / secs / 1e6);
+	fflush(stdout);
+	lastcounts = counts;
+}
+
+/*
+ * Print a histogram of log2 buckets; bucket b > 0 holds values in
+ * [2^(b-1), 2^b).
+ */
+static
+void
+printhist(const char *title, const char *unit, const uint64_t *hist)
+{
+	uint64_t total = 0, most = 0;
+	unsigned b, first, last, bar;
+
+	for (b=0; b<NBUCKETS; b++) {
+		total += hist[b];
+		if (hist[b] > most) {
+			most = hist[b];
+		}
+	}
+	printf("hub161: %s\n", title);
+	if (total == 0) {
+		printf("hub161:     (none)\n");
+		return;
+	}
+	for (first=0; hist[first] == 0; first++) {
+		/* nothing */
+	}
+	for (last=NBUCKETS-1; hist[last] == 0; last--) {
+		/* nothing */
+	}
+	for (b=first; b<=last; b++) {
+		bar = (unsigned)(hist[b] * 40 / most);
+		if (b == 0) {
+			printf("hub161:   %10s %-10s", "0", "");
+		}
+		else {
+			printf("hub161:   %10llu-%-10llu", 1ULL << (b-1),
+			       (1ULL << b) - 1);
+		}
+		printf(" %s %10llu %5.1f%% %.*s\n",
+		       unit,
+		       (unsigned long long)hist[b],
+		       100.0 * hist[b] / total,
+		       bar, "########################################");
+	}
+}
+
+static
+void
+finalreport(double elapsed)
+{
+	printf("hub161: %.1f s: sent %llu packets (%llu bytes), "
+	       "received %llu (%llu bytes)\n", elapsed,
+	       (unsigned long long)counts.txpkts,
+	       (unsigned long long)counts.txbytes,
+	       (unsigned long long)counts.rxpkts,
+	       (unsigned long long)counts.rxbytes);
+	if (conf.mode == TG_ECHO) {
+		printf("hub161: echoed %llu\n",
+		       (unsigned long long)counts.echoed);
+	}
+	if (counts.blocked > 0) {
+		printf("hub161: hub was full %llu times\n",
+		       (unsigned long long)counts.blocked);
+	}
+	if (counts.timed > 0) {
+		printf("hub161: round trips: %llu, min %.1f avg %.1f "
+		       "max %.1f us\n",
+		       (unsigned long long)counts.timed,
+		       latmin / 1e3, (double)latsum / counts.timed / 1e3,
+		       latmax / 1e3);
+		printhist("round trip times", "us ", lathist);
+	}
+	printhist("receive rate per 100 ms", "pps", ratehist);
+	fflush(stdout);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Main loop
+
+int
+trafgen(const char *spec, const char *hubname)
+{
+	char *myspec, defpath[sizeof(hubsun.sun_path) + 16];
+	uint64_t start, now, wait, interval = 0;
+	uint64_t nextsend, nextkeep, nextreport, nextslice, lastreport;
+	uint64_t reportns, donesince = 0;
+	struct pollfd pfd;
+	struct timespec ts;
+	unsigned burstleft = 0;
+	int blocked = 0, sending;
+
+	conf.addr = DEFAULT_ADDR;
+	conf.to = BROADCAST_ADDR;
+	conf.mode = TG_SEND;
+	conf.minsize = conf.maxsize = DEFAULT_SIZE;
+	conf.rate = DEFAULT_RATE;
+	conf.burst = 1;
+	conf.report = 1;
+
+	myspec = strdup(spec);
+	if (myspec == NULL) {
+		fprintf(stderr, "hub161: out of memory\n");
+		return 1;
+	}
+	if (parsespec(myspec)) {
+		return 3;
+	}
+	if (conf.sockpath == NULL) {
+		snprintf(defpath, sizeof(defpath), "%s-tg%04x", hubname,
+			 conf.addr);
+		conf.sockpath = defpath;
+	}
+	rng = conf.seed ^ 0x9e3779b97f4a7c15ULL;
+	if (rng == 0) {
+		rng = 1;
+	}
+
+	setaddr(&hubsun, &hublen, hubname);
+	opentgsock();
+	signal(SIGINT, onsignal);
+	signal(SIGTERM, onsignal);
+
+	printf("hub161: generating traffic as %04x via %s\n", conf.addr,
+	       hubname);
+	fflush(stdout);
+
+	if (conf.rate > 0) {
+		interval = NSEC * conf.burst / conf.rate;
+	}
+	reportns = conf.report > 0 ? conf.report * NSEC : 0;
+
+	start = now = nowns();
+	nextsend = nextkeep = start;
+	nextslice = start + SLICE_NS;
+	nextreport = start + reportns;
+	lastreport = start;
+
+	while (!stopping) {
+		now = nowns();
+		if (conf.time > 0 && now - start >= conf.time * NSEC) {
+			break;
+		}
+
+		sending = conf.mode != TG_ECHO &&
+			(conf.count == 0 || counts.txpkts < conf.count);
+		if (conf.mode != TG_ECHO && !sending) {
+			/* wait a second for stragglers, then quit */
+			if (donesince == 0) {
+				donesince = now;
+			}
+			else if (now - donesince >= NSEC) {
+				break;
+			}
+		}
+
+		if (now >= nextkeep) {
+			sendkeepalive();
+			nextkeep += NSEC;
+		}
+		while (now >= nextslice) {
+			ratehist[log2bucket(slicerx * (NSEC / SLICE_NS))]++;
+			slicerx = 0;
+			nextslice += SLICE_NS;
+		}
+		if (reportns > 0 && now >= nextreport) {
+			report((now - start) / 1e9,
+			       (now - lastreport) / 1e9);
+			lastreport = now;
+			nextreport += reportns;
+		}
+
+		if (sending && burstleft == 0 && now >= nextsend) {
+			burstleft = conf.burst;
+			nextsend += interval;
+			/* don't try to make up for a long stall */
+			if (now > nextsend + NSEC) {
+				nextsend = now;
+			}
+		}
+		if (sending && burstleft > 0) {
+			blocked = sendburst(&burstleft);
+		}
+
+		recvall();
+
+		/* Sleep until the next thing to do. */
+		wait = nextkeep;
+		if (nextslice < wait) {
+			wait = nextslice;
+		}
+		if (reportns > 0 && nextreport < wait) {
+			wait = nextreport;
+		}
+		if (sending && burstleft == 0 && nextsend < wait) {
+			wait = nextsend;
+		}
+		now = nowns();
+		wait = wait > now ? wait - now : 0;
+
+		if (sending && interval == 0 && !blocked) {
+			/* as fast as we can */
+			continue;
+		}
+		/*
+		 * If the hub is full, give it a ms; POLLOUT doesn't tell
+		 * us about the far end of an unconnected socket.
+		 */
+		pfd.fd = tgsock;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (wait >= 1000000 || blocked) {
+			poll(&pfd, 1, blocked ? 1 : (int)(wait / 1000000));
+			blocked = 0;
+		}
+		else if (wait > 0 && poll(&pfd, 1, 0) == 0) {
+			/* less than a ms to go; poll can't wait that little */
+			ts.tv_sec = 0;
+			ts.tv_nsec = wait;
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	finalreport((nowns() - start) / 1e9);
+	close(tgsock);
+	unlink(conf.sockpath);
+	free(myspec);
+	return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef _TRAFGEN_H_
+#define _TRAFGEN_H_
+
+/*
+ * Traffic generator: instead of being the hub, connect to one as a
+ * node and send, receive, or echo packets, for loading the network
+ * stack of a guest without running more copies of System/161.
+ *
+ * The generator is set up by a list of options, separated by commas
+ * or spaces:
+ *
+ *     addr=N          our hardware address [0xfe00]
+ *     to=N            where to send [broadcast]
+ *     mode=M          send: send packets, and time any that come back
+ *                     ping: same, but mark them as wanting a reply
+ *                     echo: send nothing; reply to whatever arrives
+ *     size=N[-M]      packet size in bytes, with link header [64];
+ *                     with a range, sizes are drawn uniformly from it
+ *     rate=N          packets per second; 0 for as fast as the hub
+ *                     takes them [1000]
+ *     burst=N         send packets in bursts of this many, keeping to
+ *                     the same average rate [1]
+ *     count=N         stop after sending this many [no limit]
+ *     time=SECS       stop after this long [no limit]
+ *     report=SECS     how often to print throughput [1]
+ *     seed=N          for packet sizes [0]
+ *     sock=PATH       our socket [hub socket name + "-tg" + addr]
+ *
+ * Packets we send carry a small header after the link header with a
+ * sequence number and the time sent; anything that comes back with
+ * that intact (echoed by us or anyone else) gets timed. At the end a
+ * histogram of round trip times and one of the receive rates seen in
+ * each 100 ms interval are printed.
+ *
+ * Returns the exit status for main.
+ */
+int trafgen(const char *spec, const char *hubname);
+
+#endif /* _TRAFGEN_H_ */
@@ -1,11 +1,16 @@
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include "config.h"
 
 #include "bswap.h"
+#include "util.h"
 #include "console.h"
 #include "bus.h"
 #include "cpu.h"
@@ -15,32 +20,64 @@
 #include "cpu-elf.h"
 
 
+/*
+ * The boot image is mapped whole while it's being loaded, so the
+ * headers can be picked out of it and the segments copied straight
+ * into RAM.
+ */
+static const char *image;
+static size_t imagesize;
+
 static
-void
-doread(int fd, uint32_t pos, void *buf, size_t len)
+const void *
+imagedata(uint32_t pos, size_t len)
 {
-	int r;
-
-	if (lseek(fd, pos, SEEK_SET)<0) {
-		msg("lseek on boot image: %s", strerror(errno));
-		die();
-	}
-
-	r = read(fd, buf, len);
-	if (r<0) {
-		msg("read: boot image: %s", strerror(errno));
-		die();
-	}
-	else if ((size_t)r < len) {
+	if (pos > imagesize || len > imagesize - pos) {
 		msg("read: boot image: unexpected EOF");
 		die();
 	}
+	return image + pos;
 }
 
+static
+void
+doread(uint32_t pos, void *buf, size_t len)
+{
+	memcpy(buf, imagedata(pos, len), len);
+}
+
+/*
+ * What load_elf did, for the kernel image cache: the (word-aligned)
+ * span of RAM the segments went into, the entry point, and the text
+ * segments given to the profiler as vaddr/size pairs.
+ */
+struct loadinfo {
+	uint32_t li_start;
+	uint32_t li_end;
+	uint32_t li_entry;
+	uint32_t li_ntext;
+	uint32_t *li_text;
+};
+
+
+/*
+ * The end of the memory the kernel is loaded into. With a lot of RAM,
+ * the upper part may not be reachable at boot time (on MIPS, RAM
+ * above 508M is not in the direct-mapped segments) so stay below it.
+ */
+static
+uint32_t
+ramtop(void)
+{
+	if (bus_ramsize > cpu_get_ram_loadsize()) {
+		return cpu_get_ram_loadsize();
+	}
+	return bus_ramsize;
+}
 
 static
 void
-load_elf(int fd)
+load_elf(struct loadinfo *li)
 {
 	Elf_Ehdr eh;
 	Elf_Phdr ph;
@@ -49,7 +86,7 @@ load_elf(int fd)
 
 	rambase = cpu_get_ram_paddr();
 
-	doread(fd, 0, &eh, sizeof(eh));
+	doread(0, &eh, sizeof(eh));
 
 	if (eh.e_ident[EI_MAG0] != ELFMAG0 ||
 	    eh.e_ident[EI_MAG1] != ELFMAG1 ||
@@ -95,8 +132,13 @@ load_elf(int fd)
 		die();
 	}
 
+	li->li_start = ramtop();
+	li->li_end = 0;
+	li->li_ntext = 0;
+	li->li_text = domalloc(2 * eh.e_phnum * sizeof(uint32_t));
+
 	for (i=0; i<eh.e_phnum; i++) {
-		doread(fd, eh.e_phoff + i*eh.e_phentsize, &ph, sizeof(ph));
+		doread(eh.e_phoff + i*eh.e_phentsize, &ph, sizeof(ph));
 
 		ph.p_type = ctoh32(ph.p_type);
 		ph.p_offset = ctoh32(ph.p_offset);
@@ -128,11 +170,18 @@ load_elf(int fd)
 			die();
 		}
 
-		if (paddr + ph.p_memsz >= rambase + bus_ramsize) {
+		if (paddr + ph.p_memsz >= rambase + ramtop()) {
 			msg("Boot image contained segment that did not"
 			    " fit in RAM");
 			die();
 		}
+		if (paddr - rambase < li->li_start) {
+			li->li_start = (paddr - rambase) & ~(uint32_t)3;
+		}
+		if (paddr - rambase + ph.p_memsz > li->li_end) {
+			li->li_end = (paddr - rambase + ph.p_memsz + 3) &
+				~(uint32_t)3;
+		}
 
 		if (ph.p_filesz > ph.p_memsz) {
 			ph.p_filesz = ph.p_memsz;
@@ -140,14 +189,286 @@ load_elf(int fd)
 
 		if (ph.p_flags & PF_X) {
 			prof_addtext(ph.p_vaddr, ph.p_memsz);
+			li->li_text[2*li->li_ntext] = ph.p_vaddr;
+			li->li_text[2*li->li_ntext+1] = ph.p_memsz;
+			li->li_ntext++;
 		}
 
-		doread(fd, ph.p_offset, ram + paddr - rambase, ph.p_filesz);
+		bus_mem_write(paddr - rambase,
+			      imagedata(ph.p_offset, ph.p_filesz),
+			      ph.p_filesz);
 		paddr += ph.p_filesz;
-		bzero(ram + paddr - rambase, ph.p_memsz - ph.p_filesz);
+		bus_mem_zero(paddr - rambase, ph.p_memsz - ph.p_filesz);
+	}
+	if (li->li_end == 0) {
+		li->li_start = 0;
 	}
 
 	cpu_set_entrypoint(0, eh.e_entry);
+	li->li_entry = eh.e_entry;
+}
+
+/*
+ * Kernel image cache (-k). This holds what load_elf put in RAM, as it
+ * is stored there, so that booting the same kernel again is one copy
+ * instead of parsing and converting the ELF file. It's keyed by the
+ * kernel file's identity (device, inode, size, and mtime, to the
+ * nanosecond where the host keeps that, so a kernel rebuilt within
+ * the same second isn't mistaken for the old one) and by the RAM
+ * layout and byte order it was loaded for; if anything doesn't match
+ * it's rebuilt.
+ *
+ * The file is the header, then kc_ntext vaddr/size pairs, then the
+ * RAM words from kc_start to kc_end. Everything is in host order.
+ */
+#define KCACHE_MAGIC	"S161KC02"
+#define KCACHE_ORDER	0x01020304
+
+struct kcache_header {
+	char kc_magic[8];
+	uint64_t kc_dev;
+	uint64_t kc_ino;
+	uint64_t kc_size;
+	int64_t kc_mtime;
+	uint64_t kc_mtimensec;		/* 0 if the host doesn't have it */
+	uint32_t kc_order;		/* KCACHE_ORDER */
+	uint32_t kc_machine;		/* EM_CPU */
+	uint32_t kc_rambase;
+	uint32_t kc_ramtop;
+	uint32_t kc_entry;
+	uint32_t kc_ntext;
+	uint32_t kc_start;
+	uint32_t kc_end;
+};
+
+static
+void
+kcache_setkey(struct kcache_header *kh, const struct stat *st)
+{
+	memset(kh, 0, sizeof(*kh));
+	memcpy(kh->kc_magic, KCACHE_MAGIC, sizeof(kh->kc_magic));
+	kh->kc_dev = st->st_dev;
+	kh->kc_ino = st->st_ino;
+	kh->kc_size = st->st_size;
+	kh->kc_mtime = st->st_mtime;
+#if defined(HAVE_STAT_MTIM)
+	kh->kc_mtimensec = st->st_mtim.tv_nsec;
+#elif defined(HAVE_STAT_MTIMESPEC)
+	kh->kc_mtimensec = st->st_mtimespec.tv_nsec;
+#endif
+	kh->kc_order = KCACHE_ORDER;
+	kh->kc_machine = EM_CPU;
+	kh->kc_rambase = cpu_get_ram_paddr();
+	kh->kc_ramtop = ramtop();
+}
+
+/*
+ * Load the kernel from the cache if it's there and up to date.
+ * Returns 0 on success; otherwise the kernel needs loading from the
+ * ELF file.
+ */
+static
+int
+kcache_load(const char *cachefile, const struct stat *st,
+	    struct loadinfo *li)
+{
+	struct kcache_header key, kh;
+	struct stat cst;
+	const char *map;
+	const uint32_t *text;
+	size_t textsize;
+	uint32_t i;
+	int fd;
+
+	fd = open(cachefile, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &cst) < 0 || read(fd, &kh, sizeof(kh)) != sizeof(kh)) {
+		close(fd);
+		return -1;
+	}
+
+	kcache_setkey(&key, st);
+	key.kc_entry = kh.kc_entry;
+	key.kc_ntext = kh.kc_ntext;
+	key.kc_start = kh.kc_start;
+	key.kc_end = kh.kc_end;
+	if (memcmp(&key, &kh, sizeof(kh)) != 0 ||
+	    kh.kc_start > kh.kc_end || kh.kc_end > kh.kc_ramtop ||
+	    (kh.kc_start & 3) != 0 || (kh.kc_end & 3) != 0 ||
+	    kh.kc_ntext > (kh.kc_end - kh.kc_start) ||
+	    (uint64_t)cst.st_size != sizeof(kh)
+	    + 2 * sizeof(uint32_t) * (uint64_t)kh.kc_ntext
+	    + (kh.kc_end - kh.kc_start)) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+
+	textsize = 2 * sizeof(uint32_t) * kh.kc_ntext;
+	text = (const uint32_t *)(map + sizeof(kh));
+	for (i=0; i<kh.kc_ntext; i++) {
+		prof_addtext(text[2*i], text[2*i+1]);
+	}
+	bus_mem_writeraw(kh.kc_start, map + sizeof(kh) + textsize,
+			 kh.kc_end - kh.kc_start);
+	munmap((void *)map, cst.st_size);
+
+	cpu_set_entrypoint(0, kh.kc_entry);
+	li->li_start = kh.kc_start;
+	li->li_end = kh.kc_end;
+	li->li_entry = kh.kc_entry;
+	li->li_ntext = 0;
+	li->li_text = NULL;
+	return 0;
+}
+
+static
+int
+kcache_write(int fd, const void *buf, size_t len)
+{
+	ssize_t r;
+
+	r = write(fd, buf, len);
+	if (r < 0) {
+		return -1;
+	}
+	if ((size_t)r < len) {
+		errno = ENOSPC;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Write the cache after loading the ELF file. It's written under a
+ * temporary name and renamed into place, so that several copies of
+ * System/161 starting at once never see a partial file. Failing to
+ * write it isn't fatal.
+ */
+static
+void
+kcache_save(const char *cachefile, const struct stat *st,
+	    const struct loadinfo *li)
+{
+	struct kcache_header kh;
+	char *tmpname, *buf;
+	uint32_t len;
+	int fd;
+
+	kcache_setkey(&kh, st);
+	kh.kc_entry = li->li_entry;
+	kh.kc_ntext = li->li_ntext;
+	kh.kc_start = li->li_start;
+	kh.kc_end = li->li_end;
+
+	len = li->li_end - li->li_start;
+	buf = domalloc(len > 0 ? len : 1);
+	bus_mem_readraw(li->li_start, buf, len);
+
+	tmpname = domalloc(strlen(cachefile) + 32);
+	sprintf(tmpname, "%s.%ld", cachefile, (long)getpid());
+
+	fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		msg("Cannot create kernel cache %s: %s",
+		    tmpname, strerror(errno));
+		free(tmpname);
+		free(buf);
+		return;
+	}
+	if (kcache_write(fd, &kh, sizeof(kh)) < 0 ||
+	    kcache_write(fd, li->li_text,
+			 2 * sizeof(uint32_t) * li->li_ntext) < 0 ||
+	    kcache_write(fd, buf, len) < 0 ||
+	    close(fd) < 0) {
+		msg("Writing kernel cache %s: %s", tmpname, strerror(errno));
+		unlink(tmpname);
+	}
+	else if (rename(tmpname, cachefile) < 0) {
+		msg("Renaming %s to %s: %s", tmpname, cachefile,
+		    strerror(errno));
+		unlink(tmpname);
+	}
+	free(tmpname);
+	free(buf);
+}
+
+/*
+ * The initrd goes right after the kernel, page-aligned, out of the
+ * way of the boot stack, which grows down from the boot string at the
+ * top of RAM; at least INITRD_STACKROOM is left free for the stack.
+ * Its physical address and size are put on the front of the boot
+ * string as "initrd=0xADDR,0xSIZE". The numbers are always 8 digits,
+ * so the string's length is known before the address is.
+ */
+#define INITRD_ARG	"initrd=0x%08x,0x%08x"
+#define INITRD_ARGLEN	(7 + 10 + 1 + 10)
+#define INITRD_ALIGN	4096
+#define INITRD_STACKROOM	4096
+
+static
+char *
+load_initrd(const char *file, const char *argument, uint32_t kernend)
+{
+	struct stat st;
+	uint32_t rambase, argsize, size, paddr, room;
+	void *map;
+	char *newarg;
+	int fd;
+
+	rambase = cpu_get_ram_paddr();
+
+	fd = open(file, O_RDONLY);
+	if (fd<0) {
+		msg("Cannot open initrd %s: %s", file, strerror(errno));
+		die();
+	}
+	if (fstat(fd, &st) < 0) {
+		msg("initrd: %s: fstat: %s", file, strerror(errno));
+		die();
+	}
+
+	/* (at least) the string setstack will put at the top of RAM */
+	argsize = INITRD_ARGLEN + 1 + strlen(argument) + 1;
+	argsize = (argsize+3) & ~(uint32_t)3;
+
+	paddr = (kernend + INITRD_ALIGN - 1) & ~(uint32_t)(INITRD_ALIGN - 1);
+	room = 0;
+	if (ramtop() > argsize + INITRD_STACKROOM) {
+		room = rambase + ramtop() - argsize - INITRD_STACKROOM;
+	}
+	if (paddr >= room || st.st_size > room - paddr) {
+		msg("initrd %s does not fit in RAM with the kernel", file);
+		die();
+	}
+	size = st.st_size;
+
+	if (size > 0) {
+		map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			msg("initrd: %s: mmap: %s", file, strerror(errno));
+			die();
+		}
+		bus_mem_write(paddr - rambase, map, size);
+		munmap(map, size);
+	}
+	close(fd);
+
+	newarg = domalloc(INITRD_ARGLEN + 1 + strlen(argument) + 1);
+	snprintf(newarg, INITRD_ARGLEN + 1, INITRD_ARG, paddr, size);
+	Assert(strlen(newarg) == INITRD_ARGLEN);
+	if (*argument != 0) {
+		strcat(newarg, " ");
+		strcat(newarg, argument);
+	}
+	return newarg;
 }
 
 static
@@ -165,9 +486,9 @@ setstack(const char *argument)
 	/* align size upwards */
 	size = (size+3) & ~(uint32_t)3;
 
-	paddr = rambase + bus_ramsize - size;
+	paddr = rambase + ramtop() - size;
 
-	strcpy(ram + paddr - rambase, argument);
+	bus_mem_write(paddr - rambase, argument, strlen(argument) + 1);
 
 	/* convert to virtual addr */
 	if (cpu_get_load_vaddr(paddr, size, &vaddr)) {
@@ -179,18 +500,58 @@ setstack(const char *argument)
 }
 
 void
-load_kernel(const char *image, const char *argument)
+load_kernel(const char *file, const char *argument, const char *initrd,
+	    const char *cachefile)
 {
+	struct loadinfo li;
+	struct stat st;
+	char *newarg = NULL;
+	void *map;
 	int fd;
-	fd = open(image, O_RDONLY);
+
+	fd = open(file, O_RDONLY);
 	if (fd<0) {
-		msg("Cannot open boot image %s: %s", image, strerror(errno));
+		msg("Cannot open boot image %s: %s", file, strerror(errno));
+		die();
+	}
+	if (fstat(fd, &st) < 0) {
+		msg("fstat: boot image: %s", strerror(errno));
 		die();
 	}
 
-	load_elf(fd);
+	if (cachefile == NULL || kcache_load(cachefile, &st, &li) < 0) {
+		if (st.st_size == 0) {
+			msg("read: boot image: unexpected EOF");
+			die();
+		}
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			msg("mmap: boot image: %s", strerror(errno));
+			die();
+		}
+		image = map;
+		imagesize = st.st_size;
+
+		load_elf(&li);
+
+		munmap(map, st.st_size);
+		image = NULL;
+		imagesize = 0;
+
+		if (cachefile != NULL) {
+			kcache_save(cachefile, &st, &li);
+		}
+		free(li.li_text);
+	}
 	close(fd);
 
+	if (initrd != NULL) {
+		newarg = load_initrd(initrd, argument,
+				     cpu_get_ram_paddr() + li.li_end);
+		argument = newarg;
+	}
+
 	setstack(argument);
+	free(newarg);
 }
 
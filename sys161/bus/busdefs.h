@@ -26,14 +26,11 @@
 /*
  * Number of possible CPUs
  */
-#define LAMEBUS_NCPUS                32
+#define LAMEBUS_NCPUS                128
 
 /*
- * Size of per-CPU control register region
+ * Size of per-CPU control register region, with up to 32 CPUs and
+ * with more than that
  */
 #define LAMEBUS_PERCPU_SIZE          1024
-
-/*
- * Size of per-cpu scratch area
- */
-#define LAMEBUS_CRAM_SIZE            128
+#define LAMEBUS_PERCPU_SMALLSIZE     256
@@ -1,11 +1,12 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <stdio.h>
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
-#include <math.h>
 
 /*
  * On Linux, or at least in some glibc versions, fcntl.h defines the
@@ -24,31 +25,21 @@
 #include "doom.h"
 #include "main.h"
 #include "util.h"
+#include "snapshot.h"
 
 #include "lamebus.h"
 #include "busids.h"
+#include "diskmodel.h"
 
 
 /* Disk underlying I/O definitions */
 #define HEADER_MESSAGE  "System/161 Disk Image"
-#define HEADERSIZE      SECTSIZE
+#define HEADER_SECTSIZE ", %u-byte sectors"
+#define HEADERSIZE(dd)  ((dd)->dd_sectsize)
 
-/* Disk physical parameters */
-#define SECTSIZE               512   /* bytes */
-#define SECTOR_FUDGE          1.06
-#define OUTER_DIAM				80
-#define INNER_DIAM				20
-#define PLATTER_AREA			((OUTER_DIAM)*(OUTER_DIAM) - \
-								(INNER_DIAM)*(INNER_DIAM)) \
-								*PI/4
-
-#define PI						3.14159
-
-#define NUMTRACKS				320
-
-/* Disk timing parameters */
-#define CACHE_READ_TIME      500       /* ns */
-#define CACHE_WRITE_TIME     500       /* ns */
+/* Disk physical parameters (the rest are in diskmodel.h) */
+#define DEFAULT_SECTSIZE       DISKMODEL_PHYSSECTSIZE
+#define MAX_SECTSIZE          4096   /* bytes */
 
 /* Number of tries after which we assume the timing code has lost its marbles*/
 #define MAX_WORKTRIES    10
@@ -58,10 +49,12 @@
 #define DISKREG_STAT  4
 #define DISKREG_SECT  8
 #define DISKREG_RPM   12
+#define DISKREG_SSIZE 16
+#define DISKREG_COUNT 20
 
 /* Transfer buffer offsets */
 #define DISK_BUF_START  32768
-#define DISK_BUF_END    (DISK_BUF_START + SECTSIZE)
+#define DISK_BUF_END(dd) (DISK_BUF_START + (dd)->dd_sectsize)
 
 /* Bits for status registers */
 #define DISKBIT_INPROGRESS    1
@@ -69,11 +62,13 @@
 #define DISKBIT_COMPLETE      4
 #define DISKBIT_INVSECT       8
 #define DISKBIT_MEDIAERR      16
+#define DISKBIT_ISDISCARD     32
 
 /* The legal values that can be written to the status register */
 #define DISKSTAT_IDLE          0
 #define DISKSTAT_READING       (DISKBIT_INPROGRESS)
 #define DISKSTAT_WRITING       (DISKBIT_INPROGRESS|DISKBIT_ISWRITE)
+#define DISKSTAT_DISCARDING    (DISKBIT_INPROGRESS|DISKBIT_ISDISCARD)
 
 /* Masks for the other values for the status register */
 #define DISKSTAT_COMPLETE      (DISKBIT_COMPLETE)
@@ -100,18 +95,22 @@ struct disk_data {
 	 */
 	int dd_fd;
 	int dd_paranoid;     /* if nonzero, fsync on every write */
+	uint32_t dd_sectsize;	/* logical sector size (bytes) */
+
+	/*
+	 * Copy-on-write overlay, in a fork-server child only: sectors
+	 * whose bit is set in dd_ovmap live in dd_ovfd (at the same
+	 * offset) instead of the image, which is shared with the
+	 * parent and the other children and never written.
+	 */
+	int dd_ovfd;		/* -1 if none */
+	uint8_t *dd_ovmap;
 
 	/* 
-	 * Geometry:
-	 * dd_sectors[] has dd_cylinders entries. 
-	 * sum(dd_sectors) * dd_heads should give dd_totsectors.
-	 * sum(dd_sectors) should give dd_totsectors.
+	 * Geometry
 	 */
-	uint32_t *dd_sectors;
-	uint32_t dd_tracks;	 	/* always is == NUMTRACKS */
+	struct diskmodel dd_model;
 	uint32_t dd_totsectors;
-	uint32_t dd_rpm;
-	uint32_t dd_nsecs_per_rev;
 
 	/*
 	 * Doom counter
@@ -132,11 +131,22 @@ struct disk_data {
 	 */
 	int dd_worktries;	/* # times dd_work called during this I/O */
 
+	/*
+	 * I/O log (NULL if not logging) and the current request's
+	 * contribution to it
+	 */
+	FILE *dd_log;
+	uint32_t dd_issuesecs;
+	uint32_t dd_issuensecs;
+	int32_t dd_opseek;
+	uint32_t dd_oprotwait;
+
 	/*
 	 * Registers
 	 */
 	uint32_t dd_stat;
 	uint32_t dd_sect;
+	uint32_t dd_count;	/* number of sectors to discard */
 
 	/*
 	 * I/O buffer
@@ -148,6 +158,8 @@ struct disk_data {
 	 *
 	 * We might end up needing to make this an array of uint32 and
 	 * scaling all the offsets, which would be a major nuisance.
+	 *
+	 * It holds one sector, so it is dd_sectsize bytes long.
 	 */
 	char *dd_buf;
 };
@@ -300,25 +312,46 @@ dowrite(int fd, off_t offset, const char *buf, size_t bufsize, int paranoid)
 	return 0;
 }
 
+/*
+ * The header occupies the first sector of the image. Images with
+ * 512-byte sectors have the plain header message, so they're
+ * unchanged from older versions; other sector sizes are recorded
+ * after it as text, which older versions will refuse to load.
+ */
+
+static
+int
+disk_valid_sectsize(uint32_t sectsize)
+{
+	return sectsize >= DEFAULT_SECTSIZE && sectsize <= MAX_SECTSIZE &&
+		(sectsize & (sectsize - 1)) == 0;
+}
+
 static
 void
 writeheader(struct disk_data *dd, const char *filename, uint32_t configsectors)
 {
 	off_t fsize;
-	char buf[HEADERSIZE];
+	char buf[MAX_SECTSIZE];
+	size_t len;
 
-	memset(buf, 0, HEADERSIZE);
+	memset(buf, 0, HEADERSIZE(dd));
 	strcpy(buf, HEADER_MESSAGE);
+	if (dd->dd_sectsize != DEFAULT_SECTSIZE) {
+		len = strlen(buf);
+		snprintf(buf + len, HEADERSIZE(dd) - len, HEADER_SECTSIZE,
+			 dd->dd_sectsize);
+	}
 
-	if (dowrite(dd->dd_fd, 0, buf, HEADERSIZE, dd->dd_paranoid)) {
+	if (dowrite(dd->dd_fd, 0, buf, HEADERSIZE(dd), dd->dd_paranoid)) {
 		msg("disk: slot %d: %s: Write of header: %s",
 		    dd->dd_slot, filename, strerror(errno));
 		die();
 	}
 	
 	fsize = configsectors;
-	fsize *= SECTSIZE;
-	fsize += HEADERSIZE;
+	fsize *= dd->dd_sectsize;
+	fsize += HEADERSIZE(dd);
 
 	if (ftruncate(dd->dd_fd, fsize)) {
 		msg("disk: slot %d: %s: ftruncate: %s",
@@ -331,21 +364,44 @@ static
 void
 readheader(struct disk_data *dd, const char *filename)
 {
-	char buf[HEADERSIZE];
-	if (doread(dd->dd_fd, 0, buf, HEADERSIZE)) {
+	char buf[DEFAULT_SECTSIZE];
+	size_t len;
+	unsigned sectsize;
+	int n;
+
+	if (doread(dd->dd_fd, 0, buf, sizeof(buf))) {
 		msg("disk: slot %d: %s: Reading header: %s",
 		    dd->dd_slot, filename, strerror(errno));
 		die();
 	}
 
 	/* just in case */
-	buf[HEADERSIZE-1] = 0;
+	buf[sizeof(buf)-1] = 0;
+
+	len = strlen(HEADER_MESSAGE);
+	if (strncmp(buf, HEADER_MESSAGE, len)) {
+		msg("disk: slot %d: %s is not a disk image",
+		    dd->dd_slot, filename);
+		die();
+	}
+	if (buf[len] == 0) {
+		dd->dd_sectsize = DEFAULT_SECTSIZE;
+		return;
+	}
 
-	if (strcmp(buf, HEADER_MESSAGE)) {
+	n = -1;
+	if (sscanf(buf + len, HEADER_SECTSIZE "%n", &sectsize, &n) != 1 ||
+	    n < 0 || buf[len + n] != 0) {
 		msg("disk: slot %d: %s is not a disk image",
 		    dd->dd_slot, filename);
 		die();
 	}
+	if (!disk_valid_sectsize(sectsize)) {
+		msg("disk: slot %d: %s: Unsupported sector size %u",
+		    dd->dd_slot, filename, sectsize);
+		die();
+	}
+	dd->dd_sectsize = sectsize;
 }
 
 static
@@ -401,19 +457,19 @@ disk_open(struct disk_data *dd, const char *filename, uint32_t configsectors)
 		    dd->dd_slot, filename, strerror(errno));
 		die();
 	}
-	if (st.st_size < HEADERSIZE) {
+	if (st.st_size < HEADERSIZE(dd)) {
 		msg("disk: slot %d: %s: No header block",
 		    dd->dd_slot, filename);
 		die();
 	}
-	st.st_size -= HEADERSIZE;
+	st.st_size -= HEADERSIZE(dd);
 	if (st.st_size > 0xffffffff) {
 		msg("disk: slot %d: %s: Image too large; using first 4G",
 		    dd->dd_slot, filename);
-		dd->dd_totsectors = 0x100000000ULL / SECTSIZE;
+		dd->dd_totsectors = 0x100000000ULL / dd->dd_sectsize;
 	}
 	else {
-		dd->dd_totsectors = st.st_size / SECTSIZE;
+		dd->dd_totsectors = st.st_size / dd->dd_sectsize;
 	}
 }
 
@@ -421,24 +477,53 @@ static
 void
 disk_close(struct disk_data *dd)
 {
-	disk_unlock(dd);
+	if (dd->dd_ovfd >= 0) {
+		/* the lock is the parent's */
+		close(dd->dd_ovfd);
+		dd->dd_ovfd = -1;
+	}
+	else {
+		disk_unlock(dd);
+	}
 	if (close(dd->dd_fd)) {
 		smoke("disk: slot %d: close: %s", 
 		      dd->dd_slot, strerror(errno));
 	}
 }
 
+/*
+ * Overlay bookkeeping.
+ */
+static
+int
+disk_inoverlay(struct disk_data *dd, uint32_t sect)
+{
+	return dd->dd_ovfd >= 0 && (dd->dd_ovmap[sect/8] & (1 << (sect%8)));
+}
+
+static
+void
+disk_tooverlay(struct disk_data *dd, uint32_t sect, uint32_t count)
+{
+	for (; count > 0; sect++, count--) {
+		dd->dd_ovmap[sect/8] |= (1 << (sect%8));
+	}
+}
+
 static
 int
 disk_readsector(struct disk_data *dd)
 {
 	off_t offset = dd->dd_sect;
-	offset *= SECTSIZE;
-	offset += HEADERSIZE;
+	int fd;
+
+	offset *= dd->dd_sectsize;
+	offset += HEADERSIZE(dd);
 
 	g_stats.s_rsects++;
 
-	return doread(dd->dd_fd, offset, dd->dd_buf, SECTSIZE);
+	fd = disk_inoverlay(dd, dd->dd_sect) ? dd->dd_ovfd : dd->dd_fd;
+	return doread(fd, offset, dd->dd_buf, dd->dd_sectsize);
 }
 
 static
@@ -446,242 +531,180 @@ int
 disk_writesector(struct disk_data *dd)
 {
 	off_t offset = dd->dd_sect;
-	offset *= SECTSIZE;
-	offset += HEADERSIZE;
+	offset *= dd->dd_sectsize;
+	offset += HEADERSIZE(dd);
 
 	g_stats.s_wsects++;
 
-	return dowrite(dd->dd_fd, offset, dd->dd_buf, SECTSIZE,
+	if (dd->dd_ovfd >= 0) {
+		if (dowrite(dd->dd_ovfd, offset, dd->dd_buf, dd->dd_sectsize,
+			    dd->dd_paranoid)) {
+			return -1;
+		}
+		disk_tooverlay(dd, dd->dd_sect, 1);
+		return 0;
+	}
+	return dowrite(dd->dd_fd, offset, dd->dd_buf, dd->dd_sectsize,
 		       dd->dd_paranoid);
 }
 
-////////////////////////////////////////////////////////////
-//
-// Geometry modeling
-
+/*
+ * Discard dd_count sectors starting at dd_sect. We punch a hole in
+ * the image file if the host supports it, so the space is given back
+ * and the sectors read back as zeros. Otherwise (or if the filesystem
+ * the image lives on can't do it) we just write zeros, which at least
+ * gives the same contents.
+ *
+ * With an overlay the discarded sectors move into it; as it starts
+ * out sparse, a hole there reads back as zeros too.
+ */
 static
 int
-compute_sectors(struct disk_data *dd)
+disk_discardsectors(struct disk_data *dd)
 {
-	uint32_t physsectors;      // total number of actual sectors
-	//uint32_t sectorspertrack;  // average sectors per track
-	uint32_t i, tot;
-
-	double sectors_per_area;
-	double trackwidth;
-
-	/*
-	 * Compute number of physical sectors. We use a bit more than the
-	 * requested space so as to leave room for sector remapping. Not
-	 * that we actually do sector remapping when computing latencies,
-	 * but we could. Note that these spare sectors do not appear in
-	 * the file we use for underlying storage.
-	 */
-	physsectors = (uint32_t)(dd->dd_totsectors * SECTOR_FUDGE);
-	if (physsectors < dd->dd_totsectors) {
-		/* Overflow - didn't fit in uint32_t */
-		smoke("Fatal error computing disk geometry");
-		return -1;
+	off_t offset, len, done;
+	size_t amt;
+	char *zeros;
+	int fd, result;
+
+	offset = dd->dd_sect;
+	offset *= dd->dd_sectsize;
+	offset += HEADERSIZE(dd);
+	len = dd->dd_count;
+	len *= dd->dd_sectsize;
+
+	if (len == 0) {
+		return 0;
 	}
 
-	//sectorspertrack = physsectors/NUMTRACKS;
-	dd->dd_tracks = NUMTRACKS;
-
-	/* allocate space for dd_tracks entries */
-	dd->dd_sectors = domalloc(dd->dd_tracks*sizeof(uint32_t));
-
-	/* compute the width of each track */
-	trackwidth = ((OUTER_DIAM - INNER_DIAM)/2) / (double)dd->dd_tracks;
-	
-	/* compute the number of sectors per unit area of disk */
-	sectors_per_area = physsectors / (PLATTER_AREA);
-
-	/*
-	 * Now, figure out how many sectors are on each track.
-	 * We do this by computing the area of the track and multiplying
-	 * by sectors_per_area, truncating to the next smallest integer.
-	 * We reserve one sector on each track.
-	 */
-	for (i=0; i<dd->dd_tracks; i++) {
-		double inside = INNER_DIAM/2.0 + i*trackwidth;
-		double outside = inside + trackwidth;
-
-		/* 
-		 * this track's area = pi*(outside^2 - inside^2) = pi*(outside +
-		 * inside)*(outside - inside) = pi*(outside +
-		 * inside)*(trackwidth)
-		 */
-
-		double trackarea = (outside+inside)*trackwidth*PI;
-		double sectors = sectors_per_area*trackarea;
+	fd = dd->dd_fd;
+	if (dd->dd_ovfd >= 0) {
+		fd = dd->dd_ovfd;
+		disk_tooverlay(dd, dd->dd_sect, dd->dd_count);
+	}
 
-		if (sectors < 2.0) {
-			/* too small */
-			msg("disk: slot %d: track %u has only one sector",
-			    dd->dd_slot, i);
+#ifdef HAVE_PUNCH_HOLE
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+		      offset, len) == 0) {
+		if (dd->dd_paranoid && fsync(fd)) {
 			return -1;
 		}
-
-		dd->dd_sectors[i] = ((int)sectors) - 1;
-	}
-
-	/* Now compute the total number of sectors available. */
-	tot = 0;
-	for (i=0; i<dd->dd_tracks; i++) {
-		tot += dd->dd_sectors[i];
+		return 0;
 	}
-
-	/* Make sure we've got enough space. */
-	if (tot < dd->dd_totsectors) {
-		/* 
-		 * Shouldn't happen. If it does, increase SECTOR_FUDGE.
-		 */
-		msg("disk: slot %d: Not enough SECTOR_FUDGE",
-		    dd->dd_slot);
+	if (errno != EOPNOTSUPP && errno != ENOSYS) {
 		return -1;
 	}
+#endif
 
-	return 0;
-}
-
-static
-void
-locate_sector(struct disk_data *dd,
-	      uint32_t sector, int *track, int *rotoffset)
-{
-	/* 
-	 * Assume sector has already been checked for being in bounds.
-	 *
-	 * Note that we start numbering sectors from the outermost
-	 * (fastest) track.
-	 */
-	
-	uint32_t i;
-	uint32_t start = 0;
-
-	for (i = dd->dd_tracks; i > 0; i--) {
-		uint32_t tr = i-1;
-		uint32_t end = start + dd->dd_sectors[tr];
-		if (sector >= start && sector < end) {
-			*track = tr;
-			*rotoffset = sector - start;
-			return;
+	zeros = domalloc(MAX_SECTSIZE * 16);
+	memset(zeros, 0, MAX_SECTSIZE * 16);
+	result = 0;
+	for (done = 0; done < len; done += amt) {
+		amt = MAX_SECTSIZE * 16;
+		if ((off_t)amt > len - done) {
+			amt = len - done;
+		}
+		if (dowrite(fd, offset + done, zeros, amt, 0)) {
+			result = -1;
+			break;
 		}
-		start = end;
 	}
-	
-	smoke("Cannot locate sector %u\n", sector);
+	free(zeros);
+	if (result == 0 && dd->dd_paranoid && fsync(fd)) {
+		result = -1;
+	}
+	return result;
 }
 
+////////////////////////////////////////////////////////////
+//
+// I/O log
+
 static
-uint32_t
-disk_seektime(struct disk_data *dd, int ntracks)
+void
+disk_openlog(struct disk_data *dd, const char *logfile)
 {
-	(void)dd;
+	struct disklog_header dlh;
+	unsigned char buf[DISKLOG_HEADERSIZE];
 
-	if (ntracks > 3) {
-		/* 10 ms stabilization + roughly 5G acceleration */
-		return 1000000 * (10 + 3*sqrt(ntracks));
+	dd->dd_log = fopen(logfile, "wb");
+	if (dd->dd_log == NULL) {
+		msg("disk: slot %d: %s: %s", dd->dd_slot, logfile,
+		    strerror(errno));
+		die();
 	}
-	else {
-		/* 5 ms track-to-track */
-		return 1000000 * (5*ntracks);
+	/* records are small; don't pay a syscall for each one */
+	setvbuf(dd->dd_log, NULL, _IOFBF, 65536);
+
+	dlh.dlh_version = DISKLOG_VERSION;
+	dlh.dlh_sectsize = dd->dd_sectsize;
+	dlh.dlh_totsectors = dd->dd_totsectors;
+	dlh.dlh_rpm = dd->dd_model.dm_rpm;
+	dlh.dlh_tracks = dd->dd_model.dm_tracks;
+	disklog_encodeheader(buf, &dlh);
+	if (fwrite(buf, sizeof(buf), 1, dd->dd_log) != 1) {
+		msg("disk: slot %d: %s: write: %s", dd->dd_slot, logfile,
+		    strerror(errno));
+		die();
 	}
 }
 
 static
-uint32_t
-disk_readrotdelay(struct disk_data *dd, uint32_t cyl, uint32_t rotoffset)
+void
+disk_closelog(struct disk_data *dd)
 {
-	uint32_t nowsecs, nownsecs;
-
-	/*
-	 * Time for crossing a single sector.
-	 */
-	uint32_t nsecs_per_sector = dd->dd_nsecs_per_rev/dd->dd_sectors[cyl];
-
-	/*
-	 * Next sector after the one we want.
-	 */
-	uint32_t targsector = (rotoffset+1) % dd->dd_sectors[cyl];
-
-	/*
-	 * Compute when the next sector would first be reached after
-	 * hitting the track. (When the next sector is reached, the
-	 * sector we want is fully read.)
-	 *
-	 * Note that we require that there are an integral number of
-	 * revs per second, and that we assume the platters are always
-	 * at position 0 when nownsecs = 0.
-	 */
-	uint32_t targsecs = dd->dd_trackarrival_secs;
-	uint32_t targnsecs = targsector * nsecs_per_sector;
-	while (targnsecs < dd->dd_trackarrival_nsecs) {
-		targnsecs += dd->dd_nsecs_per_rev;
+	if (dd->dd_log == NULL) {
+		return;
 	}
-	while (targnsecs >= 1000000000) {
-		targnsecs -= 1000000000;
-		targsecs++;
+	if (fclose(dd->dd_log)) {
+		msg("disk: slot %d: I/O log: %s", dd->dd_slot,
+		    strerror(errno));
 	}
-
-	clock_time(&nowsecs, &nownsecs);
-
-	/*
-	 * If we've reached that time, we've already crossed the
-	 * sector and it's in our track buffer.
-	 */
-	if (targsecs < nowsecs ||
-	    (targsecs == nowsecs && targnsecs <= nownsecs)) {
-		return 0;
-	}
-
-	/*
-	 * Otherwise, we need to wait until that time.
-	 */
-	targsecs -= nowsecs;
-	targnsecs -= nownsecs;
-	targnsecs += 1000000000*targsecs;  // should not overflow
-
-	return targnsecs;
+	dd->dd_log = NULL;
 }
 
 static
-uint32_t
-disk_writerotdelay(struct disk_data *dd, uint32_t cyl, uint32_t rotoffset)
+void
+disk_startlog(struct disk_data *dd)
 {
-	uint32_t nowsecs, nownsecs;
-
-	/*
-	 * Time for crossing a single sector.
-	 */
-	uint32_t nsecs_per_sector = dd->dd_nsecs_per_rev/dd->dd_sectors[cyl];
-
-	/*
-	 * Compute when the sector we want will next be reached.
-	 * (Ignore seconds. The disk must be at least 60 rpm, so we
-	 * can get to any sector without overflowing a uint32_t of
-	 * nsecs.)
-	 */
-	uint32_t targnsecs = rotoffset * nsecs_per_sector;
-	uint32_t delay;
+	clock_time(&dd->dd_issuesecs, &dd->dd_issuensecs);
+	dd->dd_opseek = 0;
+	dd->dd_oprotwait = 0;
+}
 
-	clock_time(&nowsecs, &nownsecs);
+static
+void
+disk_logio(struct disk_data *dd, uint32_t flags)
+{
+	struct disklog_record dlr;
+	unsigned char buf[DISKLOG_RECSIZE];
 
-	while (targnsecs < nownsecs) {
-		targnsecs += dd->dd_nsecs_per_rev;
+	if (dd->dd_log == NULL) {
+		return;
 	}
 
-	/*
-	 * Add in how long it takes to do the write.
-	 */
-	targnsecs += nsecs_per_sector;
-
-	/*
-	 * Wait until then.
-	 */
-	delay = targnsecs - nownsecs;
+	dlr.dlr_issuesecs = dd->dd_issuesecs;
+	dlr.dlr_issuensecs = dd->dd_issuensecs;
+	clock_time(&dlr.dlr_donesecs, &dlr.dlr_donensecs);
+	dlr.dlr_sector = dd->dd_sect;
+	dlr.dlr_flags = flags;
+	if (dd->dd_stat & DISKBIT_ISWRITE) {
+		dlr.dlr_flags |= DISKLOG_WRITE;
+	}
+	dlr.dlr_seek = dd->dd_opseek;
+	dlr.dlr_rotwait = dd->dd_oprotwait;
+	if (dd->dd_stat & DISKBIT_ISDISCARD) {
+		dlr.dlr_flags |= DISKLOG_DISCARD;
+		dlr.dlr_rotwait = dd->dd_count;
+	}
+	disklog_encoderecord(buf, &dlr);
 
-	return delay;
+	if (fwrite(buf, sizeof(buf), 1, dd->dd_log) != 1) {
+		msg("disk: slot %d: I/O log: %s; logging stopped",
+		    dd->dd_slot, strerror(errno));
+		fclose(dd->dd_log);
+		dd->dd_log = NULL;
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -689,16 +712,36 @@ disk_writerotdelay(struct disk_data *dd, uint32_t cyl, uint32_t rotoffset)
 // Setup
 
 
+static void disk_seekdone(void *data, uint32_t cyl);
+static void disk_waitdone(void *data, uint32_t status);
+
 static
 void *
 disk_init(int slot, int argc, char *argv[])
 {
 	struct disk_data *dd;
 	const char *filename = NULL;
+	const char *logfile = NULL;
+	char errbuf[128];
 	off_t size;
 	uint32_t totsectors=0;
 	uint32_t rpm = 3600;
-	int i, paranoid=0, usedoom = 1;
+	uint32_t sectsize = DEFAULT_SECTSIZE;
+	int i, paranoid=0, usedoom = 1, gotsectsize = 0;
+
+	/* sectsize= must be seen first so size= can be checked against it */
+	for (i=1; i<argc; i++) {
+		if (!strncmp(argv[i], "sectsize=", 9)) {
+			sectsize = getsize(argv[i]+9);
+			if (!disk_valid_sectsize(sectsize)) {
+				msg("disk: slot %d: Invalid sector size %s "
+				    "(512, 1024, 2048, or 4096 allowed)",
+				    slot, argv[i]+9);
+				die();
+			}
+			gotsectsize = 1;
+		}
+	}
 
 	for (i=1; i<argc; i++) {
 		if (!strncmp(argv[i], "rpm=", 4)) {
@@ -709,16 +752,22 @@ disk_init(int slot, int argc, char *argv[])
 		}
 		else if (!strncmp(argv[i], "size=", 5)) {
 			size = getsize(argv[i]+5);
-			if (size % SECTSIZE) {
+			if (size % sectsize) {
 				msg("disk: slot %d: Configured size is not a "
 				    "unit number of sectors", slot);
 				die();
 			}
-			totsectors = size / SECTSIZE;
+			totsectors = size / sectsize;
+		}
+		else if (!strncmp(argv[i], "sectsize=", 9)) {
+			/* handled above */
 		}
 		else if (!strncmp(argv[i], "file=", 5)) {
 			filename = argv[i]+5;
 		}
+		else if (!strncmp(argv[i], "iolog=", 6)) {
+			logfile = argv[i]+6;
+		}
 		else if (!strcmp(argv[i], "paranoid")) {
 			paranoid = 1;
 		}
@@ -758,12 +807,11 @@ disk_init(int slot, int argc, char *argv[])
 
 	dd->dd_fd = -1;
 	dd->dd_paranoid = paranoid;
+	dd->dd_ovfd = -1;
+	dd->dd_ovmap = NULL;
+	dd->dd_sectsize = sectsize;
 
-	dd->dd_sectors = NULL;
-	dd->dd_tracks = 0;
 	dd->dd_totsectors = 0;
-	dd->dd_rpm = rpm;
-	dd->dd_nsecs_per_rev = 1000000000 / (dd->dd_rpm / 60);
 
 	dd->dd_usedoom = usedoom;
 
@@ -774,33 +822,63 @@ disk_init(int slot, int argc, char *argv[])
 
 	dd->dd_worktries = 0;
 
+	dd->dd_log = NULL;
+	dd->dd_issuesecs = 0;
+	dd->dd_issuensecs = 0;
+	dd->dd_opseek = 0;
+	dd->dd_oprotwait = 0;
+
 	dd->dd_stat = DISKSTAT_IDLE;
 	dd->dd_sect = 0;
-
-	dd->dd_buf = domalloc(SECTSIZE);
+	dd->dd_count = 0;
 
 	disk_open(dd, filename, totsectors);
+	if (dd->dd_sectsize != sectsize) {
+		if (gotsectsize) {
+			msg("disk: slot %d: %s: Wrong configured sector "
+			    "size %u", slot, filename, sectsize);
+			msg("disk: slot %d: %s: Using image sector size %u",
+			    slot, filename, dd->dd_sectsize);
+		}
+		if (totsectors > 0) {
+			/* keep the configured size in bytes */
+			totsectors = (uint64_t)totsectors * sectsize /
+				dd->dd_sectsize;
+		}
+	}
 	if (dd->dd_totsectors != totsectors && totsectors > 0) {
 		msg("disk: slot %d: %s: Wrong configured size %u (%uK)",
 		    slot, filename, totsectors,
-		    totsectors * 1024 / SECTSIZE);
+		    (unsigned)((uint64_t)totsectors * dd->dd_sectsize / 1024));
 		msg("disk: slot %d: %s: Using image size %u (%uK)",
 		    slot, filename, dd->dd_totsectors,
-		    dd->dd_totsectors * 1024 / SECTSIZE);
+		    (unsigned)((uint64_t)dd->dd_totsectors *
+			       dd->dd_sectsize / 1024));
 	}
 
+	dd->dd_buf = domalloc(dd->dd_sectsize);
+
+	clock_nameevent(disk_seekdone, "disk seek");
+	clock_nameevent(disk_waitdone, "disk wait");
+
 	if (dd->dd_totsectors < 128) {
 		msg("disk: slot %d: %s: Too small", slot, filename);
 		die();
 	}
 
-	/* set dd_cylinders, dd_sectors, dd_heads */
-	if (compute_sectors(dd)) {
+	if (diskmodel_init(&dd->dd_model, dd->dd_totsectors,
+			   dd->dd_sectsize, rpm, DISKMODEL_NUMTRACKS,
+			   errbuf, sizeof(errbuf))) {
+		msg("disk: slot %d: %s", slot, errbuf);
 		msg("disk: slot %d: %s: Geometry initialization failed "
 		    "(try another size)", slot, filename);
 		die();
 	}
 
+	if (logfile != NULL) {
+		disk_openlog(dd, logfile);
+	}
+
 	return dd;
 }
 
@@ -809,11 +887,57 @@ void
 disk_cleanup(void *data)
 {
 	struct disk_data *dd = data;
+	disk_closelog(dd);
 	disk_close(dd);
+	diskmodel_cleanup(&dd->dd_model);
+	free(dd->dd_ovmap);
 	free(dd->dd_buf);
 	free(dd);
 }
 
+/*
+ * In a fork-server child, send writes to a private overlay so runs
+ * don't see each other's changes or touch the image. The overlay is
+ * an unlinked sparse file the size of the image. The I/O log is the
+ * parent's; stop adding to it.
+ */
+static
+void
+disk_forked(void *data, unsigned run)
+{
+	struct disk_data *dd = data;
+	const char *tmpdir;
+	char path[PATH_MAX];
+	struct stat st;
+
+	(void)run;
+
+	disk_closelog(dd);
+
+	tmpdir = getenv("TMPDIR");
+	if (tmpdir == NULL || *tmpdir == 0) {
+		tmpdir = "/tmp";
+	}
+	snprintf(path, sizeof(path), "%s/sys161-disk-XXXXXX", tmpdir);
+	dd->dd_ovfd = mkstemp(path);
+	if (dd->dd_ovfd < 0) {
+		msg("disk: slot %d: %s: %s", dd->dd_slot, path,
+		    strerror(errno));
+		die();
+	}
+	unlink(path);
+
+	if (fstat(dd->dd_fd, &st) == -1 ||
+	    ftruncate(dd->dd_ovfd, st.st_size) == -1) {
+		msg("disk: slot %d: overlay: %s", dd->dd_slot,
+		    strerror(errno));
+		die();
+	}
+
+	dd->dd_ovmap = domalloc((dd->dd_totsectors + 7) / 8);
+	memset(dd->dd_ovmap, 0, (dd->dd_totsectors + 7) / 8);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Operations
@@ -868,14 +992,35 @@ disk_work(struct disk_data *dd)
 		return;
 	}
 
-	if (dd->dd_sect >= dd->dd_totsectors) {
+	if (dd->dd_sect >= dd->dd_totsectors ||
+	    ((dd->dd_stat & DISKBIT_ISDISCARD) &&
+	     dd->dd_count > dd->dd_totsectors - dd->dd_sect)) {
 		HWTRACE(DOTRACE_DISK, "disk: slot %d: Invalid sector", 
 			dd->dd_slot);
+		disk_logio(dd, DISKLOG_INVSECT);
 		INVSECT(dd->dd_stat);
 		dd->dd_worktries = 0;
 		return;
 	}
 
+	if (dd->dd_stat & DISKBIT_ISDISCARD) {
+		/*
+		 * Discard only touches the mapping tables, not the
+		 * platters, so there's no seek or rotational delay.
+		 */
+		if (dd->dd_iostatus < 1) {
+			dd->dd_timedop = 1;
+			schedule_event(DISCARD_TIME, dd, 1, disk_waitdone,
+				       "disk discard");
+			return;
+		}
+		HWTRACE(DOTRACE_DISK, "disk: slot %d: discard sectors %u-%u",
+			dd->dd_slot, dd->dd_sect,
+			dd->dd_sect + dd->dd_count - 1);
+		err = disk_discardsectors(dd);
+		goto done;
+	}
+
 	dd->dd_worktries++;
 	if (dd->dd_worktries > MAX_WORKTRIES) {
 		msg("Geometry modeling fault! Please report to maintainer.");
@@ -899,7 +1044,9 @@ disk_work(struct disk_data *dd)
 		goto forceio;
 	}
 
-	locate_sector(dd, dd->dd_sect, &cyl, &rotoffset);
+	if (diskmodel_locate(&dd->dd_model, dd->dd_sect, &cyl, &rotoffset)) {
+		smoke("Cannot locate sector %u\n", dd->dd_sect);
+	}
 
 	if (dd->dd_current_track != cyl) {
 		/*
@@ -913,7 +1060,8 @@ disk_work(struct disk_data *dd)
 			distance = -distance;
 		}
 		
-		nsecs = disk_seektime(dd, distance);
+		nsecs = diskmodel_seektime(&dd->dd_model, distance);
+		dd->dd_opseek += cyl - dd->dd_current_track;
 
 		HWTRACE(DOTRACE_DISK,
 			"disk: slot %d: seeking to track %d: %u ns",
@@ -934,15 +1082,25 @@ disk_work(struct disk_data *dd)
 	}
 	
 	if (dd->dd_iostatus < 2) {
+		uint32_t nowsecs, nownsecs;
+
+		clock_time(&nowsecs, &nownsecs);
 		if (dd->dd_stat & DISKBIT_ISWRITE) {
-			rotdelay = disk_writerotdelay(dd, cyl, rotoffset);
+			rotdelay = diskmodel_writerotdelay(&dd->dd_model,
+							   cyl, rotoffset,
+							   nowsecs, nownsecs);
 		}
 		else {
-			rotdelay = disk_readrotdelay(dd, cyl, rotoffset);
+			rotdelay = diskmodel_readrotdelay(&dd->dd_model,
+						cyl, rotoffset,
+						dd->dd_trackarrival_secs,
+						dd->dd_trackarrival_nsecs,
+						nowsecs, nownsecs);
 		}
 		if (rotdelay > 0) {
 			HWTRACE(DOTRACE_DISK, "disk: slot %d: rotdelay %u ns", 
 				dd->dd_slot, rotdelay);
+			dd->dd_oprotwait += rotdelay;
 			dd->dd_timedop = 1;
 			schedule_event(rotdelay, dd, 2, disk_waitdone,
 				       "disk rotation");
@@ -980,13 +1138,16 @@ disk_work(struct disk_data *dd)
 		err = disk_readsector(dd);
 	}
 
+ done:
 	if (err) {
 		HWTRACE(DOTRACE_DISK, "disk: slot %d: media error", 
 			dd->dd_slot);
+		disk_logio(dd, DISKLOG_MEDIAERR);
 		MEDIAERR(dd->dd_stat);
 		dd->dd_worktries = 0;
 	}
 	else {
+		disk_logio(dd, 0);
 		COMPLETE(dd->dd_stat);
 		dd->dd_worktries = 0;
 	}
@@ -1023,6 +1184,7 @@ disk_setstatus(struct disk_data *dd, uint32_t val)
 		HWTRACE(DOTRACE_DISK, "disk: slot %d: read starts",
 			dd->dd_slot);
 		dd->dd_iostatus = 0;
+		disk_startlog(dd);
 		break;
 	    case DISKSTAT_WRITING:
 		HWTRACE(DOTRACE_DISK, "disk: slot %d: write starts", 
@@ -1031,6 +1193,16 @@ disk_setstatus(struct disk_data *dd, uint32_t val)
 			doom_tick();
 		}
 		dd->dd_iostatus = 0;
+		disk_startlog(dd);
+		break;
+	    case DISKSTAT_DISCARDING:
+		HWTRACE(DOTRACE_DISK, "disk: slot %d: discard starts",
+			dd->dd_slot);
+		if (dd->dd_usedoom) {
+			doom_tick();
+		}
+		dd->dd_iostatus = 0;
+		disk_startlog(dd);
 		break;
 	    default:
 		hang("disk: Invalid write %u to status register", val);
@@ -1047,22 +1219,16 @@ int
 disk_fetch(unsigned cpunum, void *data, uint32_t offset, uint32_t *ret)
 {
 	struct disk_data *dd = data;
-	uint32_t *ptr;
 
 	(void)cpunum;
 
-	if (offset >= DISK_BUF_START && offset < DISK_BUF_END) {
-		offset -= DISK_BUF_START;
-		ptr = (uint32_t *)(dd->dd_buf + offset);
-		*ret = ctoh32(*ptr);
-		return 0;
-	}
-
 	switch (offset) {
 	    case DISKREG_NSECT: *ret = dd->dd_totsectors; return 0;
-	    case DISKREG_RPM: *ret = dd->dd_rpm; return 0;
+	    case DISKREG_RPM: *ret = dd->dd_model.dm_rpm; return 0;
 	    case DISKREG_STAT: *ret = dd->dd_stat; return 0;
 	    case DISKREG_SECT: *ret = dd->dd_sect; return 0;
+	    case DISKREG_SSIZE: *ret = dd->dd_sectsize; return 0;
+	    case DISKREG_COUNT: *ret = dd->dd_count; return 0;
 	}
 	return -1;
 }
@@ -1072,25 +1238,33 @@ int
 disk_store(unsigned cpunum, void *data, uint32_t offset, uint32_t val)
 {
 	struct disk_data *dd = data;
-	uint32_t *ptr;
 
 	(void)cpunum;
 
-	if (offset >= DISK_BUF_START && offset < DISK_BUF_END) {
-		offset -= DISK_BUF_START;
-		ptr = (uint32_t *)(dd->dd_buf + offset);
-		*ptr = htoc32(val);
-		return 0;
-	}
-
 	switch (offset) {
 	    case DISKREG_STAT: disk_setstatus(dd, val); return 0;
 	    case DISKREG_SECT: dd->dd_sect = val; return 0;
+	    case DISKREG_COUNT: dd->dd_count = val; return 0;
 	}
 
 	return -1;
 }
 
+/*
+ * The sector buffer is accessed directly by the bus.
+ */
+static
+int
+disk_windows(void *data, struct lamebus_window *windows)
+{
+	struct disk_data *dd = data;
+
+	windows[0].lw_offset = DISK_BUF_START;
+	windows[0].lw_size = dd->dd_sectsize;
+	windows[0].lw_mem = dd->dd_buf;
+	return 1;
+}
+
 static
 void
 disk_dumpstate(void *data)
@@ -1100,9 +1274,11 @@ disk_dumpstate(void *data)
 	msg("System/161 disk rev %d", DISK_REVISION);
 	msg("    Paranoid flag: %s", dd->dd_paranoid ? "ON" : "off");
 	msg("    Tracks: %lu  Total sectors: %lu  RPM: %lu",
-	    (unsigned long) dd->dd_tracks,
+	    (unsigned long) dd->dd_model.dm_tracks,
 	    (unsigned long) dd->dd_totsectors,
-	    (unsigned long) dd->dd_rpm);
+	    (unsigned long) dd->dd_model.dm_rpm);
+	msg("    Sector size: %lu", (unsigned long) dd->dd_sectsize);
+	msg("    I/O log: %s", dd->dd_log ? "on" : "off");
 	msg("    Current track: %d  [arrived: %lu.%09lu]",
 	    dd->dd_current_track,
 	    (unsigned long) dd->dd_trackarrival_secs,
@@ -1111,12 +1287,72 @@ disk_dumpstate(void *data)
 	    dd->dd_worktries,
 	    dd->dd_iostatus,
 	    dd->dd_timedop ? "event in progress" : "idle");
-	msg("    Registers: status 0x%08lx  sector 0x%08lx", 
+	msg("    Registers: status 0x%08lx  sector 0x%08lx  count 0x%08lx",
 	    (unsigned long) dd->dd_stat,
-	    (unsigned long) dd->dd_sect);
+	    (unsigned long) dd->dd_sect,
+	    (unsigned long) dd->dd_count);
 
 	msg("    Transfer buffer:");
-	dohexdump(dd->dd_buf, SECTSIZE);
+	dohexdump(dd->dd_buf, dd->dd_sectsize);
+}
+
+/*
+ * The image contents are not saved; restoring a snapshot is only
+ * sensible with the disk as it was when the snapshot was taken.
+ */
+static
+void
+disk_save(void *data)
+{
+	struct disk_data *dd = data;
+
+	snap_write32(dd->dd_sectsize);
+	snap_write32(dd->dd_totsectors);
+
+	snap_write32(dd->dd_current_track);
+	snap_write32(dd->dd_trackarrival_secs);
+	snap_write32(dd->dd_trackarrival_nsecs);
+	snap_write32(dd->dd_iostatus);
+	snap_write32(dd->dd_timedop);
+	snap_write32(dd->dd_worktries);
+	snap_write32(dd->dd_issuesecs);
+	snap_write32(dd->dd_issuensecs);
+	snap_write32(dd->dd_opseek);
+	snap_write32(dd->dd_oprotwait);
+
+	snap_write32(dd->dd_stat);
+	snap_write32(dd->dd_sect);
+	snap_write32(dd->dd_count);
+	snap_write(dd->dd_buf, dd->dd_sectsize);
+}
+
+static
+void
+disk_restore(void *data)
+{
+	struct disk_data *dd = data;
+
+	if (snap_read32() != dd->dd_sectsize ||
+	    snap_read32() != dd->dd_totsectors) {
+		snap_error("Snapshot has a different size disk in slot %d",
+			   dd->dd_slot);
+	}
+
+	dd->dd_current_track = snap_read32();
+	dd->dd_trackarrival_secs = snap_read32();
+	dd->dd_trackarrival_nsecs = snap_read32();
+	dd->dd_iostatus = snap_read32();
+	dd->dd_timedop = snap_read32();
+	dd->dd_worktries = snap_read32();
+	dd->dd_issuesecs = snap_read32();
+	dd->dd_issuensecs = snap_read32();
+	dd->dd_opseek = snap_read32();
+	dd->dd_oprotwait = snap_read32();
+
+	dd->dd_stat = snap_read32();
+	dd->dd_sect = snap_read32();
+	dd->dd_count = snap_read32();
+	snap_read(dd->dd_buf, dd->dd_sectsize);
 }
 
 const struct lamebus_device_info disk_device_info = {
@@ -1128,4 +1364,9 @@ const struct lamebus_device_info disk_device_info = {
 	disk_store,
 	disk_dumpstate,
 	disk_cleanup,
+	disk_save,
+	disk_restore,
+	disk_forked,
+	NULL,
+	disk_windows,
 };
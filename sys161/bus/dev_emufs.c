@@ -63,6 +63,20 @@
  *           RRES: result code
  *           IOB:  contains data (one filename)
  *
+ *   READDIRS
+ *           RFH:  handle
+ *           ROFF: file position to read at
+ *           RLEN: maximum length to read
+ *           ROP:  12
+ *
+ *           As many filenames as fit are read from a directory,
+ *           each followed by a null byte. (Revision 2 and up.)
+ *
+ *           ROFF: updated (by the number of names)
+ *           RLEN: length of read performed; 0 at end of directory
+ *           RRES: result code
+ *           IOB:  contains data
+ *
  *   WRITE
  *           RFH:  handle
  *           ROFF: file position to write at
@@ -93,10 +107,62 @@
  *           The file is truncated to the requested length.
  *
  *           RRES: result code
+ *
+ *   DMAREAD/DMAWRITE
+ *           RFH:  handle
+ *           ROFF: file position to read/write at
+ *           RLEN: length to read/write
+ *           RPA:  physical address of memory to read into/write from
+ *           ROP:  10/11 respectively
+ *
+ *           As for READ and WRITE, but the data goes directly to or
+ *           from main memory instead of IOB, so there is no limit on
+ *           the length other than the size of memory.
+ *
+ *           ROFF: updated
+ *           RLEN: length of read/write performed
+ *           RRES: result code
+ *
+ * Revision 2 adds a command ring, so the guest can have many
+ * operations outstanding at once. The ring has 64 descriptors of 32
+ * bytes each, mapped at offset 16384. A descriptor is:
+ *    4 bytes: operation code (as for ROP)
+ *    4 bytes: handle         (as for RFH)
+ *    4 bytes: seek address   (as for ROFF)
+ *    4 bytes: length         (as for RLEN)
+ *    4 bytes: offset into IOB of this operation's buffer area
+ *             (for DMAREAD/DMAWRITE, the physical address instead)
+ *    4 bytes: result code    (as for RRES)
+ *    8 bytes: reserved
+ * and three more registers control it:
+ *    4 bytes: RSUB  number of descriptors submitted (free-running)
+ *    4 bytes: RDONE number of descriptors completed (read-only)
+ *    4 bytes: RACK  number of completions seen by the guest
+ * followed by the DMA register, also new in revision 2:
+ *    4 bytes: RPA   physical address for DMAREAD/DMAWRITE
+ *
+ * To queue operations, fill in descriptors RSUB, RSUB+1, ... (mod 64)
+ * and then write the new count to RSUB. They complete strictly in
+ * order; as each one completes its handle, seek address, length, and
+ * result fields are updated as for the registers, and RDONE is
+ * incremented. The interrupt is asserted while RDONE differs from
+ * RACK. No more than 64 descriptors may be outstanding.
+ *
+ * The input in the buffer area or memory (pathnames and write data)
+ * is taken when the descriptor is submitted, and the output (read and
+ * readdir data) is stored when it completes. Register operations and ring
+ * operations may not be in progress at the same time.
+ *
+ * Reads, writes (including DMA), getsize, and truncate are done by a
+ * separate host thread so they don't stall the simulation; the others
+ * are done when they complete. Ring operations take much less time
+ * than register operations, in proportion to the amount of data
+ * moved.
  */
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -105,29 +171,69 @@
 #include <dirent.h>
 #include "config.h"
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+#ifdef HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
+
 #include "util.h"
 #include "bswap.h"
 #include "console.h"
 #include "speed.h"
 #include "clock.h"
 #include "main.h"
+#include "cpu.h"
+#include "memdefs.h"
+#include "snapshot.h"
 
 #include "lamebus.h"
 #include "busids.h"
 
 
-#define MAXHANDLES     64
+#define DEFAULT_MAXHANDLES 64
+#define MAX_MAXHANDLES     65536
 #define EMU_ROOTHANDLE  0
 
+#define EMU_DCACHE_BUCKETS 256
+#define EMU_DCACHE_SIZE    1024
+
+#define EMU_DCACHE_OFF     0
+#define EMU_DCACHE_ON      1
+#define EMU_DCACHE_INOTIFY 2
+
 #define EMU_BUF_START  32768
 #define EMU_BUF_SIZE   16384
 #define EMU_BUF_END    (EMU_BUF_START + EMU_BUF_SIZE)
 
+/* Largest single DMA transfer; it goes through a host buffer */
+#define EMU_DMA_MAX    (1024*1024)
+
+#define EMU_RING_START   16384
+#define EMU_RING_ENTRIES 64
+#define EMU_RING_ENTSIZE 32
+#define EMU_RING_END     (EMU_RING_START + EMU_RING_ENTRIES*EMU_RING_ENTSIZE)
+
 #define EMUREG_HANDLE  0
 #define EMUREG_OFFSET  4
 #define EMUREG_IOLEN   8
 #define EMUREG_OPER    12
 #define EMUREG_RESULT  16
+#define EMUREG_RINGSUB  20
+#define EMUREG_RINGDONE 24
+#define EMUREG_RINGACK  28
+#define EMUREG_PADDR    32
+
+/* Ring descriptor fields */
+#define EMUDESC_OPER    0
+#define EMUDESC_HANDLE  4
+#define EMUDESC_OFFSET  8
+#define EMUDESC_IOLEN   12
+#define EMUDESC_BUFOFF  16
+#define EMUDESC_RESULT  20
 
 #define EMU_OP_OPEN          1
 #define EMU_OP_CREATE        2
@@ -138,6 +244,9 @@
 #define EMU_OP_WRITE         7
 #define EMU_OP_GETSIZE       8
 #define EMU_OP_TRUNC         9
+#define EMU_OP_DMAREAD       10
+#define EMU_OP_DMAWRITE      11
+#define EMU_OP_READDIRS      12
 
 #define EMU_RES_SUCCESS      1
 #define EMU_RES_BADHANDLE    2
@@ -157,6 +266,48 @@ struct emufs_handleinfo {
 	int eh_fd;
 	dev_t eh_dev;
 	ino_t eh_ino;
+	DIR *eh_dir;		/* directory stream, if reading a dir */
+	uint32_t eh_dirpos;	/* number of entries read from eh_dir */
+	int eh_next;		/* next in hash chain or free list */
+};
+
+/*
+ * Lookup cache entry: looking up de_path from directory
+ * de_dirdev/de_dirino finds de_dev/de_ino, or nothing.
+ */
+struct emufs_dentry {
+	struct emufs_dentry *de_next;
+	dev_t de_dirdev;
+	ino_t de_dirino;
+	char *de_path;
+	int de_exists;
+	dev_t de_dev;
+	ino_t de_ino;
+	int de_isdir;
+};
+
+/*
+ * The arguments and results of one operation. For register
+ * operations these are the registers and the IOB; for ring
+ * operations they come from the descriptor and a private copy of
+ * its buffer area.
+ */
+struct emufs_req {
+	uint32_t er_handle;
+	uint32_t er_offset;
+	uint32_t er_iolen;
+	char *er_buf;
+	uint32_t er_bufsize;
+	int er_err;			/* errno, for tracing */
+};
+
+struct emufs_ringent {
+	uint32_t re_op;
+	uint32_t re_bufoff;		/* in ed_buf, or for DMA in RAM */
+	uint32_t re_result;		/* nonzero when decided */
+	uint64_t re_nsecs;		/* time to complete */
+	int re_onworker;		/* host I/O done by the worker */
+	struct emufs_req re_req;
 };
 
 struct emufs_data {
@@ -167,16 +318,50 @@ struct emufs_data {
 	uint32_t ed_handle;		/* file handle register */
 	uint32_t ed_offset;		/* offset register */
 	uint32_t ed_iolen;		/* iolen register */
+	uint32_t ed_paddr;		/* DMA address register */
 	uint32_t ed_result;		/* result register */
 
 	/* Handles from ed_handle are indexes into here */
-	struct emufs_handleinfo ed_handles[MAXHANDLES];
+	struct emufs_handleinfo *ed_handles;
+	unsigned ed_maxhandles;
+	int *ed_buckets;		/* open handles by dev/ino */
+	unsigned ed_nbuckets;		/* power of two */
+	int ed_freehandles;		/* head of free list */
+
+	/* Lookup cache */
+	int ed_dcachemode;		/* EMU_DCACHE_* */
+	struct emufs_dentry *ed_dcache[EMU_DCACHE_BUCKETS];
+	unsigned ed_dcachecount;
+	int ed_inotifyfd;
 
 	/* Timing stuff */
 	int ed_busy;			/* true if operation in progress */
 	uint32_t ed_busyresult;		/* result for ed_result when done */
+
+	/* Command ring */
+	char *ed_ringmem;		/* descriptors, as the guest sees them */
+	struct emufs_ringent ed_ring[EMU_RING_ENTRIES];
+	uint32_t ed_ringsub;		/* submitted (RSUB) */
+	uint32_t ed_ringdone;		/* completed (RDONE) */
+	uint32_t ed_ringack;		/* acknowledged (RACK) */
+	uint32_t ed_ringhostdone;	/* host I/O finished */
+	int ed_ringtimed;		/* completion event scheduled */
+
+#ifdef HAVE_PTHREAD
+	/*
+	 * The worker thread does the host I/O for ring entries
+	 * ed_ringhostdone up to ed_ringsub, in order, stopping at any
+	 * that are done by the simulation thread. The lock covers
+	 * ed_ringsub, ed_ringhostdone, and ed_workerexit.
+	 */
+	pthread_t ed_worker;
+	pthread_mutex_t ed_ringlock;
+	pthread_cond_t ed_ringcv;
+	int ed_workerexit;
+#endif
 };
 
+#ifndef HAVE_OPENAT
 static
 int
 pushdir(int fd, int h)
@@ -205,14 +390,14 @@ popdir(int oldfd)
 	}
 	close(oldfd);
 }
+#endif /* !HAVE_OPENAT */
 
 
 static
 void
-emufs_setresult(struct emufs_data *ed, uint32_t result)
+emufs_updateirq(struct emufs_data *ed)
 {
-	ed->ed_result = result;
-	if (ed->ed_result>0) {
+	if (ed->ed_result>0 || ed->ed_ringack != ed->ed_ringdone) {
 		raise_irq(ed->ed_slot);
 	}
 	else {
@@ -220,6 +405,14 @@ emufs_setresult(struct emufs_data *ed, uint32_t result)
 	}
 }
 
+static
+void
+emufs_setresult(struct emufs_data *ed, uint32_t result)
+{
+	ed->ed_result = result;
+	emufs_updateirq(ed);
+}
+
 static
 uint32_t
 errno_to_code(int err)
@@ -238,34 +431,335 @@ errno_to_code(int err)
 	return EMU_RES_UNKNOWN;
 }
 
-/*
- * Find an existing handle for this file (if any); otherwise allocate
- * a new one. XXX: this table should really use some kind of lookup
- * scheme and not linear search, although since MAXHANDLES is
- * currently only 64 it doesn't matter that much.
- */
+////////////////////////////////////////////////////////////
+//
+// Handle table
+//
+// Open handles are hashed by dev/ino so opening a file that's
+// already open finds its handle directly. Free handles are kept on a
+// list threaded through eh_next.
+
+static
+unsigned
+emufs_handlehash(struct emufs_data *ed, dev_t dev, ino_t ino)
+{
+	uint32_t h;
+
+	h = (uint32_t)ino * 2654435761U;
+	h ^= (uint32_t)(((uint64_t)ino) >> 32);
+	h ^= (uint32_t)dev * 40503U;
+	return h & (ed->ed_nbuckets - 1);
+}
+
 static
 int
-pickhandle(struct emufs_data *ed, dev_t dev, ino_t ino)
+emufs_findhandle(struct emufs_data *ed, dev_t dev, ino_t ino)
 {
-	int i;
-	int empty = -1;
+	int h;
+
+	h = ed->ed_buckets[emufs_handlehash(ed, dev, ino)];
+	while (h >= 0) {
+		if (ed->ed_handles[h].eh_dev == dev &&
+		    ed->ed_handles[h].eh_ino == ino) {
+			return h;
+		}
+		h = ed->ed_handles[h].eh_next;
+	}
+	return -1;
+}
+
+static
+int
+emufs_newhandle(struct emufs_data *ed, dev_t dev, ino_t ino, int fd)
+{
+	struct emufs_handleinfo *eh;
+	unsigned b;
+	int h;
+
+	h = ed->ed_freehandles;
+	if (h < 0) {
+		return -1;
+	}
+	eh = &ed->ed_handles[h];
+	ed->ed_freehandles = eh->eh_next;
+
+	eh->eh_fd = fd;
+	eh->eh_dev = dev;
+	eh->eh_ino = ino;
+	eh->eh_dir = NULL;
+	eh->eh_dirpos = 0;
+
+	b = emufs_handlehash(ed, dev, ino);
+	eh->eh_next = ed->ed_buckets[b];
+	ed->ed_buckets[b] = h;
+	return h;
+}
+
+static
+void
+emufs_freehandle(struct emufs_data *ed, int h)
+{
+	struct emufs_handleinfo *eh = &ed->ed_handles[h];
+	int *pp;
+
+	pp = &ed->ed_buckets[emufs_handlehash(ed, eh->eh_dev, eh->eh_ino)];
+	while (*pp != h) {
+		Assert(*pp >= 0);
+		pp = &ed->ed_handles[*pp].eh_next;
+	}
+	*pp = eh->eh_next;
+
+	if (eh->eh_dir != NULL) {
+		closedir(eh->eh_dir);
+		eh->eh_dir = NULL;
+	}
+	close(eh->eh_fd);
+	eh->eh_fd = -1;
 
-	for (i=0; i<MAXHANDLES; i++) {
-		if (ed->ed_handles[i].eh_fd < 0) {
-			/* remember first unused handle */
-			if (empty < 0) {
-				empty = i;
+	eh->eh_next = ed->ed_freehandles;
+	ed->ed_freehandles = h;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Lookup cache
+//
+// If enabled, the results of looking up pathnames are remembered,
+// both for names that exist and names that don't, keyed by the
+// directory the lookup started from. Opening a cached name that's
+// already open then takes no host system calls at all, and neither
+// does failing to open a cached missing name. By default this assumes
+// nothing else changes the host directory tree while we run; with
+// inotify, changes to any directory involved in a cached lookup throw
+// the cache away.
+//
+// Creating files through emufs throws away the cached missing names,
+// since we can't easily tell which ones the new file matches.
+
+static
+unsigned
+emufs_dcachehash(dev_t dirdev, ino_t dirino, const char *path)
+{
+	uint32_t h;
+
+	h = (uint32_t)dirino * 2654435761U ^ (uint32_t)dirdev;
+	while (*path) {
+		h = h*33 + (unsigned char)*path++;
+	}
+	return h % EMU_DCACHE_BUCKETS;
+}
+
+static
+void
+emufs_dcache_freeentry(struct emufs_dentry *de)
+{
+	free(de->de_path);
+	free(de);
+}
+
+static
+void
+emufs_dcache_flush(struct emufs_data *ed, int negonly)
+{
+	struct emufs_dentry *de, **pp;
+	unsigned i;
+
+	for (i=0; i<EMU_DCACHE_BUCKETS; i++) {
+		pp = &ed->ed_dcache[i];
+		while (*pp != NULL) {
+			de = *pp;
+			if (negonly && de->de_exists) {
+				pp = &de->de_next;
+				continue;
 			}
+			*pp = de->de_next;
+			emufs_dcache_freeentry(de);
+			ed->ed_dcachecount--;
+		}
+	}
+}
+
+#ifdef HAVE_INOTIFY
+static
+void
+emufs_dcache_newinotify(struct emufs_data *ed)
+{
+	if (ed->ed_inotifyfd >= 0) {
+		/* closing it drops all the watches */
+		close(ed->ed_inotifyfd);
+	}
+	ed->ed_inotifyfd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (ed->ed_inotifyfd < 0) {
+		msg("emufs: slot %d: inotify_init: %s", ed->ed_slot,
+		    strerror(errno));
+		die();
+	}
+}
+
+/*
+ * Watch the directories a lookup of path from dirh goes through.
+ */
+static
+void
+emufs_dcache_watch(struct emufs_data *ed, int dirh, const char *path)
+{
+	char buf[EMU_BUF_SIZE + 64];
+	const char *s;
+	size_t len;
+	uint32_t mask;
+
+	mask = IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_ATTRIB|
+		IN_DELETE_SELF|IN_MOVE_SELF;
+	len = snprintf(buf, sizeof(buf), "/proc/self/fd/%d",
+		       ed->ed_handles[dirh].eh_fd);
+	s = path;
+	while (1) {
+		if (inotify_add_watch(ed->ed_inotifyfd, buf, mask) < 0) {
+			/* can't watch it; can't cache it */
+			emufs_dcache_flush(ed, 0);
+			return;
+		}
+		s = strchr(s, '/');
+		if (s == NULL) {
+			break;
 		}
-		else if (ed->ed_handles[i].eh_dev == dev && 
-			 ed->ed_handles[i].eh_ino == ino) {
-			return i;
+		snprintf(buf + len, sizeof(buf) - len, "/%.*s",
+			 (int)(s - path), path);
+		s++;
+	}
+}
+
+/*
+ * If anything changed, drop everything.
+ */
+static
+void
+emufs_dcache_check(struct emufs_data *ed)
+{
+	char buf[4096];
+	ssize_t r;
+	int changed = 0;
+
+	while ((r = read(ed->ed_inotifyfd, buf, sizeof(buf))) > 0) {
+		changed = 1;
+	}
+	if (changed) {
+		HWTRACE(DOTRACE_EMUFS, "emufs: slot %d: host files changed; "
+			"flushing lookup cache", ed->ed_slot);
+		emufs_dcache_flush(ed, 0);
+		emufs_dcache_newinotify(ed);
+	}
+}
+#endif /* HAVE_INOTIFY */
+
+static
+struct emufs_dentry *
+emufs_dcache_lookup(struct emufs_data *ed, int dirh, const char *path)
+{
+	struct emufs_handleinfo *eh = &ed->ed_handles[dirh];
+	struct emufs_dentry *de;
+
+#ifdef HAVE_INOTIFY
+	if (ed->ed_dcachemode == EMU_DCACHE_INOTIFY) {
+		emufs_dcache_check(ed);
+	}
+#endif
+
+	de = ed->ed_dcache[emufs_dcachehash(eh->eh_dev, eh->eh_ino, path)];
+	while (de != NULL) {
+		if (de->de_dirdev == eh->eh_dev &&
+		    de->de_dirino == eh->eh_ino &&
+		    !strcmp(de->de_path, path)) {
+			return de;
 		}
+		de = de->de_next;
+	}
+	return NULL;
+}
+
+static
+void
+emufs_dcache_enter(struct emufs_data *ed, int dirh, const char *path,
+		   int exists, dev_t dev, ino_t ino, int isdir)
+{
+	struct emufs_handleinfo *eh = &ed->ed_handles[dirh];
+	struct emufs_dentry *de;
+	unsigned b;
+
+	if (emufs_dcache_lookup(ed, dirh, path) != NULL) {
+		return;
+	}
+	if (ed->ed_dcachecount >= EMU_DCACHE_SIZE) {
+		/* Crude, but lookups are cheap to redo. */
+		emufs_dcache_flush(ed, 0);
+	}
+
+	de = domalloc(sizeof(*de));
+	de->de_dirdev = eh->eh_dev;
+	de->de_dirino = eh->eh_ino;
+	de->de_path = domalloc(strlen(path) + 1);
+	strcpy(de->de_path, path);
+	de->de_exists = exists;
+	de->de_dev = dev;
+	de->de_ino = ino;
+	de->de_isdir = isdir;
+
+	b = emufs_dcachehash(eh->eh_dev, eh->eh_ino, path);
+	de->de_next = ed->ed_dcache[b];
+	ed->ed_dcache[b] = de;
+	ed->ed_dcachecount++;
+
+#ifdef HAVE_INOTIFY
+	if (ed->ed_dcachemode == EMU_DCACHE_INOTIFY) {
+		emufs_dcache_watch(ed, dirh, path);
 	}
-	ed->ed_handles[empty].eh_dev = dev;
-	ed->ed_handles[empty].eh_ino = ino;
-	return empty;
+#endif
+}
+
+////////////////////////////////////////////////////////////
+//
+// Opening files
+
+/*
+ * Look up and open a path relative to a handle. These use the *at
+ * system calls if possible so they don't disturb the current
+ * directory; otherwise they have to chdir back and forth.
+ */
+static
+int
+emufs_statat(struct emufs_data *ed, int dirh, const char *path,
+	     struct stat *sbuf)
+{
+#ifdef HAVE_OPENAT
+	return fstatat(ed->ed_handles[dirh].eh_fd, path, sbuf, 0);
+#else
+	int curdir, result, err;
+
+	curdir = pushdir(ed->ed_handles[dirh].eh_fd, dirh);
+	result = stat(path, sbuf);
+	err = errno;
+	popdir(curdir);
+	errno = err;
+	return result;
+#endif
+}
+
+static
+int
+emufs_openat(struct emufs_data *ed, int dirh, const char *path, int flags)
+{
+#ifdef HAVE_OPENAT
+	return openat(ed->ed_handles[dirh].eh_fd, path, flags, 0664);
+#else
+	int curdir, result, err;
+
+	curdir = pushdir(ed->ed_handles[dirh].eh_fd, dirh);
+	result = open(path, flags, 0664);
+	err = errno;
+	popdir(curdir);
+	errno = err;
+	return result;
+#endif
 }
 
 static
@@ -273,9 +767,7 @@ void
 emufs_openfirst(struct emufs_data *ed, const char *dir)
 {
 	struct stat sbuf;
-	int fd;
-
-	Assert(ed->ed_handles[EMU_ROOTHANDLE].eh_fd < 0);
+	int fd, h;
 
 	fd = open(dir, O_RDONLY);
 	if (fd<0) {
@@ -289,21 +781,20 @@ emufs_openfirst(struct emufs_data *ed, const char *dir)
 		die();
 	}
 
-	ed->ed_handles[EMU_ROOTHANDLE].eh_fd = fd;
-	ed->ed_handles[EMU_ROOTHANDLE].eh_dev = sbuf.st_dev;
-	ed->ed_handles[EMU_ROOTHANDLE].eh_ino = sbuf.st_ino;
+	h = emufs_newhandle(ed, sbuf.st_dev, sbuf.st_ino, fd);
+	Assert(h == EMU_ROOTHANDLE);
 
 	g_stats.s_memu++;
 }
 
 static
 unsigned
-emufs_open_and_stat(struct emufs_data *ed, int flags, struct stat *sbuf,
-		    int *fd_ret)
+emufs_open_and_stat(struct emufs_data *ed, struct emufs_req *er,
+		    int flags, struct stat *sbuf, int *fd_ret)
 {
 	int fd, err;
 
-	fd = open(ed->ed_buf, flags, 0664);
+	fd = emufs_openat(ed, er->er_handle, er->er_buf, flags);
 	if (fd < 0) {
 		err = errno;
 		HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
@@ -322,24 +813,18 @@ emufs_open_and_stat(struct emufs_data *ed, int flags, struct stat *sbuf,
 
 static
 unsigned
-emufs_open_create(struct emufs_data *ed, int flags, int *handle_ret)
+emufs_open_create(struct emufs_data *ed, struct emufs_req *er, int flags,
+		  int *handle_ret)
 {
 	struct stat sbuf;
 	unsigned status;
 	int handle, fd = -1;
 
-	status = emufs_open_and_stat(ed, flags, &sbuf, &fd);
+	status = emufs_open_and_stat(ed, er, flags, &sbuf, &fd);
 	if (status != EMU_RES_SUCCESS) {
 		return status;
 	}
 
-	handle = pickhandle(ed, sbuf.st_dev, sbuf.st_ino);
-	if (handle < 0) {
-		close(fd);
-		HWTRACE(DOTRACE_EMUFS, "out of handles");
-		return EMU_RES_NOHANDLES;
-	}
-
 	/*
 	 * If we created a new file and got back a file we already
 	 * have open, it means someone renamed the file under us
@@ -352,11 +837,17 @@ emufs_open_create(struct emufs_data *ed, int flags, int *handle_ret)
 	 * so if this happens just reuse the existing handle for the
 	 * file and close the new fd.
 	 */
-	if (ed->ed_handles[handle].eh_fd >= 0) {
+	handle = emufs_findhandle(ed, sbuf.st_dev, sbuf.st_ino);
+	if (handle >= 0) {
 		close(fd);
 	}
 	else {
-		ed->ed_handles[handle].eh_fd = fd;
+		handle = emufs_newhandle(ed, sbuf.st_dev, sbuf.st_ino, fd);
+		if (handle < 0) {
+			close(fd);
+			HWTRACE(DOTRACE_EMUFS, "out of handles");
+			return EMU_RES_NOHANDLES;
+		}
 	}
 	*handle_ret = handle;
 	return EMU_RES_SUCCESS;
@@ -364,7 +855,7 @@ emufs_open_create(struct emufs_data *ed, int flags, int *handle_ret)
 
 static
 unsigned
-emufs_open_existing(struct emufs_data *ed, int flags,
+emufs_open_existing(struct emufs_data *ed, struct emufs_req *er, int flags,
 		    dev_t expected_dev, ino_t expected_ino,
 		    int *handle_ret)
 {
@@ -375,21 +866,19 @@ emufs_open_existing(struct emufs_data *ed, int flags,
 	while (1) {
 		/*
 		 * We might already have this file open, so look for
-		 * it first.
+		 * it first. If so, just return it.
 		 */
-		handle = pickhandle(ed, expected_dev, expected_ino);
-		if (handle < 0) {
-			HWTRACE(DOTRACE_EMUFS, "out of handles");
-			return EMU_RES_NOHANDLES;
-		}
-
-		/* If so, just return it. */
-		if (ed->ed_handles[handle].eh_fd >= 0) {
+		handle = emufs_findhandle(ed, expected_dev, expected_ino);
+		if (handle >= 0) {
 			*handle_ret = handle;
 			return EMU_RES_SUCCESS;
 		}
+		if (ed->ed_freehandles < 0) {
+			HWTRACE(DOTRACE_EMUFS, "out of handles");
+			return EMU_RES_NOHANDLES;
+		}
 
-		status = emufs_open_and_stat(ed, flags, &sbuf, &fd);
+		status = emufs_open_and_stat(ed, er, flags, &sbuf, &fd);
 		if (status != EMU_RES_SUCCESS) {
 			return status;
 		}
@@ -417,47 +906,79 @@ emufs_open_existing(struct emufs_data *ed, int flags,
 		expected_ino = sbuf.st_ino;
 	}
 
-	ed->ed_handles[handle].eh_fd = fd;
+	handle = emufs_newhandle(ed, sbuf.st_dev, sbuf.st_ino, fd);
+	Assert(handle >= 0);
 	*handle_ret = handle;
 	return EMU_RES_SUCCESS;
 }
 
+static
+int
+emufs_badhandle(struct emufs_data *ed, struct emufs_req *er)
+{
+	return er->er_handle >= ed->ed_maxhandles ||
+		ed->ed_handles[er->er_handle].eh_fd < 0;
+}
 
 static
 uint32_t
-emufs_open(struct emufs_data *ed, int flags)
+emufs_open(struct emufs_data *ed, struct emufs_req *er, int flags)
 {
+	struct emufs_dentry *de;
 	int handle = -1;
-	int curdir;
 	struct stat sbuf;
 	unsigned status;
 	int isdir;
 
-	if (ed->ed_iolen >= EMU_BUF_SIZE) {
+	if (er->er_iolen >= er->er_bufsize) {
 		return EMU_RES_BADSIZE;
 	}
+	if (emufs_badhandle(ed, er)) {
+		return EMU_RES_BADHANDLE;
+	}
 
 	/* ensure null termination */
-	ed->ed_buf[ed->ed_iolen] = 0;
+	er->er_buf[er->er_iolen] = 0;
 
 	HWTRACEL(DOTRACE_EMUFS, "emufs: slot %d: open %s: ", ed->ed_slot,
-			       ed->ed_buf);
+			       er->er_buf);
 
-	curdir = pushdir(ed->ed_handles[ed->ed_handle].eh_fd, ed->ed_handle);
+	if (ed->ed_dcachemode != EMU_DCACHE_OFF) {
+		if (flags & O_CREAT) {
+			emufs_dcache_flush(ed, 1);
+		}
+		de = emufs_dcache_lookup(ed, er->er_handle, er->er_buf);
+		if (de != NULL && !de->de_exists && flags == 0) {
+			HWTRACE(DOTRACE_EMUFS, "%s (cached)",
+				strerror(ENOENT));
+			return errno_to_code(ENOENT);
+		}
+		if (de != NULL && de->de_exists && (flags & O_EXCL) == 0) {
+			handle = emufs_findhandle(ed, de->de_dev, de->de_ino);
+		}
+		if (handle >= 0) {
+			isdir = de->de_isdir;
+			goto done;
+		}
+	}
 
-	if (stat(ed->ed_buf, &sbuf)) {
+	if (emufs_statat(ed, er->er_handle, er->er_buf, &sbuf)) {
 		if (flags==0) {
 			/* not creating; doesn't exist -> fail */
 			int err = errno;
 			HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
-			popdir(curdir);
+			if (err == ENOENT &&
+			    ed->ed_dcachemode != EMU_DCACHE_OFF) {
+				emufs_dcache_enter(ed, er->er_handle,
+						   er->er_buf, 0, 0, 0, 0);
+			}
 			return errno_to_code(err);
 		}
 		/* creating; ok if it doesn't exist, and it's not a dir */
 		flags |= O_RDWR;
 		isdir = 0;
 
-		status = emufs_open_create(ed, flags, &handle);
+		status = emufs_open_create(ed, er, flags, &handle);
 	}
 	else {
 		isdir = S_ISDIR(sbuf.st_mode)!=0;
@@ -467,21 +988,25 @@ emufs_open(struct emufs_data *ed, int flags)
 		else {
 			flags |= O_RDWR;
 		}
-		status = emufs_open_existing(ed, flags,
+		status = emufs_open_existing(ed, er, flags,
 					     sbuf.st_dev, sbuf.st_ino,
 					     &handle);
 	}
 
 	if (status != EMU_RES_SUCCESS) {
-		popdir(curdir);
 		return status;
 	}
 	Assert(handle >= 0);
 
-	popdir(curdir);
+	if (ed->ed_dcachemode != EMU_DCACHE_OFF) {
+		emufs_dcache_enter(ed, er->er_handle, er->er_buf, 1,
+				   ed->ed_handles[handle].eh_dev,
+				   ed->ed_handles[handle].eh_ino, isdir);
+	}
 
-	ed->ed_handle = handle;
-	ed->ed_iolen = isdir;
+ done:
+	er->er_handle = handle;
+	er->er_iolen = isdir;
 
 	HWTRACE(DOTRACE_EMUFS, "succeeded, handle %d%s", handle,
 		isdir ? " (directory)" : "");
@@ -492,160 +1017,319 @@ emufs_open(struct emufs_data *ed, int flags)
 
 static
 uint32_t
-emufs_close(struct emufs_data *ed)
+emufs_close(struct emufs_data *ed, struct emufs_req *er)
 {
-	close(ed->ed_handles[ed->ed_handle].eh_fd);
-	ed->ed_handles[ed->ed_handle].eh_fd = -1;
+	emufs_freehandle(ed, er->er_handle);
 	HWTRACE(DOTRACE_EMUFS, "emufs: slot %d: close handle %d",
-		ed->ed_slot, ed->ed_handle);
+		ed->ed_slot, er->er_handle);
 	g_stats.s_memu++;
 	return EMU_RES_SUCCESS;
 }
 
+/*
+ * The host side of read, write, getsize, and truncate. These may be
+ * run on the worker thread, so they don't trace or count anything;
+ * on failure they leave errno in er_err for the caller to report.
+ * The handle must already have been checked.
+ */
+
 static
 uint32_t
-emufs_read(struct emufs_data *ed)
+emufs_doread(struct emufs_data *ed, struct emufs_req *er)
 {
 	int len;
 	int fd;
 
-	if (ed->ed_iolen > EMU_BUF_SIZE) {
-		return EMU_RES_BADSIZE;
+	fd = ed->ed_handles[er->er_handle].eh_fd;
+
+	len = pread(fd, er->er_buf, er->er_iolen, er->er_offset);
+	if (len < 0) {
+		er->er_err = errno;
+		return errno_to_code(er->er_err);
 	}
 
-	HWTRACEL(DOTRACE_EMUFS, "emufs: slot %d: read %u bytes, handle %d: ",
-		 ed->ed_slot, ed->ed_iolen, ed->ed_handle);
+	er->er_offset += len;
+	er->er_iolen = len;
+	return EMU_RES_SUCCESS;
+}
 
-	fd = ed->ed_handles[ed->ed_handle].eh_fd;
+static
+uint32_t
+emufs_dowrite(struct emufs_data *ed, struct emufs_req *er)
+{
+	int len;
+	int fd;
 
-	lseek(fd, ed->ed_offset, SEEK_SET);
-	len = read(fd, ed->ed_buf, ed->ed_iolen);
+	fd = ed->ed_handles[er->er_handle].eh_fd;
 
+	len = pwrite(fd, er->er_buf, er->er_iolen, er->er_offset);
 	if (len < 0) {
-		int err = errno;
-		HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
-		return errno_to_code(err);
+		er->er_err = errno;
+		return errno_to_code(er->er_err);
 	}
 
-	ed->ed_offset += len;
-	ed->ed_iolen = len;
+	er->er_offset += len;
+	er->er_iolen = len;
+	return EMU_RES_SUCCESS;
+}
 
-	HWTRACE(DOTRACE_EMUFS, "success");
-	g_stats.s_remu++;
+static
+uint32_t
+emufs_dogetsize(struct emufs_data *ed, struct emufs_req *er)
+{
+	struct stat sb;
+	int fd;
 
+	fd = ed->ed_handles[er->er_handle].eh_fd;
+	if (fstat(fd, &sb)) {
+		er->er_err = errno;
+		return errno_to_code(er->er_err);
+	}
+
+	er->er_iolen = sb.st_size;
 	return EMU_RES_SUCCESS;
 }
 
 static
 uint32_t
-emufs_readdir(struct emufs_data *ed)
+emufs_dotrunc(struct emufs_data *ed, struct emufs_req *er)
 {
-	struct dirent *dp;
-	DIR *d;
-
-	uint32_t ct, len;
-	int herefd, fd;
+	int fd;
 
-	if (ed->ed_iolen > EMU_BUF_SIZE) {
-		return EMU_RES_BADSIZE;
+	fd = ed->ed_handles[er->er_handle].eh_fd;
+	if (ftruncate(fd, er->er_iolen)) {
+		er->er_err = errno;
+		return errno_to_code(er->er_err);
 	}
+	return EMU_RES_SUCCESS;
+}
 
-	HWTRACEL(DOTRACE_EMUFS,
-		 "emufs: slot %d: readdir %u bytes, handle %d: ",
-		 ed->ed_slot, ed->ed_iolen, ed->ed_handle);
+static
+uint32_t
+emufs_read(struct emufs_data *ed, struct emufs_req *er)
+{
+	uint32_t res;
 
-	herefd = open(".", O_RDONLY);
-	if (herefd<0) {
-		int err = errno;
-		HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
-		return errno_to_code(err);
+	if (er->er_iolen > er->er_bufsize) {
+		return EMU_RES_BADSIZE;
 	}
 
-	fd = ed->ed_handles[ed->ed_handle].eh_fd;
+	HWTRACEL(DOTRACE_EMUFS, "emufs: slot %d: read %u bytes, handle %d: ",
+		 ed->ed_slot, er->er_iolen, er->er_handle);
 
-	if (fchdir(fd)<0) {
-		int err = errno;
-		HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
-		close(herefd);
-		return errno_to_code(err);
+	res = emufs_doread(ed, er);
+	if (res != EMU_RES_SUCCESS) {
+		HWTRACE(DOTRACE_EMUFS, "%s", strerror(er->er_err));
+		return res;
 	}
 
-	d = opendir(".");
-	if (d==NULL) {
-		int err = errno;
-		HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
-		fchdir(herefd);
-		close(herefd);
-		return errno_to_code(err);
-	}
+	HWTRACE(DOTRACE_EMUFS, "success");
+	g_stats.s_remu++;
 
-	dp = NULL;
-	for (ct = 0; ct <= ed->ed_offset; ct++) {
-		dp = readdir(d);
-		if (dp == NULL) {
-			break;
+	return EMU_RES_SUCCESS;
+}
+
+/*
+ * Get the cached directory stream for a handle, opening it if
+ * necessary, and position it at entry number pos. Reading a
+ * directory in order just continues where the last call left off;
+ * only going backwards requires starting over.
+ */
+static
+uint32_t
+emufs_getdir(struct emufs_data *ed, struct emufs_req *er, uint32_t pos,
+	     DIR **ret)
+{
+	struct emufs_handleinfo *eh = &ed->ed_handles[er->er_handle];
+	DIR *d;
+	int err;
+
+	if (eh->eh_dir != NULL && pos < eh->eh_dirpos) {
+		rewinddir(eh->eh_dir);
+		eh->eh_dirpos = 0;
+	}
+
+	if (eh->eh_dir == NULL) {
+#ifdef HAVE_FDOPENDIR
+		int fd;
+
+		/* fdopendir takes over the fd, so give it a copy */
+		fd = dup(eh->eh_fd);
+		if (fd < 0) {
+			err = errno;
+			HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
+			return errno_to_code(err);
+		}
+		d = fdopendir(fd);
+		if (d == NULL) {
+			err = errno;
+			close(fd);
+			HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
+			return errno_to_code(err);
 		}
+		/* the copy shares the seek position; start at the top */
+		rewinddir(d);
+#else
+		int herefd;
+
+		herefd = open(".", O_RDONLY);
+		if (herefd<0) {
+			err = errno;
+			HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
+			return errno_to_code(err);
+		}
+		if (fchdir(eh->eh_fd)<0) {
+			err = errno;
+			HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
+			close(herefd);
+			return errno_to_code(err);
+		}
+		d = opendir(".");
+		err = errno;
+		if (fchdir(herefd)) {
+			smoke("emufs: fchdir [back]: %s", strerror(errno));
+		}
+		close(herefd);
+		if (d==NULL) {
+			HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
+			return errno_to_code(err);
+		}
+#endif
+		eh->eh_dir = d;
+		eh->eh_dirpos = 0;
+	}
+
+	while (eh->eh_dirpos < pos) {
+		if (readdir(eh->eh_dir) == NULL) {
+			break;
+		}
+		eh->eh_dirpos++;
 	}
+
+	*ret = eh->eh_dir;
+	return EMU_RES_SUCCESS;
+}
+
+static
+uint32_t
+emufs_readdir(struct emufs_data *ed, struct emufs_req *er)
+{
+	struct emufs_handleinfo *eh = &ed->ed_handles[er->er_handle];
+	struct dirent *dp;
+	DIR *d;
+	uint32_t len, res;
+
+	if (er->er_iolen > er->er_bufsize) {
+		return EMU_RES_BADSIZE;
+	}
+
+	HWTRACEL(DOTRACE_EMUFS,
+		 "emufs: slot %d: readdir %u bytes, handle %d: ",
+		 ed->ed_slot, er->er_iolen, er->er_handle);
+
+	res = emufs_getdir(ed, er, er->er_offset, &d);
+	if (res != EMU_RES_SUCCESS) {
+		return res;
+	}
+
+	dp = eh->eh_dirpos == er->er_offset ? readdir(d) : NULL;
 	if (dp != NULL) {
+		eh->eh_dirpos++;
 		HWTRACE(DOTRACE_EMUFS, "got %s", dp->d_name);
 		len = strlen(dp->d_name);
-		if (len > ed->ed_iolen) {
-			len = ed->ed_iolen;
+		if (len > er->er_iolen) {
+			len = er->er_iolen;
 		}
-		memcpy(ed->ed_buf, dp->d_name, len);
-		ed->ed_iolen = len;
-		ed->ed_offset++;
+		memcpy(er->er_buf, dp->d_name, len);
+		er->er_iolen = len;
+		er->er_offset++;
 		g_stats.s_remu++;
 	}
 	else {
 		HWTRACE(DOTRACE_EMUFS, "EOF");
-		ed->ed_iolen = 0;
+		er->er_iolen = 0;
 	}
 
-	closedir(d);
-	fchdir(herefd);
-	close(herefd);
-
 	return EMU_RES_SUCCESS;
-#if 0	
-	/*
-	 * without fchdir, can't do it - there's no fdopendir() or equivalent.
-	 */
-	(void) ed;
-	HWTRACE(DOTRACE_EMUFS, "emufs: slot %d: readdir unsupported",
-		ed->ed_slot);
-
-	return EMU_RES_UNSUPP;
-#endif
 }
 
+/*
+ * Read as many names as fit, each followed by a null byte. If even
+ * the first doesn't fit, it's truncated, as for READDIR.
+ */
 static
 uint32_t
-emufs_write(struct emufs_data *ed)
+emufs_readdirs(struct emufs_data *ed, struct emufs_req *er)
 {
-	int len;
-	int fd;
+	struct emufs_handleinfo *eh = &ed->ed_handles[er->er_handle];
+	struct dirent *dp;
+	DIR *d;
+	long where;
+	uint32_t len, pos, count, res;
 
-	if (ed->ed_iolen > EMU_BUF_SIZE) {
+	if (er->er_iolen > er->er_bufsize) {
 		return EMU_RES_BADSIZE;
 	}
 
-	HWTRACEL(DOTRACE_EMUFS, "emufs: slot %d: write %u bytes, handle %d: ",
-		 ed->ed_slot, ed->ed_iolen, ed->ed_handle);
+	HWTRACEL(DOTRACE_EMUFS,
+		 "emufs: slot %d: readdirs %u bytes, handle %d: ",
+		 ed->ed_slot, er->er_iolen, er->er_handle);
 
-	fd = ed->ed_handles[ed->ed_handle].eh_fd;
+	res = emufs_getdir(ed, er, er->er_offset, &d);
+	if (res != EMU_RES_SUCCESS) {
+		return res;
+	}
 
-	lseek(fd, ed->ed_offset, SEEK_SET);
-	len = write(fd, ed->ed_buf, ed->ed_iolen);
+	pos = 0;
+	count = 0;
+	while (eh->eh_dirpos == er->er_offset + count && pos < er->er_iolen) {
+		where = telldir(d);
+		dp = readdir(d);
+		if (dp == NULL) {
+			break;
+		}
+		len = strlen(dp->d_name);
+		if (len + 1 > er->er_iolen - pos) {
+			if (count > 0) {
+				/* save it for next time */
+				seekdir(d, where);
+				break;
+			}
+			len = er->er_iolen - 1;
+		}
+		memcpy(er->er_buf + pos, dp->d_name, len);
+		er->er_buf[pos + len] = 0;
+		pos += len + 1;
+		eh->eh_dirpos++;
+		count++;
+	}
 
-	if (len < 0) {
-		int err = errno;
-		HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
-		return errno_to_code(err);
+	HWTRACE(DOTRACE_EMUFS, "got %u names", count);
+	er->er_iolen = pos;
+	er->er_offset += count;
+	g_stats.s_remu++;
+
+	return EMU_RES_SUCCESS;
+}
+
+static
+uint32_t
+emufs_write(struct emufs_data *ed, struct emufs_req *er)
+{
+	uint32_t res;
+
+	if (er->er_iolen > er->er_bufsize) {
+		return EMU_RES_BADSIZE;
 	}
 
-	ed->ed_offset += len;
-	ed->ed_iolen = len;
+	HWTRACEL(DOTRACE_EMUFS, "emufs: slot %d: write %u bytes, handle %d: ",
+		 ed->ed_slot, er->er_iolen, er->er_handle);
+
+	res = emufs_dowrite(ed, er);
+	if (res != EMU_RES_SUCCESS) {
+		HWTRACE(DOTRACE_EMUFS, "%s", strerror(er->er_err));
+		return res;
+	}
 
 	HWTRACE(DOTRACE_EMUFS, "success");
 	g_stats.s_wemu++;
@@ -655,24 +1339,20 @@ emufs_write(struct emufs_data *ed)
 
 static
 uint32_t
-emufs_getsize(struct emufs_data *ed)
+emufs_getsize(struct emufs_data *ed, struct emufs_req *er)
 {
-	struct stat sb;
-	int fd;
+	uint32_t res;
 
 	HWTRACEL(DOTRACE_EMUFS, "emufs: slot %d: handle %d length: ",
-		 ed->ed_slot, ed->ed_handle);
+		 ed->ed_slot, er->er_handle);
 
-	fd = ed->ed_handles[ed->ed_handle].eh_fd;
-	if (fstat(fd, &sb)) {
-		int err = errno;
-		HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
-		return errno_to_code(err);
+	res = emufs_dogetsize(ed, er);
+	if (res != EMU_RES_SUCCESS) {
+		HWTRACE(DOTRACE_EMUFS, "%s", strerror(er->er_err));
+		return res;
 	}
 
-	ed->ed_iolen = sb.st_size;
-
-	HWTRACE(DOTRACE_EMUFS, "%u", ed->ed_iolen);
+	HWTRACE(DOTRACE_EMUFS, "%u", er->er_iolen);
 	g_stats.s_memu++;
 
 	return EMU_RES_SUCCESS;
@@ -680,18 +1360,17 @@ emufs_getsize(struct emufs_data *ed)
 
 static
 uint32_t
-emufs_trunc(struct emufs_data *ed)
+emufs_trunc(struct emufs_data *ed, struct emufs_req *er)
 {
-	int fd;
+	uint32_t res;
 
 	HWTRACEL(DOTRACE_EMUFS, "emufs: slot %d: truncate handle %d to %u: ",
-		 ed->ed_slot, ed->ed_handle, ed->ed_iolen);
+		 ed->ed_slot, er->er_handle, er->er_iolen);
 
-	fd = ed->ed_handles[ed->ed_handle].eh_fd;
-	if (ftruncate(fd, ed->ed_iolen)) {
-		int err = errno;
-		HWTRACE(DOTRACE_EMUFS, "%s", strerror(err));
-		return errno_to_code(err);
+	res = emufs_dotrunc(ed, er);
+	if (res != EMU_RES_SUCCESS) {
+		HWTRACE(DOTRACE_EMUFS, "%s", strerror(er->er_err));
+		return res;
 	}
 
 	HWTRACE(DOTRACE_EMUFS, "success");
@@ -700,19 +1379,32 @@ emufs_trunc(struct emufs_data *ed)
 	return EMU_RES_SUCCESS;
 }
 
+/*
+ * Check that a DMA transfer is no bigger than EMU_DMA_MAX and lies
+ * within RAM, as the cpu sees it; if so return its offset in ram[].
+ */
+static
+int
+emufs_dmacheck(uint32_t paddr, uint32_t len, uint32_t *ramoffset_ret)
+{
+	if (len > EMU_DMA_MAX) {
+		return -1;
+	}
+	return cpu_get_ram_offset(paddr, len, ramoffset_ret);
+}
+
 static
 uint32_t
-emufs_op(struct emufs_data *ed, uint32_t op)
+emufs_op(struct emufs_data *ed, struct emufs_req *er, uint32_t op)
 {
 	switch (op) {
-	    case EMU_OP_OPEN:       return emufs_open(ed, 0);
-	    case EMU_OP_CREATE:     return emufs_open(ed, O_CREAT);
-	    case EMU_OP_EXCLCREATE: return emufs_open(ed, O_CREAT|O_EXCL);
+	    case EMU_OP_OPEN:       return emufs_open(ed, er, 0);
+	    case EMU_OP_CREATE:     return emufs_open(ed, er, O_CREAT);
+	    case EMU_OP_EXCLCREATE: return emufs_open(ed, er, O_CREAT|O_EXCL);
 	    default: break;
 	}
 
-	if (ed->ed_handle >= MAXHANDLES ||
-	    ed->ed_handles[ed->ed_handle].eh_fd < 0) {
+	if (emufs_badhandle(ed, er)) {
 		return EMU_RES_BADHANDLE;
 	}
 
@@ -722,12 +1414,15 @@ emufs_op(struct emufs_data *ed, uint32_t op)
 	    case EMU_OP_EXCLCREATE:
 		/* ? */
 		break;
-	    case EMU_OP_CLOSE:      return emufs_close(ed);
-	    case EMU_OP_READ:       return emufs_read(ed);
-	    case EMU_OP_READDIR:    return emufs_readdir(ed);
-	    case EMU_OP_WRITE:      return emufs_write(ed);
-	    case EMU_OP_GETSIZE:    return emufs_getsize(ed);
-	    case EMU_OP_TRUNC:      return emufs_trunc(ed);
+	    case EMU_OP_CLOSE:      return emufs_close(ed, er);
+	    case EMU_OP_READ:       return emufs_read(ed, er);
+	    case EMU_OP_READDIR:    return emufs_readdir(ed, er);
+	    case EMU_OP_READDIRS:   return emufs_readdirs(ed, er);
+	    case EMU_OP_WRITE:      return emufs_write(ed, er);
+	    case EMU_OP_DMAREAD:    return emufs_read(ed, er);
+	    case EMU_OP_DMAWRITE:   return emufs_write(ed, er);
+	    case EMU_OP_GETSIZE:    return emufs_getsize(ed, er);
+	    case EMU_OP_TRUNC:      return emufs_trunc(ed, er);
 	}
 
 	return EMU_RES_BADOP;
@@ -754,34 +1449,479 @@ static
 void
 emufs_do_op(struct emufs_data *ed, uint32_t op)
 {
-	uint32_t res;
+	struct emufs_req er;
+	uint32_t res, ramoffset;
+	uint64_t nsecs;
 
 	if (ed->ed_busy != 0) {
 		hang("emufs operation started while an operation "
 		     "was already in progress");
 		return;
 	}
+	if (ed->ed_ringdone != ed->ed_ringsub) {
+		hang("emufs operation started while ring operations "
+		     "were in progress");
+		return;
+	}
+
+	er.er_handle = ed->ed_handle;
+	er.er_offset = ed->ed_offset;
+	er.er_iolen = ed->ed_iolen;
+	er.er_buf = ed->ed_buf;
+	er.er_bufsize = EMU_BUF_SIZE;
+	er.er_err = 0;
+	nsecs = EMUFS_NSECS;
+
+	if (op == EMU_OP_DMAREAD || op == EMU_OP_DMAWRITE) {
+		/*
+		 * Transfer to/from memory. This goes through a
+		 * temporary buffer because memory is not laid out
+		 * as a plain byte array (see inlinemem.h).
+		 */
+		if (emufs_dmacheck(ed->ed_paddr, er.er_iolen, &ramoffset)) {
+			HWTRACE(DOTRACE_EMUFS, "emufs: slot %d: Invalid DMA "
+				"address 0x%x length %u", ed->ed_slot,
+				ed->ed_paddr, er.er_iolen);
+			res = EMU_RES_BADSIZE;
+			goto done;
+		}
+		er.er_bufsize = er.er_iolen;
+		/* +1 so that a zero-length transfer still gets a buffer */
+		er.er_buf = domalloc(er.er_bufsize + 1);
+		if (op == EMU_OP_DMAWRITE) {
+			bus_mem_read(ramoffset, er.er_buf, er.er_iolen);
+		}
+		nsecs += (uint64_t)er.er_iolen * EMUFS_NSECS_PER_BYTE;
+	}
 
-	res = emufs_op(ed, op);
+	res = emufs_op(ed, &er, op);
 
+	if (op == EMU_OP_DMAREAD || op == EMU_OP_DMAWRITE) {
+		if (op == EMU_OP_DMAREAD && res == EMU_RES_SUCCESS) {
+			bus_mem_write(ramoffset, er.er_buf, er.er_iolen);
+		}
+		free(er.er_buf);
+	}
+
+	ed->ed_handle = er.er_handle;
+	ed->ed_offset = er.er_offset;
+	ed->ed_iolen = er.er_iolen;
+
+ done:
 	ed->ed_busy = 1;
 	ed->ed_busyresult = res;
 
-	schedule_event(EMUFS_NSECS, ed, 0, emufs_done, "emufs");
+	schedule_event(nsecs, ed, 0, emufs_done, "emufs");
+}
+
+////////////////////////////////////////////////////////////
+//
+// Command ring
+
+static
+void
+emufs_ringlock(struct emufs_data *ed)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&ed->ed_ringlock);
+#else
+	(void)ed;
+#endif
+}
+
+static
+void
+emufs_ringunlock(struct emufs_data *ed)
+{
+#ifdef HAVE_PTHREAD
+	pthread_cond_broadcast(&ed->ed_ringcv);
+	pthread_mutex_unlock(&ed->ed_ringlock);
+#else
+	(void)ed;
+#endif
+}
+
+static
+uint32_t
+emufs_ringword(struct emufs_data *ed, unsigned slot, uint32_t field)
+{
+	uint32_t *ptr;
+
+	ptr = (uint32_t *)(ed->ed_ringmem + slot*EMU_RING_ENTSIZE + field);
+	return ctoh32(*ptr);
+}
+
+static
+void
+emufs_setringword(struct emufs_data *ed, unsigned slot, uint32_t field,
+		  uint32_t val)
+{
+	uint32_t *ptr;
+
+	ptr = (uint32_t *)(ed->ed_ringmem + slot*EMU_RING_ENTSIZE + field);
+	*ptr = htoc32(val);
+}
+
+/*
+ * Host I/O for the operations the worker thread does.
+ */
+static
+uint32_t
+emufs_hostio(struct emufs_data *ed, struct emufs_ringent *re)
+{
+	if (emufs_badhandle(ed, &re->re_req)) {
+		return EMU_RES_BADHANDLE;
+	}
+	switch (re->re_op) {
+	    case EMU_OP_READ:    return emufs_doread(ed, &re->re_req);
+	    case EMU_OP_WRITE:   return emufs_dowrite(ed, &re->re_req);
+	    case EMU_OP_DMAREAD: return emufs_doread(ed, &re->re_req);
+	    case EMU_OP_DMAWRITE: return emufs_dowrite(ed, &re->re_req);
+	    case EMU_OP_GETSIZE: return emufs_dogetsize(ed, &re->re_req);
+	    case EMU_OP_TRUNC:   return emufs_dotrunc(ed, &re->re_req);
+	}
+	smoke("emufs: op %u on worker thread", re->re_op);
 }
 
+#ifdef HAVE_PTHREAD
+static
+void *
+emufs_worker(void *data)
+{
+	struct emufs_data *ed = data;
+	struct emufs_ringent *re;
+	uint32_t result;
+
+	pthread_mutex_lock(&ed->ed_ringlock);
+	while (!ed->ed_workerexit) {
+		if (ed->ed_ringhostdone == ed->ed_ringsub) {
+			pthread_cond_wait(&ed->ed_ringcv, &ed->ed_ringlock);
+			continue;
+		}
+		re = &ed->ed_ring[ed->ed_ringhostdone % EMU_RING_ENTRIES];
+		if (!re->re_onworker) {
+			/* The simulation thread does this one. */
+			pthread_cond_wait(&ed->ed_ringcv, &ed->ed_ringlock);
+			continue;
+		}
+		pthread_mutex_unlock(&ed->ed_ringlock);
+
+		result = emufs_hostio(ed, re);
+
+		pthread_mutex_lock(&ed->ed_ringlock);
+		re->re_result = result;
+		ed->ed_ringhostdone++;
+		pthread_cond_broadcast(&ed->ed_ringcv);
+	}
+	pthread_mutex_unlock(&ed->ed_ringlock);
+	return NULL;
+}
+
+static
+void
+emufs_startworker(struct emufs_data *ed)
+{
+	sigset_t all, old;
+	int err;
+
+	pthread_mutex_init(&ed->ed_ringlock, NULL);
+	pthread_cond_init(&ed->ed_ringcv, NULL);
+	ed->ed_workerexit = 0;
+
+	/* Signals are for the main thread. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&ed->ed_worker, NULL, emufs_worker, ed);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		msg("emufs: slot %d: pthread_create: %s", ed->ed_slot,
+		    strerror(err));
+		die();
+	}
+}
+
+static
+void
+emufs_stopworker(struct emufs_data *ed)
+{
+	pthread_mutex_lock(&ed->ed_ringlock);
+	ed->ed_workerexit = 1;
+	pthread_cond_broadcast(&ed->ed_ringcv);
+	pthread_mutex_unlock(&ed->ed_ringlock);
+	pthread_join(ed->ed_worker, NULL);
+	pthread_cond_destroy(&ed->ed_ringcv);
+	pthread_mutex_destroy(&ed->ed_ringlock);
+}
+#endif /* HAVE_PTHREAD */
+
+static void emufs_ringdone(void *d, uint32_t gen);
+
+static
+void
+emufs_ringschedule(struct emufs_data *ed)
+{
+	struct emufs_ringent *re;
+
+	re = &ed->ed_ring[ed->ed_ringdone % EMU_RING_ENTRIES];
+	ed->ed_ringtimed = 1;
+	schedule_event(re->re_nsecs, ed, 0, emufs_ringdone, "emufs ring");
+}
+
+/*
+ * Take descriptor n from the guest.
+ */
+static
+void
+emufs_ringfetch(struct emufs_data *ed, uint32_t n)
+{
+	unsigned slot = n % EMU_RING_ENTRIES;
+	struct emufs_ringent *re = &ed->ed_ring[slot];
+	struct emufs_req *er = &re->re_req;
+	uint32_t ramoffset;
+	int usesbuf = 0, input = 0, perbyte = 0;
+
+	re->re_op = emufs_ringword(ed, slot, EMUDESC_OPER);
+	re->re_bufoff = emufs_ringword(ed, slot, EMUDESC_BUFOFF);
+	re->re_result = 0;
+	re->re_nsecs = EMUFS_RING_NSECS;
+	re->re_onworker = 0;
+	er->er_handle = emufs_ringword(ed, slot, EMUDESC_HANDLE);
+	er->er_offset = emufs_ringword(ed, slot, EMUDESC_OFFSET);
+	er->er_iolen = emufs_ringword(ed, slot, EMUDESC_IOLEN);
+	er->er_buf = NULL;
+	er->er_bufsize = 0;
+	er->er_err = 0;
+
+	switch (re->re_op) {
+	    case EMU_OP_OPEN:
+	    case EMU_OP_CREATE:
+	    case EMU_OP_EXCLCREATE:
+		usesbuf = input = 1;
+		break;
+	    case EMU_OP_READDIR:
+	    case EMU_OP_READDIRS:
+		usesbuf = 1;
+		break;
+	    case EMU_OP_READ:
+		usesbuf = 1;
+		re->re_onworker = 1;
+		perbyte = 1;
+		break;
+	    case EMU_OP_WRITE:
+		usesbuf = input = 1;
+		re->re_onworker = 1;
+		perbyte = 1;
+		break;
+	    case EMU_OP_GETSIZE:
+	    case EMU_OP_TRUNC:
+		re->re_onworker = 1;
+		break;
+	    case EMU_OP_DMAREAD:
+	    case EMU_OP_DMAWRITE:
+		/*
+		 * This goes through a private buffer like everything
+		 * else, so that memory changes only when the operation
+		 * completes.
+		 */
+		if (emufs_dmacheck(re->re_bufoff, er->er_iolen, &ramoffset)) {
+			re->re_result = EMU_RES_BADSIZE;
+			return;
+		}
+		/* from here on it's the offset in ram[] */
+		re->re_bufoff = ramoffset;
+		re->re_onworker = 1;
+		re->re_nsecs += (uint64_t)er->er_iolen * EMUFS_NSECS_PER_BYTE;
+		er->er_bufsize = er->er_iolen;
+		/* +1 so that a zero-length transfer still gets a buffer */
+		er->er_buf = domalloc(er->er_bufsize + 1);
+		if (re->re_op == EMU_OP_DMAWRITE) {
+			bus_mem_read(ramoffset, er->er_buf, er->er_iolen);
+		}
+		return;
+	}
+
+	if (usesbuf) {
+		if (re->re_bufoff > EMU_BUF_SIZE ||
+		    er->er_iolen > EMU_BUF_SIZE - re->re_bufoff) {
+			re->re_result = EMU_RES_BADSIZE;
+			re->re_onworker = 0;
+			return;
+		}
+		/* only charge for the transfer once the length is known good */
+		if (perbyte) {
+			re->re_nsecs +=
+				(uint64_t)er->er_iolen * EMUFS_NSECS_PER_BYTE;
+		}
+		/* one extra byte so a pathname can be terminated */
+		er->er_bufsize = er->er_iolen + 1;
+		er->er_buf = domalloc(er->er_bufsize);
+		if (input) {
+			memcpy(er->er_buf, ed->ed_buf + re->re_bufoff,
+			       er->er_iolen);
+		}
+	}
+}
+
+static
+void
+emufs_ringsubmit(struct emufs_data *ed, uint32_t val)
+{
+	uint32_t n;
+
+	if (ed->ed_busy) {
+		hang("emufs ring operations submitted while an operation "
+		     "was in progress");
+		return;
+	}
+	if (val - ed->ed_ringsub > EMU_RING_ENTRIES ||
+	    val - ed->ed_ringdone > EMU_RING_ENTRIES) {
+		hang("emufs: Invalid ring submission count %u "
+		     "(%u submitted, %u completed)",
+		     val, ed->ed_ringsub, ed->ed_ringdone);
+		return;
+	}
+
+	for (n = ed->ed_ringsub; n != val; n++) {
+		emufs_ringfetch(ed, n);
+	}
+	HWTRACE(DOTRACE_EMUFS, "emufs: slot %d: ring: %u submitted",
+		ed->ed_slot, val - ed->ed_ringsub);
+
+	emufs_ringlock(ed);
+	ed->ed_ringsub = val;
+	emufs_ringunlock(ed);
+
+	if (!ed->ed_ringtimed && ed->ed_ringdone != ed->ed_ringsub) {
+		emufs_ringschedule(ed);
+	}
+}
+
+/*
+ * Complete the oldest outstanding ring entry.
+ */
+static
+void
+emufs_ringdone(void *d, uint32_t gen)
+{
+	struct emufs_data *ed = d;
+	struct emufs_ringent *re;
+	struct emufs_req *er;
+	unsigned slot;
+	int ours;
+
+	(void)gen;
+
+	Assert(ed->ed_ringtimed);
+	Assert(ed->ed_ringdone != ed->ed_ringsub);
+	ed->ed_ringtimed = 0;
+
+	slot = ed->ed_ringdone % EMU_RING_ENTRIES;
+	re = &ed->ed_ring[slot];
+	er = &re->re_req;
+
+	/* Wait for the worker if it has this one. */
+	emufs_ringlock(ed);
+#ifdef HAVE_PTHREAD
+	while (re->re_onworker && ed->ed_ringhostdone == ed->ed_ringdone) {
+		pthread_cond_wait(&ed->ed_ringcv, &ed->ed_ringlock);
+	}
+#endif
+	ours = ed->ed_ringhostdone == ed->ed_ringdone;
+	emufs_ringunlock(ed);
+
+	if (ours) {
+		/* re_result is already set if the descriptor was bad */
+		if (re->re_result == 0 && re->re_onworker) {
+			re->re_result = emufs_hostio(ed, re);
+		}
+		else if (re->re_result == 0) {
+			re->re_result = emufs_op(ed, er, re->re_op);
+		}
+		emufs_ringlock(ed);
+		ed->ed_ringhostdone++;
+		emufs_ringunlock(ed);
+	}
+
+	if (re->re_onworker) {
+		HWTRACE(DOTRACE_EMUFS, "emufs: slot %d: ring: op %u, "
+			"handle %u: %s", ed->ed_slot, re->re_op,
+			er->er_handle,
+			re->re_result == EMU_RES_SUCCESS ? "success" :
+			er->er_err ? strerror(er->er_err) : "failed");
+		if (re->re_result == EMU_RES_SUCCESS) {
+			switch (re->re_op) {
+			    case EMU_OP_READ:
+			    case EMU_OP_DMAREAD: g_stats.s_remu++; break;
+			    case EMU_OP_GETSIZE: g_stats.s_memu++; break;
+			    default: g_stats.s_wemu++; break;
+			}
+		}
+	}
+
+	if (re->re_result == EMU_RES_SUCCESS &&
+	    (re->re_op == EMU_OP_READ || re->re_op == EMU_OP_READDIR ||
+	     re->re_op == EMU_OP_READDIRS)) {
+		memcpy(ed->ed_buf + re->re_bufoff, er->er_buf, er->er_iolen);
+	}
+	if (re->re_result == EMU_RES_SUCCESS && re->re_op == EMU_OP_DMAREAD) {
+		/* checked when submitted; memory doesn't change size */
+		bus_mem_write(re->re_bufoff, er->er_buf, er->er_iolen);
+	}
+	emufs_setringword(ed, slot, EMUDESC_HANDLE, er->er_handle);
+	emufs_setringword(ed, slot, EMUDESC_OFFSET, er->er_offset);
+	emufs_setringword(ed, slot, EMUDESC_IOLEN, er->er_iolen);
+	emufs_setringword(ed, slot, EMUDESC_RESULT, re->re_result);
+
+	free(er->er_buf);
+	er->er_buf = NULL;
+
+	ed->ed_ringdone++;
+	emufs_updateirq(ed);
+
+	if (ed->ed_ringdone != ed->ed_ringsub) {
+		emufs_ringschedule(ed);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Setup and bus interface
+
 static
 void *
 emufs_init(int slot, int argc, char *argv[])
 {
 	struct emufs_data *ed = domalloc(sizeof(struct emufs_data));
 	const char *dir = ".";
+	unsigned maxhandles = DEFAULT_MAXHANDLES;
+	int dcachemode = EMU_DCACHE_OFF;
+	unsigned u;
 	int i;
 
 	for (i=1; i<argc; i++) {
 		if (!strncmp(argv[i], "dir=", 4)) {
 			dir = argv[i]+4;
 		}
+		else if (!strncmp(argv[i], "handles=", 8)) {
+			maxhandles = atoi(argv[i]+8);
+			if (maxhandles < 1 || maxhandles > MAX_MAXHANDLES) {
+				msg("emufs: slot %d: handles must be between "
+				    "1 and %d", slot, MAX_MAXHANDLES);
+				die();
+			}
+		}
+		else if (!strcmp(argv[i], "dcache")) {
+			dcachemode = EMU_DCACHE_ON;
+		}
+		else if (!strcmp(argv[i], "dcache=inotify")) {
+#ifdef HAVE_INOTIFY
+			dcachemode = EMU_DCACHE_INOTIFY;
+#else
+			msg("emufs: slot %d: dcache=inotify not supported "
+			    "on this platform", slot);
+			die();
+#endif
+		}
 		else {
 			msg("emufs: slot %d: invalid option %s",slot, argv[i]);
 			die();
@@ -794,19 +1934,65 @@ emufs_init(int slot, int argc, char *argv[])
 	ed->ed_handle = 0;
 	ed->ed_offset = 0;
 	ed->ed_iolen = 0;
+	ed->ed_paddr = 0;
 	ed->ed_result = 0;
 
-	for (i=0; i<MAXHANDLES; i++) {
-		ed->ed_handles[i].eh_fd = -1;
-		ed->ed_handles[i].eh_dev = 0;
-		ed->ed_handles[i].eh_ino = 0;
+	ed->ed_maxhandles = maxhandles;
+	ed->ed_handles = domalloc(maxhandles * sizeof(ed->ed_handles[0]));
+	/* Chain the free list so the lowest handles get used first. */
+	for (u=0; u<maxhandles; u++) {
+		ed->ed_handles[u].eh_fd = -1;
+		ed->ed_handles[u].eh_dev = 0;
+		ed->ed_handles[u].eh_ino = 0;
+		ed->ed_handles[u].eh_dir = NULL;
+		ed->ed_handles[u].eh_dirpos = 0;
+		ed->ed_handles[u].eh_next = u+1 < maxhandles ? (int)u+1 : -1;
+	}
+	ed->ed_freehandles = 0;
+	for (ed->ed_nbuckets = 16; ed->ed_nbuckets < maxhandles;
+	     ed->ed_nbuckets *= 2) {
+		/* nothing */
+	}
+	ed->ed_buckets = domalloc(ed->ed_nbuckets * sizeof(int));
+	for (u=0; u<ed->ed_nbuckets; u++) {
+		ed->ed_buckets[u] = -1;
+	}
+
+	ed->ed_dcachemode = dcachemode;
+	for (u=0; u<EMU_DCACHE_BUCKETS; u++) {
+		ed->ed_dcache[u] = NULL;
 	}
+	ed->ed_dcachecount = 0;
+	ed->ed_inotifyfd = -1;
+#ifdef HAVE_INOTIFY
+	if (dcachemode == EMU_DCACHE_INOTIFY) {
+		emufs_dcache_newinotify(ed);
+	}
+#endif
 
 	ed->ed_busy = 0;
 	ed->ed_busyresult = 0;
 
+	ed->ed_ringmem = domalloc(EMU_RING_ENTRIES * EMU_RING_ENTSIZE);
+	memset(ed->ed_ringmem, 0, EMU_RING_ENTRIES * EMU_RING_ENTSIZE);
+	for (i=0; i<EMU_RING_ENTRIES; i++) {
+		ed->ed_ring[i].re_req.er_buf = NULL;
+	}
+	ed->ed_ringsub = 0;
+	ed->ed_ringdone = 0;
+	ed->ed_ringack = 0;
+	ed->ed_ringhostdone = 0;
+	ed->ed_ringtimed = 0;
+
 	emufs_openfirst(ed, dir);
 
+#ifdef HAVE_PTHREAD
+	emufs_startworker(ed);
+#endif
+
+	clock_nameevent(emufs_done, "emufs");
+	clock_nameevent(emufs_ringdone, "emufs ring");
+
 	return ed;
 }
 
@@ -815,23 +2001,19 @@ int
 emufs_fetch(unsigned cpunum, void *data, uint32_t offset, uint32_t *ret)
 {
 	struct emufs_data *ed = data;
-	uint32_t *ptr;
 
 	(void)cpunum;
 
-	if (offset >= EMU_BUF_START && offset < EMU_BUF_END) {
-		offset -= EMU_BUF_START;
-		ptr = (uint32_t *)(ed->ed_buf + offset);
-		*ret = ctoh32(*ptr);
-		return 0;
-	}
-
 	switch (offset) {
 	    case EMUREG_HANDLE: *ret = ed->ed_handle; return 0;
 	    case EMUREG_OFFSET: *ret = ed->ed_offset; return 0;
 	    case EMUREG_IOLEN: *ret = ed->ed_iolen; return 0;
 	    case EMUREG_OPER: *ret = 0; return 0;
 	    case EMUREG_RESULT: *ret = ed->ed_result; return 0;
+	    case EMUREG_RINGSUB: *ret = ed->ed_ringsub; return 0;
+	    case EMUREG_RINGDONE: *ret = ed->ed_ringdone; return 0;
+	    case EMUREG_RINGACK: *ret = ed->ed_ringack; return 0;
+	    case EMUREG_PADDR: *ret = ed->ed_paddr; return 0;
 	}
 	return -1;
 }
@@ -841,27 +2023,44 @@ int
 emufs_store(unsigned cpunum, void *data, uint32_t offset, uint32_t val)
 {
 	struct emufs_data *ed = data;
-	uint32_t *ptr;
 
 	(void)cpunum;
 
-	if (offset >= EMU_BUF_START && offset < EMU_BUF_END) {
-		offset -= EMU_BUF_START;
-		ptr = (uint32_t *)(ed->ed_buf + offset);
-		*ptr = htoc32(val);
-		return 0;
-	}
-
 	switch (offset) {
 	    case EMUREG_HANDLE: ed->ed_handle = val; return 0;
 	    case EMUREG_OFFSET: ed->ed_offset = val; return 0;
 	    case EMUREG_IOLEN: ed->ed_iolen = val; return 0;
 	    case EMUREG_OPER: emufs_do_op(ed, val); return 0;
 	    case EMUREG_RESULT: emufs_setresult(ed, val); return 0;
+	    case EMUREG_RINGSUB: emufs_ringsubmit(ed, val); return 0;
+	    case EMUREG_PADDR: ed->ed_paddr = val; return 0;
+	    case EMUREG_RINGACK:
+		ed->ed_ringack = val;
+		emufs_updateirq(ed);
+		return 0;
 	}
 	return -1;
 }
 
+/*
+ * The I/O buffer and the command ring are accessed directly by the
+ * bus.
+ */
+static
+int
+emufs_windows(void *data, struct lamebus_window *windows)
+{
+	struct emufs_data *ed = data;
+
+	windows[0].lw_offset = EMU_BUF_START;
+	windows[0].lw_size = EMU_BUF_SIZE;
+	windows[0].lw_mem = ed->ed_buf;
+	windows[1].lw_offset = EMU_RING_START;
+	windows[1].lw_size = EMU_RING_END - EMU_RING_START;
+	windows[1].lw_mem = ed->ed_ringmem;
+	return 2;
+}
+
 static
 void
 emufs_dumpstate(void *data)
@@ -883,6 +2082,11 @@ emufs_dumpstate(void *data)
 	else {
 		msg("    Presently idle");
 	}
+	msg("    DMA address: 0x%08lx", (unsigned long) ed->ed_paddr);
+	msg("    Ring: submitted %lu  completed %lu  acknowledged %lu",
+	    (unsigned long) ed->ed_ringsub,
+	    (unsigned long) ed->ed_ringdone,
+	    (unsigned long) ed->ed_ringack);
 	msg("    Buffer:");
 	dohexdump(ed->ed_buf, EMU_BUF_SIZE);
 }
@@ -892,11 +2096,141 @@ void
 emufs_cleanup(void *data)
 {
 	struct emufs_data *ed = data;
-	emufs_close(ed);
+	unsigned u;
+	int i;
+
+#ifdef HAVE_PTHREAD
+	emufs_stopworker(ed);
+#endif
+	for (i=0; i<EMU_RING_ENTRIES; i++) {
+		free(ed->ed_ring[i].re_req.er_buf);
+	}
+	free(ed->ed_ringmem);
+
+	for (u=0; u<ed->ed_maxhandles; u++) {
+		if (ed->ed_handles[u].eh_fd >= 0) {
+			emufs_freehandle(ed, u);
+		}
+	}
+	free(ed->ed_handles);
+	free(ed->ed_buckets);
+
+	emufs_dcache_flush(ed, 0);
+	if (ed->ed_inotifyfd >= 0) {
+		close(ed->ed_inotifyfd);
+	}
 	free(ed->ed_buf);
 	free(ed);
 }
 
+/*
+ * Open files are host state that can't be saved, so a snapshot is
+ * only possible while nothing but the root is open and the command
+ * ring is empty. (Between boot and the first access, for instance.)
+ */
+static
+void
+emufs_save(void *data)
+{
+	struct emufs_data *ed = data;
+	unsigned u;
+
+	for (u=0; u<ed->ed_maxhandles; u++) {
+		if (u != EMU_ROOTHANDLE && ed->ed_handles[u].eh_fd >= 0) {
+			snap_fail("emufs: slot %d: files are open",
+				  ed->ed_slot);
+			return;
+		}
+	}
+	if (ed->ed_ringsub != ed->ed_ringdone || ed->ed_ringtimed) {
+		snap_fail("emufs: slot %d: ring operations in progress",
+			  ed->ed_slot);
+		return;
+	}
+
+	snap_write32(ed->ed_handle);
+	snap_write32(ed->ed_offset);
+	snap_write32(ed->ed_iolen);
+	snap_write32(ed->ed_paddr);
+	snap_write32(ed->ed_result);
+	snap_write(ed->ed_buf, EMU_BUF_SIZE);
+	snap_write32(ed->ed_busy);
+	snap_write32(ed->ed_busyresult);
+
+	snap_write(ed->ed_ringmem, EMU_RING_ENTRIES * EMU_RING_ENTSIZE);
+	snap_write32(ed->ed_ringsub);
+	snap_write32(ed->ed_ringack);
+}
+
+static
+void
+emufs_restore(void *data)
+{
+	struct emufs_data *ed = data;
+
+	ed->ed_handle = snap_read32();
+	ed->ed_offset = snap_read32();
+	ed->ed_iolen = snap_read32();
+	ed->ed_paddr = snap_read32();
+	ed->ed_result = snap_read32();
+	snap_read(ed->ed_buf, EMU_BUF_SIZE);
+	ed->ed_busy = snap_read32();
+	ed->ed_busyresult = snap_read32();
+
+	snap_read(ed->ed_ringmem, EMU_RING_ENTRIES * EMU_RING_ENTSIZE);
+	emufs_ringlock(ed);
+	ed->ed_ringsub = snap_read32();
+	ed->ed_ringdone = ed->ed_ringsub;
+	ed->ed_ringhostdone = ed->ed_ringsub;
+	emufs_ringunlock(ed);
+	ed->ed_ringack = snap_read32();
+}
+
+/*
+ * The fork point waits for operations in progress to finish, since
+ * the host side of them has already happened (or is happening in the
+ * worker) and each run would otherwise complete them again.
+ */
+static
+int
+emufs_busy(void *data)
+{
+	struct emufs_data *ed = data;
+
+	return ed->ed_busy || ed->ed_ringsub != ed->ed_ringdone ||
+		ed->ed_ringtimed;
+}
+
+/*
+ * In a fork-server child the worker thread didn't come along (only
+ * the forking thread does), and the ring lock may have been held by
+ * it at the time, so start over with a fresh lock and worker. The
+ * ring is idle (see emufs_busy), so there's nothing for it to redo.
+ *
+ * The files themselves are the host's and are shared by every run.
+ * What's in the lookup cache was right in the parent, but the runs
+ * may now change the files behind each other's backs, so it starts
+ * out empty; and the inotify descriptor is shared with the parent,
+ * which would then see our events and we theirs, so get our own.
+ */
+static
+void
+emufs_forked(void *data, unsigned run)
+{
+	struct emufs_data *ed = data;
+
+	(void)run;
+	emufs_dcache_flush(ed, 0);
+#ifdef HAVE_INOTIFY
+	if (ed->ed_dcachemode == EMU_DCACHE_INOTIFY) {
+		emufs_dcache_newinotify(ed);
+	}
+#endif
+#ifdef HAVE_PTHREAD
+	emufs_startworker(ed);
+#endif
+}
+
 const struct lamebus_device_info emufs_device_info = {
 	LBVEND_SYS161,
 	LBVEND_SYS161_EMUFS,
@@ -906,4 +2240,9 @@ const struct lamebus_device_info emufs_device_info = {
 	emufs_store,
 	emufs_dumpstate,
 	emufs_cleanup,
+	emufs_save,
+	emufs_restore,
+	emufs_forked,
+	emufs_busy,
+	emufs_windows,
 };
@@ -1,6 +1,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <stdlib.h>
@@ -16,15 +17,30 @@
 #include "onsel.h"
 #include "main.h"
 #include "util.h"
+#include "cpu.h"
+#include "memdefs.h"
+#include "snapshot.h"
+#include "cluster.h"
 
 #include "busids.h"
 #include "lamebus.h"
+#include "netring.h"
 
 
 #define NETREG_READINTR    0
 #define NETREG_WRITEINTR   4
 #define NETREG_CONTROL     8
 #define NETREG_STATUS      12
+#define NETREG_RXRING      16
+#define NETREG_RXCOUNT     20
+#define NETREG_RXPOST      24
+#define NETREG_RXDONE      28
+#define NETREG_TXRING      32
+#define NETREG_TXCOUNT     36
+#define NETREG_TXPOST      40
+#define NETREG_TXDONE      44
+#define NETREG_COALCOUNT   48
+#define NETREG_COALTIME    52
 
 #define NET_READBUF     32768
 #define NET_WRITEBUF    (NET_READBUF+NET_BUFSIZE)
@@ -37,12 +53,25 @@
 
 #define NETWORK_LATENCY		2000000  /* ns: 2ms for every packet */
 
+/*
+ * Descriptor rings. Each descriptor is 16 bytes in guest memory, in
+ * guest byte order: buffer physical address, buffer (receive) or
+ * packet (transmit) length, status written back by the card, and a
+ * reserved word.
+ */
+#define NET_MAXRING     4096
+#define NETDESC_SIZE    16
+#define NETDESC_BUF     0
+#define NETDESC_LEN     4
+#define NETDESC_STATUS  8
+
 struct net_data {
 	int nd_slot;
 
 	struct sockaddr_un nd_hubaddr;
 	socklen_t nd_hubaddrlen;
 	int nd_socket;
+	unsigned nd_run;		/* fork-server run, or 0 */
 	
 	int nd_lostcarrier;
 
@@ -54,6 +83,34 @@ struct net_data {
 	/* These used to be nd_{r,w}buf[NET_BUFSIZE]; see dev_disk.c */
 	char *nd_rbuf;
 	char *nd_wbuf;
+
+	/* Descriptor rings; counters are free-running */
+	uint32_t nd_rxring, nd_rxcount, nd_rxpost, nd_rxdone;
+	uint32_t nd_txring, nd_txcount, nd_txpost, nd_txdone;
+	int nd_txbusy;			/* transmit event scheduled */
+
+	/* Interrupt coalescing */
+	uint32_t nd_coalcount;		/* completions per interrupt */
+	uint32_t nd_coaltime;		/* usecs; 0 for no timer */
+	uint32_t nd_rxpending, nd_txpending;	/* not yet signalled */
+	uint32_t nd_coalgen;		/* to ignore stale timers */
+	int nd_coaltimed;		/* timer scheduled */
+
+#ifdef HAVE_NETSHM
+	/* Shared-memory transport (transport=shm) */
+	int nd_useshm;			/* asked for */
+	int nd_shmactive;		/* hub has acknowledged */
+	int nd_shmfd;
+	struct netring_shm *nd_shm;
+	int nd_tohub_rfd, nd_tohub_wfd;		/* hub waits on this */
+	int nd_fromhub_rfd, nd_fromhub_wfd;	/* we wait on this */
+#endif
+
+	/* Other machines of the same -n run (transport=cluster) */
+	int nd_usecluster;
+	int nd_crecvtimed;		/* receive event scheduled */
+	uint64_t nd_crecvwhen;		/* ...for this time */
+	uint32_t nd_crecvgen;		/* to ignore stale events */
 };
 
 /* Fields in interrupt registers */
@@ -63,12 +120,18 @@ struct net_data {
 /* Fields in control register */
 #define NDC_PROMISC      0x00000001
 #define NDC_START        0x00000002
-#define NDC_ZERO         0xfffffffc
+#define NDC_RINGS        0x00000004
+#define NDC_ZERO         0xfffffff8
 
 /* Fields in status register */
 #define NDS_HWADDR       0x0000ffff
 #define NDS_ZERO         0xffff0000
 
+/* Fields in descriptor status word */
+#define NDD_DONE         0x80000000
+#define NDD_ERROR        0x40000000
+#define NDD_LEN          0x0000ffff
+
 #define ND_STATUS(hw, c) (((c)?0x80000000:0) | ((uint32_t)(hw)&0xffff))
 
 struct linkheader {
@@ -112,12 +175,155 @@ writedone(struct net_data *nd)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Interrupt coalescing for the descriptor rings: completions are
+ * signalled through the ordinary interrupt registers once coalcount
+ * of either kind have built up, or coaltime after the first one that
+ * hasn't been signalled, whichever comes first.
+ */
+
+static
+void
+coalsignal(struct net_data *nd)
+{
+	HWTRACE(DOTRACE_NET, "nic: slot %d: signalling %u received, "
+		"%u sent", nd->nd_slot, nd->nd_rxpending, nd->nd_txpending);
+	if (nd->nd_rxpending > 0) {
+		nd->nd_rirq = NDI_DONE;
+	}
+	if (nd->nd_txpending > 0) {
+		nd->nd_wirq = NDI_DONE;
+	}
+	nd->nd_rxpending = nd->nd_txpending = 0;
+	nd->nd_coalgen++;
+	nd->nd_coaltimed = 0;
+	chkint(nd);
+}
+
+static
+void
+coaltimer(void *data, uint32_t gen)
+{
+	struct net_data *nd = data;
+
+	if (gen != nd->nd_coalgen) {
+		/* already signalled */
+		return;
+	}
+	coalsignal(nd);
+}
+
+static
+void
+coalesce(struct net_data *nd)
+{
+	if (nd->nd_rxpending >= nd->nd_coalcount ||
+	    nd->nd_txpending >= nd->nd_coalcount) {
+		coalsignal(nd);
+	}
+	else if ((nd->nd_rxpending > 0 || nd->nd_txpending > 0) &&
+		 nd->nd_coaltime > 0 && !nd->nd_coaltimed) {
+		nd->nd_coaltimed = 1;
+		schedule_event((uint64_t)nd->nd_coaltime * 1000, nd,
+			       nd->nd_coalgen, coaltimer, "nic coalesce");
+	}
+}
+
+/*
+ * Check that len bytes at physical address paddr lie in RAM, as the
+ * cpu sees it.
+ */
+static
+int
+net_dmacheck(uint32_t paddr, uint32_t len, uint32_t *ramoffset_ret)
+{
+	return cpu_get_ram_offset(paddr, len, ramoffset_ret);
+}
+
+/*
+ * Access a descriptor. The ring was checked when it was enabled.
+ * Descriptors are whole words, so they can be used in place; memory
+ * is in host order (see inlinemem.h).
+ */
+static
+uint32_t *
+ringword(uint32_t ring, uint32_t count, uint32_t n, uint32_t field)
+{
+	uint32_t off;
+
+	if (net_dmacheck(ring, count * NETDESC_SIZE, &off)) {
+		smoke("Network descriptor ring not in memory");
+	}
+	off += (n & (count - 1)) * NETDESC_SIZE + field;
+	return (uint32_t *)(ram + off);
+}
+
+static
+void
+setringstatus(uint32_t ring, uint32_t count, uint32_t n, uint32_t status)
+{
+	uint32_t *ptr;
+
+	ptr = ringword(ring, count, n, NETDESC_STATUS);
+	*ptr = status;
+	bus_mem_dirtyrange((char *)ptr - ram, sizeof(*ptr));
+}
+
+////////////////////////////////////////////////////////////
+
+#ifdef HAVE_NETSHM
+/*
+ * Offer the hub our rings. The control message goes with the
+ * descriptors it needs.
+ */
+static
+int
+sendattach(struct net_data *nd, const void *pkt, size_t len)
+{
+	union {
+		struct cmsghdr cm;
+		char buf[CMSG_SPACE(NETCTL_NFDS * sizeof(int))];
+	} ctl;
+	struct cmsghdr *cm;
+	struct msghdr mh;
+	struct iovec iov;
+	int fds[NETCTL_NFDS];
+
+	/* Start over; nobody else is using them. */
+	netring_init(nd->nd_shm);
+
+	fds[0] = nd->nd_shmfd;
+	fds[1] = nd->nd_tohub_rfd;
+	fds[2] = nd->nd_fromhub_wfd;
+
+	iov.iov_base = (void *)pkt;
+	iov.iov_len = len;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_name = &nd->nd_hubaddr;
+	mh.msg_namelen = nd->nd_hubaddrlen;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	memset(&ctl, 0, sizeof(ctl));
+	mh.msg_control = ctl.buf;
+	mh.msg_controllen = sizeof(ctl.buf);
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+	return sendmsg(nd->nd_socket, &mh, 0);
+}
+#endif
+
 static
 void
 keepalive(void *data, uint32_t junk)
 {
-	struct linkheader lh;
+	char pkt[NETCTL_LEN];
+	struct linkheader *lh = (struct linkheader *)pkt;
 	struct net_data *nd = data;
+	uint32_t op;
 	int r;
 	(void)junk;
 
@@ -126,14 +332,31 @@ keepalive(void *data, uint32_t junk)
 	 * know we exist until we send it a packet. So let's send it a
 	 * packet. In fact, let's do this say once a second all along
 	 * in case the hub crashes and restarts.
+	 *
+	 * If we want the shared-memory transport, this is also how
+	 * we ask for it, and how we tell the hub we're still using it.
 	 */
 
-	lh.lh_frame = htons(FRAME_MAGIC);
-	lh.lh_from = htons(nd->nd_status & NDS_HWADDR);
-	lh.lh_packetlen = htons(sizeof(lh));
-	lh.lh_to = htons(HUB_ADDR);
-
-	r = sendto(nd->nd_socket, (void *)&lh, sizeof(lh), 0, 
+	lh->lh_frame = htons(FRAME_MAGIC);
+	lh->lh_from = htons(nd->nd_status & NDS_HWADDR);
+	lh->lh_packetlen = htons(sizeof(*lh));
+	lh->lh_to = htons(HUB_ADDR);
+
+#ifdef HAVE_NETSHM
+	if (nd->nd_useshm) {
+		op = nd->nd_shmactive ? NETCTL_ATTACHED : NETCTL_ATTACH;
+		lh->lh_packetlen = htons(NETCTL_LEN);
+		op = htonl(op);
+		memcpy(pkt + sizeof(*lh), &op, sizeof(op));
+	}
+	if (nd->nd_useshm && !nd->nd_shmactive) {
+		r = sendattach(nd, pkt, NETCTL_LEN);
+	}
+	else
+#else
+	(void)op;
+#endif
+	r = sendto(nd->nd_socket, pkt, ntohs(lh->lh_packetlen), 0, 
 	       (struct sockaddr *)&nd->nd_hubaddr, nd->nd_hubaddrlen);
 
 	if (r<0 && (errno==ECONNREFUSED || errno==ENOENT || errno==ENOTSOCK)) {
@@ -144,6 +367,10 @@ keepalive(void *data, uint32_t junk)
 			msg("nic: slot %d: lost carrier", nd->nd_slot);
 			nd->nd_lostcarrier = 1;
 		}
+#ifdef HAVE_NETSHM
+		/* whoever comes back won't know about our rings */
+		nd->nd_shmactive = 0;
+#endif
 		HWTRACE(DOTRACE_NET, "nic: slot %d: keepalive rejected: %s", 
 			nd->nd_slot, strerror(errno));
 	}
@@ -165,21 +392,16 @@ keepalive(void *data, uint32_t junk)
 	schedule_event(1000000000, nd, 0, keepalive, "net keepalive");
 }
 
+/*
+ * Put the len-byte packet in the send buffer on the wire.
+ */
 static
 void
-dosend(struct net_data *nd)
+transmit(struct net_data *nd, uint32_t len)
 {
 	struct linkheader *lh = (struct linkheader *)nd->nd_wbuf;
-	uint32_t len;
 	int r;
 
-	len = ntohs(lh->lh_packetlen);
-
-	if (len > NET_BUFSIZE) {
-		hang("Packet size too long");
-		return;
-	}
-
 	HWTRACE(DOTRACE_NET, "nic: slot %d: starting send (%u bytes)", 
 		nd->nd_slot, len);
 
@@ -189,65 +411,209 @@ dosend(struct net_data *nd)
 	lh->lh_frame = htons(FRAME_MAGIC);
 	lh->lh_from = htons(nd->nd_status & NDS_HWADDR);
 
-	r = sendto(nd->nd_socket, nd->nd_wbuf, len, 0, 
-	       (struct sockaddr *)&nd->nd_hubaddr, nd->nd_hubaddrlen);
-	if (r<0) {
-		msg("nic: slot %d: sendto: %s", nd->nd_slot, strerror(errno));
+	if (nd->nd_usecluster) {
+		if (cluster_net_send(clock_monotime(), nd->nd_wbuf, len,
+				     ntohs(lh->lh_to)) < 0) {
+			msg("nic: slot %d: another machine not keeping up; "
+			    "packet lost", nd->nd_slot);
+		}
+	}
+	else
+#ifdef HAVE_NETSHM
+	if (nd->nd_shmactive) {
+		int wake;
+
+		if (netring_put(&nd->nd_shm->nsh_tohub, nd->nd_wbuf, len,
+				&wake) < 0) {
+			msg("nic: slot %d: hub not keeping up; packet lost",
+			    nd->nd_slot);
+		}
+		else if (wake) {
+			netbell_ring(nd->nd_tohub_wfd);
+		}
+	}
+	else
+#endif
+	{
+		r = sendto(nd->nd_socket, nd->nd_wbuf, len, 0, 
+			   (struct sockaddr *)&nd->nd_hubaddr,
+			   nd->nd_hubaddrlen);
+		if (r<0) {
+			msg("nic: slot %d: sendto: %s", nd->nd_slot,
+			    strerror(errno));
+		}
 	}
 
 	g_stats.s_wpkts++;
+}
 
+static
+void
+dosend(struct net_data *nd)
+{
+	struct linkheader *lh = (struct linkheader *)nd->nd_wbuf;
+	uint32_t len;
+
+	len = ntohs(lh->lh_packetlen);
+
+	if (len > NET_BUFSIZE) {
+		hang("Packet size too long");
+		return;
+	}
+
+	transmit(nd, len);
 	writedone(nd);
 }
 
+/*
+ * Send everything posted on the transmit ring.
+ */
 static
-int
-dorecv(void *data)
+void
+txring(void *data, uint32_t junk)
 {
 	struct net_data *nd = data;
+	struct linkheader *lh = (struct linkheader *)nd->nd_wbuf;
+	uint32_t paddr, len, ramoffset, status;
+	(void)junk;
 
-	char junk[8];
-	char *readbuf;
-	size_t readbuflen;
+	nd->nd_txbusy = 0;
 
-	struct linkheader *lh;
+	while (nd->nd_txdone != nd->nd_txpost) {
+		paddr = *ringword(nd->nd_txring, nd->nd_txcount,
+				  nd->nd_txdone, NETDESC_BUF);
+		len = *ringword(nd->nd_txring, nd->nd_txcount,
+				nd->nd_txdone, NETDESC_LEN);
 
-	int overrun=0, r;
+		if (len < sizeof(*lh) || len > NET_BUFSIZE ||
+		    net_dmacheck(paddr, len, &ramoffset)) {
+			HWTRACE(DOTRACE_NET, "nic: slot %d: bad transmit "
+				"descriptor (0x%x, %u bytes)", nd->nd_slot,
+				paddr, len);
+			status = NDD_DONE | NDD_ERROR;
+		}
+		else {
+			bus_mem_read(ramoffset, nd->nd_wbuf, len);
+			lh->lh_packetlen = htons(len);
+			transmit(nd, len);
+			status = NDD_DONE | len;
+		}
+		setringstatus(nd->nd_txring, nd->nd_txcount, nd->nd_txdone,
+			      status);
 
-	if (nd->nd_rirq != 0) {
-		/*
-		 * The last packet we got hasn't cleared yet.
-		 * Drop this one.
-		 */
-		overrun = 1;
-		readbuf = junk;
-		readbuflen = sizeof(junk);
+		nd->nd_txdone++;
+		nd->nd_txpending++;
+	}
+
+	coalesce(nd);
+}
+
+/*
+ * Put a received frame in the next receive descriptor.
+ */
+static
+void
+ringrecv(struct net_data *nd, const char *readbuf, int r)
+{
+	uint32_t paddr, len, ramoffset, status;
+
+	if (nd->nd_rxdone == nd->nd_rxpost) {
+		HWTRACE(DOTRACE_NET, "nic: slot %d: receive ring full",
+			nd->nd_slot);
+		g_stats.s_dpkts++;
+		return;
+	}
+
+	paddr = *ringword(nd->nd_rxring, nd->nd_rxcount,
+			  nd->nd_rxdone, NETDESC_BUF);
+	len = *ringword(nd->nd_rxring, nd->nd_rxcount,
+			nd->nd_rxdone, NETDESC_LEN);
+
+	if ((uint32_t)r > len || net_dmacheck(paddr, r, &ramoffset)) {
+		HWTRACE(DOTRACE_NET, "nic: slot %d: bad receive descriptor "
+			"(0x%x, %u bytes) for %d-byte packet", nd->nd_slot,
+			paddr, len, r);
+		g_stats.s_epkts++;
+		status = NDD_DONE | NDD_ERROR | r;
 	}
 	else {
-		readbuf = nd->nd_rbuf;
-		readbuflen = NET_BUFSIZE;
+		bus_mem_write(ramoffset, readbuf, r);
+		g_stats.s_rpkts++;
+		status = NDD_DONE | r;
 	}
+	setringstatus(nd->nd_rxring, nd->nd_rxcount, nd->nd_rxdone, status);
 
-	r = read(nd->nd_socket, readbuf, readbuflen);
-	if (r<0) {
-		msg("nic: slot %d: read: %s", nd->nd_slot, strerror(errno));
-		HWTRACE(DOTRACE_NET, "nic: slot %d: read error", 
-			nd->nd_slot);
-		return 0;
+	HWTRACE(DOTRACE_NET, "nic: slot %d: packet received", nd->nd_slot);
+	nd->nd_rxdone++;
+	nd->nd_rxpending++;
+	coalesce(nd);
+}
+
+/*
+ * Control message from the hub.
+ */
+static
+void
+hubcontrol(struct net_data *nd, const char *pkt)
+{
+	uint32_t op;
+
+	memcpy(&op, pkt + sizeof(struct linkheader), sizeof(op));
+	op = ntohl(op);
+
+#ifdef HAVE_NETSHM
+	if (op == NETCTL_ATTACHED && nd->nd_useshm && !nd->nd_shmactive) {
+		HWTRACE(DOTRACE_NET, "nic: slot %d: using shared-memory "
+			"transport", nd->nd_slot);
+		nd->nd_shmactive = 1;
+		if (netring_wantwake(&nd->nd_shm->nsh_fromhub)) {
+			netbell_ring(nd->nd_fromhub_wfd);
+		}
+		return;
+	}
+	if (op == NETCTL_DETACHED && nd->nd_shmactive) {
+		HWTRACE(DOTRACE_NET, "nic: slot %d: hub dropped shared-memory "
+			"transport", nd->nd_slot);
+		nd->nd_shmactive = 0;
+		return;
 	}
+#else
+	(void)nd;
+#endif
+	(void)op;
+}
+
+/*
+ * Check a received frame of length r in readbuf, which is either
+ * the receive buffer or (if overrun is set) a scratch buffer.
+ */
+static
+void
+recvframe(struct net_data *nd, const char *readbuf, int r, int overrun)
+{
+	const struct linkheader *lh;
+
 	if (r < 8) {
 		HWTRACE(DOTRACE_NET, "nic: slot %d: runt packet", nd->nd_slot);
 		g_stats.s_epkts++;
-		return 0;
+		return;
 	}
 
-	lh = (struct linkheader *)readbuf;
+	lh = (const struct linkheader *)readbuf;
 
 	if (ntohs(lh->lh_frame) != FRAME_MAGIC) {
 		HWTRACE(DOTRACE_NET, "nic: slot %d: framing error", 
 			nd->nd_slot);
 		g_stats.s_epkts++;
-		return 0;
+		return;
+	}
+
+	if (ntohs(lh->lh_from) == HUB_ADDR) {
+		/* The hub only sends us control messages. */
+		if (r == NETCTL_LEN && ntohs(lh->lh_packetlen) == r) {
+			hubcontrol(nd, readbuf);
+		}
+		return;
 	}
 
 	if (ntohs(lh->lh_to) != (uint16_t)(nd->nd_status & NDS_HWADDR) &&
@@ -255,36 +621,170 @@ dorecv(void *data)
 	    (nd->nd_control & NDC_PROMISC)==0) {
 		HWTRACE(DOTRACE_NET, "nic: slot %d: packet not for us", 
 			nd->nd_slot);
-		return 0;
+		return;
 	}
 
 	if (ntohs(lh->lh_packetlen) > r) {
 		HWTRACE(DOTRACE_NET, "nic: slot %d: truncated packet", 
 			nd->nd_slot);
 		g_stats.s_epkts++;
-		return 0;
+		return;
 	}
 
 	if (ntohs(lh->lh_packetlen) < r) {
 		HWTRACE(DOTRACE_NET, "nic: slot %d: garbage on end of packet", 
 			nd->nd_slot);
 		g_stats.s_epkts++;
-		return 0;
+		return;
+	}
+
+	if (nd->nd_control & NDC_RINGS) {
+		ringrecv(nd, readbuf, r);
+		return;
 	}
 
 	if (overrun) {
 		HWTRACE(DOTRACE_NET, "nic: slot %d: overrun",
 			nd->nd_slot);
 		g_stats.s_dpkts++;
-		return 0;
+		return;
 	}
 
 	g_stats.s_rpkts++;
 
 	readdone(nd);
+}
 
+static
+int
+dorecv(void *data)
+{
+	struct net_data *nd = data;
+
+	/* big enough for hub control messages */
+	char junk[16];
+	char *readbuf;
+	size_t readbuflen;
+
+	int overrun=0, r;
+
+	if (nd->nd_rirq != 0 && (nd->nd_control & NDC_RINGS) == 0) {
+		/*
+		 * The last packet we got hasn't cleared yet.
+		 * Drop this one. (With rings the receive buffer is
+		 * only a staging area.)
+		 */
+		overrun = 1;
+		readbuf = junk;
+		readbuflen = sizeof(junk);
+	}
+	else {
+		readbuf = nd->nd_rbuf;
+		readbuflen = NET_BUFSIZE;
+	}
+
+	r = read(nd->nd_socket, readbuf, readbuflen);
+	if (r<0) {
+		msg("nic: slot %d: read: %s", nd->nd_slot, strerror(errno));
+		HWTRACE(DOTRACE_NET, "nic: slot %d: read error", 
+			nd->nd_slot);
+		return 0;
+	}
+
+	recvframe(nd, readbuf, r, overrun);
+	return 0;
+}
+
+#ifdef HAVE_NETSHM
+/*
+ * The doorbell for our receive ring. Take one frame per call, like
+ * the socket; leave the doorbell readable until the ring is empty
+ * so we get called again.
+ */
+static
+int
+shmrecv(void *data)
+{
+	struct net_data *nd = data;
+	struct netring *nr = &nd->nd_shm->nsh_fromhub;
+	char junk[NET_BUFSIZE];
+	int overrun, r;
+
+	if (!nd->nd_shmactive) {
+		netbell_drain(nd->nd_fromhub_rfd);
+		return 0;
+	}
+
+	overrun = nd->nd_rirq != 0 && (nd->nd_control & NDC_RINGS) == 0;
+	r = netring_get(nr, overrun ? junk : nd->nd_rbuf, NET_BUFSIZE);
+	if (r >= 0) {
+		recvframe(nd, overrun ? junk : nd->nd_rbuf, r, overrun);
+		return 0;
+	}
+
+	netbell_drain(nd->nd_fromhub_rfd);
+	if (netring_wantwake(nr)) {
+		/* something arrived meanwhile */
+		netbell_ring(nd->nd_fromhub_wfd);
+	}
 	return 0;
 }
+#endif
+
+/*
+ * Frames from the other machines (transport=cluster) each arrive at
+ * a set time; take the ones that are due, and be called again when
+ * the next one is. cluster_sync calls clusterwake whenever more may
+ * have become due.
+ */
+static void clusterwake(void *data);
+
+static
+void
+clusterrecv(void *data, uint32_t gen)
+{
+	struct net_data *nd = data;
+	char junk[NET_BUFSIZE];
+	int overrun, r;
+
+	if (gen != nd->nd_crecvgen) {
+		return;
+	}
+	nd->nd_crecvtimed = 0;
+
+	while (1) {
+		overrun = nd->nd_rirq != 0 &&
+			(nd->nd_control & NDC_RINGS) == 0;
+		r = cluster_net_recv(clock_monotime(),
+				     overrun ? junk : nd->nd_rbuf,
+				     NET_BUFSIZE);
+		if (r < 0) {
+			break;
+		}
+		recvframe(nd, overrun ? junk : nd->nd_rbuf, r, overrun);
+	}
+	clusterwake(nd);
+}
+
+static
+void
+clusterwake(void *data)
+{
+	struct net_data *nd = data;
+	uint64_t when;
+
+	if (cluster_net_next(&when) < 0) {
+		return;
+	}
+	if (nd->nd_crecvtimed && nd->nd_crecvwhen <= when) {
+		return;
+	}
+	nd->nd_crecvgen++;
+	nd->nd_crecvtimed = 1;
+	nd->nd_crecvwhen = when;
+	schedule_event_at(when, nd, nd->nd_crecvgen,
+			  clusterrecv, "nic cluster receive");
+}
 
 ////////////////////////////////////////////////////////////
 
@@ -318,6 +818,58 @@ triggersend(void *n, uint32_t code)
 	nd->nd_control &= ~NDC_START;
 }
 
+/*
+ * Check the rings before turning them on.
+ */
+static
+int
+ringcheck(uint32_t ring, uint32_t count)
+{
+	uint32_t ramoffset;
+
+	if (count == 0) {
+		hang("Network descriptor ring size not set");
+		return -1;
+	}
+	if (ring % NETDESC_SIZE != 0) {
+		hang("Network descriptor ring not aligned");
+		return -1;
+	}
+	if (net_dmacheck(ring, count * NETDESC_SIZE, &ramoffset)) {
+		hang("Network descriptor ring outside of memory");
+		return -1;
+	}
+	return 0;
+}
+
+static
+int
+startrings(struct net_data *nd)
+{
+	if (ringcheck(nd->nd_rxring, nd->nd_rxcount) ||
+	    ringcheck(nd->nd_txring, nd->nd_txcount)) {
+		return -1;
+	}
+	HWTRACE(DOTRACE_NET, "nic: slot %d: descriptor rings enabled",
+		nd->nd_slot);
+	nd->nd_rxpost = nd->nd_rxdone = 0;
+	nd->nd_txpost = nd->nd_txdone = 0;
+	nd->nd_rxpending = nd->nd_txpending = 0;
+	return 0;
+}
+
+static
+void
+stoprings(struct net_data *nd)
+{
+	HWTRACE(DOTRACE_NET, "nic: slot %d: descriptor rings disabled",
+		nd->nd_slot);
+	/* completions not yet signalled are forgotten */
+	nd->nd_rxpending = nd->nd_txpending = 0;
+	nd->nd_coalgen++;
+	nd->nd_coaltimed = 0;
+}
+
 static
 void
 setctl(struct net_data *nd, uint32_t val)
@@ -325,7 +877,24 @@ setctl(struct net_data *nd, uint32_t val)
 	if ((val & NDC_ZERO) != 0) {
 		hang("Illegal network control register write");
 	}
+	else if ((val & NDC_RINGS) &&
+		 ((val | nd->nd_control) & NDC_START)) {
+		hang("Network descriptor rings used with register send");
+	}
+	else if ((nd->nd_control & NDC_RINGS) && !(val & NDC_RINGS) &&
+		 nd->nd_txbusy) {
+		hang("Network descriptor rings disabled while sending");
+	}
 	else {
+		if ((val & NDC_RINGS) && !(nd->nd_control & NDC_RINGS)) {
+			if (startrings(nd)) {
+				return;
+			}
+		}
+		else if (!(val & NDC_RINGS) && (nd->nd_control & NDC_RINGS)) {
+			stoprings(nd);
+		}
+
 		if (val & NDC_START) {
 			if (nd->nd_control & NDC_START) {
 				hang("Network packet send started while "
@@ -346,6 +915,73 @@ setctl(struct net_data *nd, uint32_t val)
 	}
 }
 
+/*
+ * Set one of the ring base or size registers.
+ */
+static
+void
+setring(struct net_data *nd, uint32_t *reg, uint32_t val, int issize)
+{
+	if (nd->nd_control & NDC_RINGS) {
+		hang("Network descriptor ring changed while in use");
+	}
+	else if (issize && (val == 0 || val > NET_MAXRING ||
+			    (val & (val - 1)) != 0)) {
+		hang("Illegal network descriptor ring size");
+	}
+	else {
+		*reg = val;
+	}
+}
+
+/*
+ * The guest has posted descriptors, up to (but not including) val.
+ */
+static
+void
+setpost(struct net_data *nd, uint32_t val, int isrx)
+{
+	uint32_t done = isrx ? nd->nd_rxdone : nd->nd_txdone;
+	uint32_t count = isrx ? nd->nd_rxcount : nd->nd_txcount;
+
+	if ((nd->nd_control & NDC_RINGS) == 0) {
+		hang("Network descriptors posted with rings disabled");
+	}
+	else if (val - done > count) {
+		hang("Network descriptor ring overflow");
+	}
+	else if (isrx) {
+		nd->nd_rxpost = val;
+	}
+	else {
+		nd->nd_txpost = val;
+		if (nd->nd_txpost != nd->nd_txdone && !nd->nd_txbusy) {
+			nd->nd_txbusy = 1;
+			schedule_event(NETWORK_LATENCY, nd, 0, txring,
+				       "packet send");
+		}
+	}
+}
+
+static
+void
+setcoal(struct net_data *nd, uint32_t val, int istime)
+{
+	if (istime) {
+		nd->nd_coaltime = val;
+	}
+	else if (val == 0) {
+		hang("Illegal network interrupt coalescing count");
+		return;
+	}
+	else {
+		nd->nd_coalcount = val;
+	}
+	if (nd->nd_control & NDC_RINGS) {
+		coalesce(nd);
+	}
+}
+
 ////////////////////////////////////////////////////////////
 
 static
@@ -356,21 +992,21 @@ net_fetch(unsigned cpunum, void *d, uint32_t offset, uint32_t *val)
 
 	(void)cpunum;
 
-	if (offset >= NET_READBUF && offset < NET_READBUF+NET_BUFSIZE) {
-		char *ptr = &nd->nd_rbuf[offset - NET_READBUF];
-		*val = ctoh32(*(uint32_t *)ptr);
-		return 0;
-	}
-	else if (offset >= NET_WRITEBUF && offset < NET_WRITEBUF+NET_BUFSIZE) {
-		char *ptr = &nd->nd_wbuf[offset - NET_WRITEBUF];
-		*val = ctoh32(*(uint32_t *)ptr);
-		return 0;
-	}
 	switch (offset) {
 	    case NETREG_READINTR: *val = nd->nd_rirq; return 0;
 	    case NETREG_WRITEINTR: *val = nd->nd_wirq; return 0;
 	    case NETREG_CONTROL: *val = nd->nd_control; return 0;
 	    case NETREG_STATUS: *val = nd->nd_status; return 0;
+	    case NETREG_RXRING: *val = nd->nd_rxring; return 0;
+	    case NETREG_RXCOUNT: *val = nd->nd_rxcount; return 0;
+	    case NETREG_RXPOST: *val = nd->nd_rxpost; return 0;
+	    case NETREG_RXDONE: *val = nd->nd_rxdone; return 0;
+	    case NETREG_TXRING: *val = nd->nd_txring; return 0;
+	    case NETREG_TXCOUNT: *val = nd->nd_txcount; return 0;
+	    case NETREG_TXPOST: *val = nd->nd_txpost; return 0;
+	    case NETREG_TXDONE: *val = nd->nd_txdone; return 0;
+	    case NETREG_COALCOUNT: *val = nd->nd_coalcount; return 0;
+	    case NETREG_COALTIME: *val = nd->nd_coaltime; return 0;
 	}
 	return -1;
 }
@@ -383,36 +1019,201 @@ net_store(unsigned cpunum, void *d, uint32_t offset, uint32_t val)
 
 	(void)cpunum;
 
-	if (offset >= NET_READBUF && offset < NET_READBUF+NET_BUFSIZE) {
-		char *ptr = &nd->nd_rbuf[offset - NET_READBUF];
-		*(uint32_t *)ptr = htoc32(val);
-		return 0;
-	}
-	else if (offset >= NET_WRITEBUF && offset < NET_WRITEBUF+NET_BUFSIZE) {
-		char *ptr = &nd->nd_wbuf[offset - NET_WRITEBUF];
-		*(uint32_t *)ptr = htoc32(val);
-		return 0;
-	}
 	switch (offset) {
 	    case NETREG_READINTR: setirq(nd, val, 1); break;
 	    case NETREG_WRITEINTR: setirq(nd, val, 0); break;
 	    case NETREG_CONTROL: setctl(nd, val); break;
 	    case NETREG_STATUS: return -1;
+	    case NETREG_RXRING: setring(nd, &nd->nd_rxring, val, 0); break;
+	    case NETREG_RXCOUNT: setring(nd, &nd->nd_rxcount, val, 1); break;
+	    case NETREG_RXPOST: setpost(nd, val, 1); break;
+	    case NETREG_RXDONE: return -1;
+	    case NETREG_TXRING: setring(nd, &nd->nd_txring, val, 0); break;
+	    case NETREG_TXCOUNT: setring(nd, &nd->nd_txcount, val, 1); break;
+	    case NETREG_TXPOST: setpost(nd, val, 0); break;
+	    case NETREG_TXDONE: return -1;
+	    case NETREG_COALCOUNT: setcoal(nd, val, 0); break;
+	    case NETREG_COALTIME: setcoal(nd, val, 1); break;
 	    default: return -1;
 	}
 	return 0;
 }
 
+/*
+ * The packet buffers are accessed directly by the bus.
+ */
+static
+int
+net_windows(void *d, struct lamebus_window *windows)
+{
+	struct net_data *nd = d;
+
+	windows[0].lw_offset = NET_READBUF;
+	windows[0].lw_size = NET_BUFSIZE;
+	windows[0].lw_mem = nd->nd_rbuf;
+	windows[1].lw_offset = NET_WRITEBUF;
+	windows[1].lw_size = NET_BUFSIZE;
+	windows[1].lw_mem = nd->nd_wbuf;
+	return 2;
+}
+
+#ifdef HAVE_NETSHM
+/*
+ * Create the shared memory and doorbells for transport=shm.
+ */
+static
+void
+shmsetup(struct net_data *nd, const char *cwd)
+{
+	void *ptr;
+
+#ifdef HAVE_MEMFD
+	nd->nd_shmfd = memfd_create("sys161-net", MFD_CLOEXEC);
+	if (nd->nd_shmfd < 0) {
+		msg("nic: slot %d: memfd_create: %s", nd->nd_slot,
+		    strerror(errno));
+		die();
+	}
+#else
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/.sockets/netshm-XXXXXX", cwd);
+	nd->nd_shmfd = mkstemp(path);
+	if (nd->nd_shmfd < 0) {
+		msg("nic: slot %d: %s: %s", nd->nd_slot, path,
+		    strerror(errno));
+		die();
+	}
+	unlink(path);
+#endif
+	(void)cwd;
+
+	if (ftruncate(nd->nd_shmfd, sizeof(struct netring_shm)) < 0) {
+		msg("nic: slot %d: ftruncate: %s", nd->nd_slot,
+		    strerror(errno));
+		die();
+	}
+	ptr = mmap(NULL, sizeof(struct netring_shm), PROT_READ|PROT_WRITE,
+		   MAP_SHARED, nd->nd_shmfd, 0);
+	if (ptr == MAP_FAILED) {
+		msg("nic: slot %d: mmap: %s", nd->nd_slot, strerror(errno));
+		die();
+	}
+	nd->nd_shm = ptr;
+	netring_init(nd->nd_shm);
+
+	if (netbell_create(&nd->nd_tohub_rfd, &nd->nd_tohub_wfd) < 0 ||
+	    netbell_create(&nd->nd_fromhub_rfd, &nd->nd_fromhub_wfd) < 0) {
+		msg("nic: slot %d: doorbell: %s", nd->nd_slot,
+		    strerror(errno));
+		die();
+	}
+
+	onselect(nd->nd_fromhub_rfd, nd, shmrecv, NULL);
+}
+
+static
+void
+shmcleanup(struct net_data *nd)
+{
+	notonselect(nd->nd_fromhub_rfd);
+	close(nd->nd_tohub_rfd);
+	if (nd->nd_tohub_wfd != nd->nd_tohub_rfd) {
+		close(nd->nd_tohub_wfd);
+	}
+	close(nd->nd_fromhub_rfd);
+	if (nd->nd_fromhub_wfd != nd->nd_fromhub_rfd) {
+		close(nd->nd_fromhub_wfd);
+	}
+	munmap(nd->nd_shm, sizeof(struct netring_shm));
+	close(nd->nd_shmfd);
+}
+#endif
+
+/*
+ * Our end of the connection to the hub: .sockets/net-XXXX, where
+ * XXXX is the hardware address, or in a fork-server child
+ * .sockets/net-XXXX.N for run N.
+ */
+static
+void
+net_sockname(struct net_data *nd, const char *cwd, struct sockaddr_un *sun)
+{
+	uint16_t hwaddr = nd->nd_status & NDS_HWADDR;
+	int len;
+
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (nd->nd_run > 0) {
+		len = snprintf(sun->sun_path, sizeof(sun->sun_path),
+			       "%s/.sockets/net-%04x.%u", cwd, hwaddr,
+			       nd->nd_run);
+	}
+	else {
+		len = snprintf(sun->sun_path, sizeof(sun->sun_path),
+			       "%s/.sockets/net-%04x", cwd, hwaddr);
+	}
+	if (len < 0 || len >= (int) sizeof(sun->sun_path)) {
+		msg("nic: slot %d: current directory %s too long",
+		    nd->nd_slot, cwd);
+		die();
+	}
+}
+
+static
+void
+net_opensocket(struct net_data *nd, const char *cwd)
+{
+	struct sockaddr_un mysun;
+	socklen_t mylen;
+	int one=1;
+
+	nd->nd_socket = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (nd->nd_socket < 0) {
+		msg("nic: slot %d: socket: %s", nd->nd_slot, strerror(errno));
+		die();
+	}
+
+	net_sockname(nd, cwd, &mysun);
+	mylen = SUN_LEN(&mysun);
+#ifdef HAS_SUN_LEN
+	mysun.sun_len = mylen;
+#endif
+
+	unlink(mysun.sun_path);
+	setsockopt(nd->nd_socket, SOL_SOCKET, SO_REUSEADDR, 
+		   (void *)&one, sizeof(one));
+
+	if (bind(nd->nd_socket, (struct sockaddr *)&mysun, mylen)<0) {
+		msg("nic: slot %d: bind: %s", nd->nd_slot, strerror(errno));
+		die();
+	}
+
+	onselect(nd->nd_socket, nd, dorecv, NULL);
+}
+
 static
 void
 net_cleanup(void *d)
 {
 	struct net_data *nd = d;
+	struct sockaddr_un mysun;
+	char cwd[PATH_MAX];
 
+#ifdef HAVE_NETSHM
+	if (nd->nd_useshm) {
+		shmcleanup(nd);
+	}
+#endif
 	if (nd->nd_socket >= 0) {
 		close(nd->nd_socket);
 		nd->nd_socket = -1;
 	}
+	if (nd->nd_run > 0 && getcwd(cwd, sizeof(cwd)) != NULL) {
+		/* don't leave one behind for every run */
+		net_sockname(nd, cwd, &mysun);
+		unlink(mysun.sun_path);
+	}
 
 	free(nd->nd_rbuf);
 	free(nd->nd_wbuf);
@@ -426,13 +1227,10 @@ net_init(int slot, int argc, char *argv[])
 	struct net_data *nd = domalloc(sizeof(struct net_data));
 	const char *hubname = ".sockets/hub";
 	uint16_t hwaddr = HUB_ADDR;
+	uint32_t coalcount = 1, coaltime = 0;
+	int useshm = 0, usecluster = 0;
 	char cwd[PATH_MAX];
-	int len;
-
-	struct sockaddr_un mysun;
-	socklen_t mylen;
-
-	int i, one=1;
+	int i;
 
 	for (i=1; i<argc; i++) {
 		if (!strncmp(argv[i], "hub=", 4)) {
@@ -441,6 +1239,35 @@ net_init(int slot, int argc, char *argv[])
 		else if (!strncmp(argv[i], "hwaddr=", 7)) {
 			hwaddr = atoi(argv[i]+7);
 		}
+		else if (!strncmp(argv[i], "coalesce=", 9)) {
+			coalcount = atoi(argv[i]+9);
+			if (coalcount == 0) {
+				msg("nic: slot %d: coalesce must be at "
+				    "least 1", slot);
+				die();
+			}
+		}
+		else if (!strncmp(argv[i], "coalescetime=", 13)) {
+			coaltime = atoi(argv[i]+13);
+		}
+		else if (!strcmp(argv[i], "transport=socket")) {
+			useshm = 0;
+			usecluster = 0;
+		}
+		else if (!strcmp(argv[i], "transport=cluster")) {
+			usecluster = 1;
+			useshm = 0;
+		}
+		else if (!strcmp(argv[i], "transport=shm")) {
+#ifdef HAVE_NETSHM
+			useshm = 1;
+			usecluster = 0;
+#else
+			msg("nic: slot %d: transport=shm not supported "
+			    "on this platform", slot);
+			die();
+#endif
+		}
 		else {
 			msg("nic: slot %d: invalid option %s", slot, argv[i]);
 			die();
@@ -461,39 +1288,37 @@ net_init(int slot, int argc, char *argv[])
 
 	nd->nd_status = ND_STATUS(hwaddr, 0);
 
-	nd->nd_socket = socket(AF_UNIX, SOCK_DGRAM, 0);
-	if (nd->nd_socket < 0) {
-		msg("nic: slot %d: socket: %s", slot, strerror(errno));
-		die();
+	nd->nd_rxring = nd->nd_rxcount = nd->nd_rxpost = nd->nd_rxdone = 0;
+	nd->nd_txring = nd->nd_txcount = nd->nd_txpost = nd->nd_txdone = 0;
+	nd->nd_txbusy = 0;
+	nd->nd_coalcount = coalcount;
+	nd->nd_coaltime = coaltime;
+	nd->nd_rxpending = nd->nd_txpending = 0;
+	nd->nd_coalgen = 0;
+	nd->nd_coaltimed = 0;
+
+	nd->nd_run = 0;
+	nd->nd_usecluster = usecluster;
+	nd->nd_crecvtimed = 0;
+	nd->nd_crecvwhen = 0;
+	nd->nd_crecvgen = 0;
+	if (usecluster) {
+		if (cluster_net_attach(hwaddr, clusterwake, nd) < 0) {
+			msg("nic: slot %d: transport=cluster needs -n, and "
+			    "only one nic per machine can use it", slot);
+			die();
+		}
+		nd->nd_socket = -1;
+		nd->nd_lostcarrier = 0;
+	}
+	else {
+		net_opensocket(nd, cwd);
+		nd->nd_lostcarrier = 1;
 	}
-
-	nd->nd_lostcarrier = 1;
 
 	nd->nd_rbuf = domalloc(NET_BUFSIZE);
 	nd->nd_wbuf = domalloc(NET_BUFSIZE);
 
-	memset(&mysun, 0, sizeof(mysun));
-	mysun.sun_family = AF_UNIX;
-	len = snprintf(mysun.sun_path, sizeof(mysun.sun_path),
-		       "%s/.sockets/net-%04x", cwd, hwaddr);
-	if (len < 0 || len >= (int) sizeof(mysun.sun_path)) {
-		msg("nic: slot %d: current directory %s too long", slot, cwd);
-		die();
-	}
-	mylen = SUN_LEN(&mysun);
-#ifdef HAS_SUN_LEN
-	mysun.sun_len = mylen;
-#endif
-
-	unlink(mysun.sun_path);
-	setsockopt(nd->nd_socket, SOL_SOCKET, SO_REUSEADDR, 
-		   (void *)&one, sizeof(one));
-
-	if (bind(nd->nd_socket, (struct sockaddr *)&mysun, mylen)<0) {
-		msg("nic: slot %d: bind: %s", slot, strerror(errno));
-		die();
-	}
-
 	memset(&nd->nd_hubaddr, 0, sizeof(nd->nd_hubaddr));
 	nd->nd_hubaddr.sun_family = AF_UNIX;
 	strcpy(nd->nd_hubaddr.sun_path, hubname);
@@ -502,9 +1327,24 @@ net_init(int slot, int argc, char *argv[])
 	nd->nd_hubaddr.sun_len = nd->nd_hubaddrlen;
 #endif
 
-	onselect(nd->nd_socket, nd, dorecv, NULL);
+	clock_nameevent(keepalive, "nic keepalive");
+	clock_nameevent(triggersend, "nic send");
+	clock_nameevent(txring, "nic ring send");
+	clock_nameevent(coaltimer, "nic coalesce");
 
-	keepalive(nd, 0);
+#ifdef HAVE_NETSHM
+	nd->nd_useshm = useshm;
+	nd->nd_shmactive = 0;
+	if (useshm) {
+		shmsetup(nd, cwd);
+	}
+#else
+	(void)useshm;
+#endif
+
+	if (!usecluster) {
+		keepalive(nd, 0);
+	}
 
 	return nd;
 }
@@ -515,19 +1355,157 @@ net_dumpstate(void *data)
 {
 	struct net_data *nd = data;
 	msg("System/161 network interface rev %d", NET_REVISION);
-	msg("    Hub: %s", nd->nd_hubaddr.sun_path);
-	msg("    Carrier: %s", nd->nd_lostcarrier ? "none" : "detected");
+	if (nd->nd_usecluster) {
+		msg("    Transport: cluster (machine %u)", cluster_node);
+	}
+	else {
+		msg("    Hub: %s", nd->nd_hubaddr.sun_path);
+		msg("    Carrier: %s",
+		    nd->nd_lostcarrier ? "none" : "detected");
+#ifdef HAVE_NETSHM
+		if (nd->nd_useshm) {
+			msg("    Transport: shared memory (%s)",
+			    nd->nd_shmactive ? "attached" : "waiting for hub");
+		}
+		else
+#endif
+		msg("    Transport: socket");
+	}
 	msg("    rirq: %lu  wirq: %lu  control: %lu  status: 0x%04lx",
 	    (unsigned long) nd->nd_rirq,
 	    (unsigned long) nd->nd_wirq,
 	    (unsigned long) nd->nd_control,
 	    (unsigned long) nd->nd_status);
+	if (nd->nd_control & NDC_RINGS) {
+		msg("    rx ring: 0x%08lx size %lu posted %lu done %lu",
+		    (unsigned long) nd->nd_rxring,
+		    (unsigned long) nd->nd_rxcount,
+		    (unsigned long) nd->nd_rxpost,
+		    (unsigned long) nd->nd_rxdone);
+		msg("    tx ring: 0x%08lx size %lu posted %lu done %lu%s",
+		    (unsigned long) nd->nd_txring,
+		    (unsigned long) nd->nd_txcount,
+		    (unsigned long) nd->nd_txpost,
+		    (unsigned long) nd->nd_txdone,
+		    nd->nd_txbusy ? " (sending)" : "");
+	}
+	msg("    coalescing: %lu completions or %lu us; "
+	    "%lu rx %lu tx not yet signalled",
+	    (unsigned long) nd->nd_coalcount,
+	    (unsigned long) nd->nd_coaltime,
+	    (unsigned long) nd->nd_rxpending,
+	    (unsigned long) nd->nd_txpending);
 	msg("    rx buffer:");
 	dohexdump(nd->nd_rbuf, NET_BUFSIZE);
 	msg("    tx buffer:");
 	dohexdump(nd->nd_wbuf, NET_BUFSIZE);
 }
 
+/*
+ * Packets in flight on the hub are not part of the machine; the
+ * carrier state comes back from the hub by itself.
+ */
+static
+void
+net_save(void *data)
+{
+	struct net_data *nd = data;
+
+	snap_write32(nd->nd_rirq);
+	snap_write32(nd->nd_wirq);
+	snap_write32(nd->nd_control);
+	snap_write32(nd->nd_status);
+	snap_write(nd->nd_rbuf, NET_BUFSIZE);
+	snap_write(nd->nd_wbuf, NET_BUFSIZE);
+
+	snap_write32(nd->nd_rxring);
+	snap_write32(nd->nd_rxcount);
+	snap_write32(nd->nd_rxpost);
+	snap_write32(nd->nd_rxdone);
+	snap_write32(nd->nd_txring);
+	snap_write32(nd->nd_txcount);
+	snap_write32(nd->nd_txpost);
+	snap_write32(nd->nd_txdone);
+	snap_write32(nd->nd_txbusy);
+
+	snap_write32(nd->nd_coalcount);
+	snap_write32(nd->nd_coaltime);
+	snap_write32(nd->nd_rxpending);
+	snap_write32(nd->nd_txpending);
+	snap_write32(nd->nd_coalgen);
+	snap_write32(nd->nd_coaltimed);
+}
+
+static
+void
+net_restore(void *data)
+{
+	struct net_data *nd = data;
+
+	nd->nd_rirq = snap_read32();
+	nd->nd_wirq = snap_read32();
+	nd->nd_control = snap_read32();
+	if ((snap_read32() & NDS_HWADDR) != (nd->nd_status & NDS_HWADDR)) {
+		snap_error("Snapshot has a different hardware address "
+			   "for the nic in slot %d", nd->nd_slot);
+	}
+	snap_read(nd->nd_rbuf, NET_BUFSIZE);
+	snap_read(nd->nd_wbuf, NET_BUFSIZE);
+
+	nd->nd_rxring = snap_read32();
+	nd->nd_rxcount = snap_read32();
+	nd->nd_rxpost = snap_read32();
+	nd->nd_rxdone = snap_read32();
+	nd->nd_txring = snap_read32();
+	nd->nd_txcount = snap_read32();
+	nd->nd_txpost = snap_read32();
+	nd->nd_txdone = snap_read32();
+	nd->nd_txbusy = snap_read32();
+
+	nd->nd_coalcount = snap_read32();
+	nd->nd_coaltime = snap_read32();
+	nd->nd_rxpending = snap_read32();
+	nd->nd_txpending = snap_read32();
+	nd->nd_coalgen = snap_read32();
+	nd->nd_coaltimed = snap_read32();
+}
+
+/*
+ * In a fork-server child, get our own socket (and shared-memory
+ * ring) so the parent's traffic and ours don't get mixed up. The hub
+ * finds us again from the next keepalive. (There's no fork server
+ * with -n, so no transport=cluster.)
+ */
+static
+void
+net_forked(void *data, unsigned run)
+{
+	struct net_data *nd = data;
+	char cwd[PATH_MAX];
+
+	if (nd->nd_usecluster) {
+		return;
+	}
+
+	if (getcwd(cwd, sizeof(cwd))==NULL) {
+		msg("nic: slot %d: getcwd: %s", nd->nd_slot, strerror(errno));
+		die();
+	}
+
+	notonselect(nd->nd_socket);
+	close(nd->nd_socket);
+	nd->nd_run = run;
+	net_opensocket(nd, cwd);
+
+#ifdef HAVE_NETSHM
+	if (nd->nd_useshm) {
+		shmcleanup(nd);
+		nd->nd_shmactive = 0;
+		shmsetup(nd, cwd);
+	}
+#endif
+}
+
 const struct lamebus_device_info net_device_info = {
 	LBVEND_SYS161,
 	LBVEND_SYS161_NET,
@@ -537,4 +1515,9 @@ const struct lamebus_device_info net_device_info = {
 	net_store,
 	net_dumpstate,
 	net_cleanup,
+	net_save,
+	net_restore,
+	net_forked,
+	NULL,
+	net_windows,
 };
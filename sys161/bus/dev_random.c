@@ -106,4 +106,9 @@ const struct lamebus_device_info random_device_info = {
 	rand_store,
 	rand_dumpstate,
 	rand_cleanup,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
 };
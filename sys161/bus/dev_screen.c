@@ -29,6 +29,11 @@ const struct lamebus_device_info screen_device_info = {
 	NULL,  /* fetch */
 	NULL,  /* store */
 	NULL,  /* dumpstate */
-	NULL   /* cleanup */
+	NULL,  /* cleanup */
+	NULL,  /* save */
+	NULL,  /* restore */
+	NULL,  /* forked */
+	NULL,  /* busy */
+	NULL   /* windows */
 };
 
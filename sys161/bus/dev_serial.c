@@ -9,6 +9,7 @@
 #include "clock.h"
 #include "main.h"
 #include "util.h"
+#include "snapshot.h"
 
 #include "busids.h"
 #include "lamebus.h"
@@ -247,6 +248,8 @@ serial_init(int slot, int argc, char *argv[])
 	(void)argv;
 
 	console_onkey(sd, serial_input);
+	clock_nameevent(serial_writedone, "serial write");
+	clock_nameevent(serial_pushinput, "serial read");
 
 	return sd;
 }
@@ -281,6 +284,22 @@ serial_dumpstate(void *data)
 	    sd->sd_wirq.si_force ? " (forced)" : "");
 }
 
+static
+void
+serial_save(void *data)
+{
+	snap_writesize(sizeof(struct ser_data));
+	snap_write(data, sizeof(struct ser_data));
+}
+
+static
+void
+serial_restore(void *data)
+{
+	snap_checksize("serial", sizeof(struct ser_data));
+	snap_read(data, sizeof(struct ser_data));
+}
+
 const struct lamebus_device_info serial_device_info = {
 	LBVEND_SYS161,
 	LBVEND_SYS161_SERIAL,
@@ -289,5 +308,10 @@ const struct lamebus_device_info serial_device_info = {
 	serial_fetch,
 	serial_store,
 	serial_dumpstate,
-	NULL
+	NULL,
+	serial_save,
+	serial_restore,
+	NULL,
+	NULL,
+	NULL,
 };
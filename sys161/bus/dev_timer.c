@@ -11,6 +11,7 @@
 #include "cpu.h"
 #include "clock.h"
 #include "util.h"
+#include "snapshot.h"
 
 #include "busids.h"
 #include "lamebus.h"
@@ -47,6 +48,8 @@ struct timer_data {
 	uint32_t td_generation;  /* for discarding old events */
 };
 
+static void timer_interrupt(void *d, uint32_t gen);
+
 static
 void *
 timer_init(int slot, int argc, char *argv[])
@@ -57,6 +60,8 @@ timer_init(int slot, int argc, char *argv[])
 	td->td_count_usecs = 0;
 	td->td_generation = 0;
 
+	clock_nameevent(timer_interrupt, "timer");
+
 	(void)argc;
 	(void)argv;
 
@@ -182,6 +187,22 @@ timer_dumpstate(void *data)
 	    (unsigned long) td->td_generation);
 }
 
+static
+void
+timer_save(void *data)
+{
+	snap_writesize(sizeof(struct timer_data));
+	snap_write(data, sizeof(struct timer_data));
+}
+
+static
+void
+timer_restore(void *data)
+{
+	snap_checksize("timer", sizeof(struct timer_data));
+	snap_read(data, sizeof(struct timer_data));
+}
+
 const struct lamebus_device_info timer_device_info = {
 	LBVEND_SYS161,
 	LBVEND_SYS161_TIMER,
@@ -190,6 +211,11 @@ const struct lamebus_device_info timer_device_info = {
 	timer_fetch,
 	timer_store,
 	timer_dumpstate,
-	NULL
+	NULL,
+	timer_save,
+	timer_restore,
+	NULL,
+	NULL,
+	NULL,
 };
 
@@ -18,6 +18,7 @@
 #define TRACEREG_STOP	16
 #define TRACEREG_PROFEN	20
 #define TRACEREG_PROFCL	24
+#define TRACEREG_SNAP	28
 
 
 static
@@ -103,6 +104,10 @@ trace_store(unsigned cpunum, void *data, uint32_t offset, uint32_t val)
 	    case TRACEREG_PROFCL:
 		prof_clear();
 		break;
+	    case TRACEREG_SNAP:
+		msg("trace: software-requested snapshot");
+		main_snapshot();
+		break;
 	    default:
 		return -1;
 	}
@@ -133,4 +138,9 @@ const struct lamebus_device_info trace_device_info = {
 	trace_store,
 	trace_dumpstate,
 	trace_cleanup,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
 };
@@ -0,0 +1,334 @@
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "config.h"
+
+#include "diskmodel.h"
+
+/*
+ * Disk geometry and timing model. See diskmodel.h.
+ */
+
+#define SECTOR_FUDGE          1.06
+#define OUTER_DIAM				80
+#define INNER_DIAM				20
+#define PLATTER_AREA			((OUTER_DIAM)*(OUTER_DIAM) - \
+								(INNER_DIAM)*(INNER_DIAM)) \
+								*PI/4
+
+#define PI						3.14159
+
+////////////////////////////////////////////////////////////
+//
+// Geometry modeling
+
+int
+diskmodel_init(struct diskmodel *dm, uint32_t totsectors,
+	       uint32_t sectsize, uint32_t rpm, uint32_t tracks,
+	       char *errbuf, size_t errbufsize)
+{
+	uint32_t physsectors;      // total number of actual sectors
+	uint32_t i, tot;
+
+	double sectors_per_area;
+	double trackwidth;
+
+	dm->dm_sectors = NULL;
+	dm->dm_tracks = tracks;
+	dm->dm_physpersect = sectsize / DISKMODEL_PHYSSECTSIZE;
+	dm->dm_rpm = rpm;
+	dm->dm_nsecs_per_rev = 1000000000 / (rpm / 60);
+
+	/*
+	 * Compute number of physical sectors. We use a bit more than the
+	 * requested space so as to leave room for sector remapping. Not
+	 * that we actually do sector remapping when computing latencies,
+	 * but we could. Note that these spare sectors do not appear in
+	 * the file we use for underlying storage.
+	 */
+	physsectors = (uint32_t)((double)totsectors *
+				 dm->dm_physpersect * SECTOR_FUDGE);
+	if (physsectors < totsectors * dm->dm_physpersect) {
+		/* Overflow - didn't fit in uint32_t */
+		snprintf(errbuf, errbufsize, "Disk too large for geometry");
+		return -1;
+	}
+
+	/* allocate space for dm_tracks entries */
+	dm->dm_sectors = malloc(dm->dm_tracks*sizeof(uint32_t));
+	if (dm->dm_sectors == NULL) {
+		snprintf(errbuf, errbufsize, "Out of memory");
+		return -1;
+	}
+
+	/* compute the width of each track */
+	trackwidth = ((OUTER_DIAM - INNER_DIAM)/2) / (double)dm->dm_tracks;
+
+	/* compute the number of sectors per unit area of disk */
+	sectors_per_area = physsectors / (PLATTER_AREA);
+
+	/*
+	 * Now, figure out how many sectors are on each track.
+	 * We do this by computing the area of the track and multiplying
+	 * by sectors_per_area, truncating to the next smallest integer.
+	 * We reserve one sector on each track.
+	 */
+	for (i=0; i<dm->dm_tracks; i++) {
+		double inside = INNER_DIAM/2.0 + i*trackwidth;
+		double outside = inside + trackwidth;
+
+		/*
+		 * this track's area = pi*(outside^2 - inside^2) = pi*(outside +
+		 * inside)*(outside - inside) = pi*(outside +
+		 * inside)*(trackwidth)
+		 */
+
+		double trackarea = (outside+inside)*trackwidth*PI;
+		double sectors = sectors_per_area*trackarea;
+
+		if (sectors < 2.0) {
+			/* too small */
+			snprintf(errbuf, errbufsize,
+				 "track %u has only one sector", i);
+			return -1;
+		}
+
+		dm->dm_sectors[i] = ((int)sectors) - 1;
+	}
+
+	/* Now compute the total number of sectors available. */
+	tot = 0;
+	for (i=0; i<dm->dm_tracks; i++) {
+		tot += dm->dm_sectors[i];
+	}
+
+	/* Make sure we've got enough space. */
+	if (tot < totsectors * dm->dm_physpersect) {
+		/*
+		 * Shouldn't happen. If it does, increase SECTOR_FUDGE.
+		 */
+		snprintf(errbuf, errbufsize, "Not enough SECTOR_FUDGE");
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+diskmodel_cleanup(struct diskmodel *dm)
+{
+	free(dm->dm_sectors);
+	dm->dm_sectors = NULL;
+}
+
+int
+diskmodel_locate(const struct diskmodel *dm,
+		 uint32_t sector, int *track, int *rotoffset)
+{
+	/*
+	 * Note that we start numbering sectors from the outermost
+	 * (fastest) track.
+	 */
+
+	uint32_t i;
+	uint32_t start = 0;
+
+	sector *= dm->dm_physpersect;
+
+	for (i = dm->dm_tracks; i > 0; i--) {
+		uint32_t tr = i-1;
+		uint32_t end = start + dm->dm_sectors[tr];
+		if (sector >= start && sector < end) {
+			*track = tr;
+			*rotoffset = sector - start;
+			return 0;
+		}
+		start = end;
+	}
+
+	return -1;
+}
+
+uint32_t
+diskmodel_seektime(const struct diskmodel *dm, int ntracks)
+{
+	(void)dm;
+
+	if (ntracks > 3) {
+		/* 10 ms stabilization + roughly 5G acceleration */
+		return 1000000 * (10 + 3*sqrt(ntracks));
+	}
+	else {
+		/* 5 ms track-to-track */
+		return 1000000 * (5*ntracks);
+	}
+}
+
+uint32_t
+diskmodel_readrotdelay(const struct diskmodel *dm,
+		       uint32_t cyl, uint32_t rotoffset,
+		       uint32_t arrivalsecs, uint32_t arrivalnsecs,
+		       uint32_t nowsecs, uint32_t nownsecs)
+{
+	/*
+	 * Time for crossing a single sector.
+	 */
+	uint32_t nsecs_per_sector = dm->dm_nsecs_per_rev/dm->dm_sectors[cyl];
+
+	/*
+	 * Next sector after the one we want.
+	 */
+	uint32_t targsector = (rotoffset + dm->dm_physpersect)
+		% dm->dm_sectors[cyl];
+
+	/*
+	 * Compute when the next sector would first be reached after
+	 * hitting the track. (When the next sector is reached, the
+	 * sector we want is fully read.)
+	 *
+	 * Note that we require that there are an integral number of
+	 * revs per second, and that we assume the platters are always
+	 * at position 0 when nownsecs = 0.
+	 */
+	uint32_t targsecs = arrivalsecs;
+	uint32_t targnsecs = targsector * nsecs_per_sector;
+	while (targnsecs < arrivalnsecs) {
+		targnsecs += dm->dm_nsecs_per_rev;
+	}
+	while (targnsecs >= 1000000000) {
+		targnsecs -= 1000000000;
+		targsecs++;
+	}
+
+	/*
+	 * If we've reached that time, we've already crossed the
+	 * sector and it's in our track buffer.
+	 */
+	if (targsecs < nowsecs ||
+	    (targsecs == nowsecs && targnsecs <= nownsecs)) {
+		return 0;
+	}
+
+	/*
+	 * Otherwise, we need to wait until that time.
+	 */
+	targsecs -= nowsecs;
+	targnsecs -= nownsecs;
+	targnsecs += 1000000000*targsecs;  // should not overflow
+
+	return targnsecs;
+}
+
+uint32_t
+diskmodel_writerotdelay(const struct diskmodel *dm,
+			uint32_t cyl, uint32_t rotoffset,
+			uint32_t nowsecs, uint32_t nownsecs)
+{
+	/*
+	 * Time for crossing a single sector.
+	 */
+	uint32_t nsecs_per_sector = dm->dm_nsecs_per_rev/dm->dm_sectors[cyl];
+
+	/*
+	 * Compute when the sector we want will next be reached.
+	 * (Ignore seconds. The disk must be at least 60 rpm, so we
+	 * can get to any sector without overflowing a uint32_t of
+	 * nsecs.)
+	 */
+	uint32_t targnsecs = rotoffset * nsecs_per_sector;
+	uint32_t delay;
+
+	(void)nowsecs;
+
+	while (targnsecs < nownsecs) {
+		targnsecs += dm->dm_nsecs_per_rev;
+	}
+
+	/*
+	 * Add in how long it takes to do the write.
+	 */
+	targnsecs += nsecs_per_sector * dm->dm_physpersect;
+
+	/*
+	 * Wait until then.
+	 */
+	delay = targnsecs - nownsecs;
+
+	return delay;
+}
+
+////////////////////////////////////////////////////////////
+//
+// I/O log encoding
+
+static
+void
+put32(unsigned char *buf, uint32_t val)
+{
+	buf[0] = val >> 24;
+	buf[1] = val >> 16;
+	buf[2] = val >> 8;
+	buf[3] = val;
+}
+
+static
+uint32_t
+get32(const unsigned char *buf)
+{
+	return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+		((uint32_t)buf[2] << 8) | buf[3];
+}
+
+void
+disklog_encodeheader(unsigned char *buf, const struct disklog_header *dlh)
+{
+	memset(buf, 0, DISKLOG_HEADERSIZE);
+	memcpy(buf, DISKLOG_MAGIC, 8);
+	put32(buf + 8, dlh->dlh_version);
+	put32(buf + 12, dlh->dlh_sectsize);
+	put32(buf + 16, dlh->dlh_totsectors);
+	put32(buf + 20, dlh->dlh_rpm);
+	put32(buf + 24, dlh->dlh_tracks);
+}
+
+int
+disklog_decodeheader(const unsigned char *buf, struct disklog_header *dlh)
+{
+	if (memcmp(buf, DISKLOG_MAGIC, 8)) {
+		return -1;
+	}
+	dlh->dlh_version = get32(buf + 8);
+	dlh->dlh_sectsize = get32(buf + 12);
+	dlh->dlh_totsectors = get32(buf + 16);
+	dlh->dlh_rpm = get32(buf + 20);
+	dlh->dlh_tracks = get32(buf + 24);
+	return 0;
+}
+
+void
+disklog_encoderecord(unsigned char *buf, const struct disklog_record *dlr)
+{
+	put32(buf, dlr->dlr_issuesecs);
+	put32(buf + 4, dlr->dlr_issuensecs);
+	put32(buf + 8, dlr->dlr_donesecs);
+	put32(buf + 12, dlr->dlr_donensecs);
+	put32(buf + 16, dlr->dlr_sector);
+	put32(buf + 20, dlr->dlr_flags);
+	put32(buf + 24, (uint32_t)dlr->dlr_seek);
+	put32(buf + 28, dlr->dlr_rotwait);
+}
+
+void
+disklog_decoderecord(const unsigned char *buf, struct disklog_record *dlr)
+{
+	dlr->dlr_issuesecs = get32(buf);
+	dlr->dlr_issuensecs = get32(buf + 4);
+	dlr->dlr_donesecs = get32(buf + 8);
+	dlr->dlr_donensecs = get32(buf + 12);
+	dlr->dlr_sector = get32(buf + 16);
+	dlr->dlr_flags = get32(buf + 20);
+	dlr->dlr_seek = (int32_t)get32(buf + 24);
+	dlr->dlr_rotwait = get32(buf + 28);
+}
@@ -0,0 +1,124 @@
+#ifndef DISKMODEL_H
+#define DISKMODEL_H
+
+/*
+ * Disk geometry and timing model.
+ *
+ * This is used by the disk device (dev_disk.c) and also by disk161,
+ * which can replay a disk I/O log against it with different
+ * parameters. So it must not depend on anything else in sys161.
+ */
+
+/* Disk physical parameters */
+#define DISKMODEL_PHYSSECTSIZE	512	/* bytes */
+#define DISKMODEL_NUMTRACKS	320
+
+/* Disk timing parameters */
+#define CACHE_READ_TIME      500       /* ns */
+#define CACHE_WRITE_TIME     500       /* ns */
+#define DISCARD_TIME         20000     /* ns; metadata update only */
+
+struct diskmodel {
+	/*
+	 * dm_sectors[] has dm_tracks entries; the sum is somewhat
+	 * more than the number of sectors on the disk.
+	 *
+	 * The geometry is always laid out in DISKMODEL_PHYSSECTSIZE
+	 * units so the timing doesn't depend on the logical sector
+	 * size; a logical sector covers dm_physpersect of them.
+	 */
+	uint32_t *dm_sectors;
+	uint32_t dm_tracks;
+	uint32_t dm_physpersect;
+	uint32_t dm_rpm;
+	uint32_t dm_nsecs_per_rev;
+};
+
+/*
+ * Set up the geometry. RPM must be a nonzero multiple of 60, and
+ * sectsize a multiple of DISKMODEL_PHYSSECTSIZE. On failure, returns
+ * -1 and leaves a message in errbuf.
+ */
+int diskmodel_init(struct diskmodel *dm, uint32_t totsectors,
+		   uint32_t sectsize, uint32_t rpm, uint32_t tracks,
+		   char *errbuf, size_t errbufsize);
+void diskmodel_cleanup(struct diskmodel *dm);
+
+/*
+ * Find the track and rotational offset (in physical sectors) of a
+ * logical sector. Returns -1 if the sector is beyond the geometry.
+ */
+int diskmodel_locate(const struct diskmodel *dm, uint32_t sector,
+		     int *track, int *rotoffset);
+
+/*
+ * Time (ns) to seek across ntracks tracks.
+ */
+uint32_t diskmodel_seektime(const struct diskmodel *dm, int ntracks);
+
+/*
+ * Time (ns) until a sector has been read or written, at time now,
+ * given that the heads arrived on the track at time arrival.
+ */
+uint32_t diskmodel_readrotdelay(const struct diskmodel *dm,
+				uint32_t track, uint32_t rotoffset,
+				uint32_t arrivalsecs, uint32_t arrivalnsecs,
+				uint32_t nowsecs, uint32_t nownsecs);
+uint32_t diskmodel_writerotdelay(const struct diskmodel *dm,
+				 uint32_t track, uint32_t rotoffset,
+				 uint32_t nowsecs, uint32_t nownsecs);
+
+/*
+ * Disk I/O log file format.
+ *
+ * A log is a header followed by one record per completed request.
+ * Everything is 32-bit big-endian words.
+ *
+ * Header: magic string (8 bytes), version, sector size, number of
+ * sectors, RPM, number of tracks, reserved.
+ *
+ * Record: issue time (secs, nsecs), completion time (secs, nsecs),
+ * sector, flags, seek distance in tracks (signed; negative is
+ * inward), total rotational wait (nsecs). For discards there is no
+ * seek or rotational wait, and the last word is the number of sectors
+ * discarded instead.
+ */
+#define DISKLOG_MAGIC		"S161DLOG"
+#define DISKLOG_VERSION		1
+#define DISKLOG_HEADERSIZE	32
+#define DISKLOG_RECSIZE		32
+
+#define DISKLOG_WRITE		1
+#define DISKLOG_INVSECT		2
+#define DISKLOG_MEDIAERR	4
+#define DISKLOG_DISCARD		8
+
+struct disklog_header {
+	uint32_t dlh_version;
+	uint32_t dlh_sectsize;
+	uint32_t dlh_totsectors;
+	uint32_t dlh_rpm;
+	uint32_t dlh_tracks;
+};
+
+struct disklog_record {
+	uint32_t dlr_issuesecs;
+	uint32_t dlr_issuensecs;
+	uint32_t dlr_donesecs;
+	uint32_t dlr_donensecs;
+	uint32_t dlr_sector;
+	uint32_t dlr_flags;
+	int32_t dlr_seek;
+	uint32_t dlr_rotwait;
+};
+
+void disklog_encodeheader(unsigned char *buf,
+			  const struct disklog_header *dlh);
+int disklog_decodeheader(const unsigned char *buf,
+			 struct disklog_header *dlh);
+void disklog_encoderecord(unsigned char *buf,
+			  const struct disklog_record *dlr);
+void disklog_decoderecord(const unsigned char *buf,
+			  struct disklog_record *dlr);
+
+#endif /* DISKMODEL_H */
@@ -1,9 +1,16 @@
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include "config.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "util.h"
 #include "bswap.h"
 #include "bus.h"
@@ -15,25 +22,24 @@
 #include "clock.h"
 #include "main.h"
 #include "memdefs.h"
+#include "inlinemem.h"
+#include "snapshot.h"
 
 #include "lamebus.h"
 #include "busids.h"
 #include "busdefs.h"
 
 
-/*
- * Maximum amount of physical memory we allow.
- * For now, 16M.
- */
-
-#define MAXMEM (16*1024*1024)
-
 /*
  * Memory.
  */
 
 uint32_t bus_ramsize;					/* RAMSZ */
 char *ram;
+uint8_t *ram_dirty;
+
+#define RAM_NPAGES	(bus_ramsize >> RAM_DIRTYSHIFT)
+#define RAM_DIRTYSIZE	((RAM_NPAGES + 7) / 8)
 
 /*
  * Interrupts.
@@ -47,16 +53,41 @@ static uint32_t bus_enabled_interrupts = 0xffffffff;	/* IRQE */
  */
 
 struct lamebus_cpu {
-	int cpu_enabled;				/* one bit of CPUE */
 	uint32_t cpu_enabled_interrupts;		/* CIRQE */
+	uint32_t cpu_pending;				/* IRQS&IRQE&CIRQE */
 	int cpu_interrupting;
 	int cpu_ipi;					/* CIPI, 0 or 1 */
-	/* This used to be cpu_cram[LAMEBUS_CRAM_SIZE] see dev_disk.c */
+	/* This used to be an array, see dev_disk.c */
 	char *cpu_cram;					/* CRAM */
 };
 
+/* CPUS and CPUE come in banks of 32 */
+#define CPU_NBANKS	(LAMEBUS_NCPUS / 32)
+
 static struct lamebus_cpu cpus[LAMEBUS_NCPUS];
 static unsigned ncpus;
+static uint32_t cpus_enabled[CPU_NBANKS];		/* CPUE */
+
+#define CPU_ENABLED(cn) \
+	((cpus_enabled[(cn) / 32] & ((uint32_t)1 << ((cn) % 32))) != 0)
+
+/*
+ * Layout of the per-cpu regions. With up to 32 cpus each gets
+ * LAMEBUS_PERCPU_SIZE bytes, as always; with more than that they
+ * don't fit, and each gets LAMEBUS_PERCPU_SMALLSIZE bytes instead.
+ * CRAM runs from cpu_cramstart to the end of the region.
+ */
+static uint32_t cpu_regionsize;
+static uint32_t cpu_cramstart;
+
+#define CPU_CRAMSIZE	(cpu_regionsize - cpu_cramstart)
+
+/*
+ * Interrupt routing: for each slot, the enabled cpus whose CIRQE has
+ * that slot's bit set. When a slot's interrupt comes or goes, these
+ * are the only cpus that can be affected.
+ */
+static uint32_t irq_routes[LAMEBUS_NSLOTS][CPU_NBANKS];
 
 /*
  * Slots.
@@ -69,6 +100,11 @@ struct lamebus_slot {
 
 static struct lamebus_slot devices[LAMEBUS_NSLOTS];
 
+/*
+ * Device memory windows, by 512-byte piece of I/O space.
+ */
+char *bus_io_windows[BUS_IOSIZE >> BUS_IOWIN_SHIFT];
+
 /***************************************************************/
 /* Register offsets */
 
@@ -85,6 +121,10 @@ static struct lamebus_slot devices[LAMEBUS_NSLOTS];
 #define LBC_CTL_CPUS		0x210
 #define LBC_CTL_CPUE		0x214
 #define LBC_CTL_SELF		0x218
+#define LBC_CTL_CPUNUM		0x21c
+#define LBC_CTL_CPUSIZE		0x220
+#define LBC_CTL_CPUSX		0x240	/* CPU_NBANKS words */
+#define LBC_CTL_CPUEX		0x250	/* CPU_NBANKS words */
 
 /* LAMEbus per-cpu control registers (offsets into a cpu region) */
 #define LBC_CPU_CIRQE		0x0
@@ -92,16 +132,17 @@ static struct lamebus_slot devices[LAMEBUS_NSLOTS];
 
 /* LAMEbus per-cpu scratch area (offsets into a cpu region) */
 #define LBC_CRAM_START		0x300
-#define LBC_CRAM_END		0x400
+#define LBC_SMALLCRAM_START	0x80
 
 /***************************************************************/
 /* Bus dispatcher */
 
 /*
- * Fetch device register.
+ * Fetch device register. (Windows are handled before getting here;
+ * see bus_io_fetch in inlinemem.h.)
  */
 int
-bus_io_fetch(unsigned cpunum, uint32_t offset, uint32_t *ret)
+bus_io_fetchreg(unsigned cpunum, uint32_t offset, uint32_t *ret)
 {
 	uint32_t slot = offset / LAMEBUS_SLOT_MEM;
 	uint32_t slotoffset = offset % LAMEBUS_SLOT_MEM;
@@ -126,7 +167,7 @@ bus_io_fetch(unsigned cpunum, uint32_t offset, uint32_t *ret)
  * Store to device registers.
  */
 int
-bus_io_store(unsigned cpunum, uint32_t offset, uint32_t val)
+bus_io_storereg(unsigned cpunum, uint32_t offset, uint32_t val)
 {
 	uint32_t slot = offset / LAMEBUS_SLOT_MEM;
 	uint32_t slotoffset = offset % LAMEBUS_SLOT_MEM;
@@ -150,32 +191,88 @@ bus_io_store(unsigned cpunum, uint32_t offset, uint32_t val)
 /***************************************************************/
 /* IRQ dispatcher */
 
+#define IRQ_EFFECTIVE() (bus_raised_interrupts & bus_enabled_interrupts)
+
+/*
+ * Recompute one cpu's pending interrupts, and tell it if that changes
+ * whether it's interrupting.
+ */
 static
 inline
 void
-irqupdate(void)
+irqupdate_cpu(unsigned cn, uint32_t mask)
 {
-	struct lamebus_cpu *cpu;
-	uint32_t mask;
-	unsigned i;
+	struct lamebus_cpu *cpu = &cpus[cn];
 	int irq;
 
-	mask = bus_raised_interrupts & bus_enabled_interrupts;
+	cpu->cpu_pending = mask & cpu->cpu_enabled_interrupts;
 
-	for (i=0; i<ncpus; i++) {
-		cpu = &cpus[i];
+	/* always 1/0, not a random bit, so the equality test works */
+	irq = cpu->cpu_pending != 0;
+
+	if (irq != cpu->cpu_interrupting) {
+		cpu->cpu_interrupting = irq;
+		cpu_set_irqs(cn, cpu->cpu_interrupting, cpu->cpu_ipi);
+	}
+}
+
+/*
+ * The effective interrupt mask (IRQS & IRQE) has gone from OLDMASK to
+ * NEWMASK. Update just the cpus routed to the slots that changed.
+ *
+ * Only enabled cpus are in irq_routes; the rest are brought up to
+ * date when they're turned on.
+ */
+static
+void
+irqupdate(uint32_t oldmask, uint32_t newmask)
+{
+	uint32_t changed, touched[CPU_NBANKS], bits;
+	unsigned bank, slot;
+
+	changed = oldmask ^ newmask;
+	if (changed == 0) {
+		return;
+	}
 
-		/* always 1/0, not a random bit, so the equality test works */
-		if (mask & cpu->cpu_enabled_interrupts) {
-			irq = 1;
+	for (bank=0; bank<CPU_NBANKS; bank++) {
+		touched[bank] = 0;
+	}
+	while (changed != 0) {
+		slot = __builtin_ctz(changed);
+		changed &= changed - 1;
+		for (bank=0; bank<CPU_NBANKS; bank++) {
+			touched[bank] |= irq_routes[slot][bank];
 		}
-		else {
-			irq = 0;
+	}
+
+	for (bank=0; bank<CPU_NBANKS; bank++) {
+		bits = touched[bank];
+		while (bits != 0) {
+			irqupdate_cpu(bank * 32 + __builtin_ctz(bits), newmask);
+			bits &= bits - 1;
 		}
+	}
+}
 
-		if (irq != cpu->cpu_interrupting) {
-			cpu->cpu_interrupting = irq;
-			cpu_set_irqs(i, cpu->cpu_interrupting, cpu->cpu_ipi);
+/*
+ * Add or remove a cpu from the routes for the slots in MASK.
+ */
+static
+void
+irqroute(unsigned cn, uint32_t mask, int on)
+{
+	uint32_t cpubit = (uint32_t)1 << (cn % 32);
+	unsigned slot;
+
+	while (mask != 0) {
+		slot = __builtin_ctz(mask);
+		mask &= mask - 1;
+		if (on) {
+			irq_routes[slot][cn / 32] |= cpubit;
+		}
+		else {
+			irq_routes[slot][cn / 32] &= ~cpubit;
 		}
 	}
 }
@@ -183,17 +280,23 @@ irqupdate(void)
 void
 raise_irq(int slot)
 {
+	uint32_t oldmask;
+
 	HWTRACE(DOTRACE_IRQ, "Slot %2d: irq ON", (slot));
+	oldmask = IRQ_EFFECTIVE();
 	bus_raised_interrupts |= ((uint32_t)1 << slot);
-	irqupdate();
+	irqupdate(oldmask, IRQ_EFFECTIVE());
 }
 
 void
 lower_irq(int slot)
 {
+	uint32_t oldmask;
+
 	HWTRACE(DOTRACE_IRQ, "Slot %2d: irq OFF", (slot));
+	oldmask = IRQ_EFFECTIVE();
 	bus_raised_interrupts &= ~((uint32_t)1 << slot);
-	irqupdate();
+	irqupdate(oldmask, IRQ_EFFECTIVE());
 }
 
 int
@@ -228,40 +331,45 @@ dopoweroff(void *junk1, uint32_t junk2)
 
 static
 uint32_t
-get_cpue(void)
+get_cpus(unsigned bank)
 {
-	unsigned i;
-	uint32_t ret = 0;
+	unsigned first = bank * 32;
 
-	for (i=0; i<ncpus; i++) {
-		if (cpus[i].cpu_enabled) {
-			ret |= (uint32_t)1 << i;
-		}
+	if (ncpus <= first) {
+		return 0;
+	}
+	if (ncpus - first >= 32) {
+		/* avoid nasal demons */
+		return 0xffffffff;
 	}
-	return ret;
+	return ((uint32_t)1 << (ncpus - first)) - 1;
 }
 
 static
 void
-set_cpue(uint32_t val)
+set_cpue(unsigned bank, uint32_t val)
 {
-	unsigned i, thisbit;
+	unsigned i, cn;
+	uint32_t thisbit;
 	struct lamebus_cpu *cpu;
 
-	for (i=0; i<ncpus; i++) {
-		thisbit = val & ((uint32_t)1 << i);
-		cpu = &cpus[i];
+	for (i=0; i<32 && bank * 32 + i < ncpus; i++) {
+		cn = bank * 32 + i;
+		thisbit = (uint32_t)1 << i;
+		cpu = &cpus[cn];
 
-		if (cpu->cpu_enabled && thisbit == 0) {
+		if ((cpus_enabled[bank] & thisbit) && (val & thisbit) == 0) {
 			/*
 			 * Shutting off cpu.
 			 *
 			 * Just drop it in its tracks...
 			 */
-			cpu->cpu_enabled = 0;
-			cpu_disable(i);
+			cpus_enabled[bank] &= ~thisbit;
+			irqroute(cn, cpu->cpu_enabled_interrupts, 0);
+			cpu_disable(cn);
 		}
-		else if (!cpu->cpu_enabled && thisbit != 0) {
+		else if ((cpus_enabled[bank] & thisbit) == 0 &&
+			 (val & thisbit) != 0) {
 			/*
 			 * Turning on cpu.
 			 *
@@ -275,18 +383,22 @@ set_cpue(uint32_t val)
 
 			cramoffset = LAMEBUS_SLOT_MEM * LAMEBUS_CONTROLLER_SLOT
 				+ 32768
-				+ i * LAMEBUS_PERCPU_SIZE
-				+ LBC_CRAM_END;
+				+ (cn + 1) * cpu_regionsize;
 
 			stackva = cpu_get_secondary_start_stack(cramoffset);
 			cram = (uint32_t *)cpu->cpu_cram;
 			pcva = ctoh32(cram[0]);
 			arg = ctoh32(cram[1]);
 
-			cpu_set_entrypoint(i, pcva);
-			cpu_set_stack(i, stackva, arg);
+			cpu_set_entrypoint(cn, pcva);
+			cpu_set_stack(cn, stackva, arg);
+
+			/* irqupdate skipped it while it was off */
+			cpus_enabled[bank] |= thisbit;
+			irqroute(cn, cpu->cpu_enabled_interrupts, 1);
+			irqupdate_cpu(cn, IRQ_EFFECTIVE());
 
-			cpu_enable(i);
+			cpu_enable(cn);
 		}
 	}
 }
@@ -296,12 +408,13 @@ set_cpue(uint32_t val)
 
 /*
  * Translate an offset into a 32K region into an offset and number into
- * 32 1K regions. Works for both CPU regions and config regions.
+ * 32 1K regions, for the config regions. The CPU regions are the same
+ * with up to 32 cpus but smaller beyond that; see cpu_regionsize.
  */
-#if LAMEBUS_CONFIG_SIZE != LAMEBUS_PERCPU_SIZE
+#if LAMEBUS_NSLOTS * LAMEBUS_CONFIG_SIZE != 32768
 #error bah (1)
 #endif
-#if LAMEBUS_NSLOTS != LAMEBUS_NCPUS
+#if LAMEBUS_NCPUS * LAMEBUS_PERCPU_SMALLSIZE > 32768
 #error bah (2)
 #endif
 
@@ -330,14 +443,15 @@ lamebus_controller_fetch_cpu(uint32_t offset, uint32_t *ret)
 	uint32_t *ptr;
 	struct lamebus_cpu *cpu;
 
-	lamebus_controller_region(offset, &region, &offset);
+	region = offset / cpu_regionsize;
+	offset = offset % cpu_regionsize;
 	if (region >= ncpus) {
 		return -1;
 	}
 	cpu = &cpus[region];
 
-	if (offset >= LBC_CRAM_START && offset < LBC_CRAM_END) {
-		offset -= LBC_CRAM_START;
+	if (offset >= cpu_cramstart) {
+		offset -= cpu_cramstart;
 		ptr = (uint32_t *)(cpu->cpu_cram + offset);
 		*ret = ctoh32(*ptr);
 		return 0;
@@ -363,14 +477,15 @@ lamebus_controller_store_cpu(uint32_t offset, uint32_t val)
 	uint32_t *ptr;
 	struct lamebus_cpu *cpu;
 
-	lamebus_controller_region(offset, &region, &offset);
+	region = offset / cpu_regionsize;
+	offset = offset % cpu_regionsize;
 	if (region >= ncpus) {
 		return -1;
 	}
 	cpu = &cpus[region];
 
-	if (offset >= LBC_CRAM_START && offset < LBC_CRAM_END) {
-		offset -= LBC_CRAM_START;
+	if (offset >= cpu_cramstart) {
+		offset -= cpu_cramstart;
 		ptr = (uint32_t *)(cpu->cpu_cram + offset);
 		*ptr = htoc32(val);
 		return 0;
@@ -378,8 +493,14 @@ lamebus_controller_store_cpu(uint32_t offset, uint32_t val)
 
 	switch (offset) {
 	    case LBC_CPU_CIRQE:
+		if (CPU_ENABLED(region)) {
+			irqroute(region, cpu->cpu_enabled_interrupts, 0);
+			irqroute(region, val, 1);
+		}
 		cpu->cpu_enabled_interrupts = val;
-		irqupdate();
+		if (CPU_ENABLED(region)) {
+			irqupdate_cpu(region, IRQ_EFFECTIVE());
+		}
 		return 0;
 	    case LBC_CPU_CIPI:
 		cpu->cpu_ipi = val ? 1 : 0;
@@ -440,25 +561,44 @@ lamebus_controller_fetch_config(unsigned cpunum,
 		if (isold) {
 			return -1;
 		}
-		if (ncpus == 32) {
-			/* avoid nasal demons */
-			*ret = 0xffffffff;
-		}
-		else {
-			*ret = ((uint32_t)1 << ncpus) - 1;
-		}
+		*ret = get_cpus(0);
 		return 0;
 	    case LBC_CTL_CPUE:
 		if (isold) {
 			return -1;
 		}
-		*ret = get_cpue();
+		*ret = cpus_enabled[0];
 		return 0;
 	    case LBC_CTL_SELF:
 		if (isold) {
 			return -1;
 		}
-		*ret = (uint32_t)1 << cpunum;
+		/* cpus past the first 32 have to use CPUNUM */
+		*ret = cpunum < 32 ? (uint32_t)1 << cpunum : 0;
+		return 0;
+	    case LBC_CTL_CPUNUM:
+		if (isold) {
+			return -1;
+		}
+		*ret = cpunum;
+		return 0;
+	    case LBC_CTL_CPUSIZE:
+		if (isold) {
+			return -1;
+		}
+		*ret = cpu_regionsize;
+		return 0;
+	}
+
+	if (isold) {
+		return -1;
+	}
+	if (offset >= LBC_CTL_CPUSX && offset < LBC_CTL_CPUSX + 4*CPU_NBANKS) {
+		*ret = get_cpus((offset - LBC_CTL_CPUSX) / 4);
+		return 0;
+	}
+	if (offset >= LBC_CTL_CPUEX && offset < LBC_CTL_CPUEX + 4*CPU_NBANKS) {
+		*ret = cpus_enabled[(offset - LBC_CTL_CPUEX) / 4];
 		return 0;
 	}
 
@@ -470,7 +610,7 @@ static
 int
 lamebus_controller_store_config(int isold, uint32_t offset, uint32_t val)
 {
-	uint32_t region;
+	uint32_t region, oldmask;
 
 	lamebus_controller_region(offset, &region, &offset);
 	if (region != LAMEBUS_CONTROLLER_SLOT) {
@@ -491,19 +631,26 @@ lamebus_controller_store_config(int isold, uint32_t offset, uint32_t val)
 		}
 		return 0;
 	    case LBC_CTL_IRQE:
+		oldmask = IRQ_EFFECTIVE();
 		bus_enabled_interrupts = val;
-		irqupdate();
+		irqupdate(oldmask, IRQ_EFFECTIVE());
 		return 0;
 	    case LBC_CTL_CPUE:
 		if (isold) {
 			return -1;
 		}
-		set_cpue(val);
+		set_cpue(0, val);
 		return 0;
 	    default:
 		break;
 	}
 
+	if (!isold &&
+	    offset >= LBC_CTL_CPUEX && offset < LBC_CTL_CPUEX + 4*CPU_NBANKS) {
+		set_cpue((offset - LBC_CTL_CPUEX) / 4, val);
+		return 0;
+	}
+
 	return -1;
 }
 
@@ -567,7 +714,15 @@ lamebus_commonmainboard_init(int isold, int slot, int argc, char *argv[])
 
 	for (i=1; i<argc; i++) {
 		if (!strncmp(argv[i], "ramsize=", 8)) {
-			bus_ramsize = getsize(argv[i]+8);
+			off_t size = getsize(argv[i]+8);
+
+			if (size < 0 || size > cpu_get_ram_maxsize()) {
+				msg("%s: ramsize too large (max %luM)",
+				    myname, (unsigned long)
+				    (cpu_get_ram_maxsize() / (1024*1024)));
+				die();
+			}
+			bus_ramsize = size;
 		}
 		else if (!isold && !strncmp(argv[i], "cpus=", 5)) {
 			tmp_ncpus = strtoul(argv[i]+5, NULL, 0);
@@ -589,21 +744,36 @@ lamebus_commonmainboard_init(int isold, int slot, int argc, char *argv[])
 		msg("%s: no support for multicore CPUs yet", myname);
 		die();
 	}
-	if (tmp_ncpus > 32) {
-		msg("%s: too many CPUs", myname);
+	if (tmp_ncpus > LAMEBUS_NCPUS) {
+		msg("%s: too many CPUs (max %d)", myname, LAMEBUS_NCPUS);
 		die();
 	}
 	/* avoid overflow from unsigned long to unsigned */
 	ncpus = tmp_ncpus;
 
+	if (ncpus <= 32) {
+		cpu_regionsize = LAMEBUS_PERCPU_SIZE;
+		cpu_cramstart = LBC_CRAM_START;
+	}
+	else {
+		cpu_regionsize = LAMEBUS_PERCPU_SMALLSIZE;
+		cpu_cramstart = LBC_SMALLCRAM_START;
+	}
+
 	for (j=0; j<ncpus; j++) {
-		cpus[j].cpu_enabled = 0;
 		cpus[j].cpu_enabled_interrupts = 0xffffffff;
+		cpus[j].cpu_pending = 0;
 		cpus[j].cpu_ipi = 0;
 		cpus[j].cpu_interrupting = 0;
-		cpus[j].cpu_cram = domalloc(LAMEBUS_CRAM_SIZE);
+		cpus[j].cpu_cram = domalloc(CPU_CRAMSIZE);
 	}
-	cpus[0].cpu_enabled = 1;
+	for (j=0; j<CPU_NBANKS; j++) {
+		cpus_enabled[j] = 0;
+	}
+	cpus_enabled[0] = 1;
+	irqroute(0, cpus[0].cpu_enabled_interrupts, 1);
+
+	clock_nameevent(dopoweroff, "poweroff");
 }
 
 static
@@ -680,20 +850,92 @@ lamebus_mainboard_dumpstate(void *data)
 	msg("    irqs: 0x%08x", bus_raised_interrupts);
 	msg("    irqe: 0x%08x", bus_enabled_interrupts);
 	msg("    cpus: %u", ncpus);
-	msg("    cpue: 0x%08x", get_cpue());
+	for (i=0; i<ncpus; i+=32) {
+		msg("    cpue %u-%u: 0x%08x", i, i+31, cpus_enabled[i/32]);
+	}
 	for (i=0; i<ncpus; i++) {
 		msg("    cpu %d: %s", i,
-		    cpus[i].cpu_enabled ? "ENABLED" : "DISABLED");
+		    CPU_ENABLED(i) ? "ENABLED" : "DISABLED");
 		msg("    cpu %d cirqe: 0x%08x", i,
 		    cpus[i].cpu_enabled_interrupts);
 		msg("    cpu %d cipi: %d", i, cpus[i].cpu_ipi);
-		msg("    cpu %d interrupting: %d", i,
-		    cpus[i].cpu_interrupting);
+		msg("    cpu %d interrupting: %d (pending 0x%08x)", i,
+		    cpus[i].cpu_interrupting, cpus[i].cpu_pending);
 		msg("    cpu %d cram:", i);
-		dohexdump(cpus[i].cpu_cram, LAMEBUS_CRAM_SIZE);
+		dohexdump(cpus[i].cpu_cram, CPU_CRAMSIZE);
 	}
 }
 
+static
+void
+lamebus_commonmainboard_save(void)
+{
+	unsigned i;
+
+	snap_write32(bus_raised_interrupts);
+	snap_write32(bus_enabled_interrupts);
+	snap_write32(ncpus);
+	for (i=0; i<ncpus; i++) {
+		snap_write32(CPU_ENABLED(i));
+		snap_write32(cpus[i].cpu_enabled_interrupts);
+		snap_write32(cpus[i].cpu_interrupting);
+		snap_write32(cpus[i].cpu_ipi);
+		snap_write(cpus[i].cpu_cram, CPU_CRAMSIZE);
+	}
+}
+
+static
+void
+lamebus_commonmainboard_restore(void)
+{
+	unsigned i;
+
+	bus_raised_interrupts = snap_read32();
+	bus_enabled_interrupts = snap_read32();
+	if (snap_read32() != ncpus) {
+		snap_error("Snapshot has a different number of cpus");
+	}
+	for (i=0; i<CPU_NBANKS; i++) {
+		cpus_enabled[i] = 0;
+	}
+	for (i=0; i<ncpus; i++) {
+		if (snap_read32()) {
+			cpus_enabled[i / 32] |= (uint32_t)1 << (i % 32);
+		}
+		cpus[i].cpu_enabled_interrupts = snap_read32();
+		cpus[i].cpu_interrupting = snap_read32();
+		cpus[i].cpu_ipi = snap_read32();
+		snap_read(cpus[i].cpu_cram, CPU_CRAMSIZE);
+	}
+
+	/* the routing is derived from the rest */
+	memset(irq_routes, 0, sizeof(irq_routes));
+	for (i=0; i<ncpus; i++) {
+		cpus[i].cpu_pending = 0;
+		if (CPU_ENABLED(i)) {
+			irqroute(i, cpus[i].cpu_enabled_interrupts, 1);
+			cpus[i].cpu_pending = IRQ_EFFECTIVE() &
+				cpus[i].cpu_enabled_interrupts;
+		}
+	}
+}
+
+static
+void
+lamebus_mainboard_save(void *data)
+{
+	(void)data;
+	lamebus_commonmainboard_save();
+}
+
+static
+void
+lamebus_mainboard_restore(void *data)
+{
+	(void)data;
+	lamebus_commonmainboard_restore();
+}
+
 static struct lamebus_device_info lamebus_oldmainboard_info = {
 	LBVEND_SYS161,
 	LBVEND_SYS161_OLDMAINBOARD,
@@ -703,6 +945,11 @@ static struct lamebus_device_info lamebus_oldmainboard_info = {
 	lamebus_controller_store,
 	lamebus_oldmainboard_dumpstate,
 	lamebus_oldmainboard_cleanup,
+	lamebus_mainboard_save,
+	lamebus_mainboard_restore,
+	NULL,
+	NULL,
+	NULL,
 };
 
 static struct lamebus_device_info lamebus_mainboard_info = {
@@ -714,6 +961,11 @@ static struct lamebus_device_info lamebus_mainboard_info = {
 	lamebus_controller_store,
 	lamebus_mainboard_dumpstate,
 	lamebus_mainboard_cleanup,
+	lamebus_mainboard_save,
+	lamebus_mainboard_restore,
+	NULL,
+	NULL,
+	NULL,
 };
 
 
@@ -753,10 +1005,128 @@ find_dev(const char *name)
 	return NULL;
 }
 
+/*
+ * Replace %n in a config line with the machine number, so one config
+ * file can serve all the machines run with -n; %% is a plain %.
+ */
+static
+int
+config_expand(char *buf, size_t max)
+{
+	char tmp[1024];
+	size_t i, j;
+	int len;
+
+	if (strchr(buf, '%') == NULL) {
+		return 0;
+	}
+
+	for (i=j=0; buf[i]; i++) {
+		if (buf[i] == '%' && buf[i+1] == 'n') {
+			len = snprintf(tmp+j, sizeof(tmp)-j, "%u",
+				       cluster_node);
+			if (len < 0 || (size_t)len >= sizeof(tmp)-j) {
+				return -1;
+			}
+			j += len;
+			i++;
+			continue;
+		}
+		if (buf[i] == '%' && buf[i+1] == '%') {
+			i++;
+		}
+		if (j+1 >= sizeof(tmp)) {
+			return -1;
+		}
+		tmp[j++] = buf[i];
+	}
+	tmp[j] = 0;
+	if (j >= max) {
+		return -1;
+	}
+	strcpy(buf, tmp);
+	return 0;
+}
+
+/*
+ * Allocate system memory. This is an anonymous mapping rather than a
+ * malloc'd block so that nothing is committed until the guest touches
+ * it: a machine with 1G of RAM that only ever uses a few megabytes
+ * costs a few megabytes. (Pages read before being written all share
+ * the host's zero page.) Where the host supports it, ask for huge
+ * pages as well, which cuts down on host TLB misses when the guest
+ * does touch a lot of memory.
+ */
+static
+char *
+ram_alloc(uint32_t size)
+{
+	void *ptr;
+	int flags;
+
+	flags = MAP_PRIVATE|MAP_ANON;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+	ptr = mmap(NULL, size, PROT_READ|PROT_WRITE, flags, -1, 0);
+	if (ptr == MAP_FAILED) {
+		return NULL;
+	}
+#ifdef MADV_HUGEPAGE
+	/* this is only a hint; ignore failure */
+	(void)madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+	return ptr;
+}
+
+static
+void
+ram_free(char *ptr, uint32_t size)
+{
+	if (ptr != NULL) {
+		munmap(ptr, size);
+	}
+}
+
+/*
+ * Install a device's memory windows in bus_io_windows.
+ */
+static
+void
+bus_setwindows(int slot)
+{
+	const struct lamebus_device_info *inf = devices[slot].ls_info;
+	struct lamebus_window windows[LAMEBUS_MAXWINDOWS];
+	uint32_t base, off;
+	int i, n;
+
+	if (inf->ldi_windows == NULL) {
+		return;
+	}
+	n = inf->ldi_windows(devices[slot].ls_devdata, windows);
+	Assert(n >= 0 && n <= LAMEBUS_MAXWINDOWS);
+
+	base = slot * LAMEBUS_SLOT_MEM;
+	for (i=0; i<n; i++) {
+		Assert(windows[i].lw_offset % LAMEBUS_WINDOW_ALIGN == 0);
+		Assert(windows[i].lw_size % LAMEBUS_WINDOW_ALIGN == 0);
+		Assert(windows[i].lw_offset + windows[i].lw_size
+		       <= LAMEBUS_SLOT_MEM);
+		for (off = 0; off < windows[i].lw_size;
+		     off += 1 << BUS_IOWIN_SHIFT) {
+			bus_io_windows[(base + windows[i].lw_offset + off)
+				       >> BUS_IOWIN_SHIFT] =
+				windows[i].lw_mem + off;
+		}
+	}
+}
+
 /*
  * Config file syntax is:
  *
  *     slot device-name args
+ *
+ * with %n standing for the machine number (see config_expand).
  */
 #define MAXARGS 128
 unsigned
@@ -794,6 +1164,11 @@ bus_config(const char *configfile,
 		line++;
 		s = strchr(buf, '#');
 		if (s) *s = 0;
+		if (config_expand(buf, sizeof(buf))) {
+			msg("config %s: line %d: Line too long",
+			    configfile, line);
+			die();
+		}
 		argc=0;
 		for (s=strtok(buf, " \t\r\n"); s; s=strtok(NULL, " \t\r\n")) {
 			if (argc<MAXARGS) argv[argc++] = s;
@@ -873,6 +1248,7 @@ bus_config(const char *configfile,
 		devices[slot].ls_info = dev->dev_info;
 		devices[slot].ls_devdata = 
 			dev->dev_info->ldi_init(slot, argc-1, argv+1);
+		bus_setwindows(slot);
 	}
 	
 	fclose(f);
@@ -894,16 +1270,14 @@ bus_config(const char *configfile,
 		    configfile);
 		die();
 	}
-	if (bus_ramsize > MAXMEM) {
-		msg("config %s: System memory too large", configfile);
-		die();
-	}
 	
-	ram = calloc(bus_ramsize, 1);
+	ram = ram_alloc(bus_ramsize);
 	if (!ram) {
 		msg("config %s: Cannot allocate system memory", configfile);
 		die();
 	}
+	ram_dirty = domalloc(RAM_DIRTYSIZE);
+	bus_mem_cleardirty();
 
 	return ncpus;
 }
@@ -913,8 +1287,11 @@ bus_cleanup(void)
 {
 	int i;
 
-	free(ram);
+	ram_free(ram, bus_ramsize);
 	ram = NULL;
+	free(ram_dirty);
+	ram_dirty = NULL;
+	memset(bus_io_windows, 0, sizeof(bus_io_windows));
 
 	for (i=0; i<LAMEBUS_NSLOTS; i++) {
 		if (devices[i].ls_info==NULL) {
@@ -941,5 +1318,373 @@ bus_dumpstate(void)
 	}
 
 	msg("RAM:");
+	if (RAM_BYTEXOR != 0) {
+		msg("(in host byte order within each word)");
+	}
 	dohexdump(ram, bus_ramsize);
 }
+
+/*
+ * Bulk access to memory for devices and the kernel loader, which
+ * deal in byte buffers. Memory is kept in host order (see
+ * inlinemem.h) so when that isn't the cpu's order each whole word has
+ * to be swapped on the way through.
+ *
+ * The caller checks that the range is within RAM.
+ */
+
+/*
+ * Copy NWORDS words, swapping the bytes of each. The compiler won't
+ * vectorize this by itself (baseline x86-64 has no byte shuffle) so
+ * do it by hand where we know how, 16 bytes at a time.
+ */
+static
+void
+ram_swapwords(void *dstv, const void *srcv, size_t nwords)
+{
+	char *dst = dstv;
+	const char *src = srcv;
+	uint32_t word;
+
+#if defined(__SSE2__)
+	__m128i v;
+
+	for (; nwords >= 4; nwords -= 4) {
+		v = _mm_loadu_si128((const __m128i *)src);
+		/* swap the bytes of each halfword, then the halfwords */
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		v = _mm_shufflelo_epi16(v, 0xb1);
+		v = _mm_shufflehi_epi16(v, 0xb1);
+		_mm_storeu_si128((__m128i *)dst, v);
+		src += 16;
+		dst += 16;
+	}
+#elif defined(__ARM_NEON)
+	for (; nwords >= 4; nwords -= 4) {
+		vst1q_u8((uint8_t *)dst,
+			 vrev32q_u8(vld1q_u8((const uint8_t *)src)));
+		src += 16;
+		dst += 16;
+	}
+#endif
+	for (; nwords > 0; nwords--) {
+		memcpy(&word, src, sizeof(word));
+		word = bswap32(word);
+		memcpy(dst, &word, sizeof(word));
+		src += 4;
+		dst += 4;
+	}
+}
+
+void
+bus_mem_read(uint32_t offset, void *buf, uint32_t len)
+{
+	char *dst = buf;
+
+	if (RAM_BYTEXOR == 0) {
+		memcpy(dst, ram + offset, len);
+		return;
+	}
+	for (; len > 0 && (offset & 3) != 0; len--) {
+		*dst++ = ram[offset++ ^ RAM_BYTEXOR];
+	}
+	ram_swapwords(dst, ram + offset, len / 4);
+	dst += len & ~(uint32_t)3;
+	offset += len & ~(uint32_t)3;
+	for (len &= 3; len > 0; len--) {
+		*dst++ = ram[offset++ ^ RAM_BYTEXOR];
+	}
+}
+
+void
+bus_mem_write(uint32_t offset, const void *buf, uint32_t len)
+{
+	const char *src = buf;
+
+	bus_mem_dirtyrange(offset, len);
+	if (RAM_BYTEXOR == 0) {
+		memcpy(ram + offset, src, len);
+		return;
+	}
+	for (; len > 0 && (offset & 3) != 0; len--) {
+		ram[offset++ ^ RAM_BYTEXOR] = *src++;
+	}
+	ram_swapwords(ram + offset, src, len / 4);
+	src += len & ~(uint32_t)3;
+	offset += len & ~(uint32_t)3;
+	for (len &= 3; len > 0; len--) {
+		ram[offset++ ^ RAM_BYTEXOR] = *src++;
+	}
+}
+
+void
+bus_mem_zero(uint32_t offset, uint32_t len)
+{
+	bus_mem_dirtyrange(offset, len);
+	for (; len > 0 && (offset & 3) != 0; len--) {
+		ram[offset++ ^ RAM_BYTEXOR] = 0;
+	}
+	/* zero words are the same in either order */
+	memset(ram + offset, 0, len & ~(uint32_t)3);
+	offset += len & ~(uint32_t)3;
+	for (len &= 3; len > 0; len--) {
+		ram[offset++ ^ RAM_BYTEXOR] = 0;
+	}
+}
+
+void
+bus_mem_readraw(uint32_t offset, void *buf, uint32_t len)
+{
+	Assert((offset & 3) == 0 && (len & 3) == 0);
+	memcpy(buf, ram + offset, len);
+}
+
+void
+bus_mem_writeraw(uint32_t offset, const void *buf, uint32_t len)
+{
+	Assert((offset & 3) == 0 && (len & 3) == 0);
+	bus_mem_dirtyrange(offset, len);
+	memcpy(ram + offset, buf, len);
+}
+
+/*
+ * Pages written since the last snapshot, for incremental ones.
+ */
+
+void
+bus_mem_dirtyrange(uint32_t offset, uint32_t len)
+{
+	uint32_t page;
+
+	if (len == 0) {
+		return;
+	}
+	for (page = offset >> RAM_DIRTYSHIFT;
+	     page <= (offset + len - 1) >> RAM_DIRTYSHIFT;
+	     page++) {
+		ram_dirty[page / 8] |= 1 << (page % 8);
+	}
+}
+
+void
+bus_mem_cleardirty(void)
+{
+	memset(ram_dirty, 0, RAM_DIRTYSIZE);
+}
+
+static
+int
+bus_mem_isdirty(uint32_t page)
+{
+	return (ram_dirty[page / 8] & (1 << (page % 8))) != 0;
+}
+
+/*
+ * Snapshots. The slot layout is recorded so that restoring into a
+ * differently configured machine is caught.
+ *
+ * An incremental snapshot has only the pages written since the one
+ * it's based on, each with its page number.
+ */
+static
+void
+bus_saveram(void)
+{
+	uint32_t page, count;
+
+	if (!snap_isincremental()) {
+		snap_section("RAM ");
+		snap_write(ram, bus_ramsize);
+		return;
+	}
+
+	count = 0;
+	for (page = 0; page < RAM_NPAGES; page++) {
+		if (bus_mem_isdirty(page)) {
+			count++;
+		}
+	}
+	snap_section("DIRT");
+	snap_write32(count);
+	for (page = 0; page < RAM_NPAGES; page++) {
+		if (bus_mem_isdirty(page)) {
+			snap_write32(page);
+			snap_write(ram + (page << RAM_DIRTYSHIFT),
+				   1 << RAM_DIRTYSHIFT);
+		}
+	}
+}
+
+void
+bus_save(void)
+{
+	const struct lamebus_device_info *inf;
+	int i;
+
+	snap_section("BUS ");
+	snap_write32(bus_ramsize);
+	for (i=0; i<LAMEBUS_NSLOTS; i++) {
+		inf = devices[i].ls_info;
+		snap_write32(inf ? inf->ldi_vendorid : 0);
+		snap_write32(inf ? inf->ldi_deviceid : 0);
+		snap_write32(inf ? inf->ldi_revision : 0);
+	}
+
+	bus_saveram();
+
+	for (i=0; i<LAMEBUS_NSLOTS; i++) {
+		inf = devices[i].ls_info;
+		if (inf == NULL || inf->ldi_save == NULL) {
+			continue;
+		}
+		snap_section("SLOT");
+		snap_write32(i);
+		inf->ldi_save(devices[i].ls_devdata);
+	}
+}
+
+/*
+ * The first part of bus_restore: also used alone to get the memory
+ * from the snapshots an incremental one is based on.
+ */
+void
+bus_restoreram(void)
+{
+	const struct lamebus_device_info *inf;
+	uint32_t vendor, device, revision;
+	uint32_t page, count;
+	char pagebuf[1 << RAM_DIRTYSHIFT];
+	char *ptr;
+	int i;
+
+	snap_expect("BUS ");
+	if (snap_read32() != bus_ramsize) {
+		snap_error("Snapshot has a different amount of RAM");
+	}
+	for (i=0; i<LAMEBUS_NSLOTS; i++) {
+		inf = devices[i].ls_info;
+		vendor = snap_read32();
+		device = snap_read32();
+		revision = snap_read32();
+		if (vendor != (inf ? inf->ldi_vendorid : 0) ||
+		    device != (inf ? inf->ldi_deviceid : 0) ||
+		    revision != (inf ? inf->ldi_revision : 0)) {
+			snap_error("Snapshot has a different device in "
+				   "slot %d", i);
+		}
+	}
+
+	if (!snap_isincremental()) {
+		snap_expect("RAM ");
+		/*
+		 * Go a page at a time and leave alone pages that are
+		 * already the same (mostly untouched zero pages), so
+		 * resuming doesn't commit all of memory.
+		 */
+		for (page = 0; page < RAM_NPAGES; page++) {
+			snap_read(pagebuf, sizeof(pagebuf));
+			ptr = ram + (page << RAM_DIRTYSHIFT);
+			if (memcmp(ptr, pagebuf, sizeof(pagebuf)) != 0) {
+				memcpy(ptr, pagebuf, sizeof(pagebuf));
+			}
+		}
+		return;
+	}
+
+	snap_expect("DIRT");
+	count = snap_read32();
+	while (count-- > 0) {
+		page = snap_read32();
+		if (page >= RAM_NPAGES) {
+			snap_error("Snapshot is damaged (bad page number)");
+		}
+		snap_read(ram + (page << RAM_DIRTYSHIFT), 1 << RAM_DIRTYSHIFT);
+	}
+}
+
+void
+bus_restore(void)
+{
+	const struct lamebus_device_info *inf;
+	int i;
+
+	bus_restoreram();
+
+	for (i=0; i<LAMEBUS_NSLOTS; i++) {
+		inf = devices[i].ls_info;
+		if (inf == NULL || inf->ldi_restore == NULL) {
+			continue;
+		}
+		snap_expect("SLOT");
+		if (snap_read32() != (uint32_t)i) {
+			snap_error("Snapshot is damaged (slot %d)", i);
+		}
+		inf->ldi_restore(devices[i].ls_devdata);
+	}
+}
+
+/*
+ * In a fork-server child (see forkserver.h): let each device detach
+ * itself from host state it shares with the parent.
+ */
+void
+bus_forked(unsigned run)
+{
+	const struct lamebus_device_info *inf;
+	int i;
+
+	for (i=0; i<LAMEBUS_NSLOTS; i++) {
+		inf = devices[i].ls_info;
+		if (inf == NULL || inf->ldi_forked == NULL) {
+			continue;
+		}
+		inf->ldi_forked(devices[i].ls_devdata, run);
+	}
+}
+
+int
+bus_busy(void)
+{
+	const struct lamebus_device_info *inf;
+	int i;
+
+	for (i=0; i<LAMEBUS_NSLOTS; i++) {
+		inf = devices[i].ls_info;
+		if (inf == NULL || inf->ldi_busy == NULL) {
+			continue;
+		}
+		if (inf->ldi_busy(devices[i].ls_devdata)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * For saving pending events, whose data is the device's.
+ */
+int
+bus_findslot(void *devdata)
+{
+	int i;
+
+	if (devdata == NULL) {
+		return -1;
+	}
+	for (i=0; i<LAMEBUS_NSLOTS; i++) {
+		if (devices[i].ls_info != NULL &&
+		    devices[i].ls_devdata == devdata) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void *
+bus_slotdata(int slot)
+{
+	if (slot < 0 || slot >= LAMEBUS_NSLOTS) {
+		return NULL;
+	}
+	return devices[slot].ls_devdata;
+}
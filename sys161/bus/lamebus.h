@@ -3,8 +3,35 @@
 #ifndef LAMEBUS_H
 #define LAMEBUS_H
 
+/*
+ * A device memory window: a range of a device's register space that
+ * is plain memory, like a transfer buffer. The bus reads and writes
+ * it directly, without calling ldi_fetch or ldi_store, so these only
+ * see the real registers. The memory is in cpu byte order (that is,
+ * it can be used as a byte buffer), must stay put for as long as the
+ * device exists, and the range must be aligned to and a multiple of
+ * LAMEBUS_WINDOW_ALIGN.
+ */
+struct lamebus_window {
+   uint32_t lw_offset;		/* offset within the slot */
+   uint32_t lw_size;
+   char *lw_mem;
+};
+#define LAMEBUS_WINDOW_ALIGN	512	/* 1 << BUS_IOWIN_SHIFT */
+#define LAMEBUS_MAXWINDOWS	4
+
 /*
  * Info for a simulated device.
+ *
+ * ldi_busy, if not NULL, returns nonzero while the device is partway
+ * through something that copies of the machine made by the fork
+ * server mustn't each finish on their own (say, an operation already
+ * done on the host but not yet completed to the machine); the fork
+ * point waits until no device is busy.
+ *
+ * ldi_windows, if not NULL, is called after ldi_init to fill in the
+ * device's memory windows (up to LAMEBUS_MAXWINDOWS) and returns how
+ * many there are.
  */
 struct lamebus_device_info {
    uint32_t ldi_vendorid;
@@ -15,6 +42,11 @@ struct lamebus_device_info {
    int     (*ldi_store)(unsigned, void *, uint32_t offset, uint32_t val);
    void    (*ldi_dumpstate)(void *);
    void    (*ldi_cleanup)(void *);
+   void    (*ldi_save)(void *);
+   void    (*ldi_restore)(void *);
+   void    (*ldi_forked)(void *, unsigned run);
+   int     (*ldi_busy)(void *);
+   int     (*ldi_windows)(void *, struct lamebus_window *);
 };
 
 /*
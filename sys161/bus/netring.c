@@ -0,0 +1,183 @@
+#include <sys/types.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "config.h"
+
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+#include "netring.h"
+
+/*
+ * Shared-memory frame rings. See netring.h.
+ */
+
+#ifdef HAVE_NETSHM
+
+#define LOAD_ACQ(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE_REL(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define FENCE()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+////////////////////////////////////////////////////////////
+//
+// Rings
+
+static
+void
+netring_reset(struct netring *nr)
+{
+	nr->nr_head = 0;
+	nr->nr_tail = 0;
+	nr->nr_wantwake = 0;
+}
+
+void
+netring_init(struct netring_shm *nsh)
+{
+	nsh->nsh_magic = NETRING_MAGIC;
+	nsh->nsh_version = NETRING_VERSION;
+	nsh->nsh_slots = NETRING_SLOTS;
+	nsh->nsh_maxframe = NETRING_MAXFRAME;
+	netring_reset(&nsh->nsh_tohub);
+	netring_reset(&nsh->nsh_fromhub);
+}
+
+int
+netring_check(const struct netring_shm *nsh)
+{
+	if (nsh->nsh_magic != NETRING_MAGIC ||
+	    nsh->nsh_version != NETRING_VERSION ||
+	    nsh->nsh_slots != NETRING_SLOTS ||
+	    nsh->nsh_maxframe != NETRING_MAXFRAME) {
+		return -1;
+	}
+	return 0;
+}
+
+int
+netring_put(struct netring *nr, const void *buf, uint32_t len, int *wake)
+{
+	struct netring_slot *ns;
+	uint32_t head, tail;
+
+	if (len > NETRING_MAXFRAME) {
+		return -1;
+	}
+
+	head = nr->nr_head;
+	tail = LOAD_ACQ(&nr->nr_tail);
+	if (head - tail >= NETRING_SLOTS) {
+		return -1;
+	}
+
+	ns = &nr->nr_slots[head % NETRING_SLOTS];
+	ns->ns_len = len;
+	memcpy(ns->ns_data, buf, len);
+	STORE_REL(&nr->nr_head, head+1);
+
+	/*
+	 * The consumer sets nr_wantwake and then looks at nr_head; we
+	 * set nr_head and then look at nr_wantwake. The fence makes
+	 * sure at least one of us sees the other's store.
+	 */
+	FENCE();
+	*wake = 0;
+	if (LOAD_ACQ(&nr->nr_wantwake)) {
+		STORE_REL(&nr->nr_wantwake, 0);
+		*wake = 1;
+	}
+	return 0;
+}
+
+int
+netring_get(struct netring *nr, void *buf, uint32_t bufsize)
+{
+	struct netring_slot *ns;
+	uint32_t head, tail, len;
+
+	tail = nr->nr_tail;
+	head = LOAD_ACQ(&nr->nr_head);
+	if (head == tail) {
+		return -1;
+	}
+	if (head - tail > NETRING_SLOTS) {
+		/* Garbage; throw everything away. */
+		STORE_REL(&nr->nr_tail, head);
+		return -1;
+	}
+
+	ns = &nr->nr_slots[tail % NETRING_SLOTS];
+	len = ns->ns_len;
+	if (len > bufsize || len > NETRING_MAXFRAME) {
+		len = 0;
+	}
+	else {
+		memcpy(buf, ns->ns_data, len);
+	}
+	STORE_REL(&nr->nr_tail, tail+1);
+	return len;
+}
+
+int
+netring_wantwake(struct netring *nr)
+{
+	STORE_REL(&nr->nr_wantwake, 1);
+	FENCE();
+	return LOAD_ACQ(&nr->nr_head) != nr->nr_tail;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Doorbells
+
+int
+netbell_create(int *rfd, int *wfd)
+{
+#ifdef HAVE_EVENTFD
+	int fd;
+
+	fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	*rfd = *wfd = fd;
+	return 0;
+#else
+	int fds[2];
+
+	if (pipe(fds) < 0) {
+		return -1;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	*rfd = fds[0];
+	*wfd = fds[1];
+	return 0;
+#endif
+}
+
+void
+netbell_ring(int wfd)
+{
+	/* eventfd wants exactly 8 bytes; a pipe doesn't care */
+	uint64_t one = 1;
+
+	/* If it fails, the doorbell is already ringing. */
+	(void)!write(wfd, &one, sizeof(one));
+}
+
+void
+netbell_drain(int rfd)
+{
+	char buf[64];
+
+	while (read(rfd, buf, sizeof(buf)) > 0) {
+		/* nothing */
+	}
+}
+
+#endif /* HAVE_NETSHM */
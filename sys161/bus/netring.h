@@ -0,0 +1,120 @@
+#ifndef NETRING_H
+#define NETRING_H
+
+/*
+ * Shared-memory frame transport between the network device
+ * (dev_net.c) and hub161.
+ *
+ * Each network device that asks for it creates a shared memory
+ * segment holding two single-producer single-consumer rings of
+ * frames, one toward the hub and one from it, plus a doorbell for
+ * each direction. It hands these to the hub over the existing
+ * datagram socket, which remains the control channel and is still
+ * used for everything until the hub acknowledges. This is used by
+ * both sys161 and hub161, so it must not depend on anything else in
+ * sys161.
+ *
+ * The rings are in host byte order; both ends are on the same
+ * machine. The hub must not trust anything it finds in them.
+ *
+ * Doorbells are only rung when the consumer has said it's about to
+ * sleep, so a busy link costs no system calls.
+ *
+ * The functions are only compiled if configure found HAVE_NETSHM.
+ */
+
+#define NETRING_MAGIC		0x4e523631	/* "NR61" */
+#define NETRING_VERSION		1
+#define NETRING_SLOTS		64		/* must be a power of two */
+#define NETRING_MAXFRAME	4096
+
+struct netring_slot {
+	uint32_t ns_len;
+	uint32_t ns_pad;
+	char ns_data[NETRING_MAXFRAME];
+};
+
+/*
+ * The indexes run freely and are taken modulo NETRING_SLOTS. The
+ * producer writes nr_head; the consumer writes nr_tail and
+ * nr_wantwake. Keep them on separate cache lines.
+ */
+struct netring {
+	uint32_t nr_head;
+	char nr_pad1[60];
+	uint32_t nr_tail;
+	uint32_t nr_wantwake;
+	char nr_pad2[56];
+	struct netring_slot nr_slots[NETRING_SLOTS];
+};
+
+struct netring_shm {
+	uint32_t nsh_magic;
+	uint32_t nsh_version;
+	uint32_t nsh_slots;
+	uint32_t nsh_maxframe;
+	char nsh_pad[48];
+	struct netring nsh_tohub;
+	struct netring nsh_fromhub;
+};
+
+/*
+ * Control messages. These are frames to or from the hub address
+ * with one 32-bit big-endian word of payload.
+ *
+ *    ATTACH    device -> hub: use these rings. Carries three file
+ *              descriptors: the shared memory, the doorbell the hub
+ *              waits on, and the doorbell the hub rings.
+ *    ATTACHED  hub -> device: acknowledged; send and expect frames
+ *              on the rings. Also sent device -> hub in place of the
+ *              ordinary keepalive while the rings are in use.
+ *    DETACHED  hub -> device: the hub has no rings for you (it
+ *              probably restarted); go back to the socket.
+ */
+#define NETCTL_ATTACH		1
+#define NETCTL_ATTACHED		2
+#define NETCTL_DETACHED		3
+#define NETCTL_LEN		(8 + 4)		/* with link header */
+#define NETCTL_NFDS		3
+
+/*
+ * Set up a freshly created (or reused) segment.
+ */
+void netring_init(struct netring_shm *nsh);
+
+/*
+ * Check a segment the other side set up. Returns -1 if it's not one.
+ */
+int netring_check(const struct netring_shm *nsh);
+
+/*
+ * Producer side: add a frame. Returns -1 if the ring is full.
+ * Otherwise returns 0, and sets *wake if the doorbell needs ringing.
+ */
+int netring_put(struct netring *nr, const void *buf, uint32_t len,
+		int *wake);
+
+/*
+ * Consumer side: take a frame, copying it into buf. Returns the
+ * length, or -1 if the ring is empty. A frame too big for buf is
+ * discarded and reported as length 0.
+ */
+int netring_get(struct netring *nr, void *buf, uint32_t bufsize);
+
+/*
+ * Consumer side: ask to be woken. Returns nonzero if there's
+ * already something in the ring, in which case the caller should
+ * not go to sleep.
+ */
+int netring_wantwake(struct netring *nr);
+
+/*
+ * Doorbells. With eventfd both ends are the same descriptor; with a
+ * pipe they differ. Both are nonblocking. netbell_drain clears a
+ * doorbell so select/poll will wait on it again.
+ */
+int netbell_create(int *rfd, int *wfd);
+void netbell_ring(int wfd);
+void netbell_drain(int rfd);
+
+#endif /* NETRING_H */
@@ -426,6 +426,42 @@ debug_getthreadinfo(struct gdbcontext *ctx, const char *threadid)
 	debug_send(ctx, xbuf);
 }
 
+/*
+ * "monitor" commands from gdb; the command arrives in hex.
+ */
+static
+void
+debug_monitor(struct gdbcontext *ctx, const char *hexcmd)
+{
+	char cmd[256], *s;
+	size_t i;
+
+	for (i=0; hexcmd[0] && hexcmd[1] && i < sizeof(cmd)-1; i++) {
+		cmd[i] = hexbyte(hexcmd, &s);
+		hexcmd = s;
+	}
+	cmd[i] = 0;
+
+	if (!strcmp(cmd, "snapshot")) {
+		s = NULL;
+	}
+	else if (!strncmp(cmd, "snapshot ", 9)) {
+		s = cmd + 9;
+	}
+	else {
+		msg("Unknown monitor command %s", cmd);
+		debug_send(ctx, "E00");
+		return;
+	}
+
+	/* We're stopped, so the machine is between instructions */
+	if (main_savesnapshot(s) < 0) {
+		debug_send(ctx, "E01");
+		return;
+	}
+	debug_send(ctx, "OK");
+}
+
 ////////////////////////////////////////////////////////////
 // input packet processing
 
@@ -654,6 +690,9 @@ debug_exec(struct gdbcontext *ctx, const char *pkt)
 		else if (!strncmp(pkt+2, "ThreadExtraInfo,", 16)) {
 			debug_getthreadinfo(ctx, pkt+2+16);
 		}
+		else if (!strncmp(pkt+2, "Rcmd,", 5)) {
+			debug_monitor(ctx, pkt+2+5);
+		}
 		else {
 			debug_notsupp(ctx);
 		}
@@ -347,6 +347,29 @@ common_init(int sfd)
 	onselect(sfd, NULL, accepter, NULL);
 }
 
+/*
+ * Drop the listening socket and any debugger connection, without
+ * otherwise telling anyone. For a fork-server child, whose copies of
+ * these belong to the parent.
+ */
+void
+gdb_close(void)
+{
+	int fd;
+
+	if (g_ctx_inuse) {
+		fd = g_ctx.myfd;
+		g_ctx.myfd = -1;
+		notonselect(fd);
+		close(fd);
+	}
+	if (g_listenfd >= 0) {
+		notonselect(g_listenfd);
+		close(g_listenfd);
+		g_listenfd = -1;
+	}
+}
+
 void
 gdb_inet_init(int port)
 {
@@ -6,13 +6,15 @@
  * or relative to the start of I/O space. We split things up this way
  * because the actual memory layout is machine-dependent.
  *
- * The _mem_ functions are now kept in inlinemem.h
+ * The _mem_ functions are now kept in inlinemem.h, and so are
+ * bus_io_fetch and bus_io_store, which handle device memory windows
+ * themselves and call these for the real registers.
  */
 
 //int bus_mem_fetch(uint32_t addr, uint32_t *);
 //int bus_mem_store(uint32_t addr, uint32_t);
-int bus_io_fetch(unsigned cpunum, uint32_t addr, uint32_t *);
-int bus_io_store(unsigned cpunum, uint32_t addr, uint32_t);
+int bus_io_fetchreg(unsigned cpunum, uint32_t addr, uint32_t *);
+int bus_io_storereg(unsigned cpunum, uint32_t addr, uint32_t);
 
 /*
  * Set up bus and cards in bus. Returns number of CPUs to pass to cpu_init.
@@ -31,8 +33,36 @@ void bus_cleanup(void);
 void bus_dumpstate(void);
 
 /*
- * Load kernel. (boot.c)
+ * Snapshots (see snapshot.h): the controller, RAM, and devices.
+ * bus_findslot returns the slot whose device has the given data
+ * pointer, or -1; bus_slotdata goes the other way.
  */
-void load_kernel(const char *image, const char *argument);
+void bus_save(void);
+void bus_restore(void);
+void bus_restoreram(void);
+int bus_findslot(void *devdata);
+void *bus_slotdata(int slot);
+
+/*
+ * Called in each fork-server child (see forkserver.h) with its run
+ * number, so devices can stop sharing host files and sockets with
+ * the parent.
+ */
+void bus_forked(unsigned run);
+
+/*
+ * Check if any device is partway through something that mustn't be
+ * split across fork-server runs; if so, the fork point waits.
+ */
+int bus_busy(void);
+
+/*
+ * Load kernel, and optionally an initrd image to go with it, whose
+ * location is passed in the boot string. If CACHEFILE isn't NULL,
+ * the loaded kernel image is kept there to make the next boot of the
+ * same kernel faster. (boot.c)
+ */
+void load_kernel(const char *image, const char *argument,
+		 const char *initrd, const char *cachefile);
 
 #endif /* BUS_H */
@@ -9,6 +9,17 @@ void clock_ticks(uint64_t ticks);
 void schedule_event(uint64_t nsecs, void *data, uint32_t code,
 		    void (*func)(void *, uint32_t),
 		    const char *desc);
+
+/*
+ * Like schedule_event, but at virtual time VTIME (as from
+ * clock_monotime, or now if that's already past) exactly, without
+ * the usual random jitter. For events whose timing has to be
+ * reproducible.
+ */
+void schedule_event_at(uint64_t vtime, void *data, uint32_t code,
+		       void (*func)(void *, uint32_t),
+		       const char *desc);
+
 void clock_time(uint32_t *secs, uint32_t *nsecs);
 uint64_t clock_monotime(void);
 
@@ -19,3 +30,20 @@ void clock_setnsecs(uint32_t nsecs);
 void clock_waitirq(void);
 
 void clock_dumpstate(void);
+
+/*
+ * Snapshots (see snapshot.h). Pending events are saved by the name
+ * given to their function with clock_nameevent, and their data must
+ * be NULL or a device's data pointer. Events whose function has no
+ * name are taken to belong to the host side (profiling, meters) and
+ * are neither saved nor replaced by a restore.
+ */
+void clock_nameevent(void (*func)(void *, uint32_t), const char *name);
+void clock_save(void);
+void clock_restore(void);
+
+/*
+ * Stop counting the physical time since the machine last ran (after
+ * a restore, or in a fork-server child) as time it fell behind.
+ */
+void clock_resync(void);
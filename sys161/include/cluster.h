@@ -0,0 +1,87 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+/*
+ * Machines run together with -n share one virtual timeline: none of
+ * them runs more than CLUSTER_LATENCY of virtual time ahead of the
+ * slowest. A machine that gets there waits, asleep, for the others
+ * to catch up. This also keeps the host from spending time on a
+ * machine that is only idling ahead of the rest.
+ *
+ * Network cards configured with transport=cluster talk to the other
+ * machines directly through shared memory, with no hub161 and no
+ * sockets. Each frame arrives exactly CLUSTER_LATENCY after it was
+ * sent, in virtual time, so given the same inputs a run of the
+ * whole cluster plays out the same way every time. A frame can't
+ * arrive sooner than that, which is what lets each machine run that
+ * far ahead without missing one.
+ *
+ * This needs the atomic builtins and shared mmap, so it's only
+ * available if configure found HAVE_NETSHM; otherwise each machine
+ * keeps its own time as if it were run by itself.
+ */
+
+/* Most machines -n will start */
+#define CLUSTER_MAXNODES	256
+
+/* Virtual nsecs from sending a frame until it arrives */
+#define CLUSTER_LATENCY		1000000
+
+/* Frames per receiving machine not yet delivered */
+#define CLUSTER_SLOTS		256
+#define CLUSTER_MAXFRAME	4096
+
+/*
+ * In the -n parent: set up for count machines, before forking any.
+ * After a machine's process exits, cluster_gone lets the others stop
+ * waiting for it.
+ */
+void cluster_setup(unsigned count);
+void cluster_gone(unsigned node);
+
+/*
+ * In each machine: join as machine number node (from 1).
+ */
+void cluster_join(unsigned node);
+
+/*
+ * How far this machine may run in virtual time before it has to call
+ * cluster_sync and perhaps wait. All ones when not in a cluster.
+ */
+#define CLUSTER_UNBOUNDED	((uint64_t)-1)
+extern uint64_t cluster_bound;
+
+/*
+ * Tell the other machines we've got to VNOW. If that's (within a cpu
+ * cycle of) cluster_bound, wait until it isn't. Called by the clock
+ * code after virtual time advances.
+ */
+void cluster_sync(uint64_t vnow);
+
+/*
+ * Network (transport=cluster). A machine can have one card on it.
+ *
+ * cluster_net_attach registers the card's hardware address, and a
+ * function called whenever more frames might have become due; it
+ * returns -1 if this machine isn't in a cluster or already has a
+ * card attached.
+ *
+ * cluster_net_send sends a frame, sent at virtual time VNOW, to the
+ * machines with hardware address TO (or all of them for broadcast or
+ * an address nobody has). Returns -1 if some machine had no room for
+ * it.
+ *
+ * cluster_net_next returns 0 and sets *when to the arrival time of
+ * the earliest frame that's due before cluster_bound, or returns -1
+ * if there isn't one. cluster_net_recv takes that frame if it's due
+ * by VNOW, copying it into BUF and returning its length (0 if it
+ * doesn't fit), or returns -1. Frames due at the same time are taken
+ * in order of the machine that sent them.
+ */
+int cluster_net_attach(uint16_t hwaddr, void (*func)(void *), void *data);
+int cluster_net_send(uint64_t vnow, const void *buf, uint32_t len,
+		     uint16_t to);
+int cluster_net_next(uint64_t *when);
+int cluster_net_recv(uint64_t vnow, void *buf, uint32_t bufsize);
+
+#endif /* CLUSTER_H */
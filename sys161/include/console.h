@@ -13,6 +13,7 @@
 void console_earlyinit(void);
 void console_init(int pass_sigs, int do_tracing);
 void console_cleanup(void);
+void console_redirect(int infd, int outfd);
 
 void console_beep(void);
 void console_putc(int ch);
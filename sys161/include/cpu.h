@@ -1,8 +1,42 @@
 #ifndef CPU_H
 #define CPU_H
 
-/* nonzero if at least one cpu has work to do */
-extern uint32_t cpu_running_mask;
+/*
+ * Bitmask of cpus that have work to do, and how many there are
+ * (nonzero if at least one cpu has work to do).
+ */
+#define CPU_MAXCPUS	128
+#define CPU_MASKWORDS	(CPU_MAXCPUS / 64)
+extern uint64_t cpu_running_mask[CPU_MASKWORDS];
+extern unsigned cpu_running_count;
+
+/*
+ * Return the lowest-numbered cpu at or above CN that has work to do,
+ * or CPU_MAXCPUS if there isn't one. This is how the per-cycle loop
+ * gets from one running cpu to the next without looking at the idle
+ * ones.
+ */
+static
+inline
+unsigned
+cpu_running_next(unsigned cn)
+{
+	unsigned w;
+	uint64_t bits;
+
+	w = cn / 64;
+	if (w >= CPU_MASKWORDS) {
+		return CPU_MAXCPUS;
+	}
+	bits = cpu_running_mask[w] & (~(uint64_t)0 << (cn % 64));
+	while (bits == 0) {
+		if (++w == CPU_MASKWORDS) {
+			return CPU_MAXCPUS;
+		}
+		bits = cpu_running_mask[w];
+	}
+	return w * 64 + __builtin_ctzll(bits);
+}
 
 /* number of cycles into cpu_cycles() */
 extern uint64_t cpu_cycles_count;
@@ -13,6 +47,13 @@ void cpu_stopcycling(void); /* stops cpu_cycles() */
 
 void cpu_dumpstate(void);
 
+/* Bring the per-cpu idle cycle counts in g_stats up to date */
+void cpu_updatestats(void);
+
+/* Snapshot hooks (see snapshot.h) */
+void cpu_save(void);
+void cpu_restore(void);
+
 unsigned cpu_numcpus(void);
 
 /* Functions for enabling/disabling cpus */
@@ -24,6 +65,16 @@ int cpu_enabled(unsigned cpunum);
 int cpu_get_load_paddr(uint32_t vaddr, uint32_t size, uint32_t *paddr);
 int cpu_get_load_vaddr(uint32_t paddr, uint32_t size, uint32_t *vaddr);
 uint32_t cpu_get_ram_paddr(void);
+uint32_t cpu_get_ram_maxsize(void);
+uint32_t cpu_get_ram_loadsize(void);
+
+/*
+ * For devices that do DMA: find where in RAM (as an offset into
+ * ram[]) the cpu would reach SIZE bytes at physical address PADDR.
+ * Returns -1 if any of it is ROM, I/O, past the end of RAM, or not
+ * there at all.
+ */
+int cpu_get_ram_offset(uint32_t paddr, uint32_t size, uint32_t *offset);
 
 /* Functions used to update the cpu state by the kernel load code */
 void cpu_set_entrypoint(unsigned cpunum, uint32_t addr);
@@ -0,0 +1,48 @@
+#ifndef FORKSERVER_H
+#define FORKSERVER_H
+
+/*
+ * Fork server (-F): once the machine reaches the fork point it stops
+ * and waits for requests on a control socket. Each request forks a
+ * copy of the machine, which runs from that point to completion on
+ * its own while the original stays where it is. The copies share
+ * RAM with the original copy-on-write, so starting a run costs about
+ * as much as a fork() no matter how long the boot was.
+ *
+ * Each run gets its own console input and output, its own disk
+ * overlays (see dev_disk.c) and its own sockets; the parent reports
+ * when it started and its exit code and counters when it finishes.
+ *
+ * The protocol is lines of text, one command per line:
+ *
+ *    run [in=FILE] [out=FILE]
+ *       Start run N. Console input comes from FILE (default
+ *       /dev/null) and all output goes to FILE (default run-N.out).
+ *       Replies "STARTED N pid", and later "DONE N exitcode
+ *       counters..." or "KILLED N signal".
+ *    quit
+ *       Stop taking requests; exit when the runs in progress have
+ *       finished.
+ *
+ * Errors are reported as "BAD message".
+ */
+
+/*
+ * Listen on PATH (before any machine state is set up).
+ */
+void forkserver_init(const char *path);
+
+/*
+ * Serve requests. Never returns in the parent; in each child it
+ * returns the run number (counting from 1), with the console and
+ * devices already switched over.
+ */
+unsigned forkserver_serve(void);
+
+/*
+ * In a child, send the counters to the parent at normal exit.
+ * Does nothing otherwise.
+ */
+void forkserver_report(void);
+
+#endif /* FORKSERVER_H */
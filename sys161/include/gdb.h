@@ -9,6 +9,9 @@
 void gdb_inet_init(int listenport);
 void gdb_unix_init(const char *socketpath);
 
+/* Call to drop the socket and connection (in a fork-server child) */
+void gdb_close(void);
+
 /* Call to disable waiting for connections */
 void gdb_dontwait(void);
 
@@ -7,8 +7,22 @@
  *
  * The globals used by these functions (ram[] and bus_ramsize) are
  * declared in memdefs.h.
+ *
+ * RAM is kept as 32-bit words in host byte order, because nearly all
+ * accesses (instruction fetch, loads and stores, page table walks)
+ * are whole words and this way none of them need swapping. When the
+ * cpu's byte order is not the host's, the byte at offset X is
+ * therefore found at ram[X ^ RAM_BYTEXOR] rather than ram[X]. Code
+ * outside the cpu and bus should not touch ram[] directly, but use
+ * bus_mem_read/write/zero, which convert in bulk.
  */
 
+#if HOST_ENDIAN == CPU_ENDIAN
+#define RAM_BYTEXOR 0
+#else
+#define RAM_BYTEXOR 3
+#endif
+
 
 /*
  * Fetch physical memory.
@@ -30,7 +44,7 @@ bus_mem_fetch(uint32_t offset, uint32_t *ret)
 	//Assert((offset & 0x3)==0);
 	
 	ptr = ram+offset;
-	*ret = ctoh32(*(uint32_t *)ptr);
+	*ret = *(uint32_t *)ptr;
 	
 	return 0;
 }
@@ -50,12 +64,25 @@ bus_mem_fetchbyte(uint32_t offset, uint8_t *ret)
 		return -1;
 	}
 
-	ptr = ram+offset;
+	ptr = ram+(offset ^ RAM_BYTEXOR);
 	*ret = *(uint8_t *)ptr;
 	
 	return 0;
 }
 
+/*
+ * Note a write to physical memory (for incremental snapshots).
+ */
+static
+inline
+void
+bus_mem_setdirty(uint32_t offset)
+{
+	uint32_t page = offset >> RAM_DIRTYSHIFT;
+
+	ram_dirty[page / 8] |= 1 << (page % 8);
+}
+
 /*
  * Store to physical memory.
  */
@@ -76,7 +103,8 @@ bus_mem_store(uint32_t offset, uint32_t val)
 	//Assert((offset & 0x3)==0);
 
 	ptr = ram+offset;
-	*(uint32_t *)ptr = htoc32(val);
+	*(uint32_t *)ptr = val;
+	bus_mem_setdirty(offset);
 	
 	return 0;
 }
@@ -96,8 +124,9 @@ bus_mem_storebyte(uint32_t offset, uint8_t val)
 		return -1;
 	}
 
-	ptr = ram+offset;
+	ptr = ram+(offset ^ RAM_BYTEXOR);
 	*(uint8_t *)ptr = val;
+	bus_mem_setdirty(offset);
 
 	return 0;
 }
@@ -122,5 +151,49 @@ inline
 uint32_t
 bus_use_map(const uint32_t *page, uint32_t pageoffset)
 {
-	return ctoh32(page[pageoffset/sizeof(uint32_t)]);
+	return page[pageoffset/sizeof(uint32_t)];
+}
+
+/*
+ * Fetch from I/O space. Device memory windows (transfer buffers) are
+ * read directly; everything else goes to the device. Device memory
+ * is in cpu byte order.
+ */
+static
+inline
+int
+bus_io_fetch(unsigned cpunum, uint32_t offset, uint32_t *ret)
+{
+	char *win;
+
+	if (offset < BUS_IOSIZE) {
+		win = bus_io_windows[offset >> BUS_IOWIN_SHIFT];
+		if (win != NULL) {
+			win += offset & BUS_IOWIN_MASK;
+			*ret = ctoh32(*(uint32_t *)win);
+			return 0;
+		}
+	}
+	return bus_io_fetchreg(cpunum, offset, ret);
+}
+
+/*
+ * Store to I/O space, likewise.
+ */
+static
+inline
+int
+bus_io_store(unsigned cpunum, uint32_t offset, uint32_t val)
+{
+	char *win;
+
+	if (offset < BUS_IOSIZE) {
+		win = bus_io_windows[offset >> BUS_IOWIN_SHIFT];
+		if (win != NULL) {
+			win += offset & BUS_IOWIN_MASK;
+			*(uint32_t *)win = htoc32(val);
+			return 0;
+		}
+	}
+	return bus_io_storereg(cpunum, offset, val);
 }
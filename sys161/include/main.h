@@ -32,6 +32,22 @@ void onecycle(void);
  */
 void main_dumpstate(void);
 
+/*
+ * Snapshots (see snapshot.h). main_snapshot asks for one to be taken
+ * as soon as the current instruction finishes; main_savesnapshot
+ * takes one right away and is only for use while the cpus are not
+ * running, such as from the debugger. A null path means the one
+ * given with -S. main_savesnapshot returns 0 or -1.
+ */
+void main_snapshot(void);
+int main_savesnapshot(const char *path);
+
+/*
+ * Which machine this is, when several are run at once with -n
+ * (numbered from 1); 0 otherwise.
+ */
+extern unsigned cluster_node;
+
 /*
  * Hardware counters reported at simulator exit.
  */
@@ -1,3 +1,42 @@
 extern uint32_t bus_ramsize;
 extern char *ram;
 
+/*
+ * Device memory windows (see lamebus.h). The 2M of LAMEbus I/O space
+ * is divided into 512-byte pieces; for each, the memory behind it if
+ * it is part of a window, or NULL if accesses go to the device.
+ */
+#define BUS_IOSIZE		0x200000
+#define BUS_IOWIN_SHIFT		9
+#define BUS_IOWIN_MASK		((1 << BUS_IOWIN_SHIFT) - 1)
+extern char *bus_io_windows[BUS_IOSIZE >> BUS_IOWIN_SHIFT];
+
+/*
+ * Copy between RAM and a byte buffer (in the order the cpu sees
+ * memory), or clear part of RAM. The layout of ram[] itself is
+ * described in inlinemem.h. Writes mark the pages dirty.
+ */
+void bus_mem_read(uint32_t offset, void *buf, uint32_t len);
+void bus_mem_write(uint32_t offset, const void *buf, uint32_t len);
+void bus_mem_zero(uint32_t offset, uint32_t len);
+
+/*
+ * Copy words of RAM as they are stored, without converting, for the
+ * kernel image cache in boot.c. Offset and length must be multiples
+ * of 4.
+ */
+void bus_mem_readraw(uint32_t offset, void *buf, uint32_t len);
+void bus_mem_writeraw(uint32_t offset, const void *buf, uint32_t len);
+
+/*
+ * Pages of RAM written since the last snapshot, one bit per 4K page,
+ * so the next snapshot can be incremental (see snapshot.h). The cpu
+ * stores mark them in inlinemem.h, and the functions above do for
+ * device DMA; anything else that writes into ram[] has to call
+ * bus_mem_dirtyrange.
+ */
+#define RAM_DIRTYSHIFT 12
+extern uint8_t *ram_dirty;
+
+void bus_mem_dirtyrange(uint32_t offset, uint32_t len);
+void bus_mem_cleardirty(void);
@@ -2,5 +2,6 @@
 #define METER_H
 
 void meter_init(const char *pathname);
+void meter_close(void);
 
 #endif /* METER_H */
@@ -27,5 +27,12 @@ void notonselect(int fd);
  */
 uint64_t tryselect(int do_timeout, uint64_t nsecs);
 
+/*
+ * Like tryselect(0, 0), but the time spent waiting does not pass in
+ * the machine, so the handlers see the time as it was. For waiting
+ * on the other machines with -n.
+ */
+void waitselect(void);
+
 /* Extra time from waiting in select (while dispatching select events) */
 extern uint64_t extra_selecttime;
@@ -19,4 +19,8 @@ void prof_disable(void);
 int prof_isenabled(void);
 void prof_clear(void);
 
+/* snapshot hooks: the kernel text range */
+void prof_save(void);
+void prof_restore(void);
+
 #endif /* PROF_H */
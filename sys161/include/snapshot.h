@@ -0,0 +1,78 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/*
+ * Machine snapshots: the complete state of the simulated machine
+ * (RAM, cpus, bus controller, devices, and the clock with its pending
+ * events) written to a file, so that a later run can start from that
+ * point instead of loading and booting the kernel again.
+ *
+ * A snapshot can only be restored by the same build of System/161
+ * running the same configuration: the same devices in the same
+ * slots, the same amount of RAM, and the same number of cpus. The
+ * sizes of the saved structures are recorded and checked for this.
+ * Things outside the machine (disk image contents, emufs files, the
+ * network hub, debugger and meter connections) are not saved.
+ *
+ * Snapshots are only taken between instructions, from the main loop
+ * or while stopped in the debugger; see main_snapshot().
+ */
+
+/*
+ * Write a snapshot of the machine to PATH. Returns 0 on success; on
+ * failure prints why, leaves no file behind, and returns -1. The
+ * machine is unaffected either way.
+ */
+int snapshot_save(const char *path);
+
+/*
+ * Same, but incremental: only the pages of RAM written since the
+ * last snapshot taken (or resumed from) are saved, along with a
+ * reference to that snapshot by name. Everything else is saved in
+ * full as usual; it's small. If there was no previous snapshot this
+ * is the same as snapshot_save.
+ *
+ * Restoring an incremental snapshot reads the memory from the ones
+ * it is based on first, so they must all still be there, unchanged,
+ * under the names they were saved with (relative to the directory
+ * System/161 runs in).
+ */
+int snapshot_saveincr(const char *path);
+
+/*
+ * Replace the state of the (freshly configured) machine with the
+ * snapshot in PATH. Dies on error.
+ */
+void snapshot_restore(const char *path);
+
+/*
+ * For the save and restore hooks of the various modules. Sections
+ * are tagged so a damaged or mismatched file is caught early. Read
+ * errors (including tag and size mismatches) are fatal; write errors
+ * are reported when the snapshot is finished.
+ *
+ * snap_fail is for save hooks that find their state can't be saved
+ * right now; the snapshot is abandoned.
+ */
+void snap_section(const char *tag);
+void snap_write(const void *buf, size_t len);
+void snap_write32(uint32_t val);
+void snap_write64(uint64_t val);
+void snap_writestr(const char *str);
+void snap_writesize(size_t size);
+void snap_writemap(const uint32_t *page, const uint32_t *(*rommap)(uint32_t));
+PF(1,2) void snap_fail(const char *fmt, ...);
+
+/* Whether the snapshot being written or read is incremental */
+int snap_isincremental(void);
+
+void snap_expect(const char *tag);
+void snap_read(void *buf, size_t len);
+uint32_t snap_read32(void);
+uint64_t snap_read64(void);
+char *snap_readstr(void);
+void snap_checksize(const char *what, size_t size);
+const uint32_t *snap_readmap(const uint32_t *(*rommap)(uint32_t));
+DEAD PF(1,2) void snap_error(const char *fmt, ...);
+
+#endif /* SNAPSHOT_H */
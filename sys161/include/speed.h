@@ -26,6 +26,11 @@
 // All emufs ops take 5ms.
 #define EMUFS_NSECS    (5000000)
 
+// Except ops queued on the emufs command ring, which take 20 us.
+// Ring ops and DMA ops also take 10 ns per byte transferred (100 MB/s).
+#define EMUFS_RING_NSECS     (20000)
+#define EMUFS_NSECS_PER_BYTE (10)
+
 // Profile at 1000 Hz for increased accuracy.
 #define PROFILE_NSECS  (1000000)
 
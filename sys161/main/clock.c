@@ -12,6 +12,8 @@
 #include "bus.h"
 #include "onsel.h"
 #include "main.h"
+#include "snapshot.h"
+#include "cluster.h"
 
 /*
  * random() is a BSD function that is usually documented to return
@@ -45,6 +47,8 @@
  *      instantly
  *    - when the CPU is not running and no timed events are pending:
  *      synchronously with physical time
+ *    - with -n: never more than CLUSTER_LATENCY ahead of the slowest
+ *      of the other machines (see cluster.h)
  *
  * Physical time advances as follows:
  *    - when the main loop is stopped in the debugger: not at all (*)
@@ -62,6 +66,7 @@
 static uint64_t virtual_now;
 
 static uint32_t start_secs, start_nsecs;
+static uint64_t phys_skew; /* physical nsecs not run (before a restore) */
 
 unsigned progress;
 static int check_progress;
@@ -140,15 +145,11 @@ clock_newprogressdeadline(void)
 }
 
 /*
- * Figure out how far a given virtual time is ahead of physical time.
- * Returns zero if it isn't ahead of physical time.
- *
- * If we're already ahead of physical time, limit the amount we report
- * to the amount the given virtual time is in the virtual future.
+ * Return the physical time since startup.
  */
 static
 uint64_t
-clock_vahead(uint64_t vnow, uint64_t vnsecs)
+clock_pnow(void)
 {
 	struct timeval tv;
 	uint64_t pnsecs;
@@ -166,6 +167,26 @@ clock_vahead(uint64_t vnow, uint64_t vnsecs)
 	}
 	pnsecs = tv.tv_sec * NSECS_PER_SEC + tv.tv_usec * 1000;
 	pnsecs -= start_nsecs;
+	if (pnsecs < phys_skew) {
+		return 0;
+	}
+	return pnsecs - phys_skew;
+}
+
+/*
+ * Figure out how far a given virtual time is ahead of physical time.
+ * Returns zero if it isn't ahead of physical time.
+ *
+ * If we're already ahead of physical time, limit the amount we report
+ * to the amount the given virtual time is in the virtual future.
+ */
+static
+uint64_t
+clock_vahead(uint64_t vnow, uint64_t vnsecs)
+{
+	uint64_t pnsecs;
+
+	pnsecs = clock_pnow();
 
 	if (vnsecs <= pnsecs) {
 		return 0;
@@ -261,25 +282,35 @@ check_queue(void)
  *
  * The return value needs to be rounded up; otherwise an event due
  * after the current moment but less than one cpu cycle in the future
- * never gets dispatched.
+ * never gets dispatched. The cluster bound is rounded down instead,
+ * as it mustn't be passed; cluster_sync waits when we're within a
+ * cycle of it.
  */
 uint32_t
 clock_getrunticks(void)
 {
 	struct timed_action *ta;
 	uint64_t vnow;
-	uint32_t retnsecs;
+	uint32_t retnsecs, maxrun;
 
 /* Go for up to 5 ms at a time (in virtual time) */
 #define MAXRUN 125000
 
+	maxrun = MAXRUN;
+	vnow = clock_vnow();
+	if (cluster_bound < vnow + MAXRUN * NSECS_PER_CLOCK) {
+		if (cluster_bound <= vnow) {
+			return 0;
+		}
+		maxrun = (cluster_bound - vnow) / NSECS_PER_CLOCK;
+	}
+
 	ta = queuehead;
 	if (ta != NULL) {
-		vnow = clock_vnow();
 		if (ta->ta_vtime <= vnow) {
 			return 0;
 		}
-		if (ta->ta_vtime < vnow + MAXRUN * NSECS_PER_CLOCK) {
+		if (ta->ta_vtime < vnow + maxrun * NSECS_PER_CLOCK) {
 			ta->ta_runningto = 1;
 			/* round up */
 			retnsecs = ta->ta_vtime - vnow;
@@ -287,29 +318,17 @@ clock_getrunticks(void)
 			return retnsecs / NSECS_PER_CLOCK;
 		}
 	}
-	return MAXRUN;
+	return maxrun;
 }
 
+/*
+ * Sorted linked-list insert.
+ */
+static
 void
-schedule_event(uint64_t nsecs, void *data, uint32_t code,
-	       void (*func)(void *, uint32_t),
-	       const char *desc)
+enqueue(struct timed_action *n)
 {
-	struct timed_action *n, **p;
-
-	nsecs += (uint64_t)((random()*(nsecs*0.01))/RANDOM_MAX);
-
-	n = acalloc();
-	n->ta_vtime = clock_vnow() + nsecs;
-	n->ta_data = data;
-	n->ta_code = code;
-	n->ta_func = func;
-	n->ta_desc = desc;
-	n->ta_runningto = 0;
-
-	/*
-	 * Sorted linked-list insert.
-	 */
+	struct timed_action **p;
 
 	for (p = &queuehead; (*p) != NULL; p = &(*p)->ta_next) {
 		if (n->ta_vtime < (*p)->ta_vtime) {
@@ -334,6 +353,35 @@ schedule_event(uint64_t nsecs, void *data, uint32_t code,
 	}
 }
 
+void
+schedule_event(uint64_t nsecs, void *data, uint32_t code,
+	       void (*func)(void *, uint32_t),
+	       const char *desc)
+{
+	nsecs += (uint64_t)((random()*(nsecs*0.01))/RANDOM_MAX);
+	schedule_event_at(clock_vnow() + nsecs, data, code, func, desc);
+}
+
+void
+schedule_event_at(uint64_t vtime, void *data, uint32_t code,
+		  void (*func)(void *, uint32_t),
+		  const char *desc)
+{
+	struct timed_action *n;
+	uint64_t vnow;
+
+	vnow = clock_vnow();
+	n = acalloc();
+	n->ta_vtime = vtime > vnow ? vtime : vnow;
+	n->ta_data = data;
+	n->ta_code = code;
+	n->ta_func = func;
+	n->ta_desc = desc;
+	n->ta_runningto = 0;
+
+	enqueue(n);
+}
+
 ////////////////////////////////////////////////////////////
 // elapsed time interface
 
@@ -350,6 +398,7 @@ clock_ticks(uint64_t nticks)
 	g_stats.s_tot_rcycles += nticks;
 	clock_vadvance(nticks * NSECS_PER_CLOCK);
 	check_queue();
+	cluster_sync(clock_vnow());
 
 	if (!check_progress) {
 		return;
@@ -395,10 +444,29 @@ clock_waitirq(void)
 {
 	static uint32_t idleslop;
 
-	uint64_t vnow, wnsecs, sleptnsecs, tmp;
+	uint64_t vnow, target, wnsecs, sleptnsecs, tmp;
 
-	while (cpu_running_mask == 0) {
-		if (queuehead != NULL) {
+	while (cpu_running_count == 0) {
+		cluster_sync(clock_vnow());
+		if (cluster_bound != CLUSTER_UNBOUNDED) {
+			/*
+			 * With -n, go straight to the next event, or to
+			 * where we'd have to wait for the other machines
+			 * if that's sooner, so the time we get to never
+			 * depends on how long select took. But first
+			 * sleep off any more than 10 ms we'd be ahead of
+			 * wall time, as below.
+			 */
+			vnow = clock_vnow();
+			target = cluster_bound;
+			if (queuehead != NULL && queuehead->ta_vtime < target) {
+				target = queuehead->ta_vtime;
+			}
+			wnsecs = clock_vahead(vnow, target);
+			(void)tryselect(1, wnsecs > 10000000 ? wnsecs : 0);
+			sleptnsecs = target > vnow ? target - vnow : 0;
+		}
+		else if (queuehead != NULL) {
 			/*
 			 * We have an event due; wait for it. Figure
 			 * out how far ahead of real wall time we will
@@ -434,8 +502,15 @@ clock_waitirq(void)
 			sleptnsecs = tryselect(0, 0);
 		}
 
+		/*
+		 * With -n the leftover fraction of a cycle is only
+		 * counted, not added to the time, which mustn't pass
+		 * where the branch above stopped it.
+		 */
 		tmp = sleptnsecs + idleslop;
-		sleptnsecs += idleslop;
+		if (cluster_bound == CLUSTER_UNBOUNDED) {
+			sleptnsecs += idleslop;
+		}
 		g_stats.s_tot_icycles += tmp / NSECS_PER_CLOCK;
 		idleslop = tmp % NSECS_PER_CLOCK;
 
@@ -529,6 +604,190 @@ clock_dumpstate(void)
 	}
 }
 
+////////////////////////////////////////////////////////////
+// snapshots
+
+/*
+ * Stable names for event functions, so pending events can be saved.
+ */
+#define MAXEVENTNAMES 64
+
+static struct {
+	void (*en_func)(void *, uint32_t);
+	const char *en_name;
+} eventnames[MAXEVENTNAMES];
+static unsigned numeventnames;
+
+void
+clock_nameevent(void (*func)(void *, uint32_t), const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<numeventnames; i++) {
+		if (eventnames[i].en_func == func) {
+			return;
+		}
+		if (!strcmp(eventnames[i].en_name, name)) {
+			smoke("Event name %s used twice", name);
+		}
+	}
+	if (numeventnames >= MAXEVENTNAMES) {
+		smoke("Too many event names");
+	}
+	eventnames[numeventnames].en_func = func;
+	eventnames[numeventnames].en_name = name;
+	numeventnames++;
+}
+
+static
+const char *
+eventname(void (*func)(void *, uint32_t))
+{
+	unsigned i;
+
+	for (i=0; i<numeventnames; i++) {
+		if (eventnames[i].en_func == func) {
+			return eventnames[i].en_name;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+(*eventfunc(const char *name))(void *, uint32_t)
+{
+	unsigned i;
+
+	for (i=0; i<numeventnames; i++) {
+		if (!strcmp(eventnames[i].en_name, name)) {
+			return eventnames[i].en_func;
+		}
+	}
+	return NULL;
+}
+
+void
+clock_save(void)
+{
+	struct timed_action *ta;
+	const char *name;
+	int slot;
+
+	snap_section("CLCK");
+	snap_write64(clock_vnow());
+	snap_write32(start_secs);
+	snap_write32(start_nsecs);
+
+	for (ta = queuehead; ta != NULL; ta = ta->ta_next) {
+		name = eventname(ta->ta_func);
+		if (name == NULL) {
+			/* host-side */
+			continue;
+		}
+		if (ta->ta_data == NULL) {
+			slot = -1;
+		}
+		else {
+			slot = bus_findslot(ta->ta_data);
+			if (slot < 0) {
+				snap_fail("Pending %s event does not belong "
+					  "to a device", name);
+				return;
+			}
+		}
+		snap_writestr(name);
+		snap_writestr(ta->ta_desc);
+		snap_write32(slot);
+		snap_write32(ta->ta_code);
+		snap_write64(ta->ta_vtime);
+	}
+	snap_writestr("");
+}
+
+/*
+ * Line physical time back up with virtual time, after a restore or
+ * after sitting in a fork server. Don't count the time in between as
+ * physical time gone by, or we'd never sleep to keep pace.
+ */
+void
+clock_resync(void)
+{
+	uint64_t pnsecs;
+
+	phys_skew = 0;
+	pnsecs = clock_pnow();
+	phys_skew = pnsecs > virtual_now ? pnsecs - virtual_now : 0;
+
+	if (check_progress) {
+		clock_newprogressdeadline();
+	}
+}
+
+void
+clock_restore(void)
+{
+	struct timed_action *ta, **p;
+	char *name;
+	int slot;
+
+	snap_expect("CLCK");
+	virtual_now = snap_read64();
+	start_secs = snap_read32();
+	start_nsecs = snap_read32();
+
+	/*
+	 * The machine's time of day carries on from when the snapshot
+	 * was taken, so a restored run sees exactly what the original
+	 * did.
+	 */
+	clock_resync();
+
+	/* Drop the machine's events from startup; keep the host's. */
+	p = &queuehead;
+	while (*p != NULL) {
+		ta = *p;
+		if (eventname(ta->ta_func) != NULL) {
+			*p = ta->ta_next;
+			acfree(ta);
+		}
+		else {
+			ta->ta_runningto = 0;
+			p = &ta->ta_next;
+		}
+	}
+
+	while (1) {
+		name = snap_readstr();
+		if (*name == 0) {
+			free(name);
+			break;
+		}
+		ta = acalloc();
+		ta->ta_func = eventfunc(name);
+		if (ta->ta_func == NULL) {
+			snap_error("Unknown event %s", name);
+		}
+		free(name);
+		/* not freed, like the string constants it replaces */
+		ta->ta_desc = snap_readstr();
+		slot = snap_read32();
+		ta->ta_code = snap_read32();
+		ta->ta_vtime = snap_read64();
+		ta->ta_runningto = 0;
+		if (slot < 0) {
+			ta->ta_data = NULL;
+		}
+		else {
+			ta->ta_data = bus_slotdata(slot);
+			if (ta->ta_data == NULL) {
+				snap_error("Event for empty slot %d", slot);
+			}
+		}
+		enqueue(ta);
+	}
+}
+
 void
 clock_setprogresstimeout(uint32_t secs)
 {
@@ -0,0 +1,460 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <errno.h>
+#include "config.h"
+
+#include "util.h"
+#include "console.h"
+#include "speed.h"
+#include "onsel.h"
+#include "cluster.h"
+#include "netring.h"
+
+/*
+ * Shared timeline and network for machines run with -n. See
+ * cluster.h.
+ *
+ * The parent maps the shared state and makes a doorbell for each
+ * machine before forking them, so they all inherit both. Each
+ * machine publishes how far it has got (cn_now); the bound for each
+ * is the least of the others' plus CLUSTER_LATENCY. Nobody runs at
+ * all until every machine has started, so that all the nics are
+ * attached before the first frame is sent. A machine waiting
+ * for the others sets cn_waiting and sleeps on its doorbell; whoever
+ * publishes progress rings the doorbells of the ones waiting. (Both
+ * sides store and then fence before looking at the other's flag, so
+ * one of them always sees the other.)
+ *
+ * Frames go in the receiver's inbox at send time, stamped with when
+ * they arrive. Any frame due before a machine's bound is already in
+ * its inbox: the sender had published a time at least CLUSTER_LATENCY
+ * before the bound, and sent the frame before that. So what a machine
+ * receives, and when, doesn't depend on how the host schedules the
+ * processes. The inboxes are small enough to lock with a spinlock.
+ */
+
+uint64_t cluster_bound = CLUSTER_UNBOUNDED;
+
+#ifdef HAVE_NETSHM
+
+#define LOAD_ACQ(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE_REL(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define FENCE()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* the nic's broadcast address */
+#define CLUSTER_BROADCAST	0xffff
+
+struct cluster_slot {
+	uint64_t cs_when;
+	uint32_t cs_from;		/* sending machine */
+	uint32_t cs_seq;		/* sender's frame count */
+	uint32_t cs_len;		/* 0 if free */
+	uint32_t cs_pad;
+};
+
+struct cluster_node {
+	uint64_t cn_now;		/* virtual time reached */
+	uint32_t cn_started;		/* set up and running */
+	uint32_t cn_gone;		/* process has exited */
+	uint32_t cn_waiting;		/* asleep on its doorbell */
+	uint32_t cn_hwaddr;		/* attached nic, or 0 */
+	uint32_t cn_lock;		/* for the inbox */
+	char cn_pad[36];
+
+	struct cluster_slot cn_slots[CLUSTER_SLOTS];
+	char cn_frames[CLUSTER_SLOTS][CLUSTER_MAXFRAME];
+};
+
+static struct cluster_node *nodes;
+static unsigned numnodes;
+static int *bell_rfds, *bell_wfds;
+
+/* in a machine */
+static struct cluster_node *me;
+static unsigned mynode;
+static uint32_t myseq;
+static void (*netfunc)(void *);
+static void *netdata;
+
+////////////////////////////////////////////////////////////
+// setup
+
+void
+cluster_setup(unsigned count)
+{
+	size_t size;
+	void *ptr;
+	unsigned i;
+
+	/* The pages only get touched when used, so don't need to be real. */
+	size = count * sizeof(struct cluster_node);
+	ptr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON,
+		   -1, 0);
+	if (ptr == MAP_FAILED) {
+		msg("mmap: %s", strerror(errno));
+		die();
+	}
+	nodes = ptr;
+	numnodes = count;
+
+	bell_rfds = domalloc(count * sizeof(int));
+	bell_wfds = domalloc(count * sizeof(int));
+	for (i=0; i<count; i++) {
+		if (netbell_create(&bell_rfds[i], &bell_wfds[i]) < 0) {
+			msg("Doorbell for machine %u: %s", i+1,
+			    strerror(errno));
+			die();
+		}
+	}
+}
+
+static
+void
+wakewaiters(void)
+{
+	unsigned i;
+
+	for (i=0; i<numnodes; i++) {
+		if (&nodes[i] != me && LOAD_ACQ(&nodes[i].cn_waiting)) {
+			netbell_ring(bell_wfds[i]);
+		}
+	}
+}
+
+void
+cluster_gone(unsigned node)
+{
+	if (nodes == NULL) {
+		return;
+	}
+	STORE_REL(&nodes[node-1].cn_gone, 1);
+	FENCE();
+	wakewaiters();
+}
+
+static
+int
+doorbell(void *data)
+{
+	(void)data;
+	netbell_drain(bell_rfds[mynode-1]);
+	return 0;
+}
+
+static
+uint64_t
+getbound(void)
+{
+	uint64_t bound, now;
+	unsigned i;
+
+	bound = CLUSTER_UNBOUNDED;
+	for (i=0; i<numnodes; i++) {
+		if (&nodes[i] == me || LOAD_ACQ(&nodes[i].cn_gone)) {
+			continue;
+		}
+		if (!LOAD_ACQ(&nodes[i].cn_started)) {
+			return 0;
+		}
+		now = LOAD_ACQ(&nodes[i].cn_now) + CLUSTER_LATENCY;
+		if (now < bound) {
+			bound = now;
+		}
+	}
+	return bound;
+}
+
+void
+cluster_join(unsigned node)
+{
+	mynode = node;
+	me = &nodes[node-1];
+	onselect(bell_rfds[node-1], NULL, doorbell, NULL);
+	cluster_bound = getbound();
+}
+
+////////////////////////////////////////////////////////////
+// timeline
+
+static
+inline
+int
+reached(uint64_t vnow, uint64_t bound)
+{
+	return bound <= vnow || bound - vnow < NSECS_PER_CLOCK;
+}
+
+void
+cluster_sync(uint64_t vnow)
+{
+	uint64_t oldbound;
+
+	if (me == NULL) {
+		return;
+	}
+
+	STORE_REL(&me->cn_now, vnow);
+	STORE_REL(&me->cn_started, 1);
+	FENCE();
+	wakewaiters();
+
+	oldbound = cluster_bound;
+	cluster_bound = getbound();
+	while (reached(vnow, cluster_bound)) {
+		STORE_REL(&me->cn_waiting, 1);
+		FENCE();
+		cluster_bound = getbound();
+		if (!reached(vnow, cluster_bound)) {
+			STORE_REL(&me->cn_waiting, 0);
+			break;
+		}
+		waitselect();
+		STORE_REL(&me->cn_waiting, 0);
+		cluster_bound = getbound();
+	}
+
+	if (cluster_bound != oldbound && netfunc != NULL) {
+		netfunc(netdata);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// network
+
+static
+void
+inbox_lock(struct cluster_node *cn)
+{
+	while (__atomic_exchange_n(&cn->cn_lock, 1, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&cn->cn_lock, __ATOMIC_RELAXED)) {
+			sched_yield();
+		}
+	}
+}
+
+static
+void
+inbox_unlock(struct cluster_node *cn)
+{
+	STORE_REL(&cn->cn_lock, 0);
+}
+
+int
+cluster_net_attach(uint16_t hwaddr, void (*func)(void *), void *data)
+{
+	if (me == NULL || netfunc != NULL) {
+		return -1;
+	}
+	netfunc = func;
+	netdata = data;
+	STORE_REL(&me->cn_hwaddr, hwaddr);
+	return 0;
+}
+
+/*
+ * Put a frame in one machine's inbox.
+ */
+static
+int
+deliver(struct cluster_node *cn, uint64_t when, const void *buf,
+	uint32_t len)
+{
+	unsigned i;
+
+	inbox_lock(cn);
+	for (i=0; i<CLUSTER_SLOTS; i++) {
+		if (cn->cn_slots[i].cs_len == 0) {
+			break;
+		}
+	}
+	if (i == CLUSTER_SLOTS) {
+		inbox_unlock(cn);
+		return -1;
+	}
+	cn->cn_slots[i].cs_when = when;
+	cn->cn_slots[i].cs_from = mynode;
+	cn->cn_slots[i].cs_seq = myseq;
+	memcpy(cn->cn_frames[i], buf, len);
+	cn->cn_slots[i].cs_len = len;
+	inbox_unlock(cn);
+	return 0;
+}
+
+int
+cluster_net_send(uint64_t vnow, const void *buf, uint32_t len, uint16_t to)
+{
+	uint64_t when = vnow + CLUSTER_LATENCY;
+	uint32_t hwaddr;
+	unsigned i;
+	int known = 0, result = 0;
+
+	if (len == 0 || len > CLUSTER_MAXFRAME) {
+		return -1;
+	}
+	myseq++;
+
+	if (to != CLUSTER_BROADCAST) {
+		for (i=0; i<numnodes; i++) {
+			if (&nodes[i] == me || LOAD_ACQ(&nodes[i].cn_gone)) {
+				continue;
+			}
+			hwaddr = LOAD_ACQ(&nodes[i].cn_hwaddr);
+			if (hwaddr != 0 && hwaddr == to) {
+				known = 1;
+				if (deliver(&nodes[i], when, buf, len)) {
+					result = -1;
+				}
+			}
+		}
+		if (known) {
+			return result;
+		}
+	}
+
+	/* broadcast, or nobody has that address: everyone gets it */
+	for (i=0; i<numnodes; i++) {
+		if (&nodes[i] == me || LOAD_ACQ(&nodes[i].cn_gone)) {
+			continue;
+		}
+		hwaddr = LOAD_ACQ(&nodes[i].cn_hwaddr);
+		if (hwaddr != 0 && deliver(&nodes[i], when, buf, len)) {
+			result = -1;
+		}
+	}
+	return result;
+}
+
+/*
+ * Find the next frame due before the bound, or -1. Call with the
+ * inbox locked.
+ */
+static
+int
+nextslot(void)
+{
+	const struct cluster_slot *cs, *best = NULL;
+	unsigned i;
+	int ix = -1;
+
+	for (i=0; i<CLUSTER_SLOTS; i++) {
+		cs = &me->cn_slots[i];
+		if (cs->cs_len == 0 || cs->cs_when >= cluster_bound) {
+			continue;
+		}
+		if (best == NULL || cs->cs_when < best->cs_when ||
+		    (cs->cs_when == best->cs_when &&
+		     (cs->cs_from < best->cs_from ||
+		      (cs->cs_from == best->cs_from &&
+		       (int32_t)(cs->cs_seq - best->cs_seq) < 0)))) {
+			best = cs;
+			ix = i;
+		}
+	}
+	return ix;
+}
+
+int
+cluster_net_next(uint64_t *when)
+{
+	int ix;
+
+	inbox_lock(me);
+	ix = nextslot();
+	if (ix >= 0) {
+		*when = me->cn_slots[ix].cs_when;
+	}
+	inbox_unlock(me);
+	return ix < 0 ? -1 : 0;
+}
+
+int
+cluster_net_recv(uint64_t vnow, void *buf, uint32_t bufsize)
+{
+	struct cluster_slot *cs;
+	uint32_t len;
+	int ix;
+
+	inbox_lock(me);
+	ix = nextslot();
+	if (ix < 0 || me->cn_slots[ix].cs_when > vnow) {
+		inbox_unlock(me);
+		return -1;
+	}
+	cs = &me->cn_slots[ix];
+	len = cs->cs_len;
+	if (len > bufsize) {
+		len = 0;
+	}
+	else {
+		memcpy(buf, me->cn_frames[ix], len);
+	}
+	cs->cs_len = 0;
+	inbox_unlock(me);
+	return len;
+}
+
+#else /* not HAVE_NETSHM */
+
+void
+cluster_setup(unsigned count)
+{
+	(void)count;
+}
+
+void
+cluster_gone(unsigned node)
+{
+	(void)node;
+}
+
+void
+cluster_join(unsigned node)
+{
+	(void)node;
+}
+
+void
+cluster_sync(uint64_t vnow)
+{
+	(void)vnow;
+}
+
+int
+cluster_net_attach(uint16_t hwaddr, void (*func)(void *), void *data)
+{
+	(void)hwaddr;
+	(void)func;
+	(void)data;
+	return -1;
+}
+
+int
+cluster_net_send(uint64_t vnow, const void *buf, uint32_t len, uint16_t to)
+{
+	(void)vnow;
+	(void)buf;
+	(void)len;
+	(void)to;
+	return -1;
+}
+
+int
+cluster_net_next(uint64_t *when)
+{
+	(void)when;
+	return -1;
+}
+
+int
+cluster_net_recv(uint64_t vnow, void *buf, uint32_t bufsize)
+{
+	(void)vnow;
+	(void)buf;
+	(void)bufsize;
+	return -1;
+}
+
+#endif /* HAVE_NETSHM */
@@ -917,6 +917,44 @@ console_init(int pass_signals, int tracing)
 	console_up = 1;
 }
 
+/*
+ * Switch the console to different files: for a fork-server child
+ * (see forkserver.h). The tty, if any, stays the parent's, so we
+ * let go of it without touching its settings. Unlike at startup,
+ * input that isn't a tty is read too, so a run can be fed a file.
+ */
+void
+console_redirect(int infd, int outfd)
+{
+	output_flush(o_stdout);
+	if (o_stderr != NULL) {
+		output_flush(o_stderr);
+	}
+
+	if (stdin_tty_active) {
+		notonselect(STDIN_FILENO);
+		stdin_tty_active = 0;
+	}
+	stdin_is_tty = 0;
+	got_stdin_tios = 0;
+
+	dup2(infd, STDIN_FILENO);
+	dup2(outfd, STDOUT_FILENO);
+	dup2(outfd, STDERR_FILENO);
+
+	output_checktty(o_stdout);
+	o_stdout->at_bol = 1;
+	if (o_stderr != NULL) {
+		if (trace_to == o_stderr) {
+			trace_to = o_stdout;
+		}
+		output_destroy(o_stderr);
+		o_stderr = NULL;
+	}
+
+	onselect(STDIN_FILENO, NULL, console_sel, NULL);
+}
+
 void
 console_cleanup(void)
 {
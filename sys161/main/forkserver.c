@@ -0,0 +1,564 @@
+/*
+ * Fork server. See forkserver.h.
+ *
+ * While serving, the parent is not running the machine and does not
+ * go through the main loop; it just sits here in its own select loop
+ * on the control socket, forking and reaping. The machine's own host
+ * sockets (debugger, meter, network) are not looked at until it
+ * exits.
+ */
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include "config.h"
+
+#include "exitcodes.h"
+#include "console.h"
+#include "clock.h"
+#include "bus.h"
+#include "main.h" /* for g_stats */
+#include "forkserver.h"
+
+#define PROTOCOL_VERSION  1
+
+/* how many control connections and runs in progress at once */
+#define FS_MAXCONNS	16
+#define FS_MAXRUNS	64
+
+/* how often to check for finished runs, in usecs */
+#define FS_POLLUSECS	10000
+
+#define FS_BUFSIZE	256
+
+struct fsconn {
+	int fd;			/* -1 if slot not in use */
+	char buf[FS_BUFSIZE];
+	size_t bufpos;
+};
+
+struct fsrun {
+	pid_t pid;		/* 0 if slot not in use */
+	unsigned num;
+	int conn;		/* who asked, or -1 if they left */
+	int statfd;		/* counters come back on this */
+};
+
+static int fs_socket = -1;
+static struct fsconn conns[FS_MAXCONNS];
+static struct fsrun runs[FS_MAXRUNS];
+static unsigned nextrun = 1;
+static int quitting;
+static void (*oldsigint)(int);
+static void (*oldsigquit)(int);
+
+/* in the child: where forkserver_report sends the counters */
+static int fs_statfd = -1;
+
+////////////////////////////////////////////////////////////
+// Parent side
+
+static
+PF(2, 3)
+void
+fs_say(int conn, const char *fmt, ...)
+{
+	char buf[512];
+	va_list ap;
+
+	if (conn < 0 || conns[conn].fd < 0) {
+		return;
+	}
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	write(conns[conn].fd, buf, strlen(buf));
+}
+
+/*
+ * Open the files for a run: in the parent, so a bad name can be
+ * reported back.
+ */
+static
+int
+fs_openfiles(int conn, unsigned num, const char *in, const char *out,
+	     int *infd, int *outfd)
+{
+	char name[32];
+
+	if (out == NULL) {
+		snprintf(name, sizeof(name), "run-%u.out", num);
+		out = name;
+	}
+	if (in == NULL) {
+		in = "/dev/null";
+	}
+
+	*infd = open(in, O_RDONLY);
+	if (*infd < 0) {
+		fs_say(conn, "BAD %s: %s\r\n", in, strerror(errno));
+		return -1;
+	}
+	*outfd = open(out, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (*outfd < 0) {
+		fs_say(conn, "BAD %s: %s\r\n", out, strerror(errno));
+		close(*infd);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * In the child: let go of the parent's things and switch the machine
+ * over to its own.
+ */
+static
+void
+fs_child(int infd, int outfd)
+{
+	unsigned i;
+
+	close(fs_socket);
+	fs_socket = -1;
+	for (i=0; i<FS_MAXCONNS; i++) {
+		if (conns[i].fd >= 0) {
+			close(conns[i].fd);
+			conns[i].fd = -1;
+		}
+	}
+	for (i=0; i<FS_MAXRUNS; i++) {
+		if (runs[i].pid != 0) {
+			close(runs[i].statfd);
+			runs[i].pid = 0;
+		}
+	}
+
+	signal(SIGINT, oldsigint);
+	signal(SIGQUIT, oldsigquit);
+
+	console_redirect(infd, outfd);
+	close(infd);
+	close(outfd);
+}
+
+/*
+ * Start a run. Returns the run number in the child and 0 in the
+ * parent.
+ */
+static
+unsigned
+fs_startrun(int conn, const char *in, const char *out)
+{
+	unsigned num, slot;
+	int infd, outfd, pfd[2];
+	pid_t pid;
+
+	for (slot=0; slot<FS_MAXRUNS; slot++) {
+		if (runs[slot].pid == 0) {
+			break;
+		}
+	}
+	if (slot == FS_MAXRUNS) {
+		fs_say(conn, "BAD Too many runs in progress\r\n");
+		return 0;
+	}
+
+	num = nextrun;
+	if (fs_openfiles(conn, num, in, out, &infd, &outfd) < 0) {
+		return 0;
+	}
+	if (pipe(pfd) < 0) {
+		fs_say(conn, "BAD pipe: %s\r\n", strerror(errno));
+		close(infd);
+		close(outfd);
+		return 0;
+	}
+
+	/* don't let buffered output get written twice */
+	fflush(NULL);
+
+	pid = fork();
+	if (pid < 0) {
+		fs_say(conn, "BAD fork: %s\r\n", strerror(errno));
+		close(pfd[0]);
+		close(pfd[1]);
+		close(infd);
+		close(outfd);
+		return 0;
+	}
+	if (pid == 0) {
+		close(pfd[0]);
+		fs_statfd = pfd[1];
+		fs_child(infd, outfd);
+		return num;
+	}
+
+	close(pfd[1]);
+	close(infd);
+	close(outfd);
+	nextrun++;
+
+	runs[slot].pid = pid;
+	runs[slot].num = num;
+	runs[slot].conn = conn;
+	runs[slot].statfd = pfd[0];
+	fs_say(conn, "STARTED %u %d\r\n", num, (int)pid);
+	return 0;
+}
+
+/*
+ * Collect any runs that have finished.
+ */
+static
+void
+fs_reap(void)
+{
+	char buf[FS_BUFSIZE];
+	unsigned slot;
+	pid_t pid;
+	int status, r;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (slot=0; slot<FS_MAXRUNS; slot++) {
+			if (runs[slot].pid == pid) {
+				break;
+			}
+		}
+		if (slot == FS_MAXRUNS) {
+			/* not one of ours */
+			continue;
+		}
+
+		/* the child has exited, so this doesn't block */
+		r = read(runs[slot].statfd, buf, sizeof(buf) - 1);
+		if (r < 0) {
+			r = 0;
+		}
+		buf[r] = 0;
+		buf[strcspn(buf, "\r\n")] = 0;
+		close(runs[slot].statfd);
+
+		if (WIFEXITED(status)) {
+			fs_say(runs[slot].conn, "DONE %u %d%s%s\r\n",
+			       runs[slot].num, WEXITSTATUS(status),
+			       *buf ? " " : "", buf);
+		}
+		else {
+			fs_say(runs[slot].conn, "KILLED %u %d\r\n",
+			       runs[slot].num, WTERMSIG(status));
+		}
+		runs[slot].pid = 0;
+	}
+}
+
+/*
+ * Returns the run number if we're now the child of a new run, else 0.
+ */
+static
+unsigned
+fs_processline(int conn, char *line)
+{
+#define MAXWORDS 8
+	char *words[MAXWORDS];
+	const char *in, *out;
+	char *s, *ctx;
+	int i, nwords;
+
+	nwords = 0;
+	for (s = strtok_r(line, " \t\r\n", &ctx);
+	     s != NULL;
+	     s = strtok_r(NULL, " \t\r\n", &ctx)) {
+		if (nwords >= MAXWORDS) {
+			fs_say(conn, "BAD Too many words in command\r\n");
+			return 0;
+		}
+		words[nwords++] = s;
+	}
+	if (nwords == 0) {
+		return 0;
+	}
+
+	if (!strcasecmp(words[0], "run")) {
+		if (quitting) {
+			fs_say(conn, "BAD Shutting down\r\n");
+			return 0;
+		}
+		in = out = NULL;
+		for (i=1; i<nwords; i++) {
+			if (!strncmp(words[i], "in=", 3)) {
+				in = words[i]+3;
+			}
+			else if (!strncmp(words[i], "out=", 4)) {
+				out = words[i]+4;
+			}
+			else {
+				fs_say(conn, "BAD Invalid option %s\r\n",
+				       words[i]);
+				return 0;
+			}
+		}
+		return fs_startrun(conn, in, out);
+	}
+	else if (!strcasecmp(words[0], "quit") && nwords == 1) {
+		quitting = 1;
+	}
+	else {
+		fs_say(conn, "BAD Invalid command\r\n");
+	}
+	return 0;
+}
+
+static
+void
+fs_dropconn(int conn)
+{
+	unsigned slot;
+
+	close(conns[conn].fd);
+	conns[conn].fd = -1;
+	for (slot=0; slot<FS_MAXRUNS; slot++) {
+		if (runs[slot].pid != 0 && runs[slot].conn == conn) {
+			runs[slot].conn = -1;
+		}
+	}
+}
+
+/*
+ * Input on a control connection. Returns as fs_processline.
+ */
+static
+unsigned
+fs_receive(int conn)
+{
+	static const char overflowmsg[] = "BAD Input overflow\r\n";
+
+	struct fsconn *c = &conns[conn];
+	unsigned num;
+	char *s;
+	int r;
+
+	if (c->bufpos >= sizeof(c->buf)) {
+		write(c->fd, overflowmsg, strlen(overflowmsg));
+		c->bufpos = 0;
+	}
+
+	r = read(c->fd, c->buf + c->bufpos, sizeof(c->buf) - c->bufpos);
+	if (r <= 0) {
+		fs_dropconn(conn);
+		return 0;
+	}
+	c->bufpos += r;
+
+	while ((s = memchr(c->buf, '\n', c->bufpos)) != NULL) {
+		*s = 0;
+		s++;
+		c->bufpos -= (s - c->buf);
+		num = fs_processline(conn, c->buf);
+		if (num > 0) {
+			return num;
+		}
+		memmove(c->buf, s, c->bufpos);
+	}
+	return 0;
+}
+
+static
+void
+fs_accept(void)
+{
+	struct sockaddr_storage sa;
+	socklen_t salen;
+	int remotefd;
+	unsigned i;
+
+	salen = sizeof(sa);
+	remotefd = accept(fs_socket, (struct sockaddr *)&sa, &salen);
+	if (remotefd < 0) {
+		return;
+	}
+	for (i=0; i<FS_MAXCONNS; i++) {
+		if (conns[i].fd < 0) {
+			break;
+		}
+	}
+	if (i == FS_MAXCONNS) {
+		write(remotefd, "BAD Too many connections\r\n", 26);
+		close(remotefd);
+		return;
+	}
+	conns[i].fd = remotefd;
+	conns[i].bufpos = 0;
+	fs_say(i, "HELLO %d\r\n", PROTOCOL_VERSION);
+}
+
+static
+int
+fs_busy(void)
+{
+	unsigned i;
+
+	for (i=0; i<FS_MAXRUNS; i++) {
+		if (runs[i].pid != 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+unsigned
+forkserver_serve(void)
+{
+	struct timeval tv;
+	fd_set fds;
+	unsigned i, num;
+	int maxfd, r;
+
+	if (fs_socket < 0) {
+		msg("No fork server socket; not serving");
+		die();
+	}
+
+	for (i=0; i<FS_MAXCONNS; i++) {
+		conns[i].fd = -1;
+	}
+
+	/* ^C goes to the runs; we stay to collect them */
+	oldsigint = signal(SIGINT, SIG_IGN);
+	oldsigquit = signal(SIGQUIT, SIG_IGN);
+
+	msg("Fork server ready");
+
+	while (1) {
+		fs_reap();
+		if (quitting && !fs_busy()) {
+			break;
+		}
+
+		FD_ZERO(&fds);
+		FD_SET(fs_socket, &fds);
+		maxfd = fs_socket;
+		for (i=0; i<FS_MAXCONNS; i++) {
+			if (conns[i].fd >= 0) {
+				FD_SET(conns[i].fd, &fds);
+				if (conns[i].fd > maxfd) {
+					maxfd = conns[i].fd;
+				}
+			}
+		}
+
+		tv.tv_sec = 0;
+		tv.tv_usec = FS_POLLUSECS;
+		r = select(maxfd+1, &fds, NULL, NULL, &tv);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			msg("select: %s", strerror(errno));
+			die();
+		}
+		if (r == 0) {
+			continue;
+		}
+
+		if (FD_ISSET(fs_socket, &fds)) {
+			fs_accept();
+		}
+		for (i=0; i<FS_MAXCONNS; i++) {
+			if (conns[i].fd >= 0 && FD_ISSET(conns[i].fd, &fds)) {
+				num = fs_receive(i);
+				if (num > 0) {
+					/* we're the new run */
+					goto child;
+				}
+			}
+		}
+	}
+
+	msg("Fork server: %u runs", nextrun - 1);
+	console_cleanup();
+	exit(SYS161_EXIT_NORMAL);
+
+ child:
+	bus_forked(num);
+	clock_resync();
+	return num;
+}
+
+////////////////////////////////////////////////////////////
+// Child side
+
+void
+forkserver_report(void)
+{
+	char buf[FS_BUFSIZE];
+
+	if (fs_statfd < 0) {
+		return;
+	}
+
+	snprintf(buf, sizeof(buf), "%llu %llu %u %u %u %u %u %u %u %u %u"
+		 " %u %u\n",
+		 (unsigned long long) g_stats.s_tot_rcycles,
+		 (unsigned long long) g_stats.s_tot_icycles,
+		 g_stats.s_irqs,
+		 g_stats.s_exns,
+		 g_stats.s_rsects,
+		 g_stats.s_wsects,
+		 g_stats.s_rchars,
+		 g_stats.s_wchars,
+		 g_stats.s_remu,
+		 g_stats.s_wemu,
+		 g_stats.s_memu,
+		 g_stats.s_rpkts,
+		 g_stats.s_wpkts);
+	write(fs_statfd, buf, strlen(buf));
+	close(fs_statfd);
+	fs_statfd = -1;
+}
+
+////////////////////////////////////////////////////////////
+// Setup
+
+void
+forkserver_init(const char *path)
+{
+	struct sockaddr_un su;
+	socklen_t len;
+	int sfd;
+
+	sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sfd < 0) {
+		msg("socket: %s", strerror(errno));
+		die();
+	}
+
+	memset(&su, 0, sizeof(su));
+	su.sun_family = AF_UNIX;
+	snprintf(su.sun_path, sizeof(su.sun_path), "%s", path);
+	len = SUN_LEN(&su);
+#ifdef HAS_SUN_LEN
+	su.sun_len = len;
+#endif
+
+	unlink(path);
+	if (bind(sfd, (struct sockaddr *) &su, len) < 0) {
+		msg("%s: bind: %s", path, strerror(errno));
+		die();
+	}
+	if (listen(sfd, 5) < 0) {
+		msg("%s: listen: %s", path, strerror(errno));
+		die();
+	}
+
+	fs_socket = sfd;
+}
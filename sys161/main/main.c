@@ -1,10 +1,15 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/stat.h> // for mkdir()
+#include <sys/wait.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
 #include "config.h"
 
 #include "exitcodes.h"
@@ -21,6 +26,9 @@
 #include "speed.h"
 #include "onsel.h"
 #include "main.h"
+#include "snapshot.h"
+#include "forkserver.h"
+#include "cluster.h"
 #include "version.h"
 
 
@@ -41,6 +49,36 @@ static int no_debugger_wait;
 /* Did we get an explicit debugger request? */
 static int got_debugrequest;
 
+/* Which machine we are with -n; 0 otherwise */
+unsigned cluster_node;
+
+/* Where snapshots go by default, and whether one has been asked for */
+static const char *snapshot_path = "sys161.snap";
+static int snapshot_requested;
+
+/*
+ * Periodic checkpoints (-K): every checkpoint_nsecs of virtual time,
+ * written to snapshot_path with .ckN appended. Each chain starts with
+ * a full snapshot followed by CHECKPOINT_FULLEVERY-1 incremental ones
+ * based on it. Once the next full one is safely written, the
+ * previous chain isn't needed to resume from anything later, so it
+ * is removed; that way there are never more than CHECKPOINT_FULLEVERY
+ * checkpoints on disk at once.
+ */
+#define CHECKPOINT_FULLEVERY 8
+static uint64_t checkpoint_nsecs;
+static unsigned checkpoint_count;
+static unsigned checkpoint_chain;	/* first of the current chain */
+static int checkpoint_havechain;
+static int checkpoint_requested;
+
+/* Whether the first snapshot request is instead the fork point (-F) */
+static int forkserver_mode;
+static int gdb_on_tcp;
+
+/* When run() started, for the speed report */
+static struct timeval starttime;
+
 /*
  * Event dispatching model, as of 20140730:
  *
@@ -113,6 +151,76 @@ main_leave_debugger(void)
 	stop_is_lethal = 0;
 }
 
+void
+main_snapshot(void)
+{
+	snapshot_requested = 1;
+	cpu_stopcycling();
+}
+
+int
+main_savesnapshot(const char *path)
+{
+	return snapshot_save(path != NULL ? path : snapshot_path);
+}
+
+/*
+ * For -A.
+ */
+static
+void
+snapshot_alarm(void *junk1, uint32_t junk2)
+{
+	(void)junk1;
+	(void)junk2;
+	main_snapshot();
+}
+
+/*
+ * For -K.
+ */
+static
+void
+checkpoint_alarm(void *junk1, uint32_t junk2)
+{
+	(void)junk1;
+	(void)junk2;
+	checkpoint_requested = 1;
+	cpu_stopcycling();
+	schedule_event(checkpoint_nsecs, NULL, 0, checkpoint_alarm,
+		       "checkpoint");
+}
+
+static
+void
+checkpoint(void)
+{
+	char *path;
+	unsigned i;
+
+	path = domalloc(strlen(snapshot_path) + 16);
+	sprintf(path, "%s.ck%u", snapshot_path, checkpoint_count);
+	if (!checkpoint_havechain ||
+	    checkpoint_count - checkpoint_chain >= CHECKPOINT_FULLEVERY) {
+		/* if this fails, the next one tries again */
+		if (snapshot_save(path) == 0) {
+			for (i = checkpoint_chain;
+			     checkpoint_havechain && i < checkpoint_count;
+			     i++) {
+				sprintf(path, "%s.ck%u", snapshot_path, i);
+				unlink(path);
+			}
+			checkpoint_chain = checkpoint_count;
+			checkpoint_havechain = 1;
+		}
+	}
+	else {
+		(void)snapshot_saveincr(path);
+	}
+	free(path);
+	checkpoint_count++;
+}
+
 /*
  * This is its own function because it's called from the gdb support
  * to single-step. We only bill the time cpu_cycles reports it
@@ -141,6 +249,8 @@ stoploop(void)
 	}
 }
 
+static void fork_point(void);
+
 static
 void
 runloop(void)
@@ -157,6 +267,22 @@ runloop(void)
 		wentticks = cpu_cycles(goticks);
 		clock_ticks(wentticks);
 
+		if (snapshot_requested && forkserver_mode) {
+			/* wait for the devices to finish what they're doing */
+			if (!bus_busy()) {
+				snapshot_requested = 0;
+				fork_point();
+			}
+		}
+		else if (snapshot_requested) {
+			snapshot_requested = 0;
+			(void)main_savesnapshot(NULL);
+		}
+		if (checkpoint_requested) {
+			checkpoint_requested = 0;
+			checkpoint();
+		}
+
 		rotor -= wentticks;
 		if (rotor == 0) {
 			rotor = ROTOR;
@@ -167,7 +293,7 @@ runloop(void)
 			stoploop();
 		}
 
-		if (cpu_running_mask == 0) {
+		if (cpu_running_count == 0) {
 			HWTRACE(DOTRACE_IRQ, ("Waiting for interrupt"));
 			clock_waitirq();
 		}
@@ -203,6 +329,8 @@ showstats(void)
 	uint64_t totcycles;
 	unsigned i;
 
+	cpu_updatestats();
+
 	totcycles = g_stats.s_tot_rcycles + g_stats.s_tot_icycles;
 	msg("%llu cycles (%llu run, %llu global-idle)",
 	    (unsigned long long)totcycles,
@@ -255,7 +383,7 @@ static
 void
 run(void)
 {
-	struct timeval starttime, endtime;
+	struct timeval endtime;
 	uint64_t totcycles;
 	double time;
 
@@ -357,13 +485,22 @@ usage(void)
 {
 	msg("System/161 %s, compiled %s %s", VERSION, __DATE__, __TIME__);
 	msg("Usage: sys161 [sys161 options] kernel [kernel args...]");
+	msg("       sys161 [sys161 options] -r snapshot");
 	msg("   sys161 options:");
+	msg("     -A seconds     Take a snapshot after this much virtual time");
 	msg("     -c config      Use alternate config file");
 	msg("     -C slot:arg    Override config file argument");
 	msg("     -D count       Set disk I/O doom counter");
 	msg("     -f file        Trace to specified file");
+	msg("     -F             Serve runs forked from the snapshot point");
+	msg("     -i file        Load file into RAM as an initrd");
+	msg("     -k file        Cache the loaded kernel image in file");
+	msg("     -K seconds     Take a checkpoint every so often");
+	msg("     -n count       Run count machines at once");
 	msg("     -P             Collect kernel execution profile");
 	msg("     -p port        Listen for gdb over TCP on specified port");
+	msg("     -r snapshot    Resume from snapshot instead of booting");
+	msg("     -S file        Write snapshots to file (default sys161.snap)");
 	msg("     -s             Pass signal-generating characters through");
 	msg("     -t[kujtxidne]  Set tracing flags");
 	print_traceflags_usage();
@@ -373,6 +510,207 @@ usage(void)
 	die();
 }
 
+/*
+ * Run count machines at once (-n). Each is its own process, forked
+ * before anything is set up; this returns in each child with
+ * cluster_node set, and in the parent waits for them all and exits.
+ *
+ * Machine 1 gets the terminal. The rest get /dev/null for input and
+ * send their output to node-N.out. They share a timeline and perhaps
+ * a network (see cluster.h).
+ *
+ * If we can't start them all, stop the ones already started rather
+ * than leave them running with nobody to collect them.
+ */
+static
+void
+cluster_run(unsigned count)
+{
+	char name[32];
+	unsigned node, left, i;
+	pid_t pid, *pids;
+	int fd, status, result;
+
+	pids = malloc(count * sizeof(*pids));
+	if (pids == NULL) {
+		msg("malloc failed");
+		die();
+	}
+	cluster_setup(count);
+
+	for (node = 1; node <= count; node++) {
+		pid = fork();
+		if (pid < 0) {
+			msg("fork: %s", strerror(errno));
+			for (i = 1; i < node; i++) {
+				kill(pids[i-1], SIGTERM);
+			}
+			for (i = 1; i < node; i++) {
+				waitpid(pids[i-1], NULL, 0);
+			}
+			die();
+		}
+		if (pid > 0) {
+			pids[node-1] = pid;
+			continue;
+		}
+		free(pids);
+
+		cluster_node = node;
+		cluster_join(node);
+		if (node == 1) {
+			return;
+		}
+		snprintf(name, sizeof(name), "node-%u.out", node);
+		fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+		if (fd < 0) {
+			msg("%s: %s", name, strerror(errno));
+			die();
+		}
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+		fd = open("/dev/null", O_RDONLY);
+		if (fd >= 0) {
+			dup2(fd, STDIN_FILENO);
+			close(fd);
+		}
+		return;
+	}
+
+	/* ^C goes to the machines; we stay to collect them */
+	signal(SIGINT, SIG_IGN);
+	signal(SIGQUIT, SIG_IGN);
+
+	result = SYS161_EXIT_NORMAL;
+	for (left = count; left > 0; left--) {
+		pid = wait(&status);
+		if (pid < 0) {
+			if (errno == EINTR) {
+				left++;
+				continue;
+			}
+			msg("wait: %s", strerror(errno));
+			die();
+		}
+		for (i = 0; i < count; i++) {
+			if (pids[i] == pid) {
+				cluster_gone(i+1);
+			}
+		}
+		if (WIFEXITED(status)) {
+			if (WEXITSTATUS(status) > result) {
+				result = WEXITSTATUS(status);
+			}
+		}
+		else {
+			msg("Machine process %d: signal %d", (int)pid,
+			    WTERMSIG(status));
+			if (result < SYS161_EXIT_CRASH) {
+				result = SYS161_EXIT_CRASH;
+			}
+		}
+	}
+	free(pids);
+	exit(result);
+}
+
+/*
+ * Name of one of our control sockets; with -n each machine has its own.
+ */
+static
+void
+socketname(char *buf, size_t max, const char *what)
+{
+	if (cluster_node > 0) {
+		snprintf(buf, max, ".sockets/%s-%u", what, cluster_node);
+	}
+	else {
+		snprintf(buf, max, ".sockets/%s", what);
+	}
+}
+
+/*
+ * Name of an output file; with -n each machine gets its own, and
+ * with -F so does each run. Pass cluster_node or the run number.
+ */
+static
+const char *
+numberedfile(const char *file, unsigned num)
+{
+	char *name;
+
+	if (num == 0) {
+		return file;
+	}
+	name = malloc(strlen(file) + 16);
+	if (name == NULL) {
+		msg("malloc failed");
+		die();
+	}
+	sprintf(name, "%s.%u", file, num);
+	return name;
+}
+
+/*
+ * Reset the counters, so each fork-server run reports its own.
+ */
+static
+void
+resetstats(void)
+{
+	struct stats_percpu *percpu = g_stats.s_percpu;
+	unsigned ncpus = g_stats.s_numcpus;
+
+	/* settle the idle counts first so they don't carry over */
+	cpu_updatestats();
+
+	memset(&g_stats, 0, sizeof(g_stats));
+	memset(percpu, 0, ncpus * sizeof(*percpu));
+	g_stats.s_percpu = percpu;
+	g_stats.s_numcpus = ncpus;
+}
+
+/*
+ * The fork point (-F): serve runs from here. This only returns in
+ * each run's own process, which then carries on to completion much
+ * as if it had been started with -X. It gets its own debugger and
+ * meter sockets (but no debugger over TCP, as the port is taken) and
+ * its own snapshot file.
+ */
+static
+void
+fork_point(void)
+{
+	char name[64], sockname[80];
+	unsigned run;
+
+	run = forkserver_serve();
+	forkserver_mode = 0;
+
+	gdb_close();
+	if (!gdb_on_tcp) {
+		socketname(name, sizeof(name), "gdb");
+		snprintf(sockname, sizeof(sockname), "%s.%u", name, run);
+		unlink(sockname);
+		gdb_unix_init(sockname);
+	}
+	no_debugger_wait = 1;
+	gdb_dontwait();
+
+	meter_close();
+	socketname(name, sizeof(name), "meter");
+	snprintf(sockname, sizeof(sockname), "%s.%u", name, run);
+	unlink(sockname);
+	meter_init(sockname);
+
+	snapshot_path = numberedfile(snapshot_path, run);
+
+	resetstats();
+	gettimeofday(&starttime, NULL);
+	msg("Fork server run %u", run);
+}
+
 #define MAXCONFIGEXTRA 128
 
 int
@@ -393,7 +731,15 @@ main(int argc, char *argv[])
 	int timeout;
 	int profiling=0;
 	int doom = 0;
-	unsigned ncpus;
+	unsigned ncpus, nodes = 0;
+	long l;
+	char *end;
+	const char *tracefile = NULL;
+	const char *restorefile = NULL;
+	const char *initrdfile = NULL;
+	const char *kcachefile = NULL;
+	unsigned alarmsecs = 0;
+	char sockname[64];
 
 	/* This must come absolutely first so msg() can be used. */
 	console_earlyinit();
@@ -406,8 +752,15 @@ main(int argc, char *argv[])
 		die();
 	}
 
-	while ((opt = mygetopt(argc, argv, "c:C:D:f:p:Pst:wXZ:"))!=-1) {
+	while ((opt = mygetopt(argc, argv, "A:c:C:D:f:Fi:k:K:n:p:Pr:sS:t:wXZ:"))!=-1) {
 		switch (opt) {
+		    case 'A':
+			alarmsecs = atoi(myoptarg);
+			if (alarmsecs < 1) {
+				msg("Invalid snapshot time");
+				die();
+			}
+			break;
 		    case 'c': config = myoptarg; break;
 		    case 'C':
 			if (numconfigextra >= MAXCONFIGEXTRA) {
@@ -422,13 +775,36 @@ main(int argc, char *argv[])
 			break;
 		    case 'D': doom = atoi(myoptarg); break;
 		    case 'f':
-			set_tracefile(myoptarg);
+			tracefile = myoptarg;
+			break;
+		    case 'F': forkserver_mode = 1; break;
+		    case 'i': initrdfile = myoptarg; break;
+		    case 'k': kcachefile = myoptarg; break;
+		    case 'K':
+			if (atoi(myoptarg) < 1) {
+				msg("Invalid checkpoint interval");
+				die();
+			}
+			checkpoint_nsecs = (uint64_t)atoi(myoptarg) *
+				1000000000;
+			break;
+		    case 'n':
+			l = strtol(myoptarg, &end, 10);
+			if (*myoptarg == 0 || *end != 0 ||
+			    l < 1 || l > CLUSTER_MAXNODES) {
+				msg("Invalid machine count (must be 1-%d)",
+				    CLUSTER_MAXNODES);
+				die();
+			}
+			nodes = l;
 			break;
 		    case 'p': port = atoi(myoptarg); usetcp=1; break;
 		    case 'P':
 			profiling = 1;
 			break;
+		    case 'r': restorefile = myoptarg; break;
 		    case 's': pass_signals = 1; break;
+		    case 'S': snapshot_path = myoptarg; break;
 		    case 't': 
 			set_traceflags(myoptarg); 
 			console_tracing = 1;
@@ -446,10 +822,32 @@ main(int argc, char *argv[])
 		    default: usage();
 		}
 	}
-	if (myoptind==argc) {
+	if (nodes > 0 && forkserver_mode) {
+		/* the runs would all be the same machine on the timeline */
+		msg("-F cannot be used with -n");
+		die();
+	}
+	if (restorefile != NULL) {
+		if (myoptind != argc) {
+			msg("With -r the kernel and its arguments come "
+			    "from the snapshot");
+			die();
+		}
+		if (initrdfile != NULL) {
+			msg("With -r the initrd comes from the snapshot");
+			die();
+		}
+		if (kcachefile != NULL) {
+			msg("With -r the kernel comes from the snapshot");
+			die();
+		}
+	}
+	else if (myoptind==argc) {
 		usage();
 	}
-	kernel = argv[myoptind++];
+	else {
+		kernel = argv[myoptind++];
+	}
 	
 	for (j=myoptind; j<argc; j++) {
 		argsize += strlen(argv[j])+1;
@@ -467,6 +865,25 @@ main(int argc, char *argv[])
 
 	/* This must come before bus_config in case a network card needs it */
 	mkdir(".sockets", 0700);
+
+	if (nodes > 0) {
+		cluster_run(nodes);
+		/* now we are one of the machines */
+		port += cluster_node - 1;
+	}
+
+	if (tracefile != NULL) {
+		if (strcmp(tracefile, "-") != 0) {
+			tracefile = numberedfile(tracefile,
+						     cluster_node);
+		}
+		set_tracefile(tracefile);
+	}
+	snapshot_path = numberedfile(snapshot_path, cluster_node);
+	if (restorefile != NULL) {
+		/* each machine resumes from its own snapshot */
+		restorefile = numberedfile(restorefile, cluster_node);
+	}
 	
 	console_init(pass_signals, console_tracing);
 	clock_init();
@@ -482,14 +899,36 @@ main(int argc, char *argv[])
 		gdb_inet_init(port);
 	}
 	else {
-		unlink(".sockets/gdb");
-		gdb_unix_init(".sockets/gdb");
+		socketname(sockname, sizeof(sockname), "gdb");
+		unlink(sockname);
+		gdb_unix_init(sockname);
 	}
 
-	unlink(".sockets/meter");
-	meter_init(".sockets/meter");
+	socketname(sockname, sizeof(sockname), "meter");
+	unlink(sockname);
+	meter_init(sockname);
 
-	load_kernel(kernel, argstr);
+	if (forkserver_mode) {
+		gdb_on_tcp = usetcp;
+		socketname(sockname, sizeof(sockname), "forkserver");
+		forkserver_init(sockname);
+	}
+
+	if (restorefile != NULL) {
+		snapshot_restore(restorefile);
+		msg("Resumed from snapshot %s", restorefile);
+	}
+	else {
+		load_kernel(kernel, argstr, initrdfile, kcachefile);
+	}
+	if (alarmsecs > 0) {
+		schedule_event((uint64_t)alarmsecs * 1000000000, NULL, 0,
+			       snapshot_alarm, "snapshot");
+	}
+	if (checkpoint_nsecs > 0) {
+		schedule_event(checkpoint_nsecs, NULL, 0, checkpoint_alarm,
+			       "checkpoint");
+	}
 
 	msg("System/161 %s, compiled %s %s", VERSION, __DATE__, __TIME__);
 	print_traceflags();
@@ -506,7 +945,13 @@ main(int argc, char *argv[])
 		gdb_dontwait();
 	}
 
+	if (forkserver_mode && restorefile != NULL) {
+		/* no need to wait for a snapshot request */
+		fork_point();
+	}
+
 	run();
+	forkserver_report();
 
 	prof_write();
 
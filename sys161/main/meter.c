@@ -12,6 +12,7 @@
 
 #include "speed.h"
 #include "clock.h"
+#include "cpu.h"
 #include "console.h"
 #include "onsel.h"
 #include "main.h" /* for g_stats */
@@ -28,9 +29,11 @@ struct meter {
 	int fd;
 	char buf[METER_BUFSIZE];
 	size_t bufpos;
+	struct meter *next;
 };
 
 static int meter_socket = -1;
+static struct meter *meters;
 
 static
 PF(2, 3)
@@ -89,6 +92,7 @@ meter_report(struct meter *m)
 	 * in some ways, especially for unbalanced workloads, so just
 	 * send totals across all cpus.
 	 */
+	cpu_updatestats();
 	kcycles = ucycles = icycles = 0;
 	kretired = uretired = 0;
 	for (i=0; i<g_stats.s_numcpus; i++) {
@@ -127,10 +131,15 @@ void
 meter_update(void *x, uint32_t junk)
 {
 	struct meter *m = x;
+	struct meter **p;
 
 	(void)junk;
 
 	if (m->fd < 0) {
+		for (p = &meters; *p != m; p = &(*p)->next) {
+			Assert(*p != NULL);
+		}
+		*p = m->next;
 		free(m);
 		return;
 	}
@@ -261,6 +270,8 @@ meter_accept(void *x)
 	m->interval = DEFAULT_METER_NSECS;
 	m->fd = remotefd;
 	m->bufpos = 0;
+	m->next = meters;
+	meters = m;
 	onselect(remotefd, m, meter_receive, NULL);
 
 	meter_hello(m);
@@ -307,6 +318,30 @@ meter_listen(const char *name)
 	return sfd;
 }
 
+/*
+ * Drop the listening socket and all connections; for a fork-server
+ * child, whose copies of these belong to the parent. As on EOF,
+ * each connection's data goes away at its next update.
+ */
+void
+meter_close(void)
+{
+	struct meter *m;
+
+	for (m = meters; m != NULL; m = m->next) {
+		if (m->fd >= 0) {
+			notonselect(m->fd);
+			close(m->fd);
+			m->fd = -1;
+		}
+	}
+	if (meter_socket >= 0) {
+		notonselect(meter_socket);
+		close(meter_socket);
+		meter_socket = -1;
+	}
+}
+
 void
 meter_init(const char *pathname)
 {
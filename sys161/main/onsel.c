@@ -69,8 +69,9 @@ notonselect(int fd)
 	smoke("notonselect: fd %d not found", fd);
 }
 
+static
 uint64_t
-tryselect(int dotimeout, uint64_t nsecs)
+doselect(int dotimeout, uint64_t nsecs, int timepasses)
 {
 	int i, r, hifd=-1;
 	fd_set myset;
@@ -124,7 +125,7 @@ tryselect(int dotimeout, uint64_t nsecs)
 		return sleptnsecs;
 	}
 
-	extra_selecttime = sleptnsecs;
+	extra_selecttime = timepasses ? sleptnsecs : 0;
 	for (i=0; i<nsels; i++) {
 		int fd = selections[i].sd_fd;
 		if (fd < 0 || !FD_ISSET(fd, &myset)) {
@@ -143,3 +144,15 @@ tryselect(int dotimeout, uint64_t nsecs)
 
 	return sleptnsecs;
 }
+
+uint64_t
+tryselect(int dotimeout, uint64_t nsecs)
+{
+	return doselect(dotimeout, nsecs, 1);
+}
+
+void
+waitselect(void)
+{
+	(void)doselect(0, 0, 0);
+}
@@ -15,6 +15,7 @@
 #include "console.h"
 #include "cpu.h"
 #include "prof.h"
+#include "snapshot.h"
 
 
 #define PROFILE_FILE "gmon.out"
@@ -302,3 +303,25 @@ prof_setup(void)
 		       "profiling sampler");
 }
 
+/*
+ * Only the text range (from the kernel's ELF headers) is saved; the
+ * samples themselves start over.
+ */
+void
+prof_save(void)
+{
+	snap_section("PROF");
+	snap_write32(prof_textbase);
+	snap_write32(prof_textend);
+}
+
+void
+prof_restore(void)
+{
+	snap_expect("PROF");
+	prof_textbase = snap_read32();
+	prof_textend = snap_read32();
+	if (prof_textend < prof_textbase) {
+		snap_error("Snapshot is damaged (profiling text range)");
+	}
+}
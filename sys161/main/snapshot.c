@@ -0,0 +1,469 @@
+/*
+ * Machine snapshots. See snapshot.h.
+ *
+ * File layout: a header, then sections from each part of the
+ * machine, each starting with a 4-character tag, then an end tag.
+ * Everything is in host byte order; the header records which.
+ */
+#include <sys/types.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include "config.h"
+
+#include "console.h"
+#include "util.h"
+#include "cpu.h"
+#include "bus.h"
+#include "clock.h"
+#include "prof.h"
+#include "memdefs.h"
+#include "snapshot.h"
+#include "version.h"
+#include "elf.h"
+#include "cpu-elf.h"
+
+#define SNAP_MAGIC	"System/161 snap\n"
+#define SNAP_MAGICLEN	16
+#define SNAP_VERSION	3
+#define SNAP_BYTEORDER	0x01020304
+#define SNAP_MAXSTR	4096
+
+/* How page pointers are recorded (snap_writemap) */
+#define SNAPMAP_NONE	0
+#define SNAPMAP_RAM	1
+#define SNAPMAP_ROM	2
+
+static FILE *snapfile;
+static const char *snappath;
+static int snapfailed;
+static int snapincremental;
+
+/*
+ * The last snapshot taken or resumed from, which the next incremental
+ * one is based on. Each snapshot gets an id so that one saved over
+ * with another in the meantime isn't taken for it.
+ */
+static char *lastpath;
+static uint64_t lastid;
+
+int
+snap_isincremental(void)
+{
+	return snapincremental;
+}
+
+////////////////////////////////////////////////////////////
+// writing
+
+void
+snap_write(const void *buf, size_t len)
+{
+	if (snapfailed) {
+		return;
+	}
+	if (len > 0 && fwrite(buf, len, 1, snapfile) != 1) {
+		msg("%s: write: %s", snappath, strerror(errno));
+		snapfailed = 1;
+	}
+}
+
+void
+snap_section(const char *tag)
+{
+	Assert(strlen(tag) == 4);
+	snap_write(tag, 4);
+}
+
+void
+snap_write32(uint32_t val)
+{
+	snap_write(&val, sizeof(val));
+}
+
+void
+snap_write64(uint64_t val)
+{
+	snap_write(&val, sizeof(val));
+}
+
+void
+snap_writestr(const char *str)
+{
+	size_t len = strlen(str);
+
+	Assert(len < SNAP_MAXSTR);
+	snap_write32(len);
+	snap_write(str, len);
+}
+
+void
+snap_writesize(size_t size)
+{
+	snap_write32(size);
+}
+
+/*
+ * Page pointers (into RAM, or the boot ROM as found with ROMMAP) are
+ * recorded as offsets, since RAM will be somewhere else next time.
+ */
+void
+snap_writemap(const uint32_t *page, const uint32_t *(*rommap)(uint32_t))
+{
+	const char *p = (const char *)page;
+	const char *rom = (const char *)rommap(0);
+
+	if (page == NULL) {
+		snap_write32(SNAPMAP_NONE);
+		snap_write32(0);
+	}
+	else if (p >= ram && p < ram + bus_ramsize) {
+		snap_write32(SNAPMAP_RAM);
+		snap_write32(p - ram);
+	}
+	else if (p >= rom && rommap(p - rom) == page) {
+		snap_write32(SNAPMAP_ROM);
+		snap_write32(p - rom);
+	}
+	else {
+		smoke("snapshot: page pointer %p is not RAM or ROM",
+		      (const void *)page);
+	}
+}
+
+void
+snap_fail(const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (!snapfailed) {
+		msg("%s: %s", snappath, buf);
+		snapfailed = 1;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// reading
+
+void
+snap_error(const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	msg("%s: %s", snappath, buf);
+	die();
+}
+
+void
+snap_read(void *buf, size_t len)
+{
+	if (len > 0 && fread(buf, len, 1, snapfile) != 1) {
+		if (ferror(snapfile)) {
+			snap_error("read: %s", strerror(errno));
+		}
+		snap_error("Snapshot is truncated");
+	}
+}
+
+void
+snap_expect(const char *tag)
+{
+	char buf[4];
+
+	Assert(strlen(tag) == 4);
+	snap_read(buf, 4);
+	if (memcmp(buf, tag, 4) != 0) {
+		snap_error("Snapshot is damaged (expected section %s)", tag);
+	}
+}
+
+uint32_t
+snap_read32(void)
+{
+	uint32_t val;
+
+	snap_read(&val, sizeof(val));
+	return val;
+}
+
+uint64_t
+snap_read64(void)
+{
+	uint64_t val;
+
+	snap_read(&val, sizeof(val));
+	return val;
+}
+
+char *
+snap_readstr(void)
+{
+	uint32_t len;
+	char *str;
+
+	len = snap_read32();
+	if (len >= SNAP_MAXSTR) {
+		snap_error("Snapshot is damaged (string too long)");
+	}
+	str = domalloc(len + 1);
+	snap_read(str, len);
+	str[len] = 0;
+	return str;
+}
+
+void
+snap_checksize(const char *what, size_t size)
+{
+	if (snap_read32() != size) {
+		snap_error("Saved %s state does not match this build of "
+			   "System/161", what);
+	}
+}
+
+const uint32_t *
+snap_readmap(const uint32_t *(*rommap)(uint32_t))
+{
+	uint32_t kind, offset;
+	const uint32_t *page;
+
+	kind = snap_read32();
+	offset = snap_read32();
+	switch (kind) {
+	    case SNAPMAP_NONE:
+		return NULL;
+	    case SNAPMAP_RAM:
+		if (offset >= bus_ramsize || offset % sizeof(uint32_t)) {
+			break;
+		}
+		return (const uint32_t *)(ram + offset);
+	    case SNAPMAP_ROM:
+		page = rommap(offset);
+		if (page == NULL) {
+			break;
+		}
+		return page;
+	}
+	snap_error("Snapshot is damaged (bad page reference)");
+}
+
+////////////////////////////////////////////////////////////
+// whole snapshots
+
+static
+uint64_t
+snap_newid(void)
+{
+	static uint32_t seq;
+
+	return ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16) ^
+		++seq;
+}
+
+static
+void
+snap_setlast(const char *path, uint64_t id)
+{
+	free(lastpath);
+	lastpath = domalloc(strlen(path) + 1);
+	strcpy(lastpath, path);
+	lastid = id;
+	bus_mem_cleardirty();
+}
+
+/*
+ * Read the header, up to the name and id of the base snapshot (an
+ * empty name if none).
+ */
+static
+void
+snap_readheader(uint64_t *id, char **basepath, uint64_t *baseid)
+{
+	char magic[SNAP_MAGICLEN];
+	char *version;
+	uint32_t val;
+
+	snap_read(magic, SNAP_MAGICLEN);
+	if (memcmp(magic, SNAP_MAGIC, SNAP_MAGICLEN) != 0) {
+		snap_error("Not a System/161 snapshot");
+	}
+	val = snap_read32();
+	if (val != SNAP_VERSION) {
+		snap_error("Snapshot format version %u not supported "
+			   "(expected %u)", val, SNAP_VERSION);
+	}
+	if (snap_read32() != SNAP_BYTEORDER) {
+		snap_error("Snapshot was made on a host with different "
+			   "byte order");
+	}
+	if (snap_read32() != EM_CPU) {
+		snap_error("Snapshot is for a different processor type");
+	}
+	version = snap_readstr();
+	if (strcmp(version, VERSION) != 0) {
+		snap_error("Snapshot was made by System/161 %s", version);
+	}
+	free(version);
+
+	*id = snap_read64();
+	*basepath = snap_readstr();
+	*baseid = snap_read64();
+}
+
+/*
+ * Load the memory saved in the snapshot PATH (and the ones it's based
+ * on), which must have the given id.
+ */
+static
+void
+snap_loadbase(const char *path, uint64_t id)
+{
+	FILE *f = snapfile;
+	const char *p = snappath;
+	char *basepath;
+	uint64_t myid, baseid;
+
+	snapfile = fopen(path, "rb");
+	if (snapfile == NULL) {
+		msg("Cannot open snapshot %s (needed by %s): %s",
+		    path, p, strerror(errno));
+		die();
+	}
+	snappath = path;
+
+	snap_readheader(&myid, &basepath, &baseid);
+	if (myid != id) {
+		snap_error("Snapshot has been replaced since %s was taken", p);
+	}
+	if (*basepath != 0) {
+		snap_loadbase(basepath, baseid);
+	}
+	snapincremental = (*basepath != 0);
+	free(basepath);
+
+	bus_restoreram();
+
+	fclose(snapfile);
+	snapfile = f;
+	snappath = p;
+}
+
+static
+int
+snap_save(const char *path, int incremental)
+{
+	char tmppath[PATH_MAX];
+	uint64_t id;
+	int r;
+
+	r = snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	if (r < 0 || (size_t)r >= sizeof(tmppath)) {
+		msg("%s: Name too long", path);
+		return -1;
+	}
+
+	snapfile = fopen(tmppath, "wb");
+	if (snapfile == NULL) {
+		msg("%s: %s", tmppath, strerror(errno));
+		return -1;
+	}
+	snappath = path;
+	snapfailed = 0;
+	snapincremental = incremental && lastpath != NULL &&
+		strcmp(lastpath, path) != 0;
+	id = snap_newid();
+
+	snap_write(SNAP_MAGIC, SNAP_MAGICLEN);
+	snap_write32(SNAP_VERSION);
+	snap_write32(SNAP_BYTEORDER);
+	snap_write32(EM_CPU);
+	snap_writestr(VERSION);
+	snap_write64(id);
+	snap_writestr(snapincremental ? lastpath : "");
+	snap_write64(snapincremental ? lastid : 0);
+
+	bus_save();
+	cpu_save();
+	clock_save();
+	prof_save();
+	snap_section("END ");
+
+	if (fclose(snapfile) != 0 && !snapfailed) {
+		msg("%s: write: %s", tmppath, strerror(errno));
+		snapfailed = 1;
+	}
+	snapfile = NULL;
+
+	if (!snapfailed && rename(tmppath, path) < 0) {
+		msg("%s: rename: %s", path, strerror(errno));
+		snapfailed = 1;
+	}
+	if (snapfailed) {
+		unlink(tmppath);
+		msg("Snapshot not saved");
+		return -1;
+	}
+	snap_setlast(path, id);
+	msg("%s saved to %s", snapincremental ?
+	    "Incremental snapshot" : "Snapshot", path);
+	return 0;
+}
+
+int
+snapshot_save(const char *path)
+{
+	return snap_save(path, 0);
+}
+
+int
+snapshot_saveincr(const char *path)
+{
+	return snap_save(path, 1);
+}
+
+void
+snapshot_restore(const char *path)
+{
+	char *basepath;
+	uint64_t id, baseid;
+
+	snapfile = fopen(path, "rb");
+	if (snapfile == NULL) {
+		msg("Cannot open snapshot %s: %s", path, strerror(errno));
+		die();
+	}
+	snappath = path;
+
+	snap_readheader(&id, &basepath, &baseid);
+	if (*basepath != 0) {
+		snap_loadbase(basepath, baseid);
+	}
+	snapincremental = (*basepath != 0);
+	free(basepath);
+
+	bus_restore();
+	cpu_restore();
+	clock_restore();
+	prof_restore();
+	snap_expect("END ");
+
+	fclose(snapfile);
+	snapfile = NULL;
+
+	snap_setlast(path, id);
+}
@@ -79,7 +79,7 @@ static const uint32_t fakerom[ROMWORDS] = {
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 0x3d0 */
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 0x3e0 */
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	/* 0x3f0 */
-	0x0d000000 /* BREAK */				/* 0x3ff */
+	0x0000000d /* BREAK */				/* 0x3ff */
 };
 
 int
@@ -92,10 +92,10 @@ bootrom_fetch(uint32_t offset, uint32_t *val)
 	/*
 	 * Because the pointers returned by bootrom_map are
 	 * accessed with bus_use_map(), the rom must be stored
-	 * as target (CPU) endianness.
+	 * the same way as RAM, in host order.
 	 */
 
-	*val = ctoh32(fakerom[offset/sizeof(uint32_t)]);
+	*val = fakerom[offset/sizeof(uint32_t)];
 
 	return 0;
 }
@@ -14,6 +14,7 @@
 #include "prof.h"
 #include "memdefs.h"
 #include "inlinemem.h"
+#include "snapshot.h"
 
 #include "mips-insn.h"
 #include "mips-ex.h"
@@ -444,10 +445,52 @@ static unsigned ncpus;
 /*
  * Hold cpu->state == CPU_RUNNING across all cpus, for rapid testing.
  */
-uint32_t cpu_running_mask;
+uint64_t cpu_running_mask[CPU_MASKWORDS];
+unsigned cpu_running_count;
 
-#define RUNNING_MASK_OFF(cn) (cpu_running_mask &= ~((uint32_t)1 << (cn)))
-#define RUNNING_MASK_ON(cn)  (cpu_running_mask |= (uint32_t)1 << (cn))
+/*
+ * Idle cycles are counted lazily, so that cpus that aren't running
+ * cost nothing per cycle: when a cpu stops we note how many passes
+ * of cpu_cycle() had reached it, and when it starts again (or the
+ * stats are wanted) we credit it with the passes since. cycle_pos
+ * is one more than the cpu currently executing in cpu_cycle(), or 0
+ * between passes; cpus below it have already been passed over.
+ */
+static uint64_t cycle_passes;
+static unsigned cycle_pos;
+static uint64_t *idle_since;
+
+#define CYCLE_VISITS(cn) (cycle_passes + ((cn) < cycle_pos ? 1 : 0))
+
+static
+void
+running_mask_on(unsigned cn)
+{
+	uint64_t bit = (uint64_t)1 << (cn % 64);
+
+	if ((cpu_running_mask[cn / 64] & bit) == 0) {
+		cpu_running_mask[cn / 64] |= bit;
+		cpu_running_count++;
+		g_stats.s_percpu[cn].sp_icycles +=
+			CYCLE_VISITS(cn) - idle_since[cn];
+	}
+}
+
+static
+void
+running_mask_off(unsigned cn)
+{
+	uint64_t bit = (uint64_t)1 << (cn % 64);
+
+	if (cpu_running_mask[cn / 64] & bit) {
+		cpu_running_mask[cn / 64] &= ~bit;
+		cpu_running_count--;
+		idle_since[cn] = CYCLE_VISITS(cn);
+	}
+}
+
+#define RUNNING_MASK_OFF(cn) running_mask_off(cn)
+#define RUNNING_MASK_ON(cn)  running_mask_on(cn)
 
 /*
  * Number of cycles into cpu_cycles().
@@ -914,16 +957,77 @@ cpu_init(unsigned numcpus)
 {
 	unsigned i;
 
-	Assert(numcpus <= 32);
+	Assert(numcpus <= CPU_MAXCPUS);
 
 	ncpus = numcpus;
 	mycpus = domalloc(ncpus * sizeof(*mycpus));
+	idle_since = domalloc(ncpus * sizeof(*idle_since));
 	for (i=0; i<numcpus; i++) {
 		mips_init(&mycpus[i], i);
+		idle_since[i] = 0;
 	}
 
 	mycpus[0].state = CPU_RUNNING;
-	cpu_running_mask = 0x1;
+	RUNNING_MASK_ON(0);
+}
+
+void
+cpu_updatestats(void)
+{
+	unsigned i;
+
+	for (i=0; i<ncpus; i++) {
+		if (mycpus[i].state != CPU_RUNNING) {
+			g_stats.s_percpu[i].sp_icycles +=
+				CYCLE_VISITS(i) - idle_since[i];
+			idle_since[i] = CYCLE_VISITS(i);
+		}
+	}
+}
+
+/*
+ * Snapshots. The cpu state is saved whole; the page pointers in it
+ * are host addresses, so they're saved separately as offsets and
+ * fixed up afterwards.
+ */
+void
+cpu_save(void)
+{
+	unsigned i;
+
+	snap_section("CPUS");
+	snap_writesize(sizeof(struct mipscpu));
+	snap_write32(ncpus);
+	for (i=0; i<ncpus; i++) {
+		snap_write(&mycpus[i], sizeof(struct mipscpu));
+		snap_writemap(mycpus[i].pcpage, bootrom_map);
+		snap_writemap(mycpus[i].nextpcpage, bootrom_map);
+	}
+}
+
+void
+cpu_restore(void)
+{
+	unsigned i;
+
+	snap_expect("CPUS");
+	snap_checksize("cpu", sizeof(struct mipscpu));
+	if (snap_read32() != ncpus) {
+		snap_error("Snapshot has a different number of cpus");
+	}
+	for (i=0; i<CPU_MASKWORDS; i++) {
+		cpu_running_mask[i] = 0;
+	}
+	cpu_running_count = 0;
+	for (i=0; i<ncpus; i++) {
+		idle_since[i] = CYCLE_VISITS(i);
+		snap_read(&mycpus[i], sizeof(struct mipscpu));
+		mycpus[i].pcpage = snap_readmap(bootrom_map);
+		mycpus[i].nextpcpage = snap_readmap(bootrom_map);
+		if (mycpus[i].state == CPU_RUNNING) {
+			RUNNING_MASK_ON(i);
+		}
+	}
 }
 
 void
@@ -1099,6 +1203,52 @@ cpu_get_ram_paddr(void)
 	return 0;
 }
 
+uint32_t
+cpu_get_ram_maxsize(void)
+{
+	/*
+	 * 0x1fc00000 below the boot ROM, plus 0xe0000000 from
+	 * 0x20000000 up; that is, all of it but the 4M of ROM and I/O.
+	 */
+	return 0xffc00000;
+}
+
+uint32_t
+cpu_get_ram_loadsize(void)
+{
+	/* the kernel can only be loaded into the part below the ROM */
+	return 0x1fc00000;
+}
+
+int
+cpu_get_ram_offset(uint32_t paddr, uint32_t size, uint32_t *offset)
+{
+	uint32_t ramoffset;
+
+	/* this must match accessmem() */
+	if (paddr < 0x1fc00000) {
+		if (size > 0x1fc00000 - paddr) {
+			return -1;
+		}
+		ramoffset = paddr;
+	}
+	else if (paddr >= 0x20000000) {
+		if (size > 0xffffffff - paddr + 1) {
+			return -1;
+		}
+		ramoffset = paddr - 0x00400000;
+	}
+	else {
+		return -1;
+	}
+
+	if (ramoffset > bus_ramsize || size > bus_ramsize - ramoffset) {
+		return -1;
+	}
+	*offset = ramoffset;
+	return 0;
+}
+
 void
 cpu_set_entrypoint(unsigned cpunum, uint32_t addr)
 {
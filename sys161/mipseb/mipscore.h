@@ -2464,15 +2464,19 @@ FN(cpu_cycle)(void)
 	uint32_t retire_pc;
 	unsigned retire_usermode;
 
-	for (whichcpu=0; whichcpu < ncpus; whichcpu++) {
+	/*
+	 * Visit only the running cpus; the idle ones have their idle
+	 * cycles counted when they start again. The mask is checked
+	 * afresh each time, so a cpu woken up by a lower-numbered one
+	 * still runs this cycle.
+	 */
+	for (whichcpu = cpu_running_next(0); whichcpu < ncpus;
+	     whichcpu = cpu_running_next(whichcpu + 1)) {
 		struct mipscpu *cpu = &mycpus[whichcpu];
 
-		if (cpu->state != CPU_RUNNING) {
-			// don't check this on the critical path
-			//Assert((cpu_running_mask & thiscpumask) == 0);
-			g_stats.s_percpu[cpu->cpunum].sp_icycles++;
-			continue;
-		}
+		// don't check this on the critical path
+		//Assert(cpu->state == CPU_RUNNING);
+		cycle_pos = whichcpu + 1;
 
 	/* INDENT HORROR BEGIN */
 
@@ -2753,6 +2757,8 @@ FN(cpu_cycle)(void)
 	/* INDENT HORROR END */
 
 	}
+	cycle_passes++;
+	cycle_pos = 0;
 
 	if (breakpoints == 0) {
 		return 1;
@@ -2789,7 +2795,7 @@ FN(cpu_cycles)(uint64_t maxcycles)
 			i++;
 			cpu_cycles_count = i;
 		}
-		if (cpu_running_mask == 0) {
+		if (cpu_running_count == 0) {
 			/* nothing occurs until we reach maxcycles */
 			if (cpu_cycling) {
 				g_stats.s_tot_icycles += maxcycles - i;
@@ -20,27 +20,13 @@
 /*
  * NOP and EBREAK (breakpoint) instructions.
  *
- * Note that these need to be encoded as target-endian words, not
- * host-endian. They are flipped on the memory access path, and it
- * needs to be that way because parts of the path are shared with
- * access to main memory and device memory, and at least device memory
- * needs to be target-endian so I/O works.
+ * These are plain host-endian words: the memory access path shares
+ * the ROM pages with RAM pages (see bus_use_map), and RAM is kept in
+ * host order.
  */
 
-#if 0 /* doesn't work because htoc32() isn't a constant */
-#define NOP 	htoc32(0x00000010)
-#define EBREAK	htoc32(0x00100070)
-#else
-
-#if CPU_ENDIAN == LITTLE_ENDIAN
 #define NOP 	0x00000013
 #define EBREAK	0x00100073
-#else
-#define NOP 	0x13000000
-#define EBREAK	0x73001000
-#endif
-
-#endif /* 0 */
 
 
 #define ROMWORDS 1024 /* one page */
@@ -187,10 +173,10 @@ bootrom_fetch(uint32_t offset, uint32_t *val)
 	/*
 	 * Because the pointers returned by bootrom_map are
 	 * accessed with bus_use_map(), the rom must be stored
-	 * as target endianness.
+	 * the same way as RAM, in host order.
 	 */
 
-	*val = ctoh32(fakerom[offset/sizeof(uint32_t)]);
+	*val = fakerom[offset/sizeof(uint32_t)];
 
 	return 0;
 }
@@ -15,6 +15,7 @@
 #include "prof.h"
 #include "memdefs.h"
 #include "inlinemem.h"
+#include "snapshot.h"
 
 #include "riscv-insn.h"
 #include "riscv-ex.h"
@@ -312,10 +313,52 @@ static unsigned ncpus;
 /*
  * Hold cpu->state == CPU_RUNNING across all cpus, for rapid testing.
  */
-uint32_t cpu_running_mask;
+uint64_t cpu_running_mask[CPU_MASKWORDS];
+unsigned cpu_running_count;
 
-#define RUNNING_MASK_OFF(cn) (cpu_running_mask &= ~((uint32_t)1 << (cn)))
-#define RUNNING_MASK_ON(cn)  (cpu_running_mask |= (uint32_t)1 << (cn))
+/*
+ * Idle cycles are counted lazily, so that cpus that aren't running
+ * cost nothing per cycle: when a cpu stops we note how many passes
+ * of cpu_cycle() had reached it, and when it starts again (or the
+ * stats are wanted) we credit it with the passes since. cycle_pos
+ * is one more than the cpu currently executing in cpu_cycle(), or 0
+ * between passes; cpus below it have already been passed over.
+ */
+static uint64_t cycle_passes;
+static unsigned cycle_pos;
+static uint64_t *idle_since;
+
+#define CYCLE_VISITS(cn) (cycle_passes + ((cn) < cycle_pos ? 1 : 0))
+
+static
+void
+running_mask_on(unsigned cn)
+{
+	uint64_t bit = (uint64_t)1 << (cn % 64);
+
+	if ((cpu_running_mask[cn / 64] & bit) == 0) {
+		cpu_running_mask[cn / 64] |= bit;
+		cpu_running_count++;
+		g_stats.s_percpu[cn].sp_icycles +=
+			CYCLE_VISITS(cn) - idle_since[cn];
+	}
+}
+
+static
+void
+running_mask_off(unsigned cn)
+{
+	uint64_t bit = (uint64_t)1 << (cn % 64);
+
+	if (cpu_running_mask[cn / 64] & bit) {
+		cpu_running_mask[cn / 64] &= ~bit;
+		cpu_running_count--;
+		idle_since[cn] = CYCLE_VISITS(cn);
+	}
+}
+
+#define RUNNING_MASK_OFF(cn) running_mask_off(cn)
+#define RUNNING_MASK_ON(cn)  running_mask_on(cn)
 
 /*
  * Number of cycles into cpu_cycles().
@@ -719,16 +762,32 @@ cpu_init(unsigned numcpus)
 {
 	unsigned i;
 
-	Assert(numcpus <= 32);
+	Assert(numcpus <= CPU_MAXCPUS);
 
 	ncpus = numcpus;
 	mycpus = domalloc(ncpus * sizeof(*mycpus));
+	idle_since = domalloc(ncpus * sizeof(*idle_since));
 	for (i=0; i<numcpus; i++) {
 		riscv_init(&mycpus[i], i);
+		idle_since[i] = 0;
 	}
 
 	mycpus[0].state = CPU_RUNNING;
-	cpu_running_mask = 0x1;
+	RUNNING_MASK_ON(0);
+}
+
+void
+cpu_updatestats(void)
+{
+	unsigned i;
+
+	for (i=0; i<ncpus; i++) {
+		if (mycpus[i].state != CPU_RUNNING) {
+			g_stats.s_percpu[i].sp_icycles +=
+				CYCLE_VISITS(i) - idle_since[i];
+			idle_since[i] = CYCLE_VISITS(i);
+		}
+	}
 }
 
 #define BETWEEN(addr, size, base, top) \
@@ -764,6 +823,39 @@ cpu_get_ram_paddr(void)
 	return 0xc0000000;
 }
 
+uint32_t
+cpu_get_ram_maxsize(void)
+{
+	/* everything from the RAM base up to the ROM */
+	return PADDR_ROMBASE - PADDR_RAMBASE;
+}
+
+uint32_t
+cpu_get_ram_loadsize(void)
+{
+	/* all of it is contiguous */
+	return PADDR_ROMBASE - PADDR_RAMBASE;
+}
+
+int
+cpu_get_ram_offset(uint32_t paddr, uint32_t size, uint32_t *offset)
+{
+	uint32_t ramoffset;
+
+	/* this must match accessmem() */
+	if (paddr < PADDR_RAMBASE || paddr >= PADDR_ROMBASE ||
+	    size > PADDR_ROMBASE - paddr) {
+		return -1;
+	}
+	ramoffset = paddr - PADDR_RAMBASE;
+
+	if (ramoffset > bus_ramsize || size > bus_ramsize - ramoffset) {
+		return -1;
+	}
+	*offset = ramoffset;
+	return 0;
+}
+
 void
 cpu_set_entrypoint(unsigned cpunum, uint32_t addr)
 {
@@ -893,6 +985,51 @@ cpu_set_tracing(int on)
 	tracing = on;
 }
 
+/*
+ * Snapshots. The cpu state is saved whole; the page pointers in it
+ * are host addresses, so they're saved separately as offsets and
+ * fixed up afterwards.
+ */
+void
+cpu_save(void)
+{
+	unsigned i;
+
+	snap_section("CPUS");
+	snap_writesize(sizeof(struct riscvcpu));
+	snap_write32(ncpus);
+	for (i=0; i<ncpus; i++) {
+		snap_write(&mycpus[i], sizeof(struct riscvcpu));
+		snap_writemap(mycpus[i].pcpage, bootrom_map);
+		snap_writemap(mycpus[i].mmu_pttoppage, bootrom_map);
+	}
+}
+
+void
+cpu_restore(void)
+{
+	unsigned i;
+
+	snap_expect("CPUS");
+	snap_checksize("cpu", sizeof(struct riscvcpu));
+	if (snap_read32() != ncpus) {
+		snap_error("Snapshot has a different number of cpus");
+	}
+	for (i=0; i<CPU_MASKWORDS; i++) {
+		cpu_running_mask[i] = 0;
+	}
+	cpu_running_count = 0;
+	for (i=0; i<ncpus; i++) {
+		idle_since[i] = CYCLE_VISITS(i);
+		snap_read(&mycpus[i], sizeof(struct riscvcpu));
+		mycpus[i].pcpage = snap_readmap(bootrom_map);
+		mycpus[i].mmu_pttoppage = snap_readmap(bootrom_map);
+		if (mycpus[i].state == CPU_RUNNING) {
+			RUNNING_MASK_ON(i);
+		}
+	}
+}
+
 void
 cpu_dumpstate(void)
 {